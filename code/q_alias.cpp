@@ -0,0 +1,420 @@
+/*
+ Alias models, monsters, torches and the like, are drawn after the world spans
+ have filled the z-buffer. Their triangles go straight into the backbuffer,
+ each pixel is tested against the z-buffer. Triangles are walked scanline by
+ scanline, texture coordinates are stepped affinely like Quake does, the
+ triangles are small enough for it not to show. A model far away is drawn
+ with one texel per triangle.
+*/
+
+// closer than this triangles are clipped
+#define ALIAS_NEAR_Z 1.0f
+// a model whose radius projects to fewer pixels is drawn flat
+#define ALIAS_FLAT_PIXELS 8.0f
+// seconds to blend from the last frame to a new one
+#define ALIAS_LERP_TIME 0.1f
+// like Quake, models are never pitch black nor fully bright
+#define ALIAS_MIN_LIGHT 24
+#define ALIAS_MAX_LIGHT 192
+// a triangle gets one more vertex at most from the near plane
+#define ALIAS_CLIP_VERTS 4
+
+struct AliasVert
+{
+    Vec3f view;
+    float s;
+    float t;
+    // on the screen, only set in front of the near plane
+    float x;
+    float y;
+    float invz;
+};
+
+struct AliasDraw
+{
+    U8 *pbuffer;
+    I32 bytes_per_row;
+    float *zbuffer;
+    I32 zbuffer_width;
+    Recti rect; // pixels outside are not touched
+    U8 *colormap; // the row of the light of the model
+
+    U8 *skin;
+    I32 skin_width;
+    I32 skin_height;
+    B32 flat;
+
+    // what got drawn, for the dirty tiles
+    I32 pose;
+    I32 old_pose;
+    float lerp;
+    I32 skin_image;
+    // pixels the triangles cover, inclusive, empty if max_x < min_x
+    I32 min_x, min_y;
+    I32 max_x, max_y;
+};
+
+// frame blends in over ALIAS_LERP_TIME from the one that was set before
+void EntitySetFrame(Entity *entity, I32 frame, float time)
+{
+    if (entity->frame != frame)
+    {
+        entity->old_frame = entity->frame;
+        entity->frame = frame;
+        entity->frame_time = time;
+    }
+}
+
+// pose or skin image of a group at the time, groups play in a loop
+I32 AliasGroupSelect(AliasGroup *group, float *intervals, float time)
+{
+    I32 result = group->first;
+    if (group->count > 1)
+    {
+        float *group_intervals = intervals + group->first;
+        float full_interval = group_intervals[group->count - 1];
+        float target_time = time - floorf(time / full_interval) * full_interval;
+
+        I32 i = 0;
+        while (i < group->count - 1 && group_intervals[i] <= target_time)
+        {
+            ++i;
+        }
+        result += i;
+    }
+    return result;
+}
+
+inline void AliasProjectVert(AliasVert *vert, Camera *camera)
+{
+    vert->invz = 1.0f / vert->view.z;
+    float scale = camera->scale_z * vert->invz;
+    vert->x = camera->screen_center.x + vert->view.x * scale;
+    vert->y = camera->screen_center.y - vert->view.y * scale;
+}
+
+// polygon of the part of the triangle in front of the near plane
+I32 AliasClipNear(AliasVert *in, AliasVert *out)
+{
+    I32 count = 0;
+    for (I32 i = 0; i < 3; ++i)
+    {
+        AliasVert *v0 = in + i;
+        AliasVert *v1 = in + (i + 1) % 3;
+        B32 in0 = v0->view.z >= ALIAS_NEAR_Z;
+        B32 in1 = v1->view.z >= ALIAS_NEAR_Z;
+
+        if (in0)
+        {
+            out[count++] = *v0;
+        }
+
+        if (in0 != in1)
+        {
+            float frac = (ALIAS_NEAR_Z - v0->view.z) / (v1->view.z - v0->view.z);
+            AliasVert *mid = out + count++;
+            mid->view = v0->view + (v1->view - v0->view) * frac;
+            mid->view.z = ALIAS_NEAR_Z;
+            mid->s = v0->s + (v1->s - v0->s) * frac;
+            mid->t = v0->t + (v1->t - v0->t) * frac;
+        }
+    }
+    return count;
+}
+
+struct AliasTriEdge
+{
+    float x;
+    float y;
+    float dxdy;
+};
+
+inline AliasTriEdge AliasMakeEdge(AliasVert *top, AliasVert *bottom)
+{
+    AliasTriEdge result;
+    result.x = top->x;
+    result.y = top->y;
+    float dy = bottom->y - top->y;
+    result.dxdy = dy > 0 ? (bottom->x - top->x) / dy : 0;
+    return result;
+}
+
+/*
+ Pixels whose centers are in the triangle are drawn, a center on the left or
+ top edge is in. Triangles facing away are skipped, their vertices go 
+ counterclockwise on the screen.
+*/
+void AliasDrawTriangle(AliasDraw *draw, AliasVert *v0, AliasVert *v1, AliasVert *v2)
+{
+    float ax = v1->x - v0->x;
+    float ay = v1->y - v0->y;
+    float bx = v2->x - v0->x;
+    float by = v2->y - v0->y;
+    float area = ax * by - ay * bx;
+    if (area <= 0)
+    {
+        return ;
+    }
+
+    // the value of an attribute at (x, y) is at v0 + grad_x * dx + grad_y * dy
+    float inv_area = 1.0f / area;
+    float dz1 = v1->invz - v0->invz;
+    float dz2 = v2->invz - v0->invz;
+    float z_grad_x = (dz1 * by - dz2 * ay) * inv_area;
+    float z_grad_y = (dz2 * ax - dz1 * bx) * inv_area;
+    float ds1 = v1->s - v0->s;
+    float ds2 = v2->s - v0->s;
+    float s_grad_x = (ds1 * by - ds2 * ay) * inv_area;
+    float s_grad_y = (ds2 * ax - ds1 * bx) * inv_area;
+    float dt1 = v1->t - v0->t;
+    float dt2 = v2->t - v0->t;
+    float t_grad_x = (dt1 * by - dt2 * ay) * inv_area;
+    float t_grad_y = (dt2 * ax - dt1 * bx) * inv_area;
+
+    // sort from top to bottom
+    AliasVert *top = v0;
+    AliasVert *mid = v1;
+    AliasVert *bottom = v2;
+    AliasVert *temp = NULL;
+    if (mid->y < top->y) { temp = top; top = mid; mid = temp; }
+    if (bottom->y < mid->y) { temp = mid; mid = bottom; bottom = temp; }
+    if (mid->y < top->y) { temp = top; top = mid; mid = temp; }
+
+    Recti rect = draw->rect;
+    I32 y_start = (I32)ceilf(top->y);
+    I32 y_end = (I32)ceilf(bottom->y) - 1;
+    if (y_start < rect.y)
+    {
+        y_start = rect.y;
+    }
+    if (y_end > rect.y + rect.height - 1)
+    {
+        y_end = rect.y + rect.height - 1;
+    }
+    if (y_start > y_end)
+    {
+        return ;
+    }
+
+    AliasTriEdge long_edge = AliasMakeEdge(top, bottom);
+    AliasTriEdge upper_edge = AliasMakeEdge(top, mid);
+    AliasTriEdge lower_edge = AliasMakeEdge(mid, bottom);
+
+    float max_s = (float)draw->skin_width - 1.0f;
+    float max_t = (float)draw->skin_height - 1.0f;
+
+    U8 flat_color = 0;
+    if (draw->flat)
+    {
+        float s = Clamp(0.0f, max_s, (v0->s + v1->s + v2->s) * (1.0f / 3.0f));
+        float t = Clamp(0.0f, max_t, (v0->t + v1->t + v2->t) * (1.0f / 3.0f));
+        flat_color = draw->colormap[draw->skin[(I32)t * draw->skin_width + (I32)s]];
+    }
+
+    for (I32 y = y_start; y <= y_end; ++y)
+    {
+        float fy = (float)y;
+        AliasTriEdge *short_edge = fy < mid->y ? &upper_edge : &lower_edge;
+        float x_long = long_edge.x + (fy - long_edge.y) * long_edge.dxdy;
+        float x_short = short_edge->x + (fy - short_edge->y) * short_edge->dxdy;
+        float x_left = x_long < x_short ? x_long : x_short;
+        float x_right = x_long < x_short ? x_short : x_long;
+
+        I32 x_start = (I32)ceilf(x_left);
+        I32 x_end = (I32)ceilf(x_right) - 1;
+        if (x_start < rect.x)
+        {
+            x_start = rect.x;
+        }
+        if (x_end > rect.x + rect.width - 1)
+        {
+            x_end = rect.x + rect.width - 1;
+        }
+        I32 count = x_end - x_start + 1;
+        if (count <= 0)
+        {
+            continue ;
+        }
+
+        draw->min_x = x_start < draw->min_x ? x_start : draw->min_x;
+        draw->max_x = x_end > draw->max_x ? x_end : draw->max_x;
+        draw->min_y = y < draw->min_y ? y : draw->min_y;
+        draw->max_y = y > draw->max_y ? y : draw->max_y;
+
+        float dx = (float)x_start - v0->x;
+        float dy = fy - v0->y;
+        float invz = v0->invz + z_grad_x * dx + z_grad_y * dy;
+
+        U8 *pixel = draw->pbuffer + y * draw->bytes_per_row + x_start;
+        float *zpixel = draw->zbuffer + y * draw->zbuffer_width + x_start;
+
+        if (draw->flat)
+        {
+            for (I32 i = 0; i < count; ++i)
+            {
+                if (invz >= *zpixel)
+                {
+                    *zpixel = invz;
+                    *pixel = flat_color;
+                }
+                ++pixel;
+                ++zpixel;
+                invz += z_grad_x;
+            }
+            continue ;
+        }
+
+        // clamped at both ends, the rounding can't step off the skin then
+        float s_start = v0->s + s_grad_x * dx + s_grad_y * dy;
+        float t_start = v0->t + t_grad_x * dx + t_grad_y * dy;
+        float s_end = s_start + s_grad_x * (float)(count - 1);
+        float t_end = t_start + t_grad_x * (float)(count - 1);
+        I32 s = (I32)(Clamp(0.0f, max_s, s_start) * 65536.0f);
+        I32 t = (I32)(Clamp(0.0f, max_t, t_start) * 65536.0f);
+        I32 s_step = 0;
+        I32 t_step = 0;
+        if (count > 1)
+        {
+            s_step = ((I32)(Clamp(0.0f, max_s, s_end) * 65536.0f) - s) / (count - 1);
+            t_step = ((I32)(Clamp(0.0f, max_t, t_end) * 65536.0f) - t) / (count - 1);
+        }
+
+        for (I32 i = 0; i < count; ++i)
+        {
+            if (invz >= *zpixel)
+            {
+                *zpixel = invz;
+                *pixel = draw->colormap[draw->skin[(t >> 16) * draw->skin_width + (s >> 16)]];
+            }
+            ++pixel;
+            ++zpixel;
+            invz += z_grad_x;
+            s += s_step;
+            t += t_step;
+        }
+    }
+}
+
+/*
+ The poses of the frames are blended into view space and the triangles are
+ drawn with the light of the model, light is 0 to 255 like LightPoint.
+ Temporary memory comes from the arena.
+*/
+void AliasDrawModel(AliasDraw *draw, Entity *entity, AliasHeader *header, Camera *camera,
+                    I32 light, float time, MemoryArena *arena)
+{
+    draw->min_x = draw->min_y = 0x7fffffff;
+    draw->max_x = draw->max_y = -0x7fffffff;
+
+    AliasGroup *frames = (AliasGroup *)AliasData(header, header->frames);
+    float *pose_intervals = (float *)AliasData(header, header->pose_intervals);
+    I32 frame = Clamp(0, header->num_frame - 1, entity->frame);
+    I32 old_frame = Clamp(0, header->num_frame - 1, entity->old_frame);
+    draw->pose = AliasGroupSelect(frames + frame, pose_intervals, time);
+    draw->old_pose = AliasGroupSelect(frames + old_frame, pose_intervals, time);
+    draw->lerp = Clamp(0.0f, 1.0f, (time - entity->frame_time) * (1.0f / ALIAS_LERP_TIME));
+
+    AliasGroup *skins = (AliasGroup *)AliasData(header, header->skins);
+    float *skin_intervals = (float *)AliasData(header, header->skin_intervals);
+    I32 skin_num = Clamp(0, header->num_skin - 1, entity->skin_num);
+    draw->skin_image = AliasGroupSelect(skins + skin_num, skin_intervals, time);
+    draw->skin_width = header->skin_width;
+    draw->skin_height = header->skin_height;
+    draw->skin = (U8 *)AliasData(header, header->skin_images)
+               + draw->skin_image * header->skin_width * header->skin_height;
+
+    light = Clamp(ALIAS_MIN_LIGHT, ALIAS_MAX_LIGHT, light);
+    // the same rows as BuildLightMap picks, 0 is the brightest
+    draw->colormap += ((255 - light) << COLOR_SHADE_BITS) & 0xff00;
+
+    /*
+     view = base + axes * vertex, axes are the model axes in view space scaled
+     by the scale of the vertices
+    */
+    Vec3f ex, ey, ez;
+    AngleVectors(entity->angles, &ex, &ey, &ez);
+    Vec3f model_axes[3] = {ex, ey, ez};
+    Vec3f axes[3];
+    for (I32 i = 0; i < 3; ++i)
+    {
+        Vec3f axis = model_axes[i] * header->scale[i];
+        axes[i] = {Vec3Dot(camera->rotx, axis), Vec3Dot(camera->rotz, axis),
+                   Vec3Dot(camera->roty, axis)};
+    }
+    Vec3f origin = entity->origin - camera->position
+                 + ex * header->scale_origin.x + ey * header->scale_origin.y
+                 + ez * header->scale_origin.z;
+    Vec3f base = {Vec3Dot(camera->rotx, origin), Vec3Dot(camera->rotz, origin),
+                  Vec3Dot(camera->roty, origin)};
+
+    Vec3f center = entity->origin - camera->position;
+    float center_z = Vec3Dot(camera->roty, center);
+    draw->flat = center_z > 0
+              && entity->model->radius * camera->scale_z < ALIAS_FLAT_PIXELS * center_z;
+
+    ArenaMarker marker = ArenaGetMarker(arena);
+    AliasVert *verts = ARENA_PUSH_ARRAY(arena, AliasVert, header->num_vert);
+
+    I32 pose_size = header->num_vert;
+    TriVertex *poses = (TriVertex *)AliasData(header, header->poses);
+    TriVertex *new_pose = poses + draw->pose * pose_size;
+    TriVertex *old_pose = poses + draw->old_pose * pose_size;
+    AliasSTVert *stverts = (AliasSTVert *)AliasData(header, header->stverts);
+    float lerp = draw->lerp;
+    for (I32 i = 0; i < header->num_vert; ++i)
+    {
+        AliasVert *vert = verts + i;
+        Vec3f v;
+        for (I32 j = 0; j < 3; ++j)
+        {
+            float from = (float)old_pose[i].v[j];
+            v[j] = from + ((float)new_pose[i].v[j] - from) * lerp;
+        }
+        vert->view = base + axes[0] * v.x + axes[1] * v.y + axes[2] * v.z;
+        vert->s = (float)stverts[i].s;
+        vert->t = (float)stverts[i].t;
+        if (vert->view.z >= ALIAS_NEAR_Z)
+        {
+            AliasProjectVert(vert, camera);
+        }
+    }
+
+    float seam_s = (float)(header->skin_width / 2);
+    AliasTriangle *triangle = (AliasTriangle *)AliasData(header, header->triangles);
+    for (I32 i = 0; i < header->num_tri; ++i, ++triangle)
+    {
+        AliasVert tri[3];
+        I32 in_front = 0;
+        for (I32 j = 0; j < 3; ++j)
+        {
+            I32 index = triangle->vert_index[j];
+            tri[j] = verts[index];
+            // the back of the model is on the right half of the skin
+            if (!triangle->faces_front && stverts[index].on_seam)
+            {
+                tri[j].s += seam_s;
+            }
+            in_front += tri[j].view.z >= ALIAS_NEAR_Z;
+        }
+
+        if (in_front == 3)
+        {
+            AliasDrawTriangle(draw, tri, tri + 1, tri + 2);
+        }
+        else if (in_front > 0)
+        {
+            AliasVert clipped[ALIAS_CLIP_VERTS];
+            I32 count = AliasClipNear(tri, clipped);
+            for (I32 j = 0; j < count; ++j)
+            {
+                AliasProjectVert(clipped + j, camera);
+            }
+            for (I32 j = 1; j < count - 1; ++j)
+            {
+                AliasDrawTriangle(draw, clipped, clipped + j, clipped + j + 1);
+            }
+        }
+    }
+
+    ArenaPopToMarker(arena, marker);
+}
@@ -234,6 +234,123 @@ int StringToInt(char *str)
     return number;
 }
 
+/*
+ * str is null terminated string
+ * decimal number with an optional fraction, no exponent
+ */
+float StringToFloat(char *str)
+{
+    float sign = 1.0f;
+    float number = 0.0f;
+
+    if (*str == '-')
+    {
+        sign = -1.0f;
+        str++;
+    }
+    else if (*str == '+')
+    {
+        str++;
+    }
+
+    while (*str >= '0' && *str <= '9')
+    {
+        number = number * 10.0f + (float)(*str - '0');
+        str++;
+    }
+
+    if (*str == '.')
+    {
+        str++;
+        float scale = 0.1f;
+        while (*str >= '0' && *str <= '9')
+        {
+            number += (float)(*str - '0') * scale;
+            scale *= 0.1f;
+            str++;
+        }
+    }
+
+    return sign * number;
+}
+
+/*
+ * data: null terminated text, e.g. the entity lump of a map
+ * token: receives the next word, quoted string or brace, truncated to 
+ *        token_size - 1 characters
+ * return: where to continue parsing, NULL if there's no token left
+ */
+char *StringParseToken(char *data, char *token, int token_size)
+{
+    ASSERT(token_size > 1);
+
+    int length = 0;
+    token[0] = '\0';
+
+    if (data == NULL)
+    {
+        return NULL;
+    }
+
+    // skip white space and comments
+    for (;;)
+    {
+        while (*data && (U8)*data <= ' ')
+        {
+            data++;
+        }
+
+        if (data[0] == '/' && data[1] == '/')
+        {
+            while (*data && *data != '\n')
+            {
+                data++;
+            }
+            continue;
+        }
+        break;
+    }
+
+    if (*data == '\0')
+    {
+        return NULL;
+    }
+
+    if (*data == '\"')
+    {
+        data++;
+        while (*data && *data != '\"')
+        {
+            if (length < token_size - 1)
+            {
+                token[length++] = *data;
+            }
+            data++;
+        }
+        token[length] = '\0';
+        return *data ? data + 1 : data;
+    }
+
+    if (*data == '{' || *data == '}')
+    {
+        token[0] = *data;
+        token[1] = '\0';
+        return data + 1;
+    }
+
+    while ((U8)*data > ' ' && *data != '{' && *data != '}' && *data != '\"')
+    {
+        if (length < token_size - 1)
+        {
+            token[length++] = *data;
+        }
+        data++;
+    }
+    token[length] = '\0';
+
+    return data;
+}
+
 //==========================
 // Memory Operations
 //==========================
@@ -291,7 +408,18 @@ void MemCpy(void *dest, void *src, int count)
  * allocations like strings. All big objects are allocated on Hunk.
  *
  * Zone memory is consisted of memory blocks, free or being used. There won't be 
- * any 2 consecutive free memory blocks
+ * any 2 consecutive free memory blocks. All blocks are linked in address order,
+ * free blocks are additionally linked in one list per size class, a bitmap 
+ * tells which lists are not empty. Finding a block that fits and freeing a 
+ * block are both O(1).
+ *
+ * When the zone runs out of memory, ZoneMalloc grows it by a segment from low
+ * hunk. A fence block at the beginning of a segment keeps free blocks of 
+ * different segments from being merged.
+ *
+ * All zone functions can be called from any thread, but only the thread that
+ * owns the hunk (the one that called MemoryInit) grows the zone, the hunk 
+ * isn't thread-safe. Other threads fail once the zone is full.
  *
  * Memory blocks are 8-byte aligned.
  */
@@ -300,6 +428,16 @@ void MemCpy(void *dest, void *src, int count)
 #define ZONE_ID 0x1d4a11
 #define MIN_FRAGMENT 64
 
+// blocks below ZONE_SMALL_LIMIT get one class every 64 bytes, larger blocks 
+// one class per power of 2
+#define ZONE_CLASS_NUM 32
+#define ZONE_SMALL_SHIFT 6
+#define ZONE_SMALL_LIMIT_BITS 10
+#define ZONE_SMALL_LIMIT (1 << ZONE_SMALL_LIMIT_BITS)
+#define ZONE_SMALL_CLASS_NUM (ZONE_SMALL_LIMIT >> ZONE_SMALL_SHIFT)
+
+#define ZONE_FENCE_TAG -1
+
 struct MemoryBlock
 {
     // including sizeof(MemoryBlock)
@@ -323,30 +461,144 @@ struct MemoryBlock
     MemoryBlock *next, *prev;
 };
 
+// stored in the data of a free block
+struct MemoryFreeLink
+{
+    MemoryBlock *next_free, *prev_free;
+};
+
+// a block has to be able to hold its free link once it's freed
+#define ZONE_MIN_BLOCK_SIZE (I32)(sizeof(MemoryBlock) + sizeof(MemoryFreeLink))
+
+struct ZoneStats
+{
+    I32 live_allocs;
+    I32 total_allocs;
+    I32 total_frees;
+    // including block headers
+    I32 bytes_used;
+    I32 peak_bytes_used;
+    I32 failed_allocs;
+    I32 segment_count;
+};
+
 struct MemoryZone
 {
-    // points to a free memory block most of time, could potentially speed up
-    // searching of free memory block
-    MemoryBlock *rover;
     // the same as g_cache_head, 
     // serves as reference node in the circular linked list
     MemoryBlock tailhead; 
-    // total bytes allocated including sizoef(MemoryZone)
+    MemoryBlock *free_lists[ZONE_CLASS_NUM];
+    // bit n is set if free_lists[n] is not empty
+    U32 free_bitmap;
+    SpinLock lock;
+    // total bytes allocated including sizoef(MemoryZone) and segments
     I32 size;
-    // structure needs to be aligned to the size of the largest primitive type 
-    // data in the structure, in this case it's be 8-byte pointer "rover"
     I32 padding;
+    ZoneStats stats;
 };
 
 MemoryZone *g_main_zone;
+// set on the thread that owns the hunk
+THREAD_LOCAL B32 t_zone_can_grow;
+
+void *HunkLowAlloc(int size, char *name);
+
+// size class a free block of this size is filed under
+inline I32 ZoneSizeClass(I32 size)
+{
+    if (size < ZONE_SMALL_LIMIT)
+    {
+        return size >> ZONE_SMALL_SHIFT;
+    }
+    I32 result = ZONE_SMALL_CLASS_NUM + FindMostSignificantSetBit(size) - ZONE_SMALL_LIMIT_BITS;
+    if (result > ZONE_CLASS_NUM - 1)
+    {
+        result = ZONE_CLASS_NUM - 1;
+    }
+    return result;
+}
+
+// smallest block size filed under the size class
+inline I32 ZoneClassMinSize(I32 size_class)
+{
+    if (size_class < ZONE_SMALL_CLASS_NUM)
+    {
+        return size_class << ZONE_SMALL_SHIFT;
+    }
+    I32 result = 1 << (size_class - ZONE_SMALL_CLASS_NUM + ZONE_SMALL_LIMIT_BITS);
+    return result;
+}
+
+// first size class in which every block is large enough for size
+inline I32 ZoneFitClass(I32 size)
+{
+    I32 result = ZoneSizeClass(size);
+    if (ZoneClassMinSize(result) < size)
+    {
+        result++;
+    }
+    return result;
+}
+
+inline MemoryFreeLink *ZoneFreeLink(MemoryBlock *block)
+{
+    MemoryFreeLink *result = (MemoryFreeLink *)(block + 1);
+    return result;
+}
+
+void ZoneInsertFree(MemoryZone *zone, MemoryBlock *block)
+{
+    I32 size_class = ZoneSizeClass(block->size);
+    MemoryFreeLink *link = ZoneFreeLink(block);
+    link->prev_free = NULL;
+    link->next_free = zone->free_lists[size_class];
+    if (link->next_free)
+    {
+        ZoneFreeLink(link->next_free)->prev_free = block;
+    }
+    zone->free_lists[size_class] = block;
+    zone->free_bitmap |= (1u << size_class);
+}
+
+void ZoneRemoveFree(MemoryZone *zone, MemoryBlock *block)
+{
+    I32 size_class = ZoneSizeClass(block->size);
+    MemoryFreeLink *link = ZoneFreeLink(block);
+    if (link->prev_free)
+    {
+        ZoneFreeLink(link->prev_free)->next_free = link->next_free;
+    }
+    else
+    {
+        zone->free_lists[size_class] = link->next_free;
+    }
+    if (link->next_free)
+    {
+        ZoneFreeLink(link->next_free)->prev_free = link->prev_free;
+    }
+    if (!zone->free_lists[size_class])
+    {
+        zone->free_bitmap &= ~(1u << size_class);
+    }
+}
 
 void ZoneCheckHeap()
 {
+    SpinLockAcquire(&g_main_zone->lock);
+
+    I32 free_count = 0;
     MemoryBlock *block = g_main_zone->tailhead.next;
 
-    while (block->next != &g_main_zone->tailhead)
+    while (block != &g_main_zone->tailhead)
     {
-        if ((U8 *)block + block->size != (U8 *)block->next)
+        if (block->id != ZONE_ID)
+        {
+            g_platformAPI.SysError("ZoneCheckHeap: memory block without zone id");
+        }
+
+        // next block starts a new segment
+        if (block->next != &g_main_zone->tailhead && block->next->tag != ZONE_FENCE_TAG
+            && (U8 *)block + block->size != (U8 *)block->next)
         {
             g_platformAPI.SysError("ZoneCheckHeap: block size is erroneous");
         }
@@ -356,51 +608,119 @@ void ZoneCheckHeap()
             g_platformAPI.SysError("ZoneCheckHeap: memory block linked list is broken");
         }
 
-        if (block->tag == 0 && block->next->tag == 0)
+        if (block->tag == 0)
         {
-            g_platformAPI.SysError("2 consecutive free memory blocks!");
+            if (block->next->tag == 0)
+            {
+                g_platformAPI.SysError("2 consecutive free memory blocks!");
+            }
+
+            if (!(g_main_zone->free_bitmap & (1u << ZoneSizeClass(block->size))))
+            {
+                g_platformAPI.SysError("ZoneCheckHeap: free block in an empty size class");
+            }
+
+            free_count++;
         }
 
         block = block->next;
     }
+
+    // every free block is in the free list of its size class
+    for (I32 i = 0; i < ZONE_CLASS_NUM; ++i)
+    {
+        B32 has_blocks = g_main_zone->free_lists[i] != NULL;
+        if (has_blocks != ((g_main_zone->free_bitmap >> i) & 1))
+        {
+            g_platformAPI.SysError("ZoneCheckHeap: free bitmap is erroneous");
+        }
+
+        for (MemoryBlock *free_block = g_main_zone->free_lists[i]; free_block; 
+             free_block = ZoneFreeLink(free_block)->next_free)
+        {
+            if (free_block->tag != 0 || ZoneSizeClass(free_block->size) != i)
+            {
+                g_platformAPI.SysError("ZoneCheckHeap: free list is broken");
+            }
+            free_count--;
+        }
+    }
+
+    if (free_count != 0)
+    {
+        g_platformAPI.SysError("ZoneCheckHeap: free block missing in free lists");
+    }
+
+    SpinLockRelease(&g_main_zone->lock);
 }
 
-// set all memory blocks as one free block
+// set all memory blocks as one free block, segments are dropped
 void ZoneClearAll(MemoryZone *zone)
 {
     zone->tailhead.size = 0; // so it won't store any actual data
     zone->tailhead.tag = 1; // not a free block, a reference node
     zone->tailhead.id = ZONE_ID;
 
-    zone->rover = (MemoryBlock *)((U8 *)zone + sizeof(*zone));
-    zone->rover->size = zone->size - sizeof(*zone);
-    zone->rover->tag = 0;
-    zone->rover->id = ZONE_ID;
-    zone->rover->next = &zone->tailhead;
-    zone->rover->prev = &zone->tailhead;
+    for (I32 i = 0; i < ZONE_CLASS_NUM; ++i)
+    {
+        zone->free_lists[i] = NULL;
+    }
+    zone->free_bitmap = 0;
+    zone->lock.locked = 0;
+    zone->stats = {};
+
+    MemoryBlock *block = (MemoryBlock *)((U8 *)zone + sizeof(*zone));
+    block->size = zone->size - (I32)sizeof(*zone);
+    block->tag = 0;
+    block->id = ZONE_ID;
+    block->next = &zone->tailhead;
+    block->prev = &zone->tailhead;
 
-    zone->tailhead.next = zone->rover;
-    zone->tailhead.prev = zone->rover;
+    zone->tailhead.next = block;
+    zone->tailhead.prev = block;
+
+    ZoneInsertFree(zone, block);
 }
 
-void ZoneFree(void *ptr)
+// add a segment with a free block of at least min_size bytes to the zone
+void ZoneGrow(MemoryZone *zone, I32 min_size)
 {
-    if (!ptr)
+    I32 size = min_size + 2 * (I32)sizeof(MemoryBlock);
+    if (size < DYNAMIC_ZONE_SIZE)
     {
-        g_platformAPI.SysError("ZoneFree: free NULL pointer");
+        size = DYNAMIC_ZONE_SIZE;
     }
 
-    MemoryBlock *block = (MemoryBlock *)((U8 *)ptr - sizeof(MemoryBlock));
+    MemoryBlock *fence = (MemoryBlock *)HunkLowAlloc(size, "zonesegment");
+    fence->size = (I32)sizeof(MemoryBlock);
+    fence->tag = ZONE_FENCE_TAG;
+    fence->id = ZONE_ID;
 
-    if (block->id != ZONE_ID)
-    {
-        g_platformAPI.SysError("ZoneFree: free memory block without zone id");
-    }
+    MemoryBlock *block = fence + 1;
+    block->size = size - (I32)sizeof(MemoryBlock);
+    block->tag = 0;
+    block->id = ZONE_ID;
 
-    if (block->tag == 0)
-    {
-        g_platformAPI.SysError("ZoneFree: free a free memory block");
-    }
+    // append to the end of the block list
+    MemoryBlock *last = zone->tailhead.prev;
+    last->next = fence;
+    fence->prev = last;
+    fence->next = block;
+    block->prev = fence;
+    block->next = &zone->tailhead;
+    zone->tailhead.prev = block;
+
+    ZoneInsertFree(zone, block);
+
+    zone->size += size;
+    zone->stats.segment_count++;
+}
+
+void ZoneFreeLocked(MemoryZone *zone, MemoryBlock *block)
+{
+    zone->stats.live_allocs--;
+    zone->stats.total_frees++;
+    zone->stats.bytes_used -= block->size;
 
     block->tag = 0;
 
@@ -408,15 +728,11 @@ void ZoneFree(void *ptr)
     if (other->tag == 0)
     {
         // merge with previous free block
+        ZoneRemoveFree(zone, other);
         other->next = block->next;
         block->next->prev = other;
         other->size = other->size + block->size;
         
-        if (g_main_zone->rover == block)
-        {
-            g_main_zone->rover = other;
-        }
-
         block = other;
     }
 
@@ -424,49 +740,83 @@ void ZoneFree(void *ptr)
     if (other->tag == 0)
     {
         // merge with next free block
+        ZoneRemoveFree(zone, other);
         block->next = other->next;
-        other->prev = block;
+        other->next->prev = block;
         block->size = block->size + other->size;
-
-        if (g_main_zone->rover == other)
-        {
-            g_main_zone->rover = block;
-        }
     }
+
+    ZoneInsertFree(zone, block);
 }
 
-void *ZoneTagMalloc(int size, int tag)
+void ZoneFree(void *ptr)
 {
-    if (tag == 0)
+    if (!ptr)
     {
-        g_platformAPI.SysError("ZoneTagAlloc: using a 0 tag");
+        g_platformAPI.SysError("ZoneFree: free NULL pointer");
     }
 
-    size += sizeof(MemoryBlock);
-    size += 4; // space at the end of memory block for trash tester
-    size = (size + 7) & ~7;
+    MemoryBlock *block = (MemoryBlock *)((U8 *)ptr - sizeof(MemoryBlock));
 
-    MemoryBlock *candidate = g_main_zone->rover;
+    if (block->id != ZONE_ID)
+    {
+        g_platformAPI.SysError("ZoneFree: free memory block without zone id");
+    }
 
-    // Walk through all memory blocks and try to find one that's free and have 
-    // enough space.
-    for (;;)
+    if (block->tag == 0)
     {
-        if (candidate == g_main_zone->rover->prev)
-        {
-            return NULL; // scanned all memory block, couldn't find one
-        }
+        g_platformAPI.SysError("ZoneFree: free a free memory block");
+    }
 
-        if (candidate->tag == 0 && candidate->size >= size)
-        {
-            break ;
-        }
-        else
+    SpinLockAcquire(&g_main_zone->lock);
+    ZoneFreeLocked(g_main_zone, block);
+    SpinLockRelease(&g_main_zone->lock);
+}
+
+MemoryBlock *ZoneAllocLocked(MemoryZone *zone, I32 size)
+{
+    MemoryBlock *candidate = NULL;
+
+    // blocks freed recently are at the head of their class, allocations of 
+    // the same size get them back
+    I32 size_class = ZoneSizeClass(size);
+    MemoryBlock *head = zone->free_lists[size_class];
+    if (head && head->size >= size)
+    {
+        candidate = head;
+    }
+
+    // any block in a class above the fit class is large enough
+    I32 fit_class = ZoneFitClass(size);
+    U32 classes = fit_class < ZONE_CLASS_NUM ? zone->free_bitmap & ~((1u << fit_class) - 1) : 0;
+    if (!candidate && classes)
+    {
+        candidate = zone->free_lists[FindLeastSignificantSetBit(classes)];
+    }
+
+    // other blocks in the class of size itself may still fit, the last class 
+    // has no upper bound
+    if (!candidate && head)
+    {
+        for (MemoryBlock *block = ZoneFreeLink(head)->next_free; block; 
+             block = ZoneFreeLink(block)->next_free)
         {
-            candidate = candidate->next;
+            if (block->size >= size)
+            {
+                candidate = block;
+                break;
+            }
         }
     }
 
+    if (!candidate)
+    {
+        zone->stats.failed_allocs++;
+        return NULL; // couldn't find a block large enough
+    }
+
+    ZoneRemoveFree(zone, candidate);
+
     // if the extra space is large that MIN_FRAGMENT, merge it back into free 
     // memory block
     int extra = candidate->size - size;
@@ -484,14 +834,54 @@ void *ZoneTagMalloc(int size, int tag)
         newBlock->prev = candidate;
 
         candidate->size = size;
+
+        ZoneInsertFree(zone, newBlock);
+    }
+
+    zone->stats.live_allocs++;
+    zone->stats.total_allocs++;
+    zone->stats.bytes_used += candidate->size;
+    if (zone->stats.bytes_used > zone->stats.peak_bytes_used)
+    {
+        zone->stats.peak_bytes_used = zone->stats.bytes_used;
+    }
+
+    return candidate;
+}
+
+inline I32 ZoneBlockSize(int size)
+{
+    size += (I32)sizeof(MemoryBlock);
+    size += 4; // space at the end of memory block for trash tester
+    size = (size + 7) & ~7;
+    if (size < ZONE_MIN_BLOCK_SIZE)
+    {
+        size = ZONE_MIN_BLOCK_SIZE;
+    }
+    return size;
+}
+
+void *ZoneTagMalloc(int size, int tag)
+{
+    if (tag == 0 || tag == ZONE_FENCE_TAG)
+    {
+        g_platformAPI.SysError("ZoneTagAlloc: using a reserved tag %d", tag);
+    }
+
+    size = ZoneBlockSize(size);
+
+    SpinLockAcquire(&g_main_zone->lock);
+    MemoryBlock *candidate = ZoneAllocLocked(g_main_zone, size);
+    SpinLockRelease(&g_main_zone->lock);
+
+    if (!candidate)
+    {
+        return NULL;
     }
 
     candidate->tag = tag;
     candidate->id = ZONE_ID;
 
-    // next allocation will start looking here
-    g_main_zone->rover = candidate->next;
-
     // marker for memory trash testing
     // TODO lw: ????
     *(int *)((U8 *)candidate + (candidate->size - 4)) = ZONE_ID;
@@ -509,9 +899,19 @@ void *ZoneMalloc(int size)
 
     void *result = ZoneTagMalloc(size, 1);
 
+    // the hunk isn't thread-safe, other threads would race the owner
+    if (!result && t_zone_can_grow)
+    {
+        SpinLockAcquire(&g_main_zone->lock);
+        ZoneGrow(g_main_zone, ZoneBlockSize(size));
+        SpinLockRelease(&g_main_zone->lock);
+
+        result = ZoneTagMalloc(size, 1);
+    }
+
     if (!result)
     {
-        g_platformAPI.SysError("ZoneMalloc: failed on allocation of size bytes");
+        g_platformAPI.SysError("ZoneMalloc: failed on allocation of %d bytes", size);
     }
 
     // TODO lw: zero out result
@@ -519,6 +919,14 @@ void *ZoneMalloc(int size)
     return result;
 }
 
+ZoneStats ZoneGetStats()
+{
+    SpinLockAcquire(&g_main_zone->lock);
+    ZoneStats result = g_main_zone->stats;
+    SpinLockRelease(&g_main_zone->lock);
+    return result;
+}
+
 
 
 /* 
@@ -551,6 +959,11 @@ int g_hunk_high_used;
 int g_hunk_temp_used;
 bool g_hunk_temp_active;
 
+// high-watermarks since MemoryInit
+int g_hunk_low_peak;
+int g_hunk_high_peak;
+int g_hunk_min_free;
+
 inline int Align16(int v)
 {
     int result = (v + 15) & ~15;
@@ -563,6 +976,27 @@ inline int Align8(int v)
     return result;
 }
 
+void CacheFreeBelow(U8 *address);
+void CacheFreeAbove(U8 *address);
+void HunkFreeTemp();
+
+inline void HunkUpdatePeaks()
+{
+    if (g_hunk_low_used > g_hunk_low_peak)
+    {
+        g_hunk_low_peak = g_hunk_low_used;
+    }
+    if (g_hunk_high_used > g_hunk_high_peak)
+    {
+        g_hunk_high_peak = g_hunk_high_used;
+    }
+    int free_size = g_hunk_total_size - g_hunk_low_used - g_hunk_high_used;
+    if (free_size < g_hunk_min_free)
+    {
+        g_hunk_min_free = free_size;
+    }
+}
+
 void *HunkLowAlloc(int size, char *name)
 {
     if (size < 0)
@@ -581,8 +1015,10 @@ void *HunkLowAlloc(int size, char *name)
 
     HunkHeader *hheader = (HunkHeader *)(g_hunk_base + g_hunk_low_used);
     g_hunk_low_used += size;
+    HunkUpdatePeaks();
 
-    // TODO lw: free cache memory if necessary
+    // caches sit right above low hunk
+    CacheFreeBelow(g_hunk_base + g_hunk_low_used);
 
     MemSet(hheader, 0, size);
 
@@ -606,7 +1042,12 @@ void *HunkHighAlloc(int size, char *name)
         g_platformAPI.SysError("HunkHighAlloc: negative size");
     }
 
-    // free temp hunk
+    // temp data is always on top of high hunk, it can't outlive the next 
+    // high allocation
+    if (g_hunk_temp_active)
+    {
+        HunkFreeTemp();
+    }
 
     size = Align16(size + sizeof(HunkHeader));
 
@@ -616,9 +1057,11 @@ void *HunkHighAlloc(int size, char *name)
     }
 
     g_hunk_high_used += size;
+    HunkUpdatePeaks();
     HunkHeader *hh = (HunkHeader *)(g_hunk_base + g_hunk_total_size - g_hunk_high_used);
 
-    // TODO lw: free cache memory if necessary
+    // caches may reach up to high hunk
+    CacheFreeAbove((U8 *)hh);
 
     MemSet(hh, 0, size);
 
@@ -644,9 +1087,9 @@ void *HunkTempAlloc(int size)
     {
         HunkFreeTemp();
     }
-    g_hunk_temp_active = true;
     int old_high_used = g_hunk_high_used;
     void *result = HunkHighAlloc(size, "temp");
+    g_hunk_temp_active = true;
     g_hunk_temp_used = g_hunk_high_used - old_high_used;
     return result;
 }
@@ -657,6 +1100,114 @@ void *HunkHighAlloc(int size)
     return result;
 }
 
+// memory left between low hunk and high hunk
+int HunkGetFreeSize()
+{
+    int result = g_hunk_total_size - g_hunk_low_used - g_hunk_high_used;
+    return result;
+}
+
+/*
+ * Memory Arena
+ *
+ * Arenas hold transient data on top of a block allocated from hunk. Pushing 
+ * only moves a pointer, data is thrown away by popping to a marker or by a 
+ * reset at the end of its lifetime (e.g. once per frame). 
+ *
+ * An arena belongs to one thread, each thread sets its own as the thread 
+ * arena for code that doesn't know which thread it runs on.
+ */
+
+MemoryArena g_frame_arena;
+THREAD_LOCAL MemoryArena *t_thread_arena;
+
+void ArenaInit(MemoryArena *arena, void *base, I32 size)
+{
+    arena->base = (U8 *)base;
+    arena->size = size;
+    arena->used = 0;
+    arena->peak_used = 0;
+    arena->last_peak_used = 0;
+    arena->max_peak_used = 0;
+}
+
+void ArenaInitOnHunk(MemoryArena *arena, I32 size, char *name)
+{
+    // hunk data is only 8-byte aligned
+    U8 *base = (U8 *)HunkHighAlloc(size + 8, name);
+    base = (U8 *)(((size_t)base + 15) & ~(size_t)15);
+    ArenaInit(arena, base, size);
+}
+
+// alignment must be power of 2
+void *ArenaPush(MemoryArena *arena, I32 size, I32 alignment = 16)
+{
+    if (size < 0)
+    {
+        g_platformAPI.SysError("ArenaPush: negative size");
+    }
+
+    size_t address = (size_t)(arena->base + arena->used);
+    I32 adjust = (I32)(((address + alignment - 1) & ~((size_t)alignment - 1)) - address);
+
+    if (arena->used + adjust + size > arena->size)
+    {
+        g_platformAPI.SysError("ArenaPush: out of memory, %d of %d bytes used", 
+                               arena->used, arena->size);
+    }
+
+    void *result = arena->base + arena->used + adjust;
+    arena->used += adjust + size;
+
+    if (arena->used > arena->peak_used)
+    {
+        arena->peak_used = arena->used;
+    }
+    if (arena->used > arena->max_peak_used)
+    {
+        arena->max_peak_used = arena->used;
+    }
+
+    return result;
+}
+
+ArenaMarker ArenaGetMarker(MemoryArena *arena)
+{
+    ArenaMarker result = {arena->used};
+    return result;
+}
+
+// throw away everything pushed after the marker
+void ArenaPopToMarker(MemoryArena *arena, ArenaMarker marker)
+{
+    if (marker.used > arena->used)
+    {
+        g_platformAPI.SysError("ArenaPopToMarker: marker is above the top");
+    }
+    arena->used = marker.used;
+}
+
+void ArenaReset(MemoryArena *arena)
+{
+    arena->used = 0;
+    arena->last_peak_used = arena->peak_used;
+    arena->peak_used = 0;
+}
+
+void ArenaSetThreadArena(MemoryArena *arena)
+{
+    t_thread_arena = arena;
+}
+
+MemoryArena *ArenaGetThreadArena()
+{
+    if (!t_thread_arena)
+    {
+        g_platformAPI.SysError("ArenaGetThreadArena: no arena for this thread");
+    }
+    return t_thread_arena;
+}
+
 /*
  * Cache Memory
  *
@@ -688,6 +1239,10 @@ struct CacheHeader
 // in the cache circular link.
 CacheHeader g_cache_head;
 
+// bytes of all caches including headers
+int g_cache_used;
+int g_cache_peak;
+
 void CacheUnlinkLRU(CacheHeader *ch)
 {
     if (ch->lru_next == NULL || ch->lru_prev == NULL)
@@ -745,10 +1300,31 @@ void CacheFree(CacheUser *cu)
     ch->next = NULL;
 
     cu->data = NULL;
+    g_cache_used -= ch->size;
 
     CacheUnlinkLRU(ch);
 }
 
+// free caches overlapping the memory below address, used when low hunk grows
+void CacheFreeBelow(U8 *address)
+{
+    // cache list is in address order
+    while (g_cache_head.next != &g_cache_head && (U8 *)g_cache_head.next < address)
+    {
+        CacheFree(g_cache_head.next->user);
+    }
+}
+
+// free caches overlapping the memory above address, used when high hunk grows
+void CacheFreeAbove(U8 *address)
+{
+    while (g_cache_head.prev != &g_cache_head 
+           && (U8 *)g_cache_head.prev + g_cache_head.prev->size > address)
+    {
+        CacheFree(g_cache_head.prev->user);
+    }
+}
+
 void CacheFlushAll()
 {
     CacheHeader *ch = g_cache_head.next;
@@ -761,6 +1337,7 @@ void CacheFlushAll()
     g_cache_head.prev = &g_cache_head;
     g_cache_head.lru_next = &g_cache_head;
     g_cache_head.lru_prev = &g_cache_head;
+    g_cache_used = 0;
 }
 
 /*
@@ -866,6 +1443,12 @@ void *CacheAlloc(CacheUser *cu, int size, char *name)
             ch->user->data = (void *)(ch + 1);
             StringCopy(ch->name, 15, name, 15);
 
+            g_cache_used += ch->size;
+            if (g_cache_used > g_cache_peak)
+            {
+                g_cache_peak = g_cache_used;
+            }
+
             break ;
         }
 
@@ -887,6 +1470,8 @@ void CacheInit()
     g_cache_head.lru_next = &g_cache_head;
     g_cache_head.lru_prev = &g_cache_head;
     g_cache_head.size = 0;
+    g_cache_used = 0;
+    g_cache_peak = 0;
 
     // TODO lw: add flushall command
 }
@@ -897,6 +1482,9 @@ void MemoryInit(void *buf, int size)
     g_hunk_total_size = size;
     g_hunk_low_used = 0;
     g_hunk_high_used = 0;
+    g_hunk_low_peak = 0;
+    g_hunk_high_peak = 0;
+    g_hunk_min_free = size;
 
     CacheInit();
 
@@ -905,6 +1493,203 @@ void MemoryInit(void *buf, int size)
     g_main_zone = (MemoryZone *)HunkLowAlloc(zoneSize, "zone");
     g_main_zone->size = zoneSize;
     ZoneClearAll(g_main_zone);
+    t_zone_can_grow = true;
+}
+
+//=================================
+// Memory Report
+//=================================
+
+void MemoryReportAddEntry(MemoryReport *report, MemoryRegion region, const char *name, I32 bytes)
+{
+    MemoryReportEntry *entry = NULL;
+    for (I32 i = 0; i < report->entry_count; ++i)
+    {
+        if (report->entries[i].region == region 
+            && StringCompare(report->entries[i].name, name) == 0)
+        {
+            entry = report->entries + i;
+            break;
+        }
+    }
+
+    if (!entry)
+    {
+        // the last entry collects whatever doesn't fit
+        if (report->entry_count == MEMORY_REPORT_MAX_ENTRY_NUM)
+        {
+            entry = report->entries + MEMORY_REPORT_MAX_ENTRY_NUM - 1;
+            StringCopy(entry->name, 16, "other");
+        }
+        else
+        {
+            entry = report->entries + report->entry_count++;
+            StringCopy(entry->name, 16, name);
+            entry->region = region;
+        }
+    }
+
+    entry->count++;
+    entry->bytes += bytes;
+}
+
+// walk a range of hunk headers, start and end must be hunk boundaries
+void MemoryReportWalkHunk(MemoryReport *report, MemoryRegion region, U8 *start, U8 *end)
+{
+    while (start < end)
+    {
+        HunkHeader *hh = (HunkHeader *)start;
+        if (hh->sentinel != HUNK_SENTINEL || hh->size <= 0)
+        {
+            g_platformAPI.SysError("MemoryGetReport: hunk is corrupted");
+        }
+        MemoryReportAddEntry(report, region, hh->name, hh->size);
+        start += hh->size;
+    }
+}
+
+void MemoryGetReport(MemoryReport *report)
+{
+    MemSet(report, 0, sizeof(*report));
+
+    report->total_size = g_hunk_total_size;
+    report->low_used = g_hunk_low_used;
+    report->high_used = g_hunk_high_used;
+    report->temp_used = g_hunk_temp_used;
+    report->free_size = g_hunk_total_size - g_hunk_low_used - g_hunk_high_used;
+
+    MemoryReportWalkHunk(report, MEMORY_REGION_LOW_HUNK, g_hunk_base, g_hunk_base + g_hunk_low_used);
+    MemoryReportWalkHunk(report, MEMORY_REGION_HIGH_HUNK, 
+                         g_hunk_base + g_hunk_total_size - g_hunk_high_used, 
+                         g_hunk_base + g_hunk_total_size);
+
+    // cache list is in address order, holes are what's between neighbours
+    U8 *hole_start = g_hunk_base + g_hunk_low_used;
+    for (CacheHeader *ch = g_cache_head.next; ch != &g_cache_head; ch = ch->next)
+    {
+        I32 hole = (I32)((U8 *)ch - hole_start);
+        report->cache_hole_bytes += hole;
+        if (hole > report->cache_largest_hole)
+        {
+            report->cache_largest_hole = hole;
+        }
+        report->cache_used += ch->size;
+        report->cache_count++;
+        MemoryReportAddEntry(report, MEMORY_REGION_CACHE, ch->name, ch->size);
+        hole_start = (U8 *)ch + ch->size;
+    }
+
+    SpinLockAcquire(&g_main_zone->lock);
+    report->zone_size = g_main_zone->size;
+    for (MemoryBlock *block = g_main_zone->tailhead.next; block != &g_main_zone->tailhead;
+         block = block->next)
+    {
+        if (block->tag == 0)
+        {
+            report->zone_free += block->size;
+            report->zone_free_blocks++;
+            if (block->size > report->zone_largest_free)
+            {
+                report->zone_largest_free = block->size;
+            }
+        }
+        else if (block->tag != ZONE_FENCE_TAG)
+        {
+            report->zone_used += block->size;
+        }
+    }
+    report->zone_peak = g_main_zone->stats.peak_bytes_used;
+    SpinLockRelease(&g_main_zone->lock);
+
+    report->low_peak = g_hunk_low_peak;
+    report->high_peak = g_hunk_high_peak;
+    report->cache_peak = g_cache_peak;
+    report->min_free_size = g_hunk_min_free;
+}
+
+const char *g_memory_region_names[MEMORY_REGION_NUM] = {"low", "high", "cache"};
+
+// fragmentation in percent, how much of free memory isn't in the largest piece
+inline I32 MemoryFragmentation(I32 free_size, I32 largest)
+{
+    I32 result = free_size ? 100 - (I32)((I64)largest * 100 / free_size) : 0;
+    return result;
+}
+
+// append to buffer of size, text is cut off when the buffer is full
+#define MEMORY_REPORT_PRINT(...) \
+    if (length < size - 1) \
+    { \
+        I32 written = snprintf(buffer + length, size - length, __VA_ARGS__); \
+        length = written < 0 || length + written > size - 1 ? size - 1 : length + written; \
+    }
+
+// human readable dump, returns the length of text
+I32 MemoryReportToText(MemoryReport *report, char *buffer, I32 size)
+{
+    I32 length = 0;
+
+    MEMORY_REPORT_PRINT("hunk: %dKB total, %dKB low (peak %dKB), %dKB high (peak %dKB), "
+                        "%dKB free (min %dKB)\n",
+                        report->total_size / 1024, report->low_used / 1024, 
+                        report->low_peak / 1024, report->high_used / 1024, 
+                        report->high_peak / 1024, report->free_size / 1024,
+                        report->min_free_size / 1024);
+    MEMORY_REPORT_PRINT("cache: %d caches, %dKB (peak %dKB), %dKB in holes, largest hole %dKB\n",
+                        report->cache_count, report->cache_used / 1024, 
+                        report->cache_peak / 1024, report->cache_hole_bytes / 1024, 
+                        report->cache_largest_hole / 1024);
+    MEMORY_REPORT_PRINT("zone: %dKB, %dKB used (peak %dKB), %dKB free in %d blocks, "
+                        "fragmentation %d%%\n",
+                        report->zone_size / 1024, report->zone_used / 1024, 
+                        report->zone_peak / 1024, report->zone_free / 1024, 
+                        report->zone_free_blocks, 
+                        MemoryFragmentation(report->zone_free, report->zone_largest_free));
+
+    for (I32 i = 0; i < report->entry_count; ++i)
+    {
+        MemoryReportEntry *entry = report->entries + i;
+        MEMORY_REPORT_PRINT("  %-5s %-16s %4d %8dKB\n", g_memory_region_names[entry->region],
+                            entry->name, entry->count, entry->bytes / 1024);
+    }
+
+    return length;
+}
+
+// comma separated values, one "region,name,count,bytes" row per line
+I32 MemoryReportToSnapshot(MemoryReport *report, char *buffer, I32 size)
+{
+    I32 length = 0;
+
+    MEMORY_REPORT_PRINT("region,name,count,bytes\n");
+    MEMORY_REPORT_PRINT("hunk,total,1,%d\n", report->total_size);
+    MEMORY_REPORT_PRINT("hunk,low_used,1,%d\n", report->low_used);
+    MEMORY_REPORT_PRINT("hunk,high_used,1,%d\n", report->high_used);
+    MEMORY_REPORT_PRINT("hunk,temp_used,1,%d\n", report->temp_used);
+    MEMORY_REPORT_PRINT("hunk,free,1,%d\n", report->free_size);
+    MEMORY_REPORT_PRINT("hunk,low_peak,1,%d\n", report->low_peak);
+    MEMORY_REPORT_PRINT("hunk,high_peak,1,%d\n", report->high_peak);
+    MEMORY_REPORT_PRINT("hunk,min_free,1,%d\n", report->min_free_size);
+    MEMORY_REPORT_PRINT("cache,used,%d,%d\n", report->cache_count, report->cache_used);
+    MEMORY_REPORT_PRINT("cache,peak,1,%d\n", report->cache_peak);
+    MEMORY_REPORT_PRINT("cache,holes,1,%d\n", report->cache_hole_bytes);
+    MEMORY_REPORT_PRINT("cache,largest_hole,1,%d\n", report->cache_largest_hole);
+    MEMORY_REPORT_PRINT("zone,size,1,%d\n", report->zone_size);
+    MEMORY_REPORT_PRINT("zone,used,1,%d\n", report->zone_used);
+    MEMORY_REPORT_PRINT("zone,peak,1,%d\n", report->zone_peak);
+    MEMORY_REPORT_PRINT("zone,free,%d,%d\n", report->zone_free_blocks, report->zone_free);
+    MEMORY_REPORT_PRINT("zone,largest_free,1,%d\n", report->zone_largest_free);
+
+    for (I32 i = 0; i < report->entry_count; ++i)
+    {
+        MemoryReportEntry *entry = report->entries + i;
+        MEMORY_REPORT_PRINT("%s,%s,%d,%d\n", g_memory_region_names[entry->region],
+                            entry->name, entry->count, entry->bytes);
+    }
+
+#undef MEMORY_REPORT_PRINT
+
+    return length;
 }
 
 //=================================
@@ -912,177 +1697,475 @@ void MemoryInit(void *buf, int size)
 //=================================
 
 #define MAX_CVARS 512
-#define CVAR_HASH_MASK (MAX_CVARS - 1)
+// open addressing stays at most half full, must be power of 2
+#define CVAR_HASH_SIZE (MAX_CVARS * 2)
+#define CVAR_HASH_MASK (CVAR_HASH_SIZE - 1)
+#define CVAR_NAME_POOL_SIZE (MAX_CVARS * 32)
 
 struct CvarSystem
 {
     I32 count;
-    I32 hash[MAX_CVARS];
-    Cvar cvars[MAX_CVARS];
+    Cvar cvars[CVAR_HASH_SIZE];
+
+    // names are copied here once
+    char names[CVAR_NAME_POOL_SIZE];
+    I32 names_used;
 };
 
 CvarSystem g_cvar_pool;
 
-I32 GetCvarHashKey(const char *name)
+U32 GetCvarHashKey(const char *name)
 {
     // credit: http://www.cse.yorku.ca/~oz/hash.html
-    I32 hash = 5381;
-    char *c = (char *)name;
-    while (*c)
+    U32 hash = 5381;
+    for (const char *c = name; *c; ++c)
+    {
+        hash = (hash << 5) + hash + (U8)*c;
+    }
+    return hash;
+}
+
+// the slot holding name, or the empty slot it would go into
+Cvar *CvarFindSlot(const char *name, U32 hash)
+{
+    I32 index = hash & CVAR_HASH_MASK;
+    for (;;)
     {
-        hash = (hash << 5) + hash + *c;
-        c++;
+        Cvar *cvar = g_cvar_pool.cvars + index;
+        if (cvar->name == NULL 
+            || (cvar->hash == hash && StringCompare(cvar->name, name) == 0))
+        {
+            return cvar;
+        }
+        index = (index + 1) & CVAR_HASH_MASK;
     }
-    I32 hash_key = hash & CVAR_HASH_MASK;
-    if (hash_key == 0)
+}
+
+// NULL if there's no such cvar
+Cvar *CvarFind(const char *name)
+{
+    Cvar *result = CvarFindSlot(name, GetCvarHashKey(name));
+    if (!result->name)
     {
-        hash_key = 1;
+        result = NULL;
     }
-    return 22;
+    return result;
 }
 
 // if cvar is not found, create one with default value 0
 Cvar *CvarGet(const char *name)
 {
-    Cvar *result = NULL;
+    U32 hash = GetCvarHashKey(name);
+    Cvar *result = CvarFindSlot(name, hash);
 
-    I32 hash_key = GetCvarHashKey(name);
-    I32 hash_index = hash_key;
-    while (g_cvar_pool.hash[hash_index])
-    {
-        if (g_cvar_pool.hash[hash_index] == hash_key)
-        {
-            if (StringCompare(g_cvar_pool.cvars[hash_index].name, name) == 0)
-            {
-                result = &g_cvar_pool.cvars[hash_index];
-            }
-        }
-        hash_index = (hash_index++) & CVAR_HASH_MASK;
-    } 
-
-    if (!result)
+    if (!result->name)
     {   
+        I32 length = StringLength(name) + 1;
         if (g_cvar_pool.count >= MAX_CVARS)
         {
             g_platformAPI.SysError("CvarGet: cvar count exceeds the maximum!");
         }
+        if (g_cvar_pool.names_used + length > CVAR_NAME_POOL_SIZE)
+        {
+            g_platformAPI.SysError("CvarGet: out of memory for cvar names!");
+        }
         g_cvar_pool.count++;
-		g_cvar_pool.hash[hash_index] = hash_key;
-        result = &g_cvar_pool.cvars[hash_index];
 
-        I32 length = StringLength(name) + 1;
-        result->name = (char *)ZoneMalloc(length);
+        result->name = g_cvar_pool.names + g_cvar_pool.names_used;
         StringCopy(result->name, length, name);
+        g_cvar_pool.names_used += length;
+
+        result->hash = hash;
+        result->val = 0;
+        result->archive = 0;
+        result->on_changed = NULL;
     }
     
     return result;
 }
 
+/*
+ Returns the handle of a cvar, created with default_val if it doesn't exist 
+ yet, otherwise it keeps the value it has. on_changed may be NULL.
+*/
+Cvar *CvarRegister(const char *name, float default_val, CvarChangedCallback_t *on_changed = NULL)
+{
+    Cvar *result = CvarFind(name);
+    if (!result)
+    {
+        result = CvarGet(name);
+        result->val = default_val;
+    }
+    result->on_changed = on_changed;
+    return result;
+}
+
+void CvarSetValue(Cvar *cvar, float val)
+{
+    if (cvar->val == val)
+    {
+        return ;
+    }
+
+    float old_val = cvar->val;
+    cvar->val = val;
+    if (cvar->on_changed)
+    {
+        cvar->on_changed(cvar, old_val);
+    }
+}
+
 Cvar *CvarSet(const char *name, float val)
 {
     Cvar *result = CvarGet(name);
-    result->val = val;
+    CvarSetValue(result, val);
     return result;
 }
 
 
 //=================================
-// File system
+// Compression
 //=================================
 
-#define MAX_FILE_HANDLES 10
-
-FILE *g_file_handles[MAX_FILE_HANDLES];
+/*
+ LZ4 block format. Every sequence starts with a token, the high 4 bits are 
+ the number of literals and the low 4 bits are the match length minus 4. 15 
+ means more length bytes follow, each adds up to 255. Then the literals, then 
+ a 2-byte little-endian offset back into the output. The last sequence has 
+ literals only.
+*/
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_HASH_BITS 12
+#define LZ4_MAX_OFFSET 65535
+// matches stop this many bytes before the end, like the reference encoder
+#define LZ4_LAST_LITERALS 5
+
+// largest compressed size of size bytes
+inline I32 LZ4CompressBound(I32 size)
+{
+    I32 result = size + size / 255 + 16;
+    return result;
+}
 
-SearchPath *g_search_path;
+struct LZ4Writer
+{
+    U8 *dest; // NULL only counts
+    I32 capacity;
+    I32 count;
+    B32 overflow;
+};
 
-int FileGetAvailableHande()
+inline void LZ4PutByte(LZ4Writer *writer, U8 value)
 {
-    for (int i = 0; i < MAX_FILE_HANDLES; ++i)
+    if (writer->dest)
     {
-        if (!g_file_handles[i])
+        if (writer->count >= writer->capacity)
         {
-            return i;
+            writer->overflow = true;
+            return ;
         }
+        writer->dest[writer->count] = value;
     }
-
-    g_platformAPI.SysError("out of file handle");
-
-    return -1;
+    writer->count++;
 }
 
-int FileLength(FILE *file)
+void LZ4PutLength(LZ4Writer *writer, I32 length)
 {
-    // backup of current position indicator
-    int pos = ftell(file);
-    
-    // set position indicator to the end of the file
-    fseek(file, 0, SEEK_END);
-
-    // get number of bytes from beginning to position indicator
-    int end = ftell(file);
-
-    // set position indicator to its previous position
-    fseek(file, pos, SEEK_SET);
-
-    return end;
+    for (length -= 15; length >= 255; length -= 255)
+    {
+        LZ4PutByte(writer, 255);
+    }
+    LZ4PutByte(writer, (U8)length);
 }
 
-/*
- * Open file for read, and add file pointer to global file handle array.
- * 
- */
-int FileOpenForRead(char *path, int *handle_out)
+// match_length is 0 for the last sequence
+void LZ4PutSequence(LZ4Writer *writer, const U8 *literals, I32 literal_count, 
+                    I32 offset, I32 match_length)
 {
-    int handle = FileGetAvailableHande();
-    
-    // open as binary file for read
-    FILE *f = NULL;
-    fopen_s(&f, path, "rb");
-
-    int result = 0;
-
-    if (f)
+    I32 match_code = match_length ? match_length - LZ4_MIN_MATCH : 0;
+    U8 token = (U8)(((literal_count < 15 ? literal_count : 15) << 4) 
+                    | (match_code < 15 ? match_code : 15));
+    LZ4PutByte(writer, token);
+    if (literal_count >= 15)
     {
-        g_file_handles[handle] = f;
-        *handle_out = handle;
-        result = FileLength(f);
+        LZ4PutLength(writer, literal_count);
     }
-    else
+    for (I32 i = 0; i < literal_count; ++i)
     {
-        *handle_out = -1;
-        result = -1;
+        LZ4PutByte(writer, literals[i]);
     }
 
-    return result;
-}
-
-void FileClose(int handle)
-{
-    // if it's a file in PAK, don't close it
-    for (SearchPath *sp = g_search_path; sp != NULL; ++sp)
+    if (match_length)
     {
-        if (sp->pack != NULL && sp->pack->handle == handle)
+        LZ4PutByte(writer, (U8)(offset & 0xff));
+        LZ4PutByte(writer, (U8)(offset >> 8));
+        if (match_code >= 15)
         {
-            return ;
+            LZ4PutLength(writer, match_code);
         }
     }
-
-    // TODO lw: close file such as config.cfg
 }
 
-inline size_t 
-FileRead(int filehandle, void *dest, int count)
+inline U32 LZ4Read32(const U8 *p)
 {
-    ASSERT(count >= 0);
-    size_t result = fread(dest, 1, count, g_file_handles[filehandle]);
+    U32 result = p[0] | (p[1] << 8) | (p[2] << 16) | ((U32)p[3] << 24);
     return result;
 }
 
-inline void 
-FileSeek(int filehandle, int position)
+/*
+ Greedy compression with a hash table of the last position of each 4 bytes.
+ dest may be NULL to get the compressed size. Returns the compressed size, or
+ -1 if capacity is too small. Safe to call from any thread.
+*/
+I32 LZ4Compress(const U8 *src, I32 size, U8 *dest, I32 capacity)
 {
-    fseek(g_file_handles[filehandle], position, SEEK_SET);
+    I32 table[1 << LZ4_HASH_BITS];
+    for (I32 i = 0; i < (1 << LZ4_HASH_BITS); ++i)
+    {
+        table[i] = -1;
+    }
+
+    LZ4Writer writer = {dest, capacity, 0, false};
+    I32 anchor = 0;
+    I32 pos = 0;
+    I32 match_limit = size - LZ4_LAST_LITERALS;
+    while (pos + LZ4_MIN_MATCH <= match_limit)
+    {
+        U32 sequence = LZ4Read32(src + pos);
+        U32 hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+        I32 candidate = table[hash];
+        table[hash] = pos;
+
+        if (candidate >= 0 && pos - candidate <= LZ4_MAX_OFFSET 
+            && LZ4Read32(src + candidate) == sequence)
+        {
+            I32 length = LZ4_MIN_MATCH;
+            while (pos + length < match_limit && src[candidate + length] == src[pos + length])
+            {
+                length++;
+            }
+
+            LZ4PutSequence(&writer, src + anchor, pos - anchor, pos - candidate, length);
+            pos += length;
+            anchor = pos;
+        }
+        else
+        {
+            pos++;
+        }
+    }
+    LZ4PutSequence(&writer, src + anchor, size - anchor, 0, 0);
+
+    I32 result = writer.overflow ? -1 : writer.count;
+    return result;
+}
+
+inline B32 LZ4GetLength(const U8 *src, I32 size, I32 *in, I32 *length)
+{
+    U8 value = 255;
+    while (value == 255)
+    {
+        if (*in >= size)
+        {
+            return false;
+        }
+        value = src[(*in)++];
+        *length += value;
+    }
+    return true;
+}
+
+// returns the decompressed size, -1 if src is corrupt or dest is too small
+I32 LZ4Decompress(const U8 *src, I32 size, U8 *dest, I32 capacity)
+{
+    I32 in = 0;
+    I32 out = 0;
+    while (in < size)
+    {
+        U8 token = src[in++];
+
+        I32 literal_count = token >> 4;
+        if (literal_count == 15 && !LZ4GetLength(src, size, &in, &literal_count))
+        {
+            return -1;
+        }
+        if (literal_count > size - in || literal_count > capacity - out)
+        {
+            return -1;
+        }
+        MemCpy(dest + out, (void *)(src + in), literal_count);
+        in += literal_count;
+        out += literal_count;
+
+        if (in == size)
+        {
+            break;
+        }
+
+        if (size - in < 2)
+        {
+            return -1;
+        }
+        I32 offset = src[in] | (src[in + 1] << 8);
+        in += 2;
+
+        I32 length = token & 15;
+        if (length == 15 && !LZ4GetLength(src, size, &in, &length))
+        {
+            return -1;
+        }
+        length += LZ4_MIN_MATCH;
+
+        if (offset == 0 || offset > out || length > capacity - out)
+        {
+            return -1;
+        }
+
+        // the match may overlap what it writes, copy byte by byte
+        U8 *match = dest + out - offset;
+        for (I32 i = 0; i < length; ++i)
+        {
+            dest[out + i] = match[i];
+        }
+        out += length;
+    }
+
+    return out;
+}
+
+//=================================
+// File system
+//=================================
+
+#define MAX_FILE_HANDLES 10
+
+FILE *g_file_handles[MAX_FILE_HANDLES];
+
+SearchPath *g_search_path;
+
+int FileGetAvailableHande()
+{
+    for (int i = 0; i < MAX_FILE_HANDLES; ++i)
+    {
+        if (!g_file_handles[i])
+        {
+            return i;
+        }
+    }
+
+    g_platformAPI.SysError("out of file handle");
+
+    return -1;
+}
+
+int FileLength(FILE *file)
+{
+    // backup of current position indicator
+    int pos = ftell(file);
+    
+    // set position indicator to the end of the file
+    fseek(file, 0, SEEK_END);
+
+    // get number of bytes from beginning to position indicator
+    int end = ftell(file);
+
+    // set position indicator to its previous position
+    fseek(file, pos, SEEK_SET);
+
+    return end;
+}
+
+/*
+ * Open file for read, and add file pointer to global file handle array.
+ * 
+ */
+int FileOpenForRead(char *path, int *handle_out)
+{
+    int handle = FileGetAvailableHande();
+    
+    // open as binary file for read
+    FILE *f = NULL;
+    fopen_s(&f, path, "rb");
+
+    int result = 0;
+
+    if (f)
+    {
+        g_file_handles[handle] = f;
+        *handle_out = handle;
+        result = FileLength(f);
+    }
+    else
+    {
+        *handle_out = -1;
+        result = -1;
+    }
+
+    return result;
+}
+
+// write data to a file on disk, not in a pak
+B32 FileWriteWhole(const char *path, void *data, int size)
+{
+    FILE *f = NULL;
+    fopen_s(&f, path, "wb");
+    if (!f)
+    {
+        return false;
+    }
+
+    size_t written = fwrite(data, 1, size, f);
+    fclose(f);
+
+    B32 result = written == (size_t)size;
+    return result;
+}
+
+// reads size bytes at position of a file outside the paks, safe to call from
+// any thread. false if the file is shorter.
+B32 FileReadAt(const char *path, int position, void *dest, int size)
+{
+    FILE *f = NULL;
+    fopen_s(&f, path, "rb");
+    if (!f)
+    {
+        return false;
+    }
+
+    B32 result = fseek(f, position, SEEK_SET) == 0 
+        && fread(dest, 1, size, f) == (size_t)size;
+    fclose(f);
+
+    return result;
+}
+
+void FileClose(int handle)
+{
+    // if it's a file in PAK, don't close it
+    for (SearchPath *sp = g_search_path; sp != NULL; ++sp)
+    {
+        if (sp->pack != NULL && sp->pack->handle == handle)
+        {
+            return ;
+        }
+    }
+
+    // TODO lw: close file such as config.cfg
+}
+
+inline size_t 
+FileRead(int filehandle, void *dest, int count)
+{
+    ASSERT(count >= 0);
+    size_t result = fread(dest, 1, count, g_file_handles[filehandle]);
+    return result;
+}
+
+inline void 
+FileSeek(int filehandle, int position)
+{
+    fseek(g_file_handles[filehandle], position, SEEK_SET);
 }
 
 
@@ -1124,6 +2207,143 @@ void GetFileNameFromPath(const char *path, char *dest, int destSize)
     StringCopy(dest, destSize, onePastLastSlash, (int)(scan - onePastLastSlash));
 }
 
+FileIndex g_file_index;
+
+// paths are case insensitive and both slashes separate directories
+inline char FileNormalizePathChar(char c)
+{
+    char result = c == '\\' ? '/' : c;
+    if (result >= 'A' && result <= 'Z')
+    {
+        result = (char)(result + ('a' - 'A'));
+    }
+    return result;
+}
+
+// FNV-1a of the normalized path
+U32 FileHashPath(const char *path)
+{
+    U32 hash = 2166136261u;
+    for (const char *c = path; *c; ++c)
+    {
+        hash ^= (U8)FileNormalizePathChar(*c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// FNV-1a of a block of memory
+U32 HashMemory(const void *data, int size)
+{
+    U32 hash = 2166136261u;
+    const U8 *byte = (const U8 *)data;
+    for (int i = 0; i < size; ++i)
+    {
+        hash ^= byte[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+B32 FilePathEqual(const char *lhs, const char *rhs)
+{
+    while (*lhs && FileNormalizePathChar(*lhs) == FileNormalizePathChar(*rhs))
+    {
+        lhs++;
+        rhs++;
+    }
+    B32 result = FileNormalizePathChar(*lhs) == FileNormalizePathChar(*rhs);
+    return result;
+}
+
+void FileIndexInit()
+{
+    g_file_index.entries = (FileIndexEntry *)HunkLowAlloc(FILE_INDEX_SIZE * sizeof(FileIndexEntry), 
+                                                          "fileindex");
+    g_file_index.count = 0;
+    g_file_index.missing_count = 0;
+}
+
+// the slot holding path, or the empty slot it would go into
+FileIndexEntry *FileIndexProbe(const char *path, U32 hash)
+{
+    U32 slot = hash & FILE_INDEX_MASK;
+    for (;;)
+    {
+        FileIndexEntry *entry = g_file_index.entries + slot;
+        if (!entry->name || (entry->hash == hash && FilePathEqual(entry->name, path)))
+        {
+            return entry;
+        }
+        slot = (slot + 1) & FILE_INDEX_MASK;
+    }
+}
+
+FileIndexEntry *FileIndexInsert(const char *name)
+{
+    U32 hash = FileHashPath(name);
+    FileIndexEntry *entry = FileIndexProbe(name, hash);
+    if (!entry->name)
+    {
+        // keep the load factor low so probes stay short
+        if (g_file_index.count >= FILE_INDEX_SIZE / 2)
+        {
+            g_platformAPI.SysError("FileIndexInsert: too many files in pak files");
+        }
+        g_file_index.count++;
+        entry->hash = hash;
+    }
+    return entry;
+}
+
+// files in packs added later replace the ones added before
+void FileIndexAddPack(PackHeader *pack)
+{
+    for (I32 i = 0; i < pack->numfiles; ++i)
+    {
+        FileIndexEntry *entry = FileIndexInsert(pack->files[i].name);
+        if (entry->name && entry->file_index < 0)
+        {
+            // no longer missing, the name of the pack file is used from now
+            ZoneFree((void *)entry->name);
+            g_file_index.missing_count--;
+        }
+        entry->name = pack->files[i].name;
+        entry->pack = pack;
+        entry->file_index = i;
+    }
+}
+
+// remember a file nobody has, a pack added later overwrites the entry
+void FileIndexAddMissing(const char *path)
+{
+    if (g_file_index.missing_count >= FILE_INDEX_MAX_MISSING_NUM)
+    {
+        return ;
+    }
+
+    FileIndexEntry *entry = FileIndexInsert(path);
+    if (!entry->name)
+    {
+        I32 length = StringLength(path) + 1;
+        char *name = (char *)ZoneMalloc(length);
+        StringCopy(name, length, path);
+        entry->name = name;
+        entry->pack = NULL;
+        entry->file_index = -1;
+        g_file_index.missing_count++;
+    }
+}
+
+// NULL if the file isn't indexed, an entry with file_index -1 if it's known 
+// to be missing
+FileIndexEntry *FileIndexFind(const char *path)
+{
+    FileIndexEntry *entry = FileIndexProbe(path, FileHashPath(path));
+    FileIndexEntry *result = entry->name ? entry : NULL;
+    return result;
+}
+
 int FileFind(const char *filepath, int *handle)
 {
     if (*handle >= 0)
@@ -1131,33 +2351,103 @@ int FileFind(const char *filepath, int *handle)
         g_platformAPI.SysError("handle is already set");
     }
 
-    SearchPath *searchPath = g_search_path;
-    for ( ; searchPath != NULL; searchPath = searchPath->next)
+    FileIndexEntry *entry = FileIndexFind(filepath);
+    if (entry && entry->file_index >= 0)
+    {
+        PackFile *file = entry->pack->files + entry->file_index;
+        *handle = entry->pack->handle;
+        FileSeek(*handle, file->filePosition);
+        return file->fileLength;
+    }
+
+    if (!entry)
     {
-        // search in PAK file
-        if (searchPath->pack != NULL)
+        SearchPath *searchPath = g_search_path;
+        for ( ; searchPath != NULL; searchPath = searchPath->next)
         {
-            PackHeader *pack = searchPath->pack;
-            for (int i = 0; i < pack->numfiles; ++i)
+            // files in PAK are all in the index
+            if (searchPath->pack == NULL)
             {
-                if (StringCompare(pack->files[i].name, filepath) == 0)
-                {
-                    *handle = pack->handle;
-                    FileSeek(*handle, pack->files[i].filePosition);
-                    return pack->files[i].fileLength;
-                }
+                // TODO lw: files not in PAK such as config.cfg
             }
         }
-        else
-        {
-            // TODO lw: files not in PAK such as config.cfg
-        }
+
+        FileIndexAddMissing(filepath);
     }
 
     *handle = -1;
     return 0;
 }
 
+// read-only view of a file in a mapped pak, no copy is made. NULL if the 
+// file isn't found or its pak isn't mapped.
+const U8 *FileMap(const char *filepath, int *length)
+{
+    const U8 *result = NULL;
+
+    FileIndexEntry *entry = FileIndexFind(filepath);
+    if (entry && entry->file_index >= 0 && entry->pack->mapped)
+    {
+        PackFile *file = entry->pack->files + entry->file_index;
+        if (file->filePosition >= 0 && file->fileLength >= 0
+            && file->filePosition + file->fileLength <= entry->pack->mappedSize)
+        {
+            result = entry->pack->mapped + file->filePosition;
+            *length = file->fileLength;
+        }
+    }
+
+    return result;
+}
+
+/*
+ Path of a file that goes next to the pak holding filepath, e.g. data derived 
+ from it. "maps/e1m1.bsp" in "id1/pak1.pak" with suffix "c" is 
+ "id1/pak1_maps_e1m1.bspc". false if filepath isn't in a pak.
+*/
+B32 FilePackSidePath(const char *filepath, const char *suffix, char *dest, int destSize)
+{
+    FileIndexEntry *entry = FileIndexFind(filepath);
+    if (!entry || entry->file_index < 0 || entry->pack->filepath[0] == '\0')
+    {
+        return false;
+    }
+
+    const char *packpath = entry->pack->filepath;
+    int length = StringLength(packpath);
+    const char *extension = packpath + length;
+    for (const char *c = packpath + length - 1; c >= packpath && *c != '/' && *c != '\\'; --c)
+    {
+        if (*c == '.')
+        {
+            extension = c;
+            break;
+        }
+    }
+
+    int count = 0;
+    for (const char *c = packpath; c < extension && count < destSize - 1; ++c)
+    {
+        dest[count++] = *c;
+    }
+    if (count < destSize - 1)
+    {
+        dest[count++] = '_';
+    }
+    for (const char *c = filepath; *c && count < destSize - 1; ++c)
+    {
+        dest[count++] = (*c == '/' || *c == '\\') ? '_' : *c;
+    }
+    for (const char *c = suffix; *c && count < destSize - 1; ++c)
+    {
+        dest[count++] = *c;
+    }
+    dest[count] = '\0';
+
+    B32 result = StringLength(filepath) + StringLength(suffix) + (int)(extension - packpath) + 1 < destSize;
+    return result;
+}
+
 U8 *FileLoad(const char *filepath, ALLocType allocType)
 {
     int handle = -1;
@@ -1213,7 +2503,44 @@ U8 *FileLoad(const char *filepath, ALLocType allocType)
     // TODO lw: why allocate one extra byte and set it to 0???
     buffer[fileLength] = 0; 
 
-    FileRead(handle, buffer, fileLength);
+    int mappedLength = 0;
+    const U8 *mapped = FileMap(filepath, &mappedLength);
+    if (mapped)
+    {
+        MemCpy(buffer, (void *)mapped, fileLength);
+    }
+    else
+    {
+        FileRead(handle, buffer, fileLength);
+    }
+    FileClose(handle);
+
+    return buffer;
+}
+
+// the file data is followed by a 0, NULL if the file isn't found
+U8 *FileLoadToArena(const char *filepath, MemoryArena *arena)
+{
+    int handle = -1;
+    int fileLength = FileFind(filepath, &handle);
+    if (handle == -1)
+    {
+        return NULL;
+    }
+
+    U8 *buffer = (U8 *)ArenaPush(arena, fileLength + 1);
+    buffer[fileLength] = 0;
+
+    int mappedLength = 0;
+    const U8 *mapped = FileMap(filepath, &mappedLength);
+    if (mapped)
+    {
+        MemCpy(buffer, (void *)mapped, fileLength);
+    }
+    else
+    {
+        FileRead(handle, buffer, fileLength);
+    }
     FileClose(handle);
 
     return buffer;
@@ -1225,6 +2552,279 @@ U8 *FileLoadToLowHunk(const char *filepath)
     return result;
 }
     
+//=================================
+// Asynchronous file loading
+//=================================
+
+/*
+ Memory for the file is allocated when the request is made, on the calling 
+ thread, since none of the allocators are safe to use from worker threads. 
+ Workers only copy from the mapped pak, or read with their own file handle.
+ Every request adds one work to the queue, the work loads whichever pending 
+ request has the highest priority at the time.
+*/
+
+PlatformWorkQueue *g_work_queue;
+
+struct FileRequestQueue
+{
+    SpinLock lock;
+    I32 next_id;
+    FileRequest requests[MAX_FILE_REQUEST_NUM];
+};
+
+FileRequestQueue g_file_requests;
+
+// take the pending request with the highest priority
+FileRequest *FileRequestTakeNext()
+{
+    FileRequest *result = NULL;
+
+    SpinLockAcquire(&g_file_requests.lock);
+    for (I32 i = 0; i < MAX_FILE_REQUEST_NUM; ++i)
+    {
+        FileRequest *request = g_file_requests.requests + i;
+        if (request->state == FILE_REQUEST_PENDING 
+            && (!result || request->priority > result->priority))
+        {
+            result = request;
+        }
+    }
+    if (result)
+    {
+        result->state = FILE_REQUEST_LOADING;
+    }
+    SpinLockRelease(&g_file_requests.lock);
+
+    return result;
+}
+
+PLATFORM_WORK_QUEUE_CALLBACK(FileRequestWork)
+{
+    FileRequest *request = FileRequestTakeNext();
+    if (!request)
+    {
+        return ;
+    }
+
+    I32 state = FILE_REQUEST_DONE;
+    PackHeader *pack = request->pack;
+    if (pack->mapped)
+    {
+        MemCpy(request->buffer, pack->mapped + request->position, request->length);
+    }
+    else
+    {
+        // the shared handle of the pak isn't safe to seek from here
+        FILE *f = NULL;
+        fopen_s(&f, pack->filepath, "rb");
+        if (f && fseek(f, request->position, SEEK_SET) == 0
+            && fread(request->buffer, 1, request->length, f) == (size_t)request->length)
+        {
+            state = FILE_REQUEST_DONE;
+        }
+        else
+        {
+            state = FILE_REQUEST_FAILED;
+        }
+        if (f)
+        {
+            fclose(f);
+        }
+    }
+
+    // interlocked so the data is visible before the state
+    AtomicCompareExchange(&request->state, state, FILE_REQUEST_LOADING);
+}
+
+// a free request for the file, NULL if there are too many. It's failed 
+// already if the file isn't in a pak.
+FileRequest *FileRequestCreate(const char *filepath, I32 priority,
+                               FileRequestCallback_t *callback, void *user_data)
+{
+    FileRequest *request = NULL;
+    for (I32 index = 0; index < MAX_FILE_REQUEST_NUM; ++index)
+    {
+        if (g_file_requests.requests[index].state == FILE_REQUEST_FREE)
+        {
+            request = g_file_requests.requests + index;
+            break;
+        }
+    }
+    if (!request)
+    {
+        g_platformAPI.SysError("FileLoadAsync: too many requests");
+        return NULL;
+    }
+
+    StringCopy(request->path, MAX_PACK_FILE_PATH, filepath);
+    request->id = ++g_file_requests.next_id;
+    request->priority = priority;
+    request->callback = callback;
+    request->user_data = user_data;
+    request->buffer = NULL;
+    request->length = 0;
+
+    FileIndexEntry *entry = FileIndexFind(filepath);
+    if (!entry || entry->file_index < 0)
+    {
+        request->state = FILE_REQUEST_FAILED;
+        return request;
+    }
+
+    PackFile *file = entry->pack->files + entry->file_index;
+    request->pack = entry->pack;
+    request->position = file->filePosition;
+    request->length = file->fileLength;
+
+    return request;
+}
+
+// the buffer is allocated, hand the request to the workers
+void FileRequestStart(FileRequest *request)
+{
+    request->buffer[request->length] = 0;
+
+    // the work may start right away
+    AtomicCompareExchange(&request->state, FILE_REQUEST_PENDING, FILE_REQUEST_FREE);
+
+    if (g_work_queue)
+    {
+        g_platformAPI.SysAddWork(g_work_queue, FileRequestWork, NULL);
+    }
+    else
+    {
+        FileRequestWork(NULL, NULL);
+    }
+}
+
+FileRequestHandle FileRequestGetHandle(FileRequest *request)
+{
+    FileRequestHandle result = {};
+    if (request)
+    {
+        result.index = (I32)(request - g_file_requests.requests);
+        result.id = request->id;
+    }
+    return result;
+}
+
+/*
+ Start loading a file in the background. allocType is ZONE or LOWHUNK, temp 
+ hunk could be gone before the file is loaded. callback may be NULL. The 
+ buffer belongs to the caller once the request is done. The id of the handle
+ is 0 if there are too many requests, nothing is loaded and the callback
+ isn't called then.
+*/
+FileRequestHandle FileLoadAsync(const char *filepath, ALLocType allocType, I32 priority,
+                                FileRequestCallback_t *callback, void *user_data)
+{
+    FileRequest *request = FileRequestCreate(filepath, priority, callback, user_data);
+    FileRequestHandle result = FileRequestGetHandle(request);
+    if (!request || request->state == FILE_REQUEST_FAILED)
+    {
+        return result;
+    }
+
+    char baseName[16];
+    GetFileNameFromPath(filepath, baseName, 16);
+
+    switch (allocType)
+    {
+        case ALLocType::LOWHUNK:
+        {
+            request->buffer = (U8 *)HunkLowAlloc(request->length + 1, baseName);
+        } break;
+
+        case ALLocType::ZONE:
+        {
+            request->buffer = (U8 *)ZoneMalloc(request->length + 1);
+        } break;
+
+        default:
+        {
+            g_platformAPI.SysError("FileLoadAsync: bad alloc type");
+            request->state = FILE_REQUEST_FAILED;
+            return result;
+        }
+    }
+
+    FileRequestStart(request);
+
+    return result;
+}
+
+// FileLoadAsync into an arena, the arena mustn't be used by other threads 
+// until the request is done
+FileRequestHandle FileLoadToArenaAsync(const char *filepath, MemoryArena *arena, I32 priority,
+                                       FileRequestCallback_t *callback, void *user_data)
+{
+    FileRequest *request = FileRequestCreate(filepath, priority, callback, user_data);
+    FileRequestHandle result = FileRequestGetHandle(request);
+    if (!request || request->state == FILE_REQUEST_FAILED)
+    {
+        return result;
+    }
+
+    request->buffer = (U8 *)ArenaPush(arena, request->length + 1);
+    FileRequestStart(request);
+
+    return result;
+}
+
+// FILE_REQUEST_FREE once the request finished and has been delivered
+FileRequestState FileRequestPoll(FileRequestHandle handle)
+{
+    // there were too many requests
+    if (!handle.id)
+    {
+        return FILE_REQUEST_FAILED;
+    }
+
+    FileRequest *request = g_file_requests.requests + handle.index;
+    FileRequestState result = FILE_REQUEST_FREE;
+    if (request->id == handle.id)
+    {
+        result = (FileRequestState)request->state;
+    }
+    return result;
+}
+
+// deliver finished requests, called once a frame on the main thread
+void FileAsyncUpdate()
+{
+    for (I32 i = 0; i < MAX_FILE_REQUEST_NUM; ++i)
+    {
+        FileRequest *request = g_file_requests.requests + i;
+        if (request->state == FILE_REQUEST_DONE || request->state == FILE_REQUEST_FAILED)
+        {
+            if (request->callback)
+            {
+                request->callback(request);
+            }
+            request->state = FILE_REQUEST_FREE;
+        }
+    }
+}
+
+// block until the request is finished, the callback runs before this returns
+void FileRequestWait(FileRequestHandle handle)
+{
+    for (;;)
+    {
+        FileRequestState state = FileRequestPoll(handle);
+        if (state != FILE_REQUEST_PENDING && state != FILE_REQUEST_LOADING)
+        {
+            break;
+        }
+        if (!g_work_queue || !g_platformAPI.SysDoNextWork(g_work_queue))
+        {
+            CpuPause();
+        }
+    }
+    FileAsyncUpdate();
+}
+
 PackHeader *FileLoadPack(char *packpath)
 {
     int packHandle = 0;
@@ -1272,11 +2872,18 @@ PackHeader *FileLoadPack(char *packpath)
     }
 
     PackHeader *packHeader = (PackHeader *)HunkLowAlloc(sizeof(PackHeader), "packheader");
-    //StringCopy(packHeader->filepath, MAX_OS_PATH_LENGTH, packHeaderDisk);
+    StringCopy(packHeader->filepath, MAX_OS_PATH_LENGTH, packpath);
     packHeader->handle = packHandle;
     packHeader->numfiles = packfileNum;
     packHeader->files = packFiles;
 
+    // files are read through the mapping when possible, the handle is kept 
+    // as fallback
+    if (g_platformAPI.SysMapFile)
+    {
+        packHeader->mapped = (U8 *)g_platformAPI.SysMapFile(packpath, &packHeader->mappedSize);
+    }
+
     return packHeader;
 }
 
@@ -1307,6 +2914,8 @@ void FileAddGameDiectory(char *dir)
             break ;
         }
 
+        FileIndexAddPack(pack);
+
         search = (SearchPath *)HunkLowAlloc(sizeof(SearchPath), "packpath");
         search->pack = pack;
         // insert in front of search path list
@@ -1326,6 +2935,7 @@ int FileSystemInit(char *assetDir)
         g_platformAPI.SysError("Not a Little Endian system");
     }
 
+    FileIndexInit();
     FileAddGameDiectory(assetDir);
     return 0;
 }
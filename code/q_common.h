@@ -17,6 +17,82 @@ struct CacheUser
     void *data;
 };
 
+// Linear allocator for transient data, memory is pushed on top and popped 
+// back to a marker, or all at once by a reset.
+struct MemoryArena
+{
+    U8 *base;
+    I32 size;
+    I32 used;
+    // high-watermark since the last reset
+    I32 peak_used;
+    // high-watermark of the previous reset period, e.g. last frame
+    I32 last_peak_used;
+    // high-watermark since the arena was created
+    I32 max_peak_used;
+};
+
+struct ArenaMarker
+{
+    I32 used;
+};
+
+#define ARENA_PUSH_ARRAY(arena, type, count) \
+    (type *)ArenaPush((arena), (count) * (I32)sizeof(type))
+
+enum MemoryRegion
+{
+    MEMORY_REGION_LOW_HUNK,
+    MEMORY_REGION_HIGH_HUNK,
+    MEMORY_REGION_CACHE,
+    MEMORY_REGION_NUM
+};
+
+#define MEMORY_REPORT_MAX_ENTRY_NUM 128
+
+// allocations of the same name in one region
+struct MemoryReportEntry
+{
+    char name[16];
+    I32 region;
+    I32 count;
+    I32 bytes; // including headers
+};
+
+// snapshot of every allocator, sizes are in bytes
+struct MemoryReport
+{
+    I32 total_size;
+
+    I32 low_used;
+    I32 high_used;
+    I32 temp_used;
+    // between the top of low hunk and the top of high hunk, caches included
+    I32 free_size;
+
+    I32 cache_used;
+    I32 cache_count;
+    // free memory between caches, can't be used by hunk until caches go
+    I32 cache_hole_bytes;
+    I32 cache_largest_hole;
+
+    I32 zone_size;
+    I32 zone_used;
+    I32 zone_free;
+    I32 zone_free_blocks;
+    I32 zone_largest_free;
+
+    // high-watermarks since MemoryInit
+    I32 low_peak;
+    I32 high_peak;
+    I32 cache_peak;
+    I32 zone_peak;
+    I32 min_free_size;
+
+    MemoryReportEntry entries[MEMORY_REPORT_MAX_ENTRY_NUM];
+    I32 entry_count;
+};
+
 enum ALLocType 
 {
     ZONE,
@@ -31,12 +107,22 @@ enum ALLocType
 //=================================
 
 
+struct Cvar;
+
+// called after the value changed
+#define CVAR_CHANGED_CALLBACK(name) void name(Cvar *cvar, float old_val)
+typedef CVAR_CHANGED_CALLBACK(CvarChangedCallback_t);
+
+// a Cvar * never moves, code that reads it often keeps the pointer as a 
+// handle instead of looking up the name
 struct Cvar
 {
-    char *name;
+    char *name; // interned, NULL for empty slots
     float val;
     // set true to save the variable before quitting
     I32 archive;
+    U32 hash;
+    CvarChangedCallback_t *on_changed;
 };
 
 
@@ -65,6 +151,75 @@ struct PackHeader
     int handle;
     int numfiles;
     PackFile *files; // array of pack files
+    // the whole pak file if the platform could map it, read-only
+    U8 *mapped;
+    int mappedSize;
+};
+
+// open addressing, must be power of 2
+#define FILE_INDEX_SIZE 16384
+#define FILE_INDEX_MASK (FILE_INDEX_SIZE - 1)
+// known missing files cached at most
+#define FILE_INDEX_MAX_MISSING_NUM 256
+
+// where a file lives in the pak files, path are normalized before hashing
+struct FileIndexEntry
+{
+    U32 hash;
+    // -1 if the file is known to be missing
+    I32 file_index;
+    PackHeader *pack;
+    // NULL for empty slots
+    const char *name;
+};
+
+struct FileIndex
+{
+    FileIndexEntry *entries;
+    I32 count;
+    I32 missing_count;
+};
+
+enum FileRequestState
+{
+    FILE_REQUEST_FREE, // not in use, or finished and delivered
+    FILE_REQUEST_PENDING,
+    FILE_REQUEST_LOADING,
+    FILE_REQUEST_DONE,
+    FILE_REQUEST_FAILED
+};
+
+struct FileRequest;
+
+// called on the main thread from FileAsyncUpdate once the request finishes
+#define FILE_REQUEST_CALLBACK(name) void name(FileRequest *request)
+typedef FILE_REQUEST_CALLBACK(FileRequestCallback_t);
+
+#define MAX_FILE_REQUEST_NUM 64
+
+struct FileRequest
+{
+    volatile I32 state;
+    // larger values are loaded first
+    I32 priority;
+    // tells handles of an earlier use of the slot apart
+    I32 id;
+    char path[MAX_PACK_FILE_PATH];
+
+    PackHeader *pack;
+    I32 position;
+    I32 length;
+    // length + 1 bytes, the last one is 0
+    U8 *buffer;
+
+    FileRequestCallback_t *callback;
+    void *user_data;
+};
+
+struct FileRequestHandle
+{
+    I32 index;
+    I32 id;
 };
 
 struct SearchPath
@@ -0,0 +1,235 @@
+/*
+ Entities are linked into the leaves their bounds touch, so walking the BSP 
+ finds the visible ones without testing every entity. Linking is done when an
+ entity moves, not every frame: while linking, the bounds are pushed down the
+ tree and the distance to the nearest plane they would have to cross to end
+ up in other leaves is kept. Moving less than that changes nothing.
+*/
+
+EFragSystem g_efragsystem;
+
+// small enough to never matter, large enough to cover the rounding of 
+// origin + bounds
+#define EFRAG_SLACK_EPSILON 0.01f
+
+void EFragReset(EFragSystem *system)
+{
+    system->free_efrags = NULL;
+    system->high_mark = 0;
+    system->moved = true;
+}
+
+EFrag *EFragAlloc(EFragSystem *system)
+{
+    EFrag *result = system->free_efrags;
+    if (result)
+    {
+        system->free_efrags = result->nextEntity;
+    }
+    else if (system->high_mark < MAX_EFRAGS)
+    {
+        result = system->efrags + system->high_mark++;
+    }
+    else
+    {
+        g_platformAPI.SysPrint("EFragAlloc: too many efrags\n");
+    }
+    return result;
+}
+
+void EFragFree(EFragSystem *system, EFrag *efrag)
+{
+    efrag->nextEntity = system->free_efrags;
+    system->free_efrags = efrag;
+}
+
+// bounds of the entity relative to its origin
+void EntityGetLocalBounds(Entity *entity, Vec3f *mins, Vec3f *maxs)
+{
+    Model *model = entity->model;
+    if (entity->angles.x || entity->angles.y || entity->angles.z)
+    {
+        // a box around the radius holds it in any direction
+        *maxs = {model->radius, model->radius, model->radius};
+        *mins = -1.0f * *maxs;
+    }
+    else
+    {
+        *mins = model->min;
+        *maxs = model->max;
+    }
+}
+
+void EntityUnlink(EFragSystem *system, Entity *entity)
+{
+    EFrag *efrag = entity->efrags;
+    while (efrag)
+    {
+        EFrag **link = &efrag->leaf->efrags;
+        while (*link != efrag)
+        {
+            if (!*link)
+            {
+                g_platformAPI.SysError("EntityUnlink: efrag isn't in its leaf");
+            }
+            link = &(*link)->nextLeaf;
+        }
+        *link = efrag->nextLeaf;
+
+        EFrag *next = efrag->nextEntity;
+        EFragFree(system, efrag);
+        efrag = next;
+    }
+
+    entity->efrags = NULL;
+    entity->topnode = NULL;
+    entity->linked = false;
+}
+
+struct EFragLink
+{
+    EFragSystem *system;
+    Entity *entity;
+    Vec3f mins;
+    Vec3f maxs;
+    EFrag **last_link;
+    float slack;
+};
+
+void EFragSplitOnNode(EFragLink *link, Node *node)
+{
+    if (node->contents == CONTENTS_SOLID)
+    {
+        return;
+    }
+
+    if (node->contents < 0)
+    {
+        EFrag *efrag = EFragAlloc(link->system);
+        if (!efrag)
+        {
+            return;
+        }
+
+        efrag->entity = link->entity;
+        efrag->nextEntity = NULL;
+        *link->last_link = efrag;
+        link->last_link = &efrag->nextEntity;
+
+        Leaf *leaf = (Leaf *)node;
+        efrag->leaf = leaf;
+        efrag->nextLeaf = leaf->efrags;
+        leaf->efrags = efrag;
+        return;
+    }
+
+    // distances of the nearest and the farthest corner of the bounds
+    Plane *plane = node->plane;
+    float dmin, dmax;
+    if (plane->type < 3)
+    {
+        dmin = ((float *)&link->mins)[plane->type] - plane->distance;
+        dmax = ((float *)&link->maxs)[plane->type] - plane->distance;
+    }
+    else
+    {
+        dmin = -plane->distance;
+        dmax = -plane->distance;
+        for (I32 i = 0; i < 3; ++i)
+        {
+            float n = ((float *)&plane->normal)[i];
+            float min = ((float *)&link->mins)[i];
+            float max = ((float *)&link->maxs)[i];
+            dmin += n * (n >= 0 ? min : max);
+            dmax += n * (n >= 0 ? max : min);
+        }
+    }
+
+    if (dmin >= 0)
+    {
+        link->slack = dmin < link->slack ? dmin : link->slack;
+        EFragSplitOnNode(link, node->children[0]);
+    }
+    else if (dmax < 0)
+    {
+        link->slack = -dmax < link->slack ? -dmax : link->slack;
+        EFragSplitOnNode(link, node->children[1]);
+    }
+    else
+    {
+        // stays split as long as both sides keep some of it
+        float slack = dmax < -dmin ? dmax : -dmin;
+        link->slack = slack < link->slack ? slack : link->slack;
+        if (!link->entity->topnode)
+        {
+            link->entity->topnode = node;
+        }
+        EFragSplitOnNode(link, node->children[0]);
+        EFragSplitOnNode(link, node->children[1]);
+    }
+}
+
+// call after the entity moved or changed its model, nothing is done unless 
+// it has to go into other leaves
+void EntityLink(EFragSystem *system, Entity *entity, Model *world)
+{
+    if (!entity->model || !world)
+    {
+        EntityUnlink(system, entity);
+        return;
+    }
+
+    Vec3f mins, maxs;
+    EntityGetLocalBounds(entity, &mins, &maxs);
+
+    if (entity->linked && mins == entity->link_mins && maxs == entity->link_maxs
+        && Vec3Length(entity->origin - entity->link_origin) < entity->link_slack)
+    {
+        // still in the same leaves, but drawn somewhere else
+        if (!(entity->origin == entity->link_origin))
+        {
+            system->moved = true;
+        }
+        system->skip_count++;
+        return;
+    }
+
+    EntityUnlink(system, entity);
+
+    EFragLink link = {};
+    link.system = system;
+    link.entity = entity;
+    link.mins = entity->origin + mins;
+    link.maxs = entity->origin + maxs;
+    link.last_link = &entity->efrags;
+    link.slack = 1e30f;
+    EFragSplitOnNode(&link, world->nodes);
+
+    entity->linked = true;
+    entity->link_origin = entity->origin;
+    entity->link_mins = mins;
+    entity->link_maxs = maxs;
+    entity->link_slack = link.slack - EFRAG_SLACK_EPSILON;
+
+    system->moved = true;
+    system->link_count++;
+}
+
+// entities of a visible leaf go into the visible list once a frame
+void StoreEFrags(RenderData *renderdata, EFrag *efrag)
+{
+    for (; efrag; efrag = efrag->nextLeaf)
+    {
+        Entity *entity = efrag->entity;
+        if (entity->visframe == renderdata->framecount)
+        {
+            continue;
+        }
+        entity->visframe = renderdata->framecount;
+
+        if (renderdata->visible_entity_count < MAX_VISIBLE_ENTITIES)
+        {
+            renderdata->visible_entities[renderdata->visible_entity_count++] = entity;
+        }
+    }
+}
@@ -2,18 +2,22 @@
 #include "q_common.cpp"
 #include "q_sky.cpp"
 #include "q_model.cpp"
+#include "q_trace.cpp"
 #include "q_render.cpp"
 
 float g_target_dt; // target seconds per frame
+GameOffScreenBuffer *g_offscreenBuffer;
 
 struct MapInfo
 {
-    Model *model;
+    char *name;
+    Model *model; // NULL until the level loader has loaded it
     Vec3f spawn_pos;
     LightStyle light_styles[MAX_LIGHT_STYLE_NUM];
 };
 
 MapInfo g_mapinfos[20];
+I32 g_mapinfo_count;
 
 void FillLightStyles(MapInfo *mapinfo, I32 index, const char *wave)
 {
@@ -24,7 +28,7 @@ void FillLightStyles(MapInfo *mapinfo, I32 index, const char *wave)
 void FillMapInfos()
 {
     MapInfo *mapinfo = g_mapinfos + 0;
-    mapinfo->model = ModelLoadForName("maps/start.bsp");
+    mapinfo->name = "maps/start.bsp";
     mapinfo->spawn_pos = {544.6f, 290.0f, 50.0f};
     FillLightStyles(mapinfo, 0, "m");
     FillLightStyles(mapinfo, 1, "mmnmmommommnonmmonqnmmo");
@@ -47,18 +51,22 @@ void FillMapInfos()
     FillLightStyles(mapinfo, 63, "a");
 
     mapinfo = g_mapinfos + 1;
-    mapinfo->model = ModelLoadForName("maps/e1m1.bsp");
+    mapinfo->name = "maps/e1m1.bsp";
     mapinfo->spawn_pos = {472.281250, -352.218750, 110.031250};
     
     mapinfo = g_mapinfos + 2;
-    mapinfo->model = ModelLoadForName("maps/e1m3.bsp");
+    mapinfo->name = "maps/e1m3.bsp";
     mapinfo->spawn_pos = {-735.968750f, -1591.96875f, 110.031250f};
+
+    g_mapinfo_count = 3;
 }
 
 void SetLightStyle(LightStyle dest[MAX_LIGHT_STYLE_NUM], LightStyle src[MAX_LIGHT_STYLE_NUM])
 {
     for (I32 i = 0; i < MAX_LIGHT_STYLE_NUM; ++i)
     {
+        dest[i].changes = 0;
+        dest[i].invalidations = 0;
         if (src[i].length)
         {
             dest[i].length = src[i].length;
@@ -67,15 +75,446 @@ void SetLightStyle(LightStyle dest[MAX_LIGHT_STYLE_NUM], LightStyle src[MAX_LIGH
     }
 }
 
+//======================================
+// Entities
+//======================================
+
+#define MAX_ENTITIES 512
+
+Entity g_entities[MAX_ENTITIES];
+I32 g_entity_count;
+
+Vec3f ParseVec3(char *text)
+{
+    Vec3f result = {0};
+    char token[32];
+    for (I32 i = 0; i < 3; ++i)
+    {
+        text = StringParseToken(text, token, (I32)sizeof(token));
+        result[i] = StringToFloat(token);
+    }
+    return result;
+}
+
+struct EntityModelSpec
+{
+    const char *classname;
+    const char *model;
+    I32 frame;
+};
+
+// what game code would give the entities that show a model right away
+EntityModelSpec g_entity_models[] = 
+{
+    {"light_torch_small_walltorch", "progs/flame.mdl", 0},
+    {"light_flame_large_yellow", "progs/flame2.mdl", 1},
+    {"light_flame_small_yellow", "progs/flame2.mdl", 0},
+    {"light_flame_small_white", "progs/flame2.mdl", 0},
+    {"monster_army", "progs/soldier.mdl", 0},
+    {"monster_dog", "progs/dog.mdl", 0},
+    {"monster_ogre", "progs/ogre.mdl", 0},
+    {"monster_knight", "progs/knight.mdl", 0},
+    {"monster_hell_knight", "progs/hknight.mdl", 0},
+    {"monster_zombie", "progs/zombie.mdl", 0},
+    {"monster_wizard", "progs/wizard.mdl", 0},
+    {"monster_demon1", "progs/demon.mdl", 0},
+    {"monster_shambler", "progs/shambler.mdl", 0},
+    {"monster_enforcer", "progs/enforcer.mdl", 0},
+    {"monster_shalrath", "progs/shalrath.mdl", 0},
+    {"monster_tarbaby", "progs/tarbaby.mdl", 0},
+    {"monster_fish", "progs/fish.mdl", 0},
+};
+
+EntityModelSpec *FindEntityModel(char *classname)
+{
+    for (I32 i = 0; i < (I32)(ARRAY_COUNT(g_entity_models)); ++i)
+    {
+        if (StringCompare(g_entity_models[i].classname, classname) == 0)
+        {
+            return g_entity_models + i;
+        }
+    }
+    return NULL;
+}
+
+// Entities of the map that have a model, brush entities like doors and
+// platforms, and the monsters and torches in g_entity_models. Nothing moves 
+// them yet, that needs game code.
+void SpawnEntities(Model *world)
+{
+    g_entity_count = 0;
+
+    char *data = world->entities;
+    char key[64];
+    char value[256];
+    while ((data = StringParseToken(data, key, (I32)sizeof(key))) != NULL)
+    {
+        if (key[0] != '{')
+        {
+            g_platformAPI.SysError("SpawnEntities: found %s when expecting {", key);
+        }
+
+        I32 submodel_index = 0;
+        EntityModelSpec *spec = NULL;
+        Vec3f origin = {0};
+        float angle = 0;
+        for (;;)
+        {
+            data = StringParseToken(data, key, (I32)sizeof(key));
+            if (!data)
+            {
+                g_platformAPI.SysError("SpawnEntities: EOF without closing brace");
+            }
+            if (key[0] == '}')
+            {
+                break;
+            }
+
+            data = StringParseToken(data, value, (I32)sizeof(value));
+            if (!data || value[0] == '}')
+            {
+                g_platformAPI.SysError("SpawnEntities: closing brace without data");
+            }
+
+            if (StringCompare(key, "model") == 0 && value[0] == '*')
+            {
+                submodel_index = StringToInt(value + 1);
+            }
+            else if (StringCompare(key, "classname") == 0)
+            {
+                spec = FindEntityModel(value);
+            }
+            else if (StringCompare(key, "origin") == 0)
+            {
+                origin = ParseVec3(value);
+            }
+            else if (StringCompare(key, "angle") == 0)
+            {
+                angle = StringToFloat(value);
+            }
+        }
+
+        char name[MAX_PACK_FILE_PATH];
+        if (submodel_index > 0 && submodel_index < world->numSubmodel)
+        {
+            // "*0" would be the world itself
+            snprintf(name, MAX_PACK_FILE_PATH, "%s*%d", world->name, submodel_index);
+        }
+        else if (spec)
+        {
+            // the shareware pak doesn't have all of them
+            FileIndexEntry *entry = FileIndexFind(spec->model);
+            if (!entry || entry->file_index < 0)
+            {
+                continue;
+            }
+            StringCopy(name, MAX_PACK_FILE_PATH, spec->model);
+        }
+        else
+        {
+            continue;
+        }
+
+        if (g_entity_count == MAX_ENTITIES)
+        {
+            g_platformAPI.SysPrint("SpawnEntities: too many entities\n");
+            break;
+        }
+
+        Entity *entity = g_entities + g_entity_count++;
+        *entity = {};
+        entity->origin = origin;
+        if (spec && !submodel_index)
+        {
+            entity->model = ModelLoadForName(name);
+            entity->frame = entity->old_frame = spec->frame;
+            // the angle is counterclockwise from x, yaw is clockwise
+            entity->angles.z = -angle;
+        }
+        else
+        {
+            entity->model = ModelFindForName(name);
+        }
+        EntityLink(&g_efragsystem, entity, world);
+    }
+}
+
 void SetMapInfo(MapInfo *mapinfo)
 {
     g_renderdata.worldModel = mapinfo->model;
     g_camera.position = mapinfo->spawn_pos;
     g_camera.angles = {0, 0.0f, -90.0f};
 
+    if (mapinfo->model->skyTexture)
+    {
+        SkyInit(&g_skycanvas, mapinfo->model->skyTexture);
+    }
+
     SetLightStyle(g_lightsystem.styles, g_mapinfos[0].light_styles);
 
-    ModelInit();
+    SpawnEntities(mapinfo->model);
+}
+
+//======================================
+// Level loading
+//======================================
+
+/*
+ Two levels can be in memory, the one being played and the next one. Each of
+ them owns an arena on hunk that is reset when the level goes away, so 
+ nothing of the old level is left in low hunk. The next level is parsed on a
+ worker thread while the current one renders, and it becomes the world 
+ between two frames.
+*/
+
+#define LEVEL_ARENA_SIZE (I32)MEGA_BYTES(12)
+
+enum LevelLoadState
+{
+    LEVEL_LOAD_IDLE,
+    LEVEL_LOAD_LOADING,
+    LEVEL_LOAD_READY
+};
+
+struct LevelSlot
+{
+    MemoryArena arena;
+    MapInfo *mapinfo;
+    // the pak file data if it isn't mapped
+    void *buffer;
+};
+
+struct LevelLoader
+{
+    LevelSlot slots[2];
+    // slot of the level being played
+    I32 current;
+    // state of the other slot
+    volatile I32 state;
+    // switch as soon as the next level is ready
+    B32 switch_requested;
+};
+
+LevelLoader g_level_loader;
+
+PLATFORM_WORK_QUEUE_CALLBACK(LevelLoadWork)
+{
+    LevelSlot *slot = (LevelSlot *)data;
+    ModelLoadFromBuffer(slot->mapinfo->model, slot->buffer, true);
+    AtomicCompareExchange(&g_level_loader.state, LEVEL_LOAD_READY, LEVEL_LOAD_LOADING);
+}
+
+void LevelStartLoadWork(LevelSlot *slot)
+{
+    if (g_work_queue)
+    {
+        g_platformAPI.SysAddWork(g_work_queue, LevelLoadWork, slot);
+    }
+    else
+    {
+        LevelLoadWork(NULL, slot);
+    }
+}
+
+// the file of a level in an unmapped pak has been read into its arena
+FILE_REQUEST_CALLBACK(LevelFileLoaded)
+{
+    LevelSlot *slot = (LevelSlot *)request->user_data;
+    if (request->state != FILE_REQUEST_DONE)
+    {
+        g_platformAPI.SysError("LevelPreload: couldn't read %s", request->path);
+        slot->mapinfo = NULL;
+        g_level_loader.state = LEVEL_LOAD_IDLE;
+        return;
+    }
+    slot->buffer = request->buffer;
+    LevelStartLoadWork(slot);
+}
+
+void LevelLoaderInit()
+{
+    for (I32 i = 0; i < 2; ++i)
+    {
+        ArenaInitOnHunk(&g_level_loader.slots[i].arena, LEVEL_ARENA_SIZE, "level");
+    }
+    g_level_loader.current = 0;
+    g_level_loader.state = LEVEL_LOAD_IDLE;
+}
+
+// start loading a level into the free slot, false if a load is in progress
+B32 LevelPreload(MapInfo *mapinfo)
+{
+    if (g_level_loader.state != LEVEL_LOAD_IDLE
+        || g_level_loader.slots[g_level_loader.current].mapinfo == mapinfo)
+    {
+        return false;
+    }
+
+    LevelSlot *slot = g_level_loader.slots + (g_level_loader.current ^ 1);
+    ArenaReset(&slot->arena);
+    slot->mapinfo = mapinfo;
+
+    Model *model = ModelFindForName(mapinfo->name);
+    model->arena = &slot->arena;
+    mapinfo->model = model;
+
+    // cvars are read here, the loader thread can't look them up
+    g_model_cache_enabled = CvarGet("bsp_cache")->val != 0;
+    g_texture_compress = CvarGet("texture_compress")->val != 0;
+
+    g_level_loader.state = LEVEL_LOAD_LOADING;
+
+    // the view of a mapped pak lives as long as the model does, otherwise 
+    // the file is read into the level arena in the background and parsed 
+    // once it's there
+    int length = 0;
+    slot->buffer = (void *)FileMap(mapinfo->name, &length);
+    if (slot->buffer)
+    {
+        LevelStartLoadWork(slot);
+        return true;
+    }
+
+    FileRequestHandle request = FileLoadToArenaAsync(mapinfo->name, &slot->arena, 1, 
+                                                     LevelFileLoaded, slot);
+    if (!request.id)
+    {
+        slot->buffer = FileLoadToArena(mapinfo->name, &slot->arena);
+        if (!slot->buffer)
+        {
+            g_platformAPI.SysError("LevelPreload: couldn't find %s", mapinfo->name);
+        }
+        LevelStartLoadWork(slot);
+    }
+
+    return true;
+}
+
+// make the preloaded level the world and free the previous one, must be 
+// called between frames
+void LevelSwitch()
+{
+    LevelSlot *old_slot = g_level_loader.slots + g_level_loader.current;
+    g_level_loader.current ^= 1;
+    LevelSlot *new_slot = g_level_loader.slots + g_level_loader.current;
+
+    // surface caches point back to the surfaces of the old level, efrags 
+    // into its leaves
+    SurfaceCacheFlush();
+    EFragReset(&g_efragsystem);
+    ParticleReset(&g_particlesystem);
+    g_renderdata.coherent_valid = false;
+
+    SetMapInfo(new_slot->mapinfo);
+
+    if (old_slot->mapinfo)
+    {
+        ModelRelease(old_slot->mapinfo->model);
+        old_slot->mapinfo->model = NULL;
+        old_slot->mapinfo = NULL;
+    }
+    ArenaReset(&old_slot->arena);
+
+    g_level_loader.state = LEVEL_LOAD_IDLE;
+    g_level_loader.switch_requested = false;
+}
+
+// load a level and switch to it right away, used when nothing is loaded yet
+void LevelLoadNow(MapInfo *mapinfo)
+{
+    if (!LevelPreload(mapinfo))
+    {
+        g_platformAPI.SysError("LevelLoadNow: a level is already loading");
+    }
+
+    while (g_level_loader.state != LEVEL_LOAD_READY)
+    {
+        // the parsing starts from the callback of the file request
+        FileAsyncUpdate();
+        if (g_level_loader.state == LEVEL_LOAD_IDLE)
+        {
+            return;
+        }
+        if (!g_work_queue || !g_platformAPI.SysDoNextWork(g_work_queue))
+        {
+            CpuPause();
+        }
+    }
+
+    LevelSwitch();
+}
+
+I32 LevelNextMapIndex()
+{
+    MapInfo *current = g_level_loader.slots[g_level_loader.current].mapinfo;
+    I32 result = (I32)(current - g_mapinfos + 1) % g_mapinfo_count;
+    return result;
+}
+
+// called once a frame before anything of the world is touched
+void LevelUpdate()
+{
+    if (g_level_loader.state == LEVEL_LOAD_READY && g_level_loader.switch_requested)
+    {
+        LevelSwitch();
+    }
+
+    // keep the next level of the rotation ready
+    if (g_level_loader.state == LEVEL_LOAD_IDLE)
+    {
+        LevelPreload(g_mapinfos + LevelNextMapIndex());
+    }
+}
+
+// move the camera like a player would, sliding along what it runs into
+void CameraMove(Vec3f move)
+{
+    Model *world = g_renderdata.worldModel;
+    if (!world || CvarGet("noclip")->val != 0)
+    {
+        g_camera.position += move;
+        return;
+    }
+
+    Vec3f mins = {-16, -16, -24};
+    Vec3f maxs = {16, 16, 32};
+
+    // a couple of walls at most, a corner stops the move
+    for (I32 i = 0; i < 3; ++i)
+    {
+        Vec3f end = g_camera.position + move;
+        Trace trace = TraceBox(world, g_camera.position, mins, maxs, end);
+        if (trace.all_solid)
+        {
+            // stuck in a wall, let it fly out
+            g_camera.position = end;
+            return;
+        }
+
+        g_camera.position = trace.end;
+        if (trace.fraction == 1)
+        {
+            return;
+        }
+
+        // what's left of the move, along the plane
+        move = (1 - trace.fraction) * move;
+        move -= Vec3Dot(move, trace.plane.normal) * trace.plane.normal;
+    }
+}
+
+// a rocket from the camera to the first wall it hits, leaving a trail of
+// smoke and exploding there
+void FireRocket(Model *world)
+{
+    Vec3f start = g_camera.position + g_camera.roty * 16.0f;
+    Vec3f end = g_camera.position + g_camera.roty * 4096.0f;
+    LineHit hit;
+    TraceLine(world, start, end, &hit);
+    end = start + (end - start) * hit.fraction;
+
+    ParticleRocketTrail(&g_particlesystem, start, end);
+    ParticleExplosion(&g_particlesystem, end);
 }
 
 void AllocRenderBuffer(RenderBuffer *renderBuffer, GameOffScreenBuffer *offscreenBuffer)
@@ -100,15 +539,45 @@ void AllocRenderBuffer(RenderBuffer *renderBuffer, GameOffScreenBuffer *offscree
     SurfaceCacheInit(surface_cache, surface_cache_size);
 }
 
+// print where the memory goes, and save it for capacity planning
+void DumpMemoryReport()
+{
+    static MemoryReport report;
+    static char text[16 * 1024];
+
+    MemoryGetReport(&report);
+    MemoryReportToText(&report, text, (I32)sizeof(text));
+
+    // SysPrint has a limited buffer, print line by line
+    char *line = text;
+    for (char *c = text; *c; ++c)
+    {
+        if (*c == '\n')
+        {
+            *c = '\0';
+            g_platformAPI.SysPrint("%s\n", line);
+            line = c + 1;
+        }
+    }
+
+    I32 length = MemoryReportToSnapshot(&report, text, (I32)sizeof(text));
+    FileWriteWhole("memory_report.csv", text, length);
+}
+
 extern "C" GAME_INIT(GameInit)
 {
     g_platformAPI = memory->platformAPI;
+    g_work_queue = memory->workQueue;
 
     MemoryInit(memory->gameMemory, memory->gameMemorySize);
     
     FileSystemInit(memory->gameAssetDir);
 
-    AllocRenderBuffer(&g_renderbuffer, &memory->offscreenBuffer);
+    g_offscreenBuffer = &memory->offscreenBuffer;
+    AllocRenderBuffer(&g_renderbuffer, g_offscreenBuffer);
+    RenderAllocSpanStorage(&g_renderdata);
+    ArenaInitOnHunk(&g_frame_arena, FRAME_ARENA_SIZE, "framearena");
+    ArenaSetThreadArena(&g_frame_arena);
 
     g_renderbuffer.colorPalette = FileLoadToLowHunk("gfx/palette.lmp");
     g_renderbuffer.colormap = FileLoadToLowHunk("gfx/colormap.lmp");
@@ -127,7 +596,14 @@ extern "C" GAME_INIT(GameInit)
 
     FillMapInfos();
 
-    SetMapInfo(g_mapinfos + 2);
+    // converted maps are cached next to the paks
+    CvarRegister("bsp_cache", 1);
+    // textures copied out of the paks stay compressed until drawn
+    CvarRegister("texture_compress", 0);
+    // the camera goes through walls
+    CvarRegister("noclip", 0);
+    LevelLoaderInit();
+    LevelLoadNow(g_mapinfos + 2);
 
     // x right, y forward, z up
     AngleVectors(g_camera.angles, &g_camera.rotx, &g_camera.roty, &g_camera.rotz);
@@ -146,6 +622,9 @@ extern "C" GAME_INIT(GameInit)
 
 extern "C" GAME_UPDATE_AND_RENDER(GameUpdateAndRender)
 {
+    // the world only changes between frames
+    LevelUpdate();
+
     Vec3f forward = g_camera.roty;
     //forward.z = 0;
     forward = Vec3Normalize(forward);
@@ -160,20 +639,46 @@ extern "C" GAME_UPDATE_AND_RENDER(GameUpdateAndRender)
         KeyState key = game_input->key_events[i];
         if (key.key == 'w' && key.is_down)
         {
-            g_camera.position += forward * move_speed;
+            CameraMove(forward * move_speed);
         }
         else if (key.key == 's' && key.is_down)
         {
-            g_camera.position -= forward * move_speed;
+            CameraMove(-move_speed * forward);
         }
 
         if (key.key == 'a' && key.is_down)
         {
-            g_camera.position -= right * move_speed;
+            CameraMove(-move_speed * right);
         }
         else if (key.key == 'd' && key.is_down)
         {
-            g_camera.position += right * move_speed;
+            CameraMove(right * move_speed);
+        }
+
+        if (key.key == 'm' && key.is_down)
+        {
+            DumpMemoryReport();
+        }
+
+        if (key.key == 'l' && key.is_down)
+        {
+            LightStylesReport(&g_lightsystem);
+        }
+
+        if (key.key == 't' && key.is_down && g_renderdata.worldModel)
+        {
+            TraceBenchmark(g_renderdata.worldModel, &g_frame_arena);
+        }
+
+        if (key.key == 'p' && key.is_down && g_renderdata.worldModel)
+        {
+            FireRocket(g_renderdata.worldModel);
+        }
+
+        // next map of the rotation, instantly if it's been preloaded
+        if (key.key == 'n' && key.is_down)
+        {
+            g_level_loader.switch_requested = true;
         }
     }
 
@@ -209,5 +714,11 @@ extern "C" GAME_UPDATE_AND_RENDER(GameUpdateAndRender)
 
     AngleVectors(g_camera.angles, &g_camera.rotx, &g_camera.roty, &g_camera.rotz);
 
+    FileAsyncUpdate();
+
+    ParticleUpdate(&g_particlesystem, g_target_dt);
     RenderView(g_target_dt);
+
+    g_offscreenBuffer->dirtyRectCount = 
+        RenderGetDirtyRects(g_offscreenBuffer->dirtyRects, MAX_DIRTY_RECT_NUM);
 }
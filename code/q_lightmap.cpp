@@ -13,11 +13,102 @@ LightSystem g_lightsystem;
 // Memory management for surface caching
 //======================================
 
+/*
+ Surface cache memory is split into pages. A page is carved into slots of one
+ size class, classes are half an octave apart (128, 192, 256, 384, ...) so a 
+ slot wastes at most a third of its size and no merging is ever needed. 
+ Entries larger than a page take a run of contiguous pages.
+
+ Used entries of a class are kept in LRU order. Entries used in the current
+ frame are never evicted unless everything else is: when a class has no free
+ slot, a free page is carved, then the least recently used entry of the class 
+ is evicted, then the page that has been unused the longest is taken from 
+ whatever class owns it.
+*/
+
+#define SURFCACHE_PAGE_SIZE (16 * 1024)
+#define SURFCACHE_MAX_PAGE_NUM 1024
+#define SURFCACHE_MAX_CHUNK_NUM 16
+// the last class is for entries larger than a page
+#define SURFCACHE_CLASS_NUM 16
+#define SURFCACHE_LARGE_CLASS (SURFCACHE_CLASS_NUM - 1)
+#define SURFCACHE_FREE_PAGE -1
+// a power of 2
+#define SURFCACHE_ANIM_SLOT_NUM 1024
+
+struct SurfaceCachePage
+{
+    U8 *memory;
+    // SURFCACHE_FREE_PAGE if the page is not used by any class
+    I32 size_class;
+    I32 used_slots;
+    // the latest frame any entry in the page was used
+    I32 last_used_frame;
+    // first page of the run for pages of a large entry
+    I32 run_start;
+};
+
+enum SurfaceCacheRebuildReason
+{
+    SURFCACHE_REBUILD_FIRST_USE,
+    SURFCACHE_REBUILD_EVICTED,
+    SURFCACHE_REBUILD_LIGHT_STYLE,
+    SURFCACHE_REBUILD_DYNAMIC_LIGHT,
+    SURFCACHE_REBUILD_REASON_NUM
+};
+
+struct SurfaceCacheStats
+{
+    I32 hits;
+    I32 misses;
+    I32 rebuilds[SURFCACHE_REBUILD_REASON_NUM];
+    I32 bytes_rebuilt;
+    I32 evictions;
+    // evicted entries that were used in the same frame
+    I32 evicted_visible;
+    I32 pages_stolen;
+    // frame changes of animated textures served by a parked entry
+    I32 anim_swaps;
+};
+
+// frames the stats are accumulated over before deciding to grow
+#define SURFCACHE_STATS_WINDOW 64
+#define SURFCACHE_GROW_SIZE (256 * 1024)
+// never grow into the last few megabytes of hunk, levels need them
+#define SURFCACHE_HUNK_RESERVE (4 * 1024 * 1024)
+
+// an entry of an animated surface that shows another frame right now
+struct SurfaceCacheAnimSlot
+{
+    Surface *surface;
+    Texture *texture;
+    I32 miplevel;
+    SurfaceCache *cache; // NULL if evicted
+};
+
 struct SurfaceCacheMemory
 {
-    SurfaceCache *base;
-    SurfaceCache *rover;
+    SurfaceCachePage pages[SURFCACHE_MAX_PAGE_NUM];
+    I32 page_count;
+
+    // sentinels, lru[c].next is the most recently used entry of class c
+    SurfaceCache lru[SURFCACHE_CLASS_NUM];
+    SurfaceCache free_slots[SURFCACHE_CLASS_NUM];
+    I32 class_sizes[SURFCACHE_CLASS_NUM];
+
+    // guard after every chunk of pages
+    I32 *guards[SURFCACHE_MAX_CHUNK_NUM];
+    I32 chunk_count;
+
+    SurfaceCacheAnimSlot anim_slots[SURFCACHE_ANIM_SLOT_NUM];
+
     I32 size;
+    I32 framecount;
+
+    SurfaceCacheStats stats; // current frame
+    SurfaceCacheStats last_stats; // previous frame
+    SurfaceCacheStats window_stats; // last SURFCACHE_STATS_WINDOW frames
+    I32 window_frames;
 };
 
 SurfaceCacheMemory g_surfcache_memory;
@@ -30,49 +121,399 @@ I32 SurfaceCacheGetSizeForResolution(I32 width, I32 height)
 
 void SurfaceCacheCheckCacheGuard()
 {
-    U8 *s = (U8 *)g_surfcache_memory.base + g_surfcache_memory.size;
-    if (*((I32 *)s) != SURFACE_CACHE_GUARD)
+    for (I32 i = 0; i < g_surfcache_memory.chunk_count; ++i)
+    {
+        if (*g_surfcache_memory.guards[i] != SURFACE_CACHE_GUARD)
+        {
+            g_platformAPI.SysError("Surface cache is corrupted!");
+        }
+    }
+}
+
+inline void SurfaceCacheListInit(SurfaceCache *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+inline void SurfaceCacheListUnlink(SurfaceCache *sc)
+{
+    sc->next->prev = sc->prev;
+    sc->prev->next = sc->next;
+    sc->next = NULL;
+    sc->prev = NULL;
+}
+
+inline void SurfaceCacheListPushFront(SurfaceCache *head, SurfaceCache *sc)
+{
+    sc->next = head->next;
+    sc->prev = head;
+    head->next->prev = sc;
+    head->next = sc;
+}
+
+// smallest class whose slots can hold total_size bytes
+I32 SurfaceCacheSizeClass(I32 total_size)
+{
+    for (I32 i = 0; i < SURFCACHE_LARGE_CLASS; ++i)
+    {
+        if (total_size <= g_surfcache_memory.class_sizes[i])
+        {
+            return i;
+        }
+    }
+    return SURFCACHE_LARGE_CLASS;
+}
+
+// split a chunk of memory into pages
+void SurfaceCacheAddMemory(void *buffer, I32 size)
+{
+    if (g_surfcache_memory.chunk_count == SURFCACHE_MAX_CHUNK_NUM)
     {
-        g_platformAPI.SysError("Surface cache is corrupted!");
+        g_platformAPI.SysError("SurfaceCacheAddMemory: too many chunks");
     }
+
+    U8 *memory = (U8 *)(((size_t)buffer + 15) & ~(size_t)15);
+    size -= (I32)(memory - (U8 *)buffer) + SURFACE_CACHE_GUARD_SIZE;
+
+    I32 page_count = size / SURFCACHE_PAGE_SIZE;
+    if (g_surfcache_memory.page_count + page_count > SURFCACHE_MAX_PAGE_NUM)
+    {
+        page_count = SURFCACHE_MAX_PAGE_NUM - g_surfcache_memory.page_count;
+    }
+
+    for (I32 i = 0; i < page_count; ++i)
+    {
+        SurfaceCachePage *page = g_surfcache_memory.pages + g_surfcache_memory.page_count++;
+        page->memory = memory + i * SURFCACHE_PAGE_SIZE;
+        page->size_class = SURFCACHE_FREE_PAGE;
+        page->used_slots = 0;
+        page->last_used_frame = 0;
+        page->run_start = 0;
+    }
+    g_surfcache_memory.size += page_count * SURFCACHE_PAGE_SIZE;
+
+    I32 *guard = (I32 *)(memory + page_count * SURFCACHE_PAGE_SIZE);
+    *guard = SURFACE_CACHE_GUARD;
+    g_surfcache_memory.guards[g_surfcache_memory.chunk_count++] = guard;
 }
 
-void SurfaceCacheSetCacheGuard()
+void SurfaceCacheInit(void *buffer, I32 size)
 {
-    U8 *s = (U8 *)g_surfcache_memory.base + g_surfcache_memory.size;
-    *((I32 *)s) = SURFACE_CACHE_GUARD;
+    g_surfcache_memory.page_count = 0;
+    g_surfcache_memory.chunk_count = 0;
+    g_surfcache_memory.size = 0;
+    g_surfcache_memory.framecount = 0;
+    g_surfcache_memory.stats = {};
+    g_surfcache_memory.last_stats = {};
+    g_surfcache_memory.window_stats = {};
+    g_surfcache_memory.window_frames = 0;
+
+    // half an octave apart: 128, 192, 256, 384, ... 16K
+    for (I32 i = 0; i < SURFCACHE_LARGE_CLASS; ++i)
+    {
+        I32 octave = 128 << (i >> 1);
+        g_surfcache_memory.class_sizes[i] = (i & 1) ? octave + (octave >> 1) : octave;
+        SurfaceCacheListInit(g_surfcache_memory.lru + i);
+        SurfaceCacheListInit(g_surfcache_memory.free_slots + i);
+    }
+    g_surfcache_memory.class_sizes[SURFCACHE_LARGE_CLASS] = 0;
+    SurfaceCacheListInit(g_surfcache_memory.lru + SURFCACHE_LARGE_CLASS);
+    SurfaceCacheListInit(g_surfcache_memory.free_slots + SURFCACHE_LARGE_CLASS);
+
+    ASSERT(g_surfcache_memory.class_sizes[SURFCACHE_LARGE_CLASS - 1] <= SURFCACHE_PAGE_SIZE);
+
+    SurfaceCacheAddMemory(buffer, size);
 }
 
 void SurfaceCacheFlush()
 {
-    if (!g_surfcache_memory.base)
+    for (I32 i = 0; i < SURFCACHE_CLASS_NUM; ++i)
+    {
+        SurfaceCache *head = g_surfcache_memory.lru + i;
+        for (SurfaceCache *sc = head->next; sc != head; sc = sc->next)
+        {
+            *(sc->owner) = NULL;
+            sc->owner = NULL;
+        }
+        SurfaceCacheListInit(head);
+        SurfaceCacheListInit(g_surfcache_memory.free_slots + i);
+    }
+
+    for (I32 i = 0; i < g_surfcache_memory.page_count; ++i)
+    {
+        g_surfcache_memory.pages[i].size_class = SURFCACHE_FREE_PAGE;
+        g_surfcache_memory.pages[i].used_slots = 0;
+    }
+}
+
+void SurfaceCacheAccumulateStats(SurfaceCacheStats *total, SurfaceCacheStats *stats)
+{
+    total->hits += stats->hits;
+    total->misses += stats->misses;
+    for (I32 i = 0; i < SURFCACHE_REBUILD_REASON_NUM; ++i)
+    {
+        total->rebuilds[i] += stats->rebuilds[i];
+    }
+    total->bytes_rebuilt += stats->bytes_rebuilt;
+    total->evictions += stats->evictions;
+    total->evicted_visible += stats->evicted_visible;
+    total->pages_stolen += stats->pages_stolen;
+    total->anim_swaps += stats->anim_swaps;
+}
+
+// add another chunk of pages from high hunk, false if there is no room. 
+// caches in the way are evicted, temp data would be thrown away.
+B32 SurfaceCacheGrow()
+{
+    if (g_hunk_temp_active
+        || g_surfcache_memory.chunk_count == SURFCACHE_MAX_CHUNK_NUM
+        || g_surfcache_memory.page_count + SURFCACHE_GROW_SIZE / SURFCACHE_PAGE_SIZE > SURFCACHE_MAX_PAGE_NUM
+        || HunkGetFreeSize() < SURFCACHE_GROW_SIZE + SURFCACHE_HUNK_RESERVE)
+    {
+        return false;
+    }
+
+    // room for the alignment and the guard
+    I32 size = SURFCACHE_GROW_SIZE + 16 + SURFACE_CACHE_GUARD_SIZE;
+    void *buffer = HunkHighAlloc(size, "surfacecache");
+    SurfaceCacheAddMemory(buffer, size);
+    return true;
+}
+
+/*
+ Only misses of evicted entries are caused by the cache being too small, first
+ uses and lighting changes rebuild no matter how large the cache is.
+*/
+void SurfaceCacheUpdateWindow()
+{
+    SurfaceCacheStats *window = &g_surfcache_memory.window_stats;
+    SurfaceCacheAccumulateStats(window, &g_surfcache_memory.stats);
+    if (++g_surfcache_memory.window_frames < SURFCACHE_STATS_WINDOW)
+    {
+        return ;
+    }
+
+    I32 lookups = window->hits + window->misses;
+    float miss_rate = lookups ? (float)window->misses / lookups : 0.0f;
+    float evicted_rate = lookups ? (float)window->rebuilds[SURFCACHE_REBUILD_EVICTED] / lookups : 0.0f;
+
+    if (CvarGet("surfcache_stats")->val && g_platformAPI.SysPrint)
+    {
+        g_platformAPI.SysPrint("surfcache: %dKB, miss %.1f%% (first %d, evicted %d, style %d, dlight %d), "
+                               "%dKB rebuilt, %d evicted visible, %d anim swaps\n",
+                               g_surfcache_memory.size / 1024, miss_rate * 100.0f,
+                               window->rebuilds[SURFCACHE_REBUILD_FIRST_USE],
+                               window->rebuilds[SURFCACHE_REBUILD_EVICTED],
+                               window->rebuilds[SURFCACHE_REBUILD_LIGHT_STYLE],
+                               window->rebuilds[SURFCACHE_REBUILD_DYNAMIC_LIGHT],
+                               window->bytes_rebuilt / 1024, window->evicted_visible,
+                               window->anim_swaps);
+    }
+
+    if (CvarGet("surfcache_autosize")->val 
+        && evicted_rate > CvarGet("surfcache_missrate")->val)
+    {
+        SurfaceCacheGrow();
+    }
+
+    g_surfcache_memory.window_stats = {};
+    g_surfcache_memory.window_frames = 0;
+}
+
+// roll the per-frame counters
+void SurfaceCacheBeginFrame(I32 framecount)
+{
+    SurfaceCacheUpdateWindow();
+
+    g_surfcache_memory.framecount = framecount;
+    g_surfcache_memory.last_stats = g_surfcache_memory.stats;
+    g_surfcache_memory.stats = {};
+}
+
+// mark the entry as used in this frame
+void SurfaceCacheTouch(SurfaceCache *sc)
+{
+    I32 framecount = g_surfcache_memory.framecount;
+
+    sc->last_used_frame = framecount;
+    SurfaceCacheListUnlink(sc);
+    SurfaceCacheListPushFront(g_surfcache_memory.lru + sc->size_class, sc);
+
+    I32 run_pages = sc->size_class == SURFCACHE_LARGE_CLASS ? sc->size / SURFCACHE_PAGE_SIZE : 1;
+    for (I32 i = 0; i < run_pages; ++i)
+    {
+        g_surfcache_memory.pages[sc->page + i].last_used_frame = framecount;
+    }
+}
+
+void SurfaceCacheEvict(SurfaceCache *sc)
+{
+    // unlink (surface->cachespots) from this surfacecache
+    *(sc->owner) = NULL;
+    sc->owner = NULL;
+    SurfaceCacheListUnlink(sc);
+
+    g_surfcache_memory.stats.evictions++;
+    if (sc->last_used_frame == g_surfcache_memory.framecount)
+    {
+        g_surfcache_memory.stats.evicted_visible++;
+    }
+
+    if (sc->size_class == SURFCACHE_LARGE_CLASS)
+    {
+        I32 run_pages = sc->size / SURFCACHE_PAGE_SIZE;
+        for (I32 i = 0; i < run_pages; ++i)
+        {
+            g_surfcache_memory.pages[sc->page + i].size_class = SURFCACHE_FREE_PAGE;
+            g_surfcache_memory.pages[sc->page + i].used_slots = 0;
+        }
+    }
+    else
+    {
+        g_surfcache_memory.pages[sc->page].used_slots--;
+        SurfaceCacheListPushFront(g_surfcache_memory.free_slots + sc->size_class, sc);
+    }
+}
+
+// evict everything in the page and give it back
+void SurfaceCacheFreePage(I32 page_index)
+{
+    SurfaceCachePage *page = g_surfcache_memory.pages + page_index;
+    if (page->size_class == SURFCACHE_FREE_PAGE)
+    {
+        return ;
+    }
+
+    g_surfcache_memory.stats.pages_stolen++;
+
+    if (page->size_class == SURFCACHE_LARGE_CLASS)
     {
+        SurfaceCacheEvict((SurfaceCache *)g_surfcache_memory.pages[page->run_start].memory);
         return ;
     }
-    for (SurfaceCache *sc = g_surfcache_memory.base; sc != NULL; sc = sc->next)
+
+    I32 slot_size = g_surfcache_memory.class_sizes[page->size_class];
+    I32 slot_count = SURFCACHE_PAGE_SIZE / slot_size;
+    for (I32 i = 0; i < slot_count; ++i)
     {
+        SurfaceCache *sc = (SurfaceCache *)(page->memory + i * slot_size);
         if (sc->owner)
         {
-            *(sc->owner) = NULL;
+            SurfaceCacheEvict(sc);
         }
+        SurfaceCacheListUnlink(sc);
     }
-    g_surfcache_memory.base->next = NULL;
-    g_surfcache_memory.base->owner = NULL;
-    g_surfcache_memory.base->size = g_surfcache_memory.size;
-    g_surfcache_memory.rover = g_surfcache_memory.base;
+
+    page->size_class = SURFCACHE_FREE_PAGE;
+    page->used_slots = 0;
 }
 
-void SurfaceCacheInit(void *buffer, I32 size)
+/*
+ Find run_pages contiguous pages that have been unused the longest, free 
+ pages come first. Pages used in this frame are only considered if 
+ allow_visible is set. Returns the first page, or -1.
+*/
+I32 SurfaceCacheFindPages(I32 run_pages, B32 allow_visible)
+{
+    I32 best_start = -1;
+    I32 best_cost = 0;
+
+    for (I32 start = 0; start + run_pages <= g_surfcache_memory.page_count; ++start)
+    {
+        I32 cost = -1;
+        B32 usable = true;
+        for (I32 i = start; i < start + run_pages; ++i)
+        {
+            SurfaceCachePage *page = g_surfcache_memory.pages + i;
+            // pages of different chunks aren't contiguous
+            if (i > start && page->memory != page[-1].memory + SURFCACHE_PAGE_SIZE)
+            {
+                usable = false;
+                break;
+            }
+            if (page->size_class != SURFCACHE_FREE_PAGE)
+            {
+                if (!allow_visible && page->last_used_frame == g_surfcache_memory.framecount)
+                {
+                    usable = false;
+                    break;
+                }
+                if (page->last_used_frame > cost)
+                {
+                    cost = page->last_used_frame;
+                }
+            }
+        }
+
+        if (usable && (best_start < 0 || cost < best_cost))
+        {
+            best_start = start;
+            best_cost = cost;
+        }
+    }
+
+    return best_start;
+}
+
+// carve a page into free slots of the size class
+void SurfaceCacheFormatPage(I32 page_index, I32 size_class)
+{
+    SurfaceCachePage *page = g_surfcache_memory.pages + page_index;
+    page->size_class = size_class;
+    page->used_slots = 0;
+
+    I32 slot_size = g_surfcache_memory.class_sizes[size_class];
+    I32 slot_count = SURFCACHE_PAGE_SIZE / slot_size;
+    for (I32 i = slot_count - 1; i >= 0; --i)
+    {
+        SurfaceCache *sc = (SurfaceCache *)(page->memory + i * slot_size);
+        MemSet(sc, 0, sizeof(*sc));
+        sc->size = slot_size;
+        sc->size_class = (I16)size_class;
+        sc->page = (I16)page_index;
+        SurfaceCacheListPushFront(g_surfcache_memory.free_slots + size_class, sc);
+    }
+}
+
+// make sure the size class has a free slot
+void SurfaceCacheRefillClass(I32 size_class)
 {
-    g_surfcache_memory.size = size - SURFACE_CACHE_GUARD_SIZE;
-    g_surfcache_memory.base = (SurfaceCache *)buffer;
-    g_surfcache_memory.rover = g_surfcache_memory.base;
+    SurfaceCache *free_head = g_surfcache_memory.free_slots + size_class;
+    SurfaceCache *lru_head = g_surfcache_memory.lru + size_class;
+    SurfaceCache *oldest = lru_head->prev;
 
-    g_surfcache_memory.base->next = NULL;
-    g_surfcache_memory.base->owner = NULL;
-    g_surfcache_memory.base->size = g_surfcache_memory.size;
+    I32 page_index = SurfaceCacheFindPages(1, false);
+    if (page_index >= 0 && g_surfcache_memory.pages[page_index].size_class == SURFCACHE_FREE_PAGE)
+    {
+        SurfaceCacheFormatPage(page_index, size_class);
+    }
+    else if (oldest != lru_head && oldest->last_used_frame != g_surfcache_memory.framecount)
+    {
+        SurfaceCacheEvict(oldest);
+    }
+    else if (page_index >= 0)
+    {
+        SurfaceCacheFreePage(page_index);
+        SurfaceCacheFormatPage(page_index, size_class);
+    }
+    else if (oldest != lru_head)
+    {
+        // everything is on screen, cache is too small for this frame
+        SurfaceCacheEvict(oldest);
+    }
+    else
+    {
+        page_index = SurfaceCacheFindPages(1, true);
+        if (page_index < 0)
+        {
+            g_platformAPI.SysError("SurfaceCacheAlloc: not enough memory!");
+        }
+        SurfaceCacheFreePage(page_index);
+        SurfaceCacheFormatPage(page_index, size_class);
+    }
 
-    SurfaceCacheSetCacheGuard();
+    ASSERT(free_head->next != free_head);
 }
 
 SurfaceCache *SurfaceCacheAlloc(I32 width, I32 size)
@@ -87,61 +528,63 @@ SurfaceCache *SurfaceCacheAlloc(I32 width, I32 size)
     }
     // SurfaceCache *tempcache = 0;
     //size_t total_size = (size_t)(&tempcache->data[size]);
-    I32 total_size = size + sizeof(SurfaceCache) - 4;
+    I32 total_size = size + (I32)sizeof(SurfaceCache) - 4;
     total_size = (total_size + 3) & ~3;
     if (total_size > g_surfcache_memory.size)
     {
         g_platformAPI.SysError("SurfaceCacheAlloc: %d > surface cache size", total_size);
     }
 
-    // if there is not enough memory left, we go back to base
-    if (!g_surfcache_memory.rover 
-        || (U8 *)g_surfcache_memory.rover - (U8 *)g_surfcache_memory.base > g_surfcache_memory.size - total_size)
-    {
-        g_surfcache_memory.rover = g_surfcache_memory.base;
-    }
+    I32 size_class = SurfaceCacheSizeClass(total_size);
+    SurfaceCache *new_cache = NULL;
 
-    // find a memory block large enough
-    SurfaceCache *new_cache = g_surfcache_memory.rover;
-    if (new_cache->owner)
-    {
-        // unlink (surface->cachespots) from this surfacecache
-        *(new_cache->owner) = NULL; 
-    }
-    while (new_cache->size < total_size)
+    if (size_class == SURFCACHE_LARGE_CLASS)
     {
-        g_surfcache_memory.rover = g_surfcache_memory.rover->next;
-
-        if (!g_surfcache_memory.rover)
+        I32 run_pages = (total_size + SURFCACHE_PAGE_SIZE - 1) / SURFCACHE_PAGE_SIZE;
+        I32 start = SurfaceCacheFindPages(run_pages, false);
+        if (start < 0)
+        {
+            start = SurfaceCacheFindPages(run_pages, true);
+        }
+        if (start < 0)
         {
             g_platformAPI.SysError("SurfaceCacheAlloc: not enough memory!");
         }
 
-        if (g_surfcache_memory.rover->owner)
+        for (I32 i = start; i < start + run_pages; ++i)
         {
-            *(g_surfcache_memory.rover->owner) = NULL;
+            SurfaceCacheFreePage(i);
+        }
+        for (I32 i = start; i < start + run_pages; ++i)
+        {
+            g_surfcache_memory.pages[i].size_class = SURFCACHE_LARGE_CLASS;
+            g_surfcache_memory.pages[i].used_slots = 1;
+            g_surfcache_memory.pages[i].run_start = start;
         }
 
-        new_cache->next = g_surfcache_memory.rover->next;
-        new_cache->size += g_surfcache_memory.rover->size; 
-    }
-
-    // if new_cache is too big, carve out the rest
-    if (new_cache->size - total_size > sizeof(SurfaceCache) + 256)
-    {
-        g_surfcache_memory.rover = (SurfaceCache *)((U8 *)new_cache + total_size);
-        g_surfcache_memory.rover->size = new_cache->size - total_size;
-        g_surfcache_memory.rover->next = new_cache->next;
-        g_surfcache_memory.rover->owner = NULL;
-        new_cache->next = g_surfcache_memory.rover;
-        new_cache->size = total_size;
+        new_cache = (SurfaceCache *)g_surfcache_memory.pages[start].memory;
+        MemSet(new_cache, 0, sizeof(*new_cache));
+        new_cache->size = run_pages * SURFCACHE_PAGE_SIZE;
+        new_cache->size_class = SURFCACHE_LARGE_CLASS;
+        new_cache->page = (I16)start;
+        SurfaceCacheListPushFront(g_surfcache_memory.lru + size_class, new_cache);
     }
     else
     {
-        g_surfcache_memory.rover = new_cache->next;
+        SurfaceCache *free_head = g_surfcache_memory.free_slots + size_class;
+        if (free_head->next == free_head)
+        {
+            SurfaceCacheRefillClass(size_class);
+        }
+
+        new_cache = free_head->next;
+        SurfaceCacheListUnlink(new_cache);
+        SurfaceCacheListPushFront(g_surfcache_memory.lru + size_class, new_cache);
+        g_surfcache_memory.pages[new_cache->page].used_slots++;
     }
 
     new_cache->width = width;
+    SurfaceCacheTouch(new_cache);
 
     SurfaceCacheCheckCacheGuard();
 
@@ -156,6 +599,10 @@ struct LightSurface
     U8 *surface_cache_data;
     Fixed8 bright_adjusts[MAX_LIGHT_MAPS];
 
+    // Store light brightness, quake allots 6 bit for different brightness.
+    // Transient, on the arena of the thread building the surface.
+    Fixed8 *blocklights;
+
     I32 mip_level;
     I32 mip_width_in_texel; 
     I32 mip_height_in_texel;
@@ -229,7 +676,7 @@ void AddDynamicLights(LightSurface *lightsurf, LightSystem *lightsystem)
                 if (dist < minlight)
                 {
                     // TODO lw: ?
-                    ((Fixed8 *)lightsystem->blocklights)[v_i * lightsurf->lightblocks_width + u_i] = 
+                    lightsurf->blocklights[v_i * lightsurf->lightblocks_width + u_i] = 
                         (Fixed8)((dist_delta - dist) * 256);
                 }
             }
@@ -248,7 +695,7 @@ void BuildLightMap(LightSurface *lightsurf, LightSystem *lightsystem, I32 framec
 
     // Cvar *ambient_light = CvarGet("ambientlight");
 
-    Fixed8 *blocklights = (Fixed8 *)lightsystem->blocklights;
+    Fixed8 *blocklights = lightsurf->blocklights;
 
     // clear to ambient
     for (I32 i = 0; i < lightsample_size; ++i)
@@ -301,7 +748,7 @@ void LightTextureSurface(LightSurface *lightsurf, LightSystem *lightsystem,
     BuildLightMap(lightsurf, lightsystem, framecount);
 
     Texture *texture = lightsurf->texture;
-    U8 *miptex = (U8 *)texture + texture->offsets[lightsurf->mip_level];
+    U8 *miptex = TextureGetMip(texture, lightsurf->mip_level);
 
     // sample at every 16 texel
     I32 lightsample_width = lightsurf->lightblocks_width;
@@ -334,7 +781,7 @@ void LightTextureSurface(LightSurface *lightsurf, LightSystem *lightsystem,
 
     U8 *surfcache_row = lightsurf->surface_cache_data;
 
-    Fixed8 *blocklights = (Fixed8 *)lightsystem->blocklights;
+    Fixed8 *blocklights = lightsurf->blocklights;
 
     for (I32 u = 0; u < lightblock_num_h; ++u)
     {
@@ -389,18 +836,108 @@ void LightTextureSurface(LightSurface *lightsurf, LightSystem *lightsystem,
     }
 }
 
-Texture *AnimateTexture(Texture *base_tex)
+// the frame of the texture shown at time, brush entities in frame 1 show the
+// alternate sequence
+Texture *AnimateTexture(Texture *base_tex, I32 frame, float time)
 {
+    if (frame && base_tex->alternateAnims)
+    {
+        base_tex = base_tex->alternateAnims;
+    }
+
+    if (!base_tex->animTotal)
+    {
+        return base_tex;
+    }
+
+    I32 relative = (I32)(time * 10) % base_tex->animTotal;
+    I32 count = 0;
+    while (base_tex->anim_min > relative || base_tex->anim_max <= relative)
+    {
+        base_tex = base_tex->animNext;
+        if (!base_tex)
+        {
+            g_platformAPI.SysError("AnimateTexture: broken cycle");
+        }
+        if (++count > 100)
+        {
+            g_platformAPI.SysError("AnimateTexture: infinite cycle");
+        }
+    }
     return base_tex;
 }
 
-SurfaceCache *CacheSurface(Surface *surface, I32 miplevel, LightSystem *lightsystem, 
-                           I32 framecount, U8 *colormap)
+/*
+ Animated surfaces keep an entry per frame of their texture. The entry of the
+ frame drawn last is in surface->cachespots, the others are parked in 
+ anim_slots by surface, texture and mip level. A frame change swaps them, 
+ parked entries age in the LRU like the others.
+*/
+SurfaceCacheAnimSlot *SurfaceCacheGetAnimSlot(Surface *surface, Texture *texture, I32 miplevel)
 {
-    LightSurface lightsurf;
+    U32 hash = HashMemory(&surface, (I32)sizeof(surface));
+    hash = hash * 31 + HashMemory(&texture, (I32)sizeof(texture));
+    hash = hash * 31 + (U32)miplevel;
+    SurfaceCacheAnimSlot *result = g_surfcache_memory.anim_slots 
+                                 + (hash & (SURFCACHE_ANIM_SLOT_NUM - 1));
+    return result;
+}
+
+void SurfaceCacheSwapFrame(Surface *surface, I32 miplevel, Texture *texture)
+{
+    SurfaceCache **spot = surface->cachespots + miplevel;
+    SurfaceCache *current = *spot;
+    if (current && current->texture == texture)
+    {
+        return ;
+    }
+
+    if (current)
+    {
+        SurfaceCacheAnimSlot *slot = SurfaceCacheGetAnimSlot(surface, current->texture, miplevel);
+        if (slot->cache)
+        {
+            // another frame hashed into the slot, the older one goes
+            SurfaceCacheEvict(slot->cache);
+        }
+        slot->surface = surface;
+        slot->texture = current->texture;
+        slot->miplevel = miplevel;
+        slot->cache = current;
+        current->owner = &slot->cache;
+        *spot = NULL;
+    }
+
+    SurfaceCacheAnimSlot *slot = SurfaceCacheGetAnimSlot(surface, texture, miplevel);
+    if (slot->cache && slot->surface == surface && slot->texture == texture 
+        && slot->miplevel == miplevel)
+    {
+        *spot = slot->cache;
+        slot->cache->owner = spot;
+        slot->cache = NULL;
+        g_surfcache_memory.stats.anim_swaps++;
+    }
+}
+
+// A surface cache can be reused as long as it shows the same frame of the 
+// texture and no light affecting the surface has changed since it was built.
+// Light styles mark their surfaces when they change, see MarkStyleSurfaces.
+B32 SurfaceCacheIsValid(SurfaceCache *surface_cache, Surface *surface, Texture *texture,
+                        I32 framecount)
+{
+    // TODO lw: why surface->lightframe != frameount?
+    B32 result = surface_cache && surface_cache->texture == texture
+        && !surface_cache->dlight && surface->lightframe != framecount 
+        && surface_cache->lit_frame >= surface->styleframe;
+    return result;
+}
 
-    // if the surface is animating or flashing, flush the code
-    lightsurf.texture = AnimateTexture(surface->tex_info->texture);
+// texture: the frame to show, see AnimateTexture
+SurfaceCache *CacheSurface(Surface *surface, I32 miplevel, Texture *texture,
+                           LightSystem *lightsystem, I32 framecount, U8 *colormap)
+{
+    LightSurface lightsurf;
+    lightsurf.texture = texture;
 
     lightsurf.bright_adjusts[0] = lightsystem->styles[surface->light_styles[0]].cur_value;
     lightsurf.bright_adjusts[1] = lightsystem->styles[surface->light_styles[1]].cur_value;
@@ -411,19 +948,31 @@ SurfaceCache *CacheSurface(Surface *surface, I32 miplevel, LightSystem *lightsys
     lightsurf.lightblocks_width = (surface->uv_extents[0] >> 4) + 1;
     lightsurf.lightblocks_height = (surface->uv_extents[1] >> 4) + 1;
 
+    SurfaceCacheSwapFrame(surface, miplevel, texture);
     SurfaceCache *surface_cache = surface->cachespots[miplevel];
 
     // check if cache is still valid
-    // TODO lw: why surface->lightframe != frameount?
-    if (surface_cache && !surface_cache->dlight && surface->lightframe != framecount 
-        && surface_cache->bright_adjusts[0] == lightsurf.bright_adjusts[0]
-        && surface_cache->bright_adjusts[1] == lightsurf.bright_adjusts[1]
-        && surface_cache->bright_adjusts[2] == lightsurf.bright_adjusts[2]
-        && surface_cache->bright_adjusts[3] == lightsurf.bright_adjusts[3])
+    if (SurfaceCacheIsValid(surface_cache, surface, texture, framecount))
     {
+        g_surfcache_memory.stats.hits++;
+        SurfaceCacheTouch(surface_cache);
         return surface_cache;
     }
 
+    SurfaceCacheRebuildReason reason;
+    if (surface_cache)
+    {
+        reason = (surface_cache->dlight || surface->lightframe == framecount) 
+            ? SURFCACHE_REBUILD_DYNAMIC_LIGHT : SURFCACHE_REBUILD_LIGHT_STYLE;
+    }
+    else
+    {
+        reason = (surface->cached_mips & (1 << miplevel)) 
+            ? SURFCACHE_REBUILD_EVICTED : SURFCACHE_REBUILD_FIRST_USE;
+    }
+    g_surfcache_memory.stats.misses++;
+    g_surfcache_memory.stats.rebuilds[reason]++;
+
     float surf_scale = 1.0f / (1 << miplevel);
     lightsurf.mip_level = miplevel;
     // surface cache's width and height are mip adjusted and cropped to surface size
@@ -437,25 +986,59 @@ SurfaceCache *CacheSurface(Surface *surface, I32 miplevel, LightSystem *lightsys
 
         surface_cache->height = lightsurf.mip_height_in_texel;
         surface->cachespots[miplevel] = surface_cache;
+        surface->cached_mips |= 1 << miplevel;
         surface_cache->owner = &(surface->cachespots[miplevel]);
         // surface_cache->mipscale = surf_scale;
     }
 
     surface_cache->dlight = surface->lightframe == framecount ? 1 : 0; // TODO lw: ?
+    surface_cache->texture = texture;
     lightsurf.surface_cache_data = surface_cache->data;
 
-    surface_cache->bright_adjusts[0] = lightsurf.bright_adjusts[0];
-    surface_cache->bright_adjusts[1] = lightsurf.bright_adjusts[1];
-    surface_cache->bright_adjusts[2] = lightsurf.bright_adjusts[2];
-    surface_cache->bright_adjusts[3] = lightsurf.bright_adjusts[3];
+    surface_cache->lit_frame = framecount;
+
+    g_surfcache_memory.stats.bytes_rebuilt += lightsurf.mip_width_in_texel * lightsurf.mip_height_in_texel;
 
     lightsurf.surface = surface;
+
+    MemoryArena *arena = ArenaGetThreadArena();
+    ArenaMarker marker = ArenaGetMarker(arena);
+    lightsurf.blocklights = ARENA_PUSH_ARRAY(arena, Fixed8, MAX_BLOCKLIGHT_NUM);
+
     LightTextureSurface(&lightsurf, lightsystem, framecount, colormap);
 
+    ArenaPopToMarker(arena, marker);
+
     return surface_cache;
 }
 
-void AnimateLights(LightSystem *lightsystem, I32 framecount)
+/*
+ Surfaces of the styles that changed this frame are marked, their caches are
+ out of date. Inline brush models share the surfaces of the world.
+*/
+void MarkStyleSurfaces(LightSystem *lightsystem, Model *model, I32 framecount)
+{
+    lightsystem->marked_surface_count = 0;
+    for (I32 i = 0; i < MAX_LIGHT_STYLE_NUM; ++i)
+    {
+        LightStyle *style = lightsystem->styles + i;
+        if (style->changed_frame != framecount)
+        {
+            continue;
+        }
+
+        I32 first = model->style_surface_first[i];
+        I32 end = model->style_surface_first[i + 1];
+        for (I32 j = first; j < end; ++j)
+        {
+            model->surfaces[model->style_surfaces[j]].styleframe = framecount;
+        }
+        style->invalidations += end - first;
+        lightsystem->marked_surface_count += end - first;
+    }
+}
+
+void AnimateLights(LightSystem *lightsystem, Model *world, I32 framecount)
 {
     // scale ('a'-'m') to (0-255)
     const I32 bright_scale = (I32)(255.0f / 12.0f);
@@ -464,16 +1047,35 @@ void AnimateLights(LightSystem *lightsystem, I32 framecount)
     for (I32 i = 0; i < MAX_LIGHT_STYLE_NUM; ++i)
     {
         LightStyle *style = lightsystem->styles + i;
+        Fixed8 value = 256;
         if (style->length)
         {
             I32 k = t % style->length;
             k = style->wave[k] - 'a';
-            k *= bright_scale;
-            style->cur_value = k;
+            value = k * bright_scale;
+        }
+
+        if (value != style->cur_value)
+        {
+            style->cur_value = value;
+            style->changed_frame = framecount;
+            style->changes++;
         }
-        else
+    }
+
+    MarkStyleSurfaces(lightsystem, world, framecount);
+}
+
+// how much each style has cost since the level started
+void LightStylesReport(LightSystem *lightsystem)
+{
+    for (I32 i = 0; i < MAX_LIGHT_STYLE_NUM; ++i)
+    {
+        LightStyle *style = lightsystem->styles + i;
+        if (style->changes)
         {
-            style->cur_value = 256;
+            g_platformAPI.SysPrint("style %2d: %d changes, %d surfaces invalidated\n", 
+                                   i, style->changes, style->invalidations);
         }
     }
 }
@@ -536,3 +1138,113 @@ void PushLights(LightSystem *lightsystem, float dt, Node *world_nodes,
         }
     }
 }
+
+// -1 if the line hits nothing lit
+I32 RecursiveLightPoint(LightSystem *lightsystem, Surface *allsurfaces, Node *node, 
+                        Vec3f start, Vec3f end)
+{
+    if (node->contents < 0)
+    {
+        return -1;
+    }
+
+    Plane *plane = node->plane;
+    float front = Vec3Dot(start, plane->normal) - plane->distance;
+    float back = Vec3Dot(end, plane->normal) - plane->distance;
+    I32 side = front < 0;
+
+    if ((back < 0) == side)
+    {
+        return RecursiveLightPoint(lightsystem, allsurfaces, node->children[side], start, end);
+    }
+
+    float frac = front / (front - back);
+    Vec3f mid = start + (end - start) * frac;
+
+    // the side the line starts on first
+    I32 result = RecursiveLightPoint(lightsystem, allsurfaces, node->children[side], start, mid);
+    if (result >= 0)
+    {
+        return result;
+    }
+
+    // the line crosses the plane here, the light comes from a surface on it
+    Surface *surface = allsurfaces + node->firstsurface;
+    for (I32 i = 0; i < node->numsurface; ++i, ++surface)
+    {
+        if (surface->flags & SURF_DRAW_TILED)
+        {
+            continue ;
+        }
+
+        TextureInfo *tex_info = surface->tex_info;
+        I32 s = (I32)(Vec3Dot(mid, tex_info->u_axis) + tex_info->u_offset);
+        I32 t = (I32)(Vec3Dot(mid, tex_info->v_axis) + tex_info->v_offset);
+        if (s < surface->uv_min[0] || t < surface->uv_min[1])
+        {
+            continue ;
+        }
+
+        I32 ds = s - surface->uv_min[0];
+        I32 dt = t - surface->uv_min[1];
+        if (ds > surface->uv_extents[0] || dt > surface->uv_extents[1])
+        {
+            continue ;
+        }
+
+        if (!surface->samples)
+        {
+            return 0;
+        }
+
+        // a sample every 16 texels
+        I32 samples_width = (surface->uv_extents[0] >> 4) + 1;
+        I32 samples_height = (surface->uv_extents[1] >> 4) + 1;
+        U8 *samples = surface->samples + (dt >> 4) * samples_width + (ds >> 4);
+
+        Fixed8 light = 0;
+        for (I32 lightmap = 0; 
+             lightmap < MAX_LIGHT_MAPS && surface->light_styles[lightmap] != 255;
+             ++lightmap)
+        {
+            light += *samples * lightsystem->styles[surface->light_styles[lightmap]].cur_value;
+            samples += samples_width * samples_height;
+        }
+
+        return light >> 8;
+    }
+
+    return RecursiveLightPoint(lightsystem, allsurfaces, node->children[!side], mid, end);
+}
+
+/*
+ How bright things at the point are, 255 is the brightest a lightmap gets 
+ with normal light styles. The world is sampled under the point, the dynamic
+ lights around it are added.
+*/
+I32 LightPoint(LightSystem *lightsystem, Model *world, Vec3f point)
+{
+    Vec3f end = point;
+    end.z -= 2048.0f;
+
+    I32 result = RecursiveLightPoint(lightsystem, world->surfaces, world->nodes, point, end);
+    if (result < 0)
+    {
+        result = 0;
+    }
+
+    for (I32 i = 0; i < MAX_LIGHT_NUM; ++i)
+    {
+        Light *light = lightsystem->lights + i;
+        if (light->time_passed < light->duration && light->radius != 0)
+        {
+            float add = light->radius - Vec3Length(point - light->position);
+            if (add > 0)
+            {
+                result += (I32)add;
+            }
+        }
+    }
+
+    return result;
+}
@@ -1,6 +1,5 @@
 #pragma once
 
-#define MAX_LIGHT_STYLE_NUM 64
 #define MAX_LIGHT_NUM 32
 
 struct LightStyle
@@ -10,6 +9,12 @@ struct LightStyle
     // light, 'm' normal bright, 'z' double birght. 
     char wave[64];
     Fixed8 cur_value;
+    // last frame cur_value changed
+    I32 changed_frame;
+    // since the level started, how often it changed and how many surfaces
+    // it marked, see MarkStyleSurfaces
+    I32 changes;
+    I32 invalidations;
 };
 
 struct Light 
@@ -29,7 +34,9 @@ struct LightSystem
 
     LightStyle styles[MAX_LIGHT_STYLE_NUM];
     Light lights[MAX_LIGHT_NUM];
-
-    // Store light brightness, quake allots 6 bit for different brightness.
-    Fixed8 blocklights[18 * 18];
+    // surfaces marked by light styles in the last frame
+    I32 marked_surface_count;
 };
+
+// a surface is at most 18 light samples wide and high
+#define MAX_BLOCKLIGHT_NUM (18 * 18)
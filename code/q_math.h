@@ -23,6 +23,18 @@ inline Fixed16 Clamp(Fixed16 min, Fixed16 max, Fixed16 x)
     return x;
 }
 
+inline I32 Minimum(I32 a, I32 b)
+{
+    I32 result = a < b ? a : b;
+    return result;
+}
+
+inline I32 Maximum(I32 a, I32 b)
+{
+    I32 result = a > b ? a : b;
+    return result;
+}
+
 inline float Absf(float x)
 {
     float result = fabsf(x);
@@ -177,6 +189,14 @@ inline Vec3f Vec3Normalize(const Vec3f &v)
     return result;
 }
 
+inline Vec3f Vec3Cross(const Vec3f &lhv, const Vec3f &rhv)
+{
+    Vec3f result = {lhv.y * rhv.z - lhv.z * rhv.y,
+                    lhv.z * rhv.x - lhv.x * rhv.z,
+                    lhv.x * rhv.y - lhv.y * rhv.x};
+    return result;
+}
+
 B32 operator==(const Vec3f &lhv, const Vec3f &rhv)
 {
     B32 result = (lhv.x == rhv.x && lhv.y == rhv.y && lhv.z == rhv.z);
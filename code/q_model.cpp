@@ -5,14 +5,13 @@
  * floor, ceil
  */
 #include <math.h>
+#include <emmintrin.h> // SSE2, every x64 cpu has it
 
 #define BSPVERSION 29
 
 #define IDSPRITEHEADER	(('P'<<24)+('S'<<16)+('D'<<8)+'I')
 #define IDPOLYHEADER	(('O'<<24)+('P'<<16)+('D'<<8)+'I')
 
-#define MAX_MAP_LEAVES 8192
-
 struct VertexDisk
 {
     Vec3f position;
@@ -122,8 +121,76 @@ struct ModelHeaderDisk
     Lump lumps[ModelLump::COUNT];
 };
 
+#define ALIAS_VERSION 6
+
+struct AliasHeaderDisk
+{
+    int ident;
+    int version;
+    Vec3f scale;
+    Vec3f scale_origin;
+    float bounding_radius;
+    Vec3f eye_position;
+    int num_skin;
+    int skin_width;
+    int skin_height;
+    int num_vert;
+    int num_tri;
+    int num_frame;
+    int sync_type;
+    int flags;
+    float size;
+};
+
+// single frames and skins are type 0, groups anything else
+struct AliasFrameDisk
+{
+    TriVertex bbox_min;
+    TriVertex bbox_max;
+    char name[16];
+};
+
+#define SPRITE_VERSION 1
+
+struct SpriteHeaderDisk
+{
+    int ident;
+    int version;
+    int type;
+    float bounding_radius;
+    int width;
+    int height;
+    int num_frame;
+    float beam_length;
+    int sync_type;
+};
+
+// single frames are type 0, groups anything else
+struct SpriteImageDisk
+{
+    int origin[2]; // of the top left corner
+    int width;
+    int height;
+};
+
 Texture *g_defaultTexture;
 
+// memory is zeroed, the same as low hunk
+void *ModelAlloc(Model *model, int size)
+{
+    void *result = NULL;
+    if (model->arena)
+    {
+        result = ArenaPush(model->arena, size);
+        MemSet(result, 0, size);
+    }
+    else
+    {
+        result = HunkLowAlloc(size, model->name);
+    }
+    return result;
+}
+
 Texture *TextureCreateDefault()
 {
     // create a simple checkerboard texture
@@ -139,6 +206,7 @@ Texture *TextureCreateDefault()
     tx->offsets[1] = sizeof(*tx) + 64 * 64;
     tx->offsets[2] = sizeof(*tx) + 64 * 64 + 16 * 16;
     tx->offsets[3] = sizeof(*tx) + 64 * 64 + 16 * 16 + 8 * 8;
+    tx->mip_base = (U8 *)tx;
 
     // 4 mipmaps
     for (int i = 0; i < 4; ++i)
@@ -170,46 +238,108 @@ Texture *TextureCreateDefault()
     return tx;
 }
 
+// decoding happens on the main thread, the cache isn't thread safe
+U8 *TextureGetMip(Texture *texture, I32 mip_level)
+{
+    if (!texture->packed)
+    {
+        U8 *result = texture->mip_base + texture->offsets[mip_level];
+        return result;
+    }
+
+    CacheUser *cache = texture->mip_cache + mip_level;
+    U8 *result = (U8 *)CacheCheck(cache);
+    if (!result)
+    {
+        I32 size = (texture->width >> mip_level) * (texture->height >> mip_level);
+        result = (U8 *)CacheAlloc(cache, size, texture->name);
+
+        U8 *packed = texture->packed + texture->packed_offsets[mip_level];
+        I32 packed_size = texture->packed_offsets[mip_level + 1] - texture->packed_offsets[mip_level];
+        if (LZ4Decompress(packed, packed_size, result, size) != size)
+        {
+            g_platformAPI.SysError("TextureGetMip: %s is corrupt", texture->name);
+        }
+    }
+    return result;
+}
+
+// compresses each mip level on its own, right after the texture. tx NULL 
+// only counts the bytes.
+int TexturePackMips(MipTexture *mipTex, Texture *tx)
+{
+    U8 *packed = tx ? (U8 *)(tx + 1) : NULL;
+    int total = 0;
+    for (int i = 0; i < MIP_LEVELS; ++i)
+    {
+        U8 *pixels = (U8 *)mipTex + mipTex->offsets[i];
+        int size = (mipTex->width >> i) * (mipTex->height >> i);
+        if (tx)
+        {
+            tx->packed_offsets[i] = total;
+        }
+        total += LZ4Compress(pixels, size, packed ? packed + total : NULL, LZ4CompressBound(size));
+    }
+
+    if (tx)
+    {
+        tx->packed = packed;
+        tx->packed_offsets[MIP_LEVELS] = total;
+    }
+    return total;
+}
+
+/*
+Lumps are loaded in two steps. Reserve validates a lump, allocates its memory 
+and sets the pointers and counts other lumps refer to, it runs on the loading 
+thread because the allocators are not thread safe. Decode converts the disk 
+data into the reserved memory and touches nothing but its own lump, so the 
+independent ones can run on the work queue at the same time.
+*/
+
 void 
-ModelLoadVertices(Model *model, U8 *base, Lump lump)
+ModelReserveVertices(Model *model, U8 *, Lump lump)
 {
-    VertexDisk *vertDisk = (VertexDisk *)(base + lump.offset);
-    if (lump.length % sizeof(*vertDisk))
+    if (lump.length % sizeof(VertexDisk))
     {
         g_platformAPI.SysError("incorrect lump size for vertex");
     }
     
-    int vertCount = lump.length / sizeof(*vertDisk);
-    Vertex *vert = NULL;
-    vert = (Vertex *)HunkLowAlloc(vertCount * sizeof(*vert), model->name);
-    
-    model->vertices = vert;
+    int vertCount = lump.length / sizeof(VertexDisk);
+    model->vertices = (Vertex *)ModelAlloc(model, vertCount * sizeof(Vertex));
     model->numVert = vertCount;
+}
 
-    for (int i = 0; i < vertCount; ++i, ++vert, ++vertDisk)
+void 
+ModelDecodeVertices(Model *model, U8 *base, Lump lump)
+{
+    VertexDisk *vertDisk = (VertexDisk *)(base + lump.offset);
+    Vertex *vert = model->vertices;
+    for (int i = 0; i < model->numVert; ++i, ++vert, ++vertDisk)
     {
         vert->position = vertDisk->position;
     }
 }
 
 void 
-ModelLoadEdges(Model *model, U8 *base, Lump lump)
+ModelReserveEdges(Model *model, U8 *, Lump lump)
 {
-    EdgeDisk *edgeDisk = (EdgeDisk *)(base + lump.offset);
-    if (lump.length % sizeof(*edgeDisk))
+    if (lump.length % sizeof(EdgeDisk))
     {
         g_platformAPI.SysError("incorrect lump size for edges");
     }
     
-    int edgeCount = lump.length / sizeof(*edgeDisk);
-    Edge *edge = NULL; 
-    edge = (Edge *)HunkLowAlloc(edgeCount * sizeof(*edge), model->name);
-    MemSet(edge, 0, edgeCount * sizeof(*edge));
-
-    model->edges = edge;
+    int edgeCount = lump.length / sizeof(EdgeDisk);
+    model->edges = (Edge *)ModelAlloc(model, edgeCount * sizeof(Edge));
     model->numEdge = edgeCount;
+}
 
-    for (int i = 0; i < edgeCount; ++i, ++edge, ++edgeDisk)
+void 
+ModelDecodeEdges(Model *model, U8 *base, Lump lump)
+{
+    EdgeDisk *edgeDisk = (EdgeDisk *)(base + lump.offset);
+    Edge *edge = model->edges;
+    for (int i = 0; i < model->numEdge; ++i, ++edge, ++edgeDisk)
     {
         edge->vertIndex[0] = edgeDisk->vertIndex[0];
         edge->vertIndex[1] = edgeDisk->vertIndex[1];
@@ -217,46 +347,50 @@ ModelLoadEdges(Model *model, U8 *base, Lump lump)
 }
 
 void 
-ModelLoadSurfaceEdges(Model *model, U8 *base, Lump lump)
+ModelReserveSurfaceEdges(Model *model, U8 *, Lump lump)
 {
-    int *surfaceEdgeDisk = (int *)(base + lump.offset);
-    if (lump.length % sizeof(*surfaceEdgeDisk))
+    if (lump.length % sizeof(int))
     {
         g_platformAPI.SysError("incorrect lump size for surface edge");
     }
 
-    int surfaceEdgeCount = lump.length / sizeof(*surfaceEdgeDisk);
-    int *surfaceEdge = NULL;
-    surfaceEdge = (int *)HunkLowAlloc(surfaceEdgeCount * sizeof(*surfaceEdge), model->name);
-
-    model->surfaceEdges = surfaceEdge;
+    int surfaceEdgeCount = lump.length / sizeof(int);
+    model->surfaceEdges = (int *)ModelAlloc(model, surfaceEdgeCount * sizeof(int));
     model->numSurfaceEdge = surfaceEdgeCount;
+}
 
-    for (int i = 0; i < surfaceEdgeCount; ++i)
+void 
+ModelDecodeSurfaceEdges(Model *model, U8 *base, Lump lump)
+{
+    int *surfaceEdgeDisk = (int *)(base + lump.offset);
+    int *surfaceEdge = model->surfaceEdges;
+    for (int i = 0; i < model->numSurfaceEdge; ++i)
     {
         surfaceEdge[i] = surfaceEdgeDisk[i];
     }
 }
 
 void 
-ModelLoadPlanes(Model *model, U8 *base, Lump lump)
+ModelReservePlanes(Model *model, U8 *, Lump lump)
 {
-    PlaneDisk *planeDisk = (PlaneDisk *)(base + lump.offset);
-    if (lump.length % sizeof(*planeDisk))
+    if (lump.length % sizeof(PlaneDisk))
     {
         g_platformAPI.SysError("incorrect lump size for planes");
     }
 
-    I32 planeCount = lump.length / sizeof(*planeDisk);
-    Plane *plane = NULL;
+    I32 planeCount = lump.length / sizeof(PlaneDisk);
     
     // TODO lw: why allocated twice amount of memory?
-    plane = (Plane *)HunkLowAlloc(planeCount * 2 * sizeof(*plane), model->name);
-
-    model->planes = plane;
+    model->planes = (Plane *)ModelAlloc(model, planeCount * 2 * sizeof(Plane));
     model->numPlane = planeCount;
+}
 
-    for (I32 i = 0; i < planeCount; ++i, ++plane, ++planeDisk)
+void 
+ModelDecodePlanes(Model *model, U8 *base, Lump lump)
+{
+    PlaneDisk *planeDisk = (PlaneDisk *)(base + lump.offset);
+    Plane *plane = model->planes;
+    for (I32 i = 0; i < model->numPlane; ++i, ++plane, ++planeDisk)
     {
         U8 bits = 0;
         for (I32 j = 0; j < 3; ++j)
@@ -274,27 +408,30 @@ ModelLoadPlanes(Model *model, U8 *base, Lump lump)
     }
 }
 
+// in_place: base stays valid as long as the model, data that needs no 
+// conversion is referenced instead of copied
+// compress: mips that would be copied are kept compressed instead, the 
+// compression runs twice, here only to size the memory
 void 
-ModelLoadTextures(Model *model, U8 *base, Lump lump)
+ModelReserveTextures(Model *model, U8 *base, Lump lump, B32 in_place, B32 compress)
 {
     if (!lump.length)
     {
         model->textures = NULL;
+        model->numTexture = 0;
+        return ;
     }
 
     MipTexLump *miptexLump = (MipTexLump *)(base + lump.offset);
-    MipTexture *mipTex = NULL;
 
     model->numTexture = miptexLump->numMipTex;
-    model->textures = (Texture **)HunkLowAlloc(
-            miptexLump->numMipTex * sizeof(*model->textures), model->name);
+    model->textures = (Texture **)ModelAlloc(model, miptexLump->numMipTex * sizeof(*model->textures));
 
     if ((miptexLump->numMipTex + 1) * sizeof(int) != miptexLump->dataOffsets[0])
     {
         g_platformAPI.SysError("texture data is corrupted!");
     }
 
-    Texture *tx = NULL;
     for (int i = 0; i < miptexLump->numMipTex; ++i)
     {
         if (miptexLump->dataOffsets[i] == -1)
@@ -302,7 +439,7 @@ ModelLoadTextures(Model *model, U8 *base, Lump lump)
             continue;
         }
 
-        mipTex = (MipTexture *)((I8 *)miptexLump + miptexLump->dataOffsets[i]);
+        MipTexture *mipTex = (MipTexture *)((I8 *)miptexLump + miptexLump->dataOffsets[i]);
 
         if (mipTex->width & 15 || mipTex->height & 15)
         {
@@ -311,56 +448,190 @@ ModelLoadTextures(Model *model, U8 *base, Lump lump)
 
         // w*h + w/2*h/2 + w/4*h/4 + w/8*h/8
         int pixelCount = mipTex->width * mipTex->height * 85 / 64;
-        tx = (Texture *)HunkLowAlloc(sizeof(*tx) + pixelCount, model->name);
-        model->textures[i] = tx;
+        int dataSize = in_place ? 0 : pixelCount;
+        if (compress)
+        {
+            dataSize = TexturePackMips(mipTex, NULL);
+        }
+        model->textures[i] = (Texture *)ModelAlloc(model, sizeof(Texture) + dataSize);
+    }
+}
+
+#define ANIM_CYCLE 2 // tenths of a second per frame
+#define MAX_ANIM_FRAMES 10
+
+/*
+ Frames of an animated texture are named "+0name" to "+9name", the alternate
+ sequence "+aname" to "+jname". Every frame points to the next one of its 
+ sequence and knows when it's shown, see AnimateTexture.
+*/
+void ModelSequenceAnimFrames(Texture **frames, I32 frame_count, Texture *alternate)
+{
+    for (I32 i = 0; i < frame_count; ++i)
+    {
+        Texture *frame = frames[i];
+        if (!frame)
+        {
+            g_platformAPI.SysError("Missing frame %d of %s", i, frames[0] ? frames[0]->name : "");
+        }
+        frame->animTotal = frame_count * ANIM_CYCLE;
+        frame->anim_min = i * ANIM_CYCLE;
+        frame->anim_max = (i + 1) * ANIM_CYCLE;
+        frame->animNext = frames[(i + 1) % frame_count];
+        frame->alternateAnims = alternate;
+    }
+}
+
+void ModelSequenceTextures(Model *model)
+{
+    for (I32 i = 0; i < model->numTexture; ++i)
+    {
+        Texture *tx = model->textures[i];
+        if (!tx || tx->name[0] != '+' || tx->animNext)
+        {
+            continue;
+        }
+
+        Texture *anims[MAX_ANIM_FRAMES] = {};
+        Texture *altanims[MAX_ANIM_FRAMES] = {};
+        I32 max = 0;
+        I32 altmax = 0;
+        for (I32 j = i; j < model->numTexture; ++j)
+        {
+            Texture *tx2 = model->textures[j];
+            if (!tx2 || tx2->name[0] != '+' || StringCompare(tx2->name + 2, tx->name + 2) != 0)
+            {
+                continue;
+            }
+
+            I32 num = tx2->name[1];
+            if (num >= 'a' && num <= 'z')
+            {
+                num -= 'a' - 'A';
+            }
+            if (num >= '0' && num <= '9')
+            {
+                num -= '0';
+                anims[num] = tx2;
+                max = num + 1 > max ? num + 1 : max;
+            }
+            else if (num >= 'A' && num <= 'J')
+            {
+                num -= 'A';
+                altanims[num] = tx2;
+                altmax = num + 1 > altmax ? num + 1 : altmax;
+            }
+            else
+            {
+                g_platformAPI.SysError("Bad animating texture %s", tx2->name);
+            }
+        }
+
+        ModelSequenceAnimFrames(anims, max, altmax ? altanims[0] : NULL);
+        ModelSequenceAnimFrames(altanims, altmax, max ? anims[0] : NULL);
+    }
+}
+
+void 
+ModelDecodeTextures(Model *model, U8 *base, Lump lump, B32 in_place, B32 compress)
+{
+    if (!lump.length)
+    {
+        return ;
+    }
+
+    MipTexLump *miptexLump = (MipTexLump *)(base + lump.offset);
+    for (int i = 0; i < model->numTexture; ++i)
+    {
+        Texture *tx = model->textures[i];
+        if (!tx)
+        {
+            continue;
+        }
+
+        MipTexture *mipTex = (MipTexture *)((I8 *)miptexLump + miptexLump->dataOffsets[i]);
 
         StringCopy(tx->name, sizeof(tx->name), mipTex->name);
         tx->width = mipTex->width;
         tx->height = mipTex->height;
-        for (int j = 0; j < MIP_LEVELS; ++j)
+        if (compress)
+        {
+            TexturePackMips(mipTex, tx);
+        }
+        else if (in_place)
         {
-            tx->offsets[j] = mipTex->offsets[j] - sizeof(*mipTex) + sizeof(*tx);
+            tx->mip_base = (U8 *)mipTex;
+            for (int j = 0; j < MIP_LEVELS; ++j)
+            {
+                tx->offsets[j] = mipTex->offsets[j];
+            }
+        }
+        else
+        {
+            int pixelCount = mipTex->width * mipTex->height * 85 / 64;
+            tx->mip_base = (U8 *)tx;
+            for (int j = 0; j < MIP_LEVELS; ++j)
+            {
+                tx->offsets[j] = mipTex->offsets[j] - sizeof(*mipTex) + sizeof(*tx);
+            }
+            MemCpy(tx + 1, mipTex + 1, pixelCount);
         }
-        MemCpy(tx + 1, mipTex + 1, pixelCount);
 
         if (StringNCompare(tx->name, "sky", 3) == 0)
         {
-            SkyInit(&g_skycanvas, tx);
+            model->skyTexture = tx;
         }
     }
+
+    ModelSequenceTextures(model);
 }
 
 void
-ModelLoadLighting(Model *model, U8 *base, Lump lump)
+ModelReserveLighting(Model *model, U8 *base, Lump lump, B32 in_place)
 {
     if (lump.length == 0)
     {
         model->light_data = NULL;
     }
+    else if (in_place)
+    {
+        model->light_data = base + lump.offset;
+    }
     else
     {
-        model->light_data = (U8 *)HunkLowAlloc(lump.length, model->name);
+        model->light_data = (U8 *)ModelAlloc(model, lump.length);
+    }
+}
+
+void
+ModelDecodeLighting(Model *model, U8 *base, Lump lump, B32 in_place)
+{
+    if (lump.length && !in_place)
+    {
         MemCpy(model->light_data, base + lump.offset, lump.length);
     }
 }
 
 void
-ModelLoadTextureInfo(Model *model, U8 *base, Lump lump)
+ModelReserveTextureInfo(Model *model, U8 *, Lump lump)
 {
-    TextureInfoDisk *texInfoDisk = (TextureInfoDisk *)(base + lump.offset);
-    if (lump.length % sizeof(*texInfoDisk))
+    if (lump.length % sizeof(TextureInfoDisk))
     {
         g_platformAPI.SysError("incorrect lump size for texture info");
     }
     
-    int count = lump.length / sizeof(*texInfoDisk);
-    TextureInfo *tex_info = NULL;
-    tex_info = (TextureInfo *)HunkLowAlloc(count * sizeof(*tex_info), model->name);
-
+    int count = lump.length / sizeof(TextureInfoDisk);
+    model->tex_info = (TextureInfo *)ModelAlloc(model, count * sizeof(TextureInfo));
     model->numTexInfo = count;
-    model->tex_info = tex_info;
+}
 
-    for (int i = 0; i < count; ++i, ++texInfoDisk, ++tex_info)
+// only needs the texture pointers, they are set when textures are reserved
+void
+ModelDecodeTextureInfo(Model *model, U8 *base, Lump lump)
+{
+    TextureInfoDisk *texInfoDisk = (TextureInfoDisk *)(base + lump.offset);
+    TextureInfo *tex_info = model->tex_info;
+    for (int i = 0; i < model->numTexInfo; ++i, ++texInfoDisk, ++tex_info)
     {
         MemCpy(tex_info, texInfoDisk, 8 * sizeof(float));
 
@@ -410,7 +681,6 @@ ModelLoadTextureInfo(Model *model, U8 *base, Lump lump)
         }
     }
 }
-
 void
 CalcTexCoordExtents(Model *model, Surface *surface)
 {
@@ -474,25 +744,51 @@ CalcTexCoordExtents(Model *model, Surface *surface)
 }
 
 void 
-ModelLoadFaces(Model *model, U8 *base, Lump lump)
+ModelReserveFaces(Model *model, U8 *base, Lump lump)
 {
-    FaceDisk * faceDisk= (FaceDisk *)(base + lump.offset);
-    if (lump.length % sizeof(*faceDisk))
+    if (lump.length % sizeof(FaceDisk))
     {
         g_platformAPI.SysError("incorrect lump size for surface");
     }
 
-    I32 count = lump.length / sizeof(*faceDisk);
-
-    Surface *surface = NULL;
-    surface = (Surface *)HunkLowAlloc(count * sizeof(*surface), model->name);
+    I32 count = lump.length / sizeof(FaceDisk);
+    model->surfaces = (Surface *)ModelAlloc(model, count * sizeof(Surface));
+    model->numSurface = count; 
 
-    MemSet(surface, 0, count * sizeof(*surface));
+    // surfaces of each light style are counted here, ModelDecodeFaces lists
+    // them
+    FaceDisk *faceDisk = (FaceDisk *)(base + lump.offset);
+    I32 style_counts[MAX_LIGHT_STYLE_NUM] = {};
+    for (I32 i = 0; i < count; ++i, ++faceDisk)
+    {
+        for (I32 j = 0; j < MAX_LIGHT_MAPS; ++j)
+        {
+            if (faceDisk->light_styles[j] < MAX_LIGHT_STYLE_NUM)
+            {
+                style_counts[faceDisk->light_styles[j]]++;
+            }
+        }
+    }
 
-    model->surfaces = surface;
-    model->numSurface = count; 
+    I32 total = 0;
+    for (I32 i = 0; i < MAX_LIGHT_STYLE_NUM; ++i)
+    {
+        model->style_surface_first[i] = total;
+        total += style_counts[i];
+    }
+    model->style_surface_first[MAX_LIGHT_STYLE_NUM] = total;
+    model->style_surfaces = total ? (I32 *)ModelAlloc(model, total * (I32)sizeof(I32)) : NULL;
+}
 
-    for (I32 i = 0; i < count; ++i, ++faceDisk, ++surface)
+// needs vertices, edges, surface edges, texture info and texture names decoded
+void 
+ModelDecodeFaces(Model *model, U8 *base, Lump lump)
+{
+    FaceDisk *faceDisk = (FaceDisk *)(base + lump.offset);
+    Surface *surface = model->surfaces;
+    I32 style_next[MAX_LIGHT_STYLE_NUM];
+    MemCpy(style_next, model->style_surface_first, (I32)sizeof(style_next));
+    for (I32 i = 0; i < model->numSurface; ++i, ++faceDisk, ++surface)
     {
         surface->firstEdge = faceDisk->firstEdge;
         surface->numEdge = faceDisk->numEdge;
@@ -512,6 +808,10 @@ ModelLoadFaces(Model *model, U8 *base, Lump lump)
         for (I32 j = 0; j < MAX_LIGHT_MAPS; ++j)
         {
             surface->light_styles[j] = faceDisk->light_styles[j];
+            if (faceDisk->light_styles[j] < MAX_LIGHT_STYLE_NUM)
+            {
+                model->style_surfaces[style_next[faceDisk->light_styles[j]]++] = i;
+            }
         }
 
         if (faceDisk->lightOffset == -1)
@@ -542,63 +842,78 @@ ModelLoadFaces(Model *model, U8 *base, Lump lump)
 }
 
 void 
-ModelLoadMarkSurfaces(Model *model, U8 *base, Lump lump)
+ModelReserveMarkSurfaces(Model *model, U8 *, Lump lump)
 {
-    I16 *markSurfOffset = (I16 *)(base + lump.offset);
-    if (lump.length % sizeof(*markSurfOffset))
+    if (lump.length % sizeof(I16))
     {
         g_platformAPI.SysError("incorrect lump size for mark surface offsets");
     }
 
-    int count = lump.length / sizeof(*markSurfOffset);
-    Surface **marksurface = NULL;
-    marksurface = (Surface **)HunkLowAlloc(count * sizeof(*marksurface), model->name);
-
-    model->marksurfaces = marksurface;
+    int count = lump.length / sizeof(I16);
+    model->marksurfaces = (Surface **)ModelAlloc(model, count * sizeof(Surface *));
     model->numMarksurface = count;
+}
 
-    for (int i = 0; i < count; ++i)
+void 
+ModelDecodeMarkSurfaces(Model *model, U8 *base, Lump lump)
+{
+    I16 *markSurfOffset = (I16 *)(base + lump.offset);
+    Surface **marksurface = model->marksurfaces;
+    for (int i = 0; i < model->numMarksurface; ++i)
     {
         if (markSurfOffset[i] >= model->numSurface)
         {
-            g_platformAPI.SysError("ModelLoadMarkSurfaces: bad marksurface");
+            g_platformAPI.SysError("ModelDecodeMarkSurfaces: bad marksurface");
         }
         marksurface[i] = model->surfaces + markSurfOffset[i];
     }
 }
 
 void 
-ModelLoadVisibility(Model *model, U8 *base, Lump lump)
+ModelReserveVisibility(Model *model, U8 *base, Lump lump, B32 in_place)
 {
     if (!lump.length)
     {
         model->visibility = NULL;
-        return ;
     }
+    else if (in_place)
+    {
+        model->visibility = base + lump.offset;
+    }
+    else
+    {
+        model->visibility = (U8 *)ModelAlloc(model, lump.length);
+    }
+}
 
-    model->visibility = (U8 *)HunkLowAlloc(lump.length, model->name);
-    MemCpy(model->visibility, base + lump.offset, lump.length);
+void 
+ModelDecodeVisibility(Model *model, U8 *base, Lump lump, B32 in_place)
+{
+    if (lump.length && !in_place)
+    {
+        MemCpy(model->visibility, base + lump.offset, lump.length);
+    }
 }
 
 void
-ModelLoadLeaves(Model *model, U8 *base, Lump lump)
+ModelReserveLeaves(Model *model, U8 *, Lump lump)
 {
-    LeafDisk *leafDisk = (LeafDisk *)(base + lump.offset);
-    if (lump.length % sizeof(*leafDisk))
+    if (lump.length % sizeof(LeafDisk))
     {
         g_platformAPI.SysError("incorrect lump size for leaf");
     }
 
-    int count = lump.length / sizeof(*leafDisk);
-
-    Leaf *leaf = NULL;
-    leaf = (Leaf *)HunkLowAlloc(count * sizeof(*leaf), model->name);
-    MemSet(leaf, 0, count * sizeof(*leaf));
-
-    model->leaves = leaf;
+    int count = lump.length / sizeof(LeafDisk);
+    model->leaves = (Leaf *)ModelAlloc(model, count * sizeof(Leaf));
     model->numLeaf = count;
+}
 
-    for (int i = 0; i < count; ++i, ++leafDisk, ++leaf)
+void
+ModelDecodeLeaves(Model *model, U8 *base, Lump lump)
+{
+    LeafDisk *leafDisk = (LeafDisk *)(base + lump.offset);
+    Leaf *leaf = model->leaves;
+    for (int i = 0; i < model->numLeaf; ++i, ++leafDisk, ++leaf)
     {
         for (int j = 0; j < 3; ++j)
         {
@@ -641,23 +956,24 @@ void ModelSetNodeParent(Node *node, Node *parent)
     }
 }
 
-void ModelLoadNodes(Model *model, U8 *base, Lump lump)
+void ModelReserveNodes(Model *model, U8 *, Lump lump)
 {
-    NodeDisk *nodeDisk = (NodeDisk *)(base + lump.offset);
-    if (lump.length % sizeof(*nodeDisk))
+    if (lump.length % sizeof(NodeDisk))
     {
         g_platformAPI.SysError("incorrect lump size for nodes");
     }
 
-    int count = lump.length / sizeof(*nodeDisk);
-    Node *node = NULL;
-    node = (Node *)HunkLowAlloc(count * sizeof(*node), model->name);
-    MemSet(node, 0, count * sizeof(*node));
-
-    model->nodes = node;
+    int count = lump.length / sizeof(NodeDisk);
+    model->nodes = (Node *)ModelAlloc(model, count * sizeof(Node));
     model->numNode = count;
+}
 
-    for (int i = 0; i < count; ++i, ++nodeDisk, ++node)
+// parents are linked by the hull task, it needs leaf contents
+void ModelDecodeNodes(Model *model, U8 *base, Lump lump)
+{
+    NodeDisk *nodeDisk = (NodeDisk *)(base + lump.offset);
+    Node *node = model->nodes;
+    for (int i = 0; i < model->numNode; ++i, ++nodeDisk, ++node)
     {
         for (int j = 0; j < 3; ++j)
         {
@@ -682,21 +998,16 @@ void ModelLoadNodes(Model *model, U8 *base, Lump lump)
             }
         }
     }
-
-    ModelSetNodeParent(model->nodes, NULL);
 }
 
-void ModelLoadClipNodes(Model *model, U8 *base, Lump lump)
+void ModelReserveClipNodes(Model *model, U8 *, Lump lump)
 {
-    ClipNode *clipNodeDisk = (ClipNode *)(base + lump.offset);
-    ClipNode *clipNode = NULL;
-
-    if (lump.length % sizeof(*clipNodeDisk))
+    if (lump.length % sizeof(ClipNode))
     {
         g_platformAPI.SysError("incorrect lump size for clip node");
     }
-    int count = lump.length / sizeof(*clipNodeDisk);
-    clipNode = (ClipNode *)HunkLowAlloc(count * sizeof(*clipNode), model->name);
+    int count = lump.length / sizeof(ClipNode);
+    ClipNode *clipNode = (ClipNode *)ModelAlloc(model, count * sizeof(ClipNode));
 
     model->clipNodes = clipNode;
     model->numClipNode = count;
@@ -716,8 +1027,13 @@ void ModelLoadClipNodes(Model *model, U8 *base, Lump lump)
     hull->planes = model->planes;
     hull->clipMin = {-32, -32, -24};
     hull->clipMax = {32, 32, 64};
+}
 
-    for (int i = 0; i < count; ++i, ++clipNode, ++clipNodeDisk)
+void ModelDecodeClipNodes(Model *model, U8 *base, Lump lump)
+{
+    ClipNode *clipNodeDisk = (ClipNode *)(base + lump.offset);
+    ClipNode *clipNode = model->clipNodes;
+    for (int i = 0; i < model->numClipNode; ++i, ++clipNode, ++clipNodeDisk)
     {
         clipNode->planeOffset = clipNodeDisk->planeOffset;
         clipNode->children[0] = clipNodeDisk->children[0];
@@ -725,32 +1041,42 @@ void ModelLoadClipNodes(Model *model, U8 *base, Lump lump)
     }
 }
 
-void ModelLoadEntities(Model *model, U8 *base, Lump lump)
+void ModelReserveEntities(Model *model, U8 *, Lump lump)
 {
     if (lump.length == 0)
     {
         model->entities = NULL;
     }
+    else
+    {
+        model->entities = (char *)ModelAlloc(model, lump.length);
+    }
+}
 
-    model->entities = (char *)HunkLowAlloc(lump.length, model->name);
-    MemCpy(model->entities, base + lump.offset, lump.length);
+void ModelDecodeEntities(Model *model, U8 *base, Lump lump)
+{
+    if (lump.length)
+    {
+        MemCpy(model->entities, base + lump.offset, lump.length);
+    }
 }
 
-void ModelLoadSubmodels(Model *model, U8 *base, Lump lump)
+void ModelReserveSubmodels(Model *model, U8 *, Lump lump)
 {
-    Submodel *submodelDisk = (Submodel *)(base + lump.offset);
-    if (lump.length % sizeof(*submodelDisk))
+    if (lump.length % sizeof(Submodel))
     {
         g_platformAPI.SysError("incorrect lump size for submodels");
     }
-    int count = lump.length / sizeof(*submodelDisk);
-    Submodel *submodel = NULL;
-    submodel = (Submodel *)HunkLowAlloc(count * sizeof(*submodel), model->name);
-
-    model->submodels = submodel;
+    int count = lump.length / sizeof(Submodel);
+    model->submodels = (Submodel *)ModelAlloc(model, count * sizeof(Submodel));
     model->numSubmodel = count;
+}
 
-    for (int i = 0; i < count; ++i, ++submodelDisk, ++submodel)
+void ModelDecodeSubmodels(Model *model, U8 *base, Lump lump)
+{
+    Submodel *submodelDisk = (Submodel *)(base + lump.offset);
+    Submodel *submodel = model->submodels;
+    for (int i = 0; i < model->numSubmodel; ++i, ++submodelDisk, ++submodel)
     {
         Vec3f one = {1, 1, 1};
         submodel->min = submodelDisk->min - one;
@@ -767,19 +1093,23 @@ void ModelLoadSubmodels(Model *model, U8 *base, Lump lump)
     }
 }
 
-void ModelMakeHull(Model *model)
+// hull 0 is made of the drawing nodes
+void ModelReserveHull(Model *model)
 {
     Hull *hull = &model->hulls[0];
-
-    Node *node = model->nodes;
-    ClipNode *clipNode = (ClipNode *)HunkLowAlloc(
-            model->numNode * sizeof(ClipNode), model->name);
-
-    hull->clipNodes = clipNode;
+    hull->clipNodes = (ClipNode *)ModelAlloc(model, model->numNode * sizeof(ClipNode));
     hull->planes = model->planes;
     hull->firstClipNode = 0;
     hull->lastClipNode = model->numNode - 1;
+}
+
+// needs nodes and leaves decoded
+void ModelMakeHull(Model *model)
+{
+    ModelSetNodeParent(model->nodes, NULL);
 
+    Node *node = model->nodes;
+    ClipNode *clipNode = model->hulls[0].clipNodes;
     for (int i = 0; i < model->numNode; ++i, node++, clipNode++)
     {
         clipNode->planeOffset = (I32)(node->plane - model->planes);
@@ -798,266 +1128,1727 @@ void ModelMakeHull(Model *model)
     }
 }
 
-#define MAX_KNOWN_MODEL 256
-Model g_knownModels[MAX_KNOWN_MODEL];
-int g_numKnownModel;
+//=== Lump decoding graph ===
 
-// Try to find a loaded model that's matching the name, else return an unused
-// mode in g_knownModels[MAX_KNOWN_MODEL]
-Model *ModelFindForName(char *name)
+// one task per lump plus one that builds hull 0 from the nodes
+#define MODEL_LOAD_TASK_HULL ModelLump::COUNT
+#define MODEL_LOAD_TASK_COUNT (ModelLump::COUNT + 1)
+
+#define MODEL_LOAD_TASK_BIT(task) (1u << (task))
+
+char *g_model_load_task_names[MODEL_LOAD_TASK_COUNT] = 
 {
-    if (name == NULL || name[0] == '\0')
-    {
-        g_platformAPI.SysError("no model name");
-    }
+    "entities", "planes", "textures", "vertices", "visibility", "nodes", 
+    "texinfo", "faces", "lighting", "clipnodes", "leaves", "marksurfaces", 
+    "edges", "surfedges", "submodels", "hull"
+};
 
-    Model *unusedModel = NULL;
-    Model *model = g_knownModels;
-    int modelIndex = 0;
-    for (modelIndex = 0; modelIndex < g_numKnownModel; ++modelIndex, ++model)
-    {
-        if (StringCompare(model->name, name) == 0)
-        {
+struct ModelLoadJob;
+
+struct ModelLoadTask
+{
+    ModelLoadJob *job;
+    I32 id;
+    U32 dependencies; // bits of the tasks that must finish first
+    volatile I32 waiting; // dependencies not finished yet
+    U64 cycles;
+};
+
+struct ModelLoadJob
+{
+    Model *model;
+    U8 *base;
+    ModelHeaderDisk *header;
+    B32 in_place;
+    B32 compress_textures;
+
+    ModelLoadTask tasks[MODEL_LOAD_TASK_COUNT];
+    volatile I32 remaining;
+};
+
+// cycles spent on the last brush model, decode cycles are summed over threads
+struct ModelLoadTimings
+{
+    U64 task_cycles[MODEL_LOAD_TASK_COUNT];
+    U64 reserve_cycles;
+    U64 decode_cycles; // wall clock from the first task to the last
+};
+
+ModelLoadTimings g_model_load_timings;
+
+// keep textures compressed, only read when a load starts
+B32 g_texture_compress;
+
+void ModelDecodeLump(ModelLoadJob *job, I32 id)
+{
+    Model *model = job->model;
+    U8 *base = job->base;
+    Lump *lumps = job->header->lumps;
+    switch (id)
+    {
+        case ModelLump::ENTITY: ModelDecodeEntities(model, base, lumps[id]); break;
+        case ModelLump::PLANE: ModelDecodePlanes(model, base, lumps[id]); break;
+        case ModelLump::TEXTURE: ModelDecodeTextures(model, base, lumps[id], job->in_place, job->compress_textures); break;
+        case ModelLump::VERTEX: ModelDecodeVertices(model, base, lumps[id]); break;
+        case ModelLump::VISIBILITY: ModelDecodeVisibility(model, base, lumps[id], job->in_place); break;
+        case ModelLump::NODE: ModelDecodeNodes(model, base, lumps[id]); break;
+        case ModelLump::TEXTUREINFO: ModelDecodeTextureInfo(model, base, lumps[id]); break;
+        case ModelLump::FACE: ModelDecodeFaces(model, base, lumps[id]); break;
+        case ModelLump::LIGHTING: ModelDecodeLighting(model, base, lumps[id], job->in_place); break;
+        case ModelLump::CLIPNODE: ModelDecodeClipNodes(model, base, lumps[id]); break;
+        case ModelLump::LEAF: ModelDecodeLeaves(model, base, lumps[id]); break;
+        case ModelLump::MARKSURFACE: ModelDecodeMarkSurfaces(model, base, lumps[id]); break;
+        case ModelLump::EDGE: ModelDecodeEdges(model, base, lumps[id]); break;
+        case ModelLump::SURFACEEDGE: ModelDecodeSurfaceEdges(model, base, lumps[id]); break;
+        case ModelLump::SUBMODEL: ModelDecodeSubmodels(model, base, lumps[id]); break;
+        case MODEL_LOAD_TASK_HULL: ModelMakeHull(model); break;
+    }
+}
+
+PLATFORM_WORK_QUEUE_CALLBACK(ModelLoadTaskWork);
+
+void ModelRunLoadTask(ModelLoadTask *task)
+{
+    ModelLoadJob *job = task->job;
+
+    U64 start = ReadCycleCounter();
+    ModelDecodeLump(job, task->id);
+    task->cycles = ReadCycleCounter() - start;
+
+    // the last dependency to finish starts the dependent task
+    for (I32 i = 0; i < MODEL_LOAD_TASK_COUNT; ++i)
+    {
+        ModelLoadTask *dependent = job->tasks + i;
+        if ((dependent->dependencies & MODEL_LOAD_TASK_BIT(task->id))
+            && AtomicAdd(&dependent->waiting, -1) == 0)
+        {
+            if (g_work_queue)
+            {
+                g_platformAPI.SysAddWork(g_work_queue, ModelLoadTaskWork, dependent);
+            }
+            else
+            {
+                ModelRunLoadTask(dependent);
+            }
+        }
+    }
+
+    // dependents are queued before this, the job is done when it reaches 0
+    AtomicAdd(&job->remaining, -1);
+}
+
+PLATFORM_WORK_QUEUE_CALLBACK(ModelLoadTaskWork)
+{
+    ModelRunLoadTask((ModelLoadTask *)data);
+}
+
+void ModelInitLoadJob(ModelLoadJob *job, Model *model, void *buffer, B32 in_place)
+{
+    MemSet(job, 0, sizeof(*job));
+    job->model = model;
+    job->base = (U8 *)buffer;
+    job->header = (ModelHeaderDisk *)buffer;
+    job->in_place = in_place;
+    // pixels referenced in place cost no memory of their own
+    job->compress_textures = g_texture_compress && !in_place;
+    job->remaining = MODEL_LOAD_TASK_COUNT;
+
+    // every other lump only needs the pointers set when it's reserved
+    job->tasks[ModelLump::FACE].dependencies = 
+        MODEL_LOAD_TASK_BIT(ModelLump::VERTEX) | MODEL_LOAD_TASK_BIT(ModelLump::EDGE) 
+        | MODEL_LOAD_TASK_BIT(ModelLump::SURFACEEDGE) | MODEL_LOAD_TASK_BIT(ModelLump::TEXTURE)
+        | MODEL_LOAD_TASK_BIT(ModelLump::TEXTUREINFO);
+    job->tasks[MODEL_LOAD_TASK_HULL].dependencies = 
+        MODEL_LOAD_TASK_BIT(ModelLump::NODE) | MODEL_LOAD_TASK_BIT(ModelLump::LEAF);
+
+    for (I32 i = 0; i < MODEL_LOAD_TASK_COUNT; ++i)
+    {
+        ModelLoadTask *task = job->tasks + i;
+        task->job = job;
+        task->id = i;
+        for (U32 bits = task->dependencies; bits; bits &= bits - 1)
+        {
+            task->waiting++;
+        }
+    }
+}
+
+// reserves all lumps on the calling thread, then decodes them on the work 
+// queue in dependency order. the calling thread helps until all are done.
+void ModelDecodeLumps(Model *model, void *buffer, B32 in_place)
+{
+    ModelLoadJob job;
+    ModelInitLoadJob(&job, model, buffer, in_place);
+
+    U64 start = ReadCycleCounter();
+
+    // the order matters, hull 0 is sized by the node count
+    U8 *base = job.base;
+    Lump *lumps = job.header->lumps;
+    ModelReserveVertices(model, base, lumps[ModelLump::VERTEX]);
+    ModelReserveEdges(model, base, lumps[ModelLump::EDGE]);
+    ModelReserveSurfaceEdges(model, base, lumps[ModelLump::SURFACEEDGE]);
+    ModelReserveTextures(model, base, lumps[ModelLump::TEXTURE], in_place, job.compress_textures);
+    ModelReserveLighting(model, base, lumps[ModelLump::LIGHTING], in_place);
+    ModelReservePlanes(model, base, lumps[ModelLump::PLANE]);
+    ModelReserveTextureInfo(model, base, lumps[ModelLump::TEXTUREINFO]);
+    ModelReserveFaces(model, base, lumps[ModelLump::FACE]);
+    ModelReserveMarkSurfaces(model, base, lumps[ModelLump::MARKSURFACE]);
+    ModelReserveVisibility(model, base, lumps[ModelLump::VISIBILITY], in_place);
+    ModelReserveLeaves(model, base, lumps[ModelLump::LEAF]);
+    ModelReserveNodes(model, base, lumps[ModelLump::NODE]);
+    ModelReserveClipNodes(model, base, lumps[ModelLump::CLIPNODE]);
+    ModelReserveEntities(model, base, lumps[ModelLump::ENTITY]);
+    ModelReserveSubmodels(model, base, lumps[ModelLump::SUBMODEL]);
+    ModelReserveHull(model);
+
+    U64 reserved = ReadCycleCounter();
+
+    for (I32 i = 0; i < MODEL_LOAD_TASK_COUNT; ++i)
+    {
+        ModelLoadTask *task = job.tasks + i;
+        if (task->dependencies)
+        {
+            continue;
+        }
+
+        if (g_work_queue)
+        {
+            g_platformAPI.SysAddWork(g_work_queue, ModelLoadTaskWork, task);
+        }
+        else
+        {
+            ModelRunLoadTask(task);
+        }
+    }
+
+    // may be inside a work callback itself, so help instead of waiting for 
+    // the whole queue
+    while (job.remaining)
+    {
+        if (!g_work_queue || !g_platformAPI.SysDoNextWork(g_work_queue))
+        {
+            CpuPause();
+        }
+    }
+
+    ModelLoadTimings *timings = &g_model_load_timings;
+    timings->reserve_cycles = reserved - start;
+    timings->decode_cycles = ReadCycleCounter() - reserved;
+    for (I32 i = 0; i < MODEL_LOAD_TASK_COUNT; ++i)
+    {
+        timings->task_cycles[i] = job.tasks[i].cycles;
+    }
+}
+
+void ModelPrintLoadTimings(Model *model)
+{
+    if (!g_platformAPI.SysPrint)
+    {
+        return ;
+    }
+
+    ModelLoadTimings *timings = &g_model_load_timings;
+    U64 summed = 0;
+    for (I32 i = 0; i < MODEL_LOAD_TASK_COUNT; ++i)
+    {
+        summed += timings->task_cycles[i];
+    }
+
+    g_platformAPI.SysPrint("%s: reserve %lluK cycles, decode %lluK cycles (%lluK summed over lumps)\n",
+                           model->name, timings->reserve_cycles / 1000, 
+                           timings->decode_cycles / 1000, summed / 1000);
+    for (I32 i = 0; i < MODEL_LOAD_TASK_COUNT; ++i)
+    {
+        g_platformAPI.SysPrint("    %-12s %8lluK\n", g_model_load_task_names[i], 
+                               timings->task_cycles[i] / 1000);
+    }
+}
+
+//=== Converted model cache ===
+
+/*
+The converted data of a brush model loaded into an arena is one block. It's 
+written next to the pak with every pointer replaced by a tagged offset, and 
+the next load of the same bsp only reads the block back and turns the offsets 
+into pointers again in one walk. Lumps used in place are pointed to in the bsp
+itself, so the bsp must be in_place for both.
+*/
+
+#define MODEL_CACHE_MAGIC (('C'<<24)+('Z'<<16)+('Q'<<8)+'B')
+#define MODEL_CACHE_VERSION 3
+
+// low 2 bits of an encoded pointer, the offset is in the rest
+#define MODEL_CACHE_TAG_BLOCK 1
+#define MODEL_CACHE_TAG_SOURCE 2 // into the bsp
+#define MODEL_CACHE_TAG_DEFAULT_TEXTURE 3
+
+struct ModelCacheHeader
+{
+    U32 magic;
+    U32 version;
+    U32 layout; // sizes of the converted structs
+    U32 source_hash;
+    I32 source_size;
+    U32 data_hash;
+    I32 data_size;
+    Model model; // pointers encoded
+};
+
+struct ModelCacheContext
+{
+    U8 *block;
+    I32 block_size;
+    U8 *source;
+    I32 source_size;
+
+    // encoding writes into copies of the block and the model
+    Model *model;
+    Model *model_copy;
+    U8 *block_copy;
+
+    B32 failed;
+};
+
+typedef void ModelPointerVisitor_t(void **slot, ModelCacheContext *context);
+
+B32 g_model_cache_enabled;
+
+U32 ModelCacheLayout()
+{
+    I32 sizes[] = 
+    {
+        (I32)sizeof(void *), (I32)sizeof(Model), (I32)sizeof(Vertex), (I32)sizeof(Edge), 
+        (I32)sizeof(Texture), (I32)sizeof(TextureInfo), (I32)sizeof(Plane), (I32)sizeof(Surface), 
+        (I32)sizeof(Node), (I32)sizeof(Leaf), (I32)sizeof(ClipNode), (I32)sizeof(Submodel)
+    };
+    U32 result = HashMemory(sizes, sizeof(sizes));
+    return result;
+}
+
+// the bsp has no size of its own, it ends with its last lump
+I32 ModelSourceSize(ModelHeaderDisk *header)
+{
+    I32 result = sizeof(*header);
+    for (I32 i = 0; i < ModelLump::COUNT; ++i)
+    {
+        I32 end = header->lumps[i].offset + header->lumps[i].length;
+        if (end > result)
+        {
+            result = end;
+        }
+    }
+    return result;
+}
+
+/*
+Visits every pointer of the converted data. The model comes first and each 
+slot is visited before it's followed, so fixing up in place can walk the data
+it is fixing up.
+*/
+void ModelVisitPointers(Model *model, ModelPointerVisitor_t *visit, ModelCacheContext *context)
+{
+    visit((void **)&model->submodels, context);
+    visit((void **)&model->vertices, context);
+    visit((void **)&model->edges, context);
+    visit((void **)&model->nodes, context);
+    visit((void **)&model->planes, context);
+    visit((void **)&model->surfaceEdges, context);
+    visit((void **)&model->textures, context);
+    visit((void **)&model->tex_info, context);
+    visit((void **)&model->surfaces, context);
+    visit((void **)&model->clipNodes, context);
+    visit((void **)&model->marksurfaces, context);
+    visit((void **)&model->leaves, context);
+    visit((void **)&model->visibility, context);
+    visit((void **)&model->light_data, context);
+    visit((void **)&model->style_surfaces, context);
+    visit((void **)&model->entities, context);
+    visit((void **)&model->skyTexture, context);
+    for (I32 i = 0; i < MAX_MAP_HULLS; ++i)
+    {
+        visit((void **)&model->hulls[i].clipNodes, context);
+        visit((void **)&model->hulls[i].planes, context);
+    }
+    if (context->failed)
+    {
+        return ;
+    }
+
+    for (I32 i = 0; i < model->numTexture; ++i)
+    {
+        visit((void **)&model->textures[i], context);
+        Texture *texture = model->textures[i];
+        if (texture)
+        {
+            visit((void **)&texture->animNext, context);
+            visit((void **)&texture->alternateAnims, context);
+            visit((void **)&texture->mip_base, context);
+            visit((void **)&texture->packed, context);
+            for (I32 j = 0; j < MIP_LEVELS; ++j)
+            {
+                visit((void **)&texture->mip_cache[j].data, context);
+            }
+        }
+    }
+
+    for (I32 i = 0; i < model->numTexInfo; ++i)
+    {
+        visit((void **)&model->tex_info[i].texture, context);
+    }
+
+    for (I32 i = 0; i < model->numSurface; ++i)
+    {
+        Surface *surface = model->surfaces + i;
+        visit((void **)&surface->plane, context);
+        visit((void **)&surface->tex_info, context);
+        for (I32 j = 0; j < MIP_LEVELS; ++j)
+        {
+            visit((void **)&surface->cachespots[j], context);
+        }
+        visit((void **)&surface->samples, context);
+    }
+
+    for (I32 i = 0; i < model->numMarksurface; ++i)
+    {
+        visit((void **)&model->marksurfaces[i], context);
+    }
+
+    for (I32 i = 0; i < model->numLeaf; ++i)
+    {
+        Leaf *leaf = model->leaves + i;
+        visit((void **)&leaf->parent, context);
+        visit((void **)&leaf->visibilityCompressed, context);
+        visit((void **)&leaf->hearabilityCompressed, context);
+        visit((void **)&leaf->efrags, context);
+        visit((void **)&leaf->firstMarksurface, context);
+    }
+
+    for (I32 i = 0; i < model->numNode; ++i)
+    {
+        Node *node = model->nodes + i;
+        visit((void **)&node->parent, context);
+        visit((void **)&node->plane, context);
+        visit((void **)&node->children[0], context);
+        visit((void **)&node->children[1], context);
+    }
+}
+
+void ModelCacheEncodePointer(void **slot, ModelCacheContext *context)
+{
+    U8 *pointer = (U8 *)*slot;
+    size_t encoded = 0;
+    if (pointer == NULL)
+    {
+        encoded = 0;
+    }
+    else if (pointer >= context->block && pointer < context->block + context->block_size)
+    {
+        encoded = ((size_t)(pointer - context->block) << 2) | MODEL_CACHE_TAG_BLOCK;
+    }
+    else if (pointer >= context->source && pointer <= context->source + context->source_size)
+    {
+        encoded = ((size_t)(pointer - context->source) << 2) | MODEL_CACHE_TAG_SOURCE;
+    }
+    else if (pointer == (U8 *)g_defaultTexture)
+    {
+        encoded = MODEL_CACHE_TAG_DEFAULT_TEXTURE;
+    }
+    else
+    {
+        context->failed = true;
+    }
+
+    // the same place in the copies
+    U8 *at = (U8 *)slot;
+    U8 *copy = NULL;
+    if (at >= (U8 *)context->model && at < (U8 *)(context->model + 1))
+    {
+        copy = (U8 *)context->model_copy + (at - (U8 *)context->model);
+    }
+    else
+    {
+        copy = context->block_copy + (at - context->block);
+    }
+    *(size_t *)copy = encoded;
+}
+
+void ModelCacheFixPointer(void **slot, ModelCacheContext *context)
+{
+    size_t encoded = (size_t)*slot;
+    size_t offset = encoded >> 2;
+    void *pointer = NULL;
+    switch (encoded & 3)
+    {
+        case 0:
+        {
+            pointer = NULL;
+        } break;
+
+        case MODEL_CACHE_TAG_BLOCK:
+        {
+            if (offset < (size_t)context->block_size)
+            {
+                pointer = context->block + offset;
+            }
+            else
+            {
+                context->failed = true;
+            }
+        } break;
+
+        case MODEL_CACHE_TAG_SOURCE:
+        {
+            if (offset <= (size_t)context->source_size)
+            {
+                pointer = context->source + offset;
+            }
+            else
+            {
+                context->failed = true;
+            }
+        } break;
+
+        case MODEL_CACHE_TAG_DEFAULT_TEXTURE:
+        {
+            pointer = g_defaultTexture;
+        } break;
+    }
+    *slot = pointer;
+}
+
+// block is the converted data in the model's arena, right after loading
+void ModelCacheWrite(Model *model, void *buffer, U8 *block)
+{
+    char path[MAX_OS_PATH_LENGTH];
+    if (!FilePackSidePath(model->name, "c", path, MAX_OS_PATH_LENGTH))
+    {
+        return ;
+    }
+
+    MemoryArena *arena = model->arena;
+    I32 block_size = (I32)(arena->base + arena->used - block);
+    if (arena->size - arena->used < (I32)sizeof(ModelCacheHeader) + block_size + 16)
+    {
+        return ;
+    }
+
+    // encoded on top of the arena and thrown away after writing
+    ArenaMarker marker = ArenaGetMarker(arena);
+    ModelCacheHeader *header = (ModelCacheHeader *)ArenaPush(arena, sizeof(ModelCacheHeader) + block_size);
+    U8 *block_copy = (U8 *)(header + 1);
+    header->model = *model;
+    MemCpy(block_copy, block, block_size);
+
+    ModelCacheContext context = {};
+    context.block = block;
+    context.block_size = block_size;
+    context.source = (U8 *)buffer;
+    context.source_size = ModelSourceSize((ModelHeaderDisk *)buffer);
+    context.model = model;
+    context.model_copy = &header->model;
+    context.block_copy = block_copy;
+    ModelVisitPointers(model, ModelCacheEncodePointer, &context);
+
+    header->model.arena = NULL;
+    header->model.cache.data = NULL;
+
+    if (!context.failed)
+    {
+        header->magic = MODEL_CACHE_MAGIC;
+        header->version = MODEL_CACHE_VERSION;
+        header->layout = ModelCacheLayout();
+        header->source_hash = HashMemory(buffer, context.source_size);
+        header->source_size = context.source_size;
+        header->data_hash = HashMemory(block_copy, block_size);
+        header->data_size = block_size;
+        FileWriteWhole(path, header, sizeof(*header) + block_size);
+    }
+
+    ArenaPopToMarker(arena, marker);
+}
+
+// false if there's no valid cache for the bsp in buffer, the model is untouched
+B32 ModelCacheLoad(Model *model, void *buffer)
+{
+    char path[MAX_OS_PATH_LENGTH];
+    if (!FilePackSidePath(model->name, "c", path, MAX_OS_PATH_LENGTH))
+    {
+        return false;
+    }
+
+    ModelCacheHeader header;
+    if (!FileReadAt(path, 0, &header, sizeof(header)))
+    {
+        return false;
+    }
+
+    I32 source_size = ModelSourceSize((ModelHeaderDisk *)buffer);
+    MemoryArena *arena = model->arena;
+    if (header.magic != MODEL_CACHE_MAGIC 
+        || header.version != MODEL_CACHE_VERSION
+        || header.layout != ModelCacheLayout()
+        || header.source_size != source_size
+        || header.data_size < 0
+        || header.data_size + 16 > arena->size - arena->used
+        || header.source_hash != HashMemory(buffer, source_size))
+    {
+        return false;
+    }
+
+    ArenaMarker marker = ArenaGetMarker(arena);
+    U8 *block = (U8 *)ArenaPush(arena, header.data_size);
+    if (!FileReadAt(path, sizeof(header), block, header.data_size)
+        || header.data_hash != HashMemory(block, header.data_size))
+    {
+        ArenaPopToMarker(arena, marker);
+        return false;
+    }
+
+    Model saved = *model;
+
+    *model = header.model;
+    StringCopy(model->name, sizeof(model->name), saved.name);
+    model->arena = saved.arena;
+    model->cache = saved.cache;
+    model->type = saved.type;
+    model->loadStatus = saved.loadStatus;
+
+    ModelCacheContext context = {};
+    context.block = block;
+    context.block_size = header.data_size;
+    context.source = (U8 *)buffer;
+    context.source_size = source_size;
+    ModelVisitPointers(model, ModelCacheFixPointer, &context);
+
+    if (context.failed)
+    {
+        *model = saved;
+        ArenaPopToMarker(arena, marker);
+        return false;
+    }
+
+    return true;
+}
+
+#define MAX_KNOWN_MODEL 256
+Model g_knownModels[MAX_KNOWN_MODEL];
+int g_numKnownModel;
+
+// Try to find a loaded model that's matching the name, else return an unused
+// mode in g_knownModels[MAX_KNOWN_MODEL]
+// models are looked up from the level loader thread as well
+SpinLock g_model_lock;
+
+Model *ModelFindForName(char *name)
+{
+    if (name == NULL || name[0] == '\0')
+    {
+        g_platformAPI.SysError("no model name");
+    }
+
+    SpinLockAcquire(&g_model_lock);
+
+    Model *unusedModel = NULL;
+    Model *model = g_knownModels;
+    int modelIndex = 0;
+    for (modelIndex = 0; modelIndex < g_numKnownModel; ++modelIndex, ++model)
+    {
+        if (StringCompare(model->name, name) == 0)
+        {
             break ;
         }
         if (model->loadStatus == ModelLoadStatus::UNUSED)
         {
-            if (unusedModel == NULL || model->type != ModelType::ALIAS)
-            {
-                unusedModel = model;
-            }
-        }
+            if (unusedModel == NULL || model->type == ModelType::BRUSH)
+            {
+                unusedModel = model;
+            }
+        }
+    }
+
+    // no existing model matches the name, need to load one
+    if (modelIndex == g_numKnownModel)
+    {
+        if (unusedModel)
+        {
+            model = unusedModel;
+            // if cache is still in memory, eject it
+            if (model->type != ModelType::BRUSH)
+            {
+                if (CacheCheck(&model->cache))
+                {
+                    CacheFree(&model->cache);
+                }
+            }
+        }
+        else if (g_numKnownModel == MAX_KNOWN_MODEL)
+        {
+            g_platformAPI.SysError("Exceeds maximum model number!");
+        }
+        else
+        {
+            g_numKnownModel++;
+        }
+
+        StringCopy(model->name, sizeof(model->name), name);
+        model->loadStatus = ModelLoadStatus::NEEDLOAD;
+    }
+
+    SpinLockRelease(&g_model_lock);
+
+    return model;
+}
+
+float ModelRadiusFromBounds(Vec3f min, Vec3f max)
+{
+    Vec3f extreme = {0};
+    for (int i = 0; i < 3; ++i)
+    {
+        extreme[i] = Absf(min[i]) > Absf(max[i]) ? Absf(min[i]) : Absf(max[i]);
+    }
+
+    float result = Vec3Length(extreme);
+    return result;
+}
+
+/*
+Type Submodel is used for describing data, the real data of each submodel are 
+stored as an instance of type of Model too. Submodel includes the room model as
+well as torche and other small models. 
+*/
+void ModelSetupSubmodel(Model *model)
+{
+    Model *submodel = model;
+    for (int i = 0; i < model->numSubmodel; ++i)
+    {
+        Submodel *spec = &model->submodels[i];
+        // hull 0 is made of the nodes, its last node stays as it is
+        submodel->hulls[0].firstClipNode = spec->headNodes[0];
+        for (int j = 1; j < MAX_MAP_HULLS; ++j)
+        {
+            submodel->hulls[j].firstClipNode = spec->headNodes[j];
+            submodel->hulls[j].lastClipNode = model->numClipNode - 1;
+        }
+
+        submodel->firstModelSurface = spec->firstFace;
+        submodel->numModelSurface = spec->numFace;
+
+        submodel->min = spec->min;
+        submodel->max = spec->max;
+        submodel->radius = ModelRadiusFromBounds(submodel->min, submodel->max);
+
+        submodel->numLeaf = spec->visibleLeaves;
+
+        if (i < model->numSubmodel - 1)
+        {
+            char submodelname[MAX_PACK_FILE_PATH];
+            // "*1" is the first submodel after the world, as entities name them
+            snprintf(submodelname, MAX_PACK_FILE_PATH, "%s*%d", model->name, i + 1);
+            Model *nextSubmodel = ModelFindForName(submodelname);
+            // duplicate the basic information
+            *nextSubmodel = *model;
+            StringCopy(nextSubmodel->name, MAX_PACK_FILE_PATH, submodelname, 0);
+            submodel = nextSubmodel;
+        }
+    }
+
+}
+
+void ModelBuildHearability(Model *model);
+
+// in_place is set if buffer is never freed, e.g. a mapped pak file
+void ModelLoadBrushModel(Model *model, void *buffer, B32 in_place)
+{
+    model->type = ModelType::BRUSH;
+
+    ModelHeaderDisk *headerDisk = (ModelHeaderDisk *)buffer;
+
+    if (headerDisk->version != BSPVERSION)
+    {
+        g_platformAPI.SysError("ModelLoadBrushModel: %s has wrong version number", model->name);
+    }
+
+    // lumps used in place must stay where the cache says they are
+    B32 cacheable = g_model_cache_enabled && model->arena && in_place;
+    if (!cacheable || !ModelCacheLoad(model, buffer))
+    {
+        // pushing nothing aligns the start of the block
+        U8 *block = model->arena ? (U8 *)ArenaPush(model->arena, 0) : NULL;
+
+        ModelDecodeLumps(model, buffer, in_place);
+        ModelBuildHearability(model);
+        ModelPrintLoadTimings(model);
+
+        if (cacheable)
+        {
+            ModelCacheWrite(model, buffer, block);
+        }
+    }
+
+    model->numFrame = 2; // regular and alternate animation TODO lw: ???
+    model->flags = 0;
+
+    ModelSetupSubmodel(model);
+}
+
+// steps over the skins or frames in an mdl, counts images and poses when
+// header is NULL and copies them into it otherwise
+U8 *ModelReadAliasSkins(Model *model, U8 *in, I32 num_skin, I32 skin_size, 
+                        AliasHeader *header, I32 *image_count)
+{
+    I32 image = 0;
+    for (I32 i = 0; i < num_skin; ++i)
+    {
+        I32 type = *(I32 *)in;
+        in += sizeof(I32);
+
+        I32 count = 1;
+        float *intervals = NULL;
+        if (type != 0)
+        {
+            count = *(I32 *)in;
+            in += sizeof(I32);
+            intervals = (float *)in;
+            in += count * sizeof(float);
+        }
+
+        if (count < 1)
+        {
+            g_platformAPI.SysError("Model %s has an empty skin group", model->name);
+        }
+
+        if (header)
+        {
+            AliasGroup *group = (AliasGroup *)AliasData(header, header->skins) + i;
+            group->first = image;
+            group->count = count;
+
+            float *dest_intervals = (float *)AliasData(header, header->skin_intervals);
+            U8 *dest_images = (U8 *)AliasData(header, header->skin_images);
+            for (I32 j = 0; j < count; ++j)
+            {
+                float interval = intervals ? intervals[j] : 1.0f;
+                if (interval <= 0.0f)
+                {
+                    g_platformAPI.SysError("Model %s has a skin interval <= 0", model->name);
+                }
+                dest_intervals[image + j] = interval;
+                MemCpy(dest_images + (image + j) * skin_size, in + j * skin_size, skin_size);
+            }
+        }
+
+        in += count * skin_size;
+        image += count;
+    }
+
+    *image_count = image;
+    return in;
+}
+
+U8 *ModelReadAliasFrames(Model *model, U8 *in, I32 num_frame, I32 num_vert, 
+                         AliasHeader *header, I32 *pose_count)
+{
+    I32 pose_size = num_vert * (I32)sizeof(TriVertex);
+    I32 pose = 0;
+    for (I32 i = 0; i < num_frame; ++i)
+    {
+        I32 type = *(I32 *)in;
+        in += sizeof(I32);
+
+        I32 count = 1;
+        float *intervals = NULL;
+        if (type != 0)
+        {
+            count = *(I32 *)in;
+            // the bounds of the whole group follow the count
+            in += sizeof(I32) + 2 * sizeof(TriVertex);
+            intervals = (float *)in;
+            in += count * sizeof(float);
+        }
+
+        if (count < 1)
+        {
+            g_platformAPI.SysError("Model %s has an empty frame group", model->name);
+        }
+
+        for (I32 j = 0; j < count; ++j)
+        {
+            AliasFrameDisk *frame = (AliasFrameDisk *)in;
+            in += sizeof(AliasFrameDisk);
+
+            if (header)
+            {
+                float interval = intervals ? intervals[j] : 1.0f;
+                if (interval <= 0.0f)
+                {
+                    g_platformAPI.SysError("Model %s has a frame interval <= 0", model->name);
+                }
+                ((float *)AliasData(header, header->pose_intervals))[pose + j] = interval;
+
+                U8 *dest = (U8 *)AliasData(header, header->poses) + (pose + j) * pose_size;
+                MemCpy(dest, in, pose_size);
+
+                for (I32 k = 0; k < 3; ++k)
+                {
+                    float lo = (float)frame->bbox_min.v[k] * header->scale[k] + header->scale_origin[k];
+                    float hi = (float)frame->bbox_max.v[k] * header->scale[k] + header->scale_origin[k];
+                    B32 first = pose + j == 0;
+                    model->min[k] = first || lo < model->min[k] ? lo : model->min[k];
+                    model->max[k] = first || hi > model->max[k] ? hi : model->max[k];
+                }
+            }
+
+            in += pose_size;
+        }
+
+        if (header)
+        {
+            AliasGroup *group = (AliasGroup *)AliasData(header, header->frames) + i;
+            group->first = pose;
+            group->count = count;
+        }
+
+        pose += count;
+    }
+
+    *pose_count = pose;
+    return in;
+}
+
+/*
+ The model data go into the cache, ModelLoadForName loads the model again if
+ they have been evicted.
+*/
+void ModelLoadAliasModel(Model *model, void *buffer)
+{
+    AliasHeaderDisk *disk = (AliasHeaderDisk *)buffer;
+
+    if (disk->version != ALIAS_VERSION)
+    {
+        g_platformAPI.SysError("Model %s has wrong version number (%d should be %d)",
+                               model->name, disk->version, ALIAS_VERSION);
+    }
+
+    if (disk->num_skin < 1 || disk->num_skin > MAX_ALIAS_SKINS)
+    {
+        g_platformAPI.SysError("Model %s has invalid # of skins: %d", model->name, disk->num_skin);
+    }
+
+    if (disk->skin_width <= 0 || disk->skin_height <= 0 || (disk->skin_width & 3))
+    {
+        g_platformAPI.SysError("Model %s has invalid skin size %dx%d", 
+                               model->name, disk->skin_width, disk->skin_height);
+    }
+
+    if (disk->num_vert <= 0 || disk->num_vert > MAX_ALIAS_VERTS)
+    {
+        g_platformAPI.SysError("Model %s has invalid # of vertices: %d", model->name, disk->num_vert);
+    }
+
+    if (disk->num_tri <= 0 || disk->num_tri > MAX_ALIAS_TRIS)
+    {
+        g_platformAPI.SysError("Model %s has invalid # of triangles: %d", model->name, disk->num_tri);
+    }
+
+    if (disk->num_frame < 1 || disk->num_frame > MAX_ALIAS_FRAMES)
+    {
+        g_platformAPI.SysError("Model %s has invalid # of frames: %d", model->name, disk->num_frame);
+    }
+
+    I32 skin_size = disk->skin_width * disk->skin_height;
+    I32 num_vert = disk->num_vert;
+    I32 num_tri = disk->num_tri;
+
+    // count the images and poses in the groups to know the size
+    I32 num_skin_image = 0;
+    I32 num_pose = 0;
+    U8 *skins_in = (U8 *)(disk + 1);
+    U8 *stverts_in = ModelReadAliasSkins(model, skins_in, disk->num_skin, skin_size, 
+                                         NULL, &num_skin_image);
+    U8 *triangles_in = stverts_in + num_vert * sizeof(AliasSTVert);
+    U8 *frames_in = triangles_in + num_tri * sizeof(AliasTriangle);
+    ModelReadAliasFrames(model, frames_in, disk->num_frame, num_vert, NULL, &num_pose);
+
+    I32 size = (I32)sizeof(AliasHeader);
+    I32 frames = size;
+    size += disk->num_frame * (I32)sizeof(AliasGroup);
+    I32 skins = size;
+    size += disk->num_skin * (I32)sizeof(AliasGroup);
+    I32 pose_intervals = size;
+    size += num_pose * (I32)sizeof(float);
+    I32 skin_intervals = size;
+    size += num_skin_image * (I32)sizeof(float);
+    I32 stverts = size;
+    size += num_vert * (I32)sizeof(AliasSTVert);
+    I32 triangles = size;
+    size += num_tri * (I32)sizeof(AliasTriangle);
+    I32 poses = size;
+    size += num_pose * num_vert * (I32)sizeof(TriVertex);
+    I32 skin_images = size;
+    size += num_skin_image * skin_size;
+
+    AliasHeader *header = (AliasHeader *)CacheAlloc(&model->cache, size, model->name);
+    if (!header)
+    {
+        g_platformAPI.SysError("Not enough cache for model %s", model->name);
+    }
+
+    header->scale = disk->scale;
+    header->scale_origin = disk->scale_origin;
+    header->skin_width = disk->skin_width;
+    header->skin_height = disk->skin_height;
+    header->num_vert = num_vert;
+    header->num_tri = num_tri;
+    header->num_frame = disk->num_frame;
+    header->num_pose = num_pose;
+    header->num_skin = disk->num_skin;
+    header->num_skin_image = num_skin_image;
+    header->frames = frames;
+    header->skins = skins;
+    header->pose_intervals = pose_intervals;
+    header->skin_intervals = skin_intervals;
+    header->stverts = stverts;
+    header->triangles = triangles;
+    header->poses = poses;
+    header->skin_images = skin_images;
+
+    ModelReadAliasSkins(model, skins_in, disk->num_skin, skin_size, header, &num_skin_image);
+
+    AliasSTVert *stvert_src = (AliasSTVert *)stverts_in;
+    AliasSTVert *stvert_dest = (AliasSTVert *)AliasData(header, stverts);
+    for (I32 i = 0; i < num_vert; ++i)
+    {
+        stvert_dest[i].on_seam = stvert_src[i].on_seam;
+        stvert_dest[i].s = stvert_src[i].s;
+        stvert_dest[i].t = stvert_src[i].t;
+        if ((U32)stvert_dest[i].s > (U32)disk->skin_width 
+            || (U32)stvert_dest[i].t > (U32)disk->skin_height)
+        {
+            g_platformAPI.SysError("Model %s has a vertex off the skin", model->name);
+        }
+    }
+
+    AliasTriangle *tri_src = (AliasTriangle *)triangles_in;
+    AliasTriangle *tri_dest = (AliasTriangle *)AliasData(header, triangles);
+    for (I32 i = 0; i < num_tri; ++i)
+    {
+        tri_dest[i].faces_front = tri_src[i].faces_front;
+        for (I32 j = 0; j < 3; ++j)
+        {
+            tri_dest[i].vert_index[j] = tri_src[i].vert_index[j];
+            if ((U32)tri_dest[i].vert_index[j] >= (U32)num_vert)
+            {
+                g_platformAPI.SysError("Model %s has a triangle with a bad vertex", model->name);
+            }
+        }
+    }
+
+    ModelReadAliasFrames(model, frames_in, disk->num_frame, num_vert, header, &num_pose);
+
+    model->type = ModelType::ALIAS;
+    model->flags = disk->flags;
+    model->numFrame = disk->num_frame;
+    model->radius = ModelRadiusFromBounds(model->min, model->max);
+}
+
+I32 SpriteMipSize(I32 width, I32 height, I32 mip)
+{
+    I32 mip_width = (width >> mip) ? (width >> mip) : 1;
+    I32 mip_height = (height >> mip) ? (height >> mip) : 1;
+    return mip_width * mip_height;
+}
+
+// like ModelReadAliasFrames, counts when header is NULL and copies otherwise
+U8 *ModelReadSpriteFrames(Model *model, U8 *in, I32 num_frame, SpriteHeader *header, 
+                          I32 *image_count, I32 *pixel_size)
+{
+    I32 image = 0;
+    I32 pixel_offset = header ? header->images + header->num_image * (I32)sizeof(SpriteImage) : 0;
+    for (I32 i = 0; i < num_frame; ++i)
+    {
+        I32 type = *(I32 *)in;
+        in += sizeof(I32);
+
+        I32 count = 1;
+        float *intervals = NULL;
+        if (type != 0)
+        {
+            count = *(I32 *)in;
+            in += sizeof(I32);
+            intervals = (float *)in;
+            in += count * sizeof(float);
+        }
+
+        if (count < 1)
+        {
+            g_platformAPI.SysError("Model %s has an empty frame group", model->name);
+        }
+
+        if (header)
+        {
+            AliasGroup *group = (AliasGroup *)SpriteData(header, header->frames) + i;
+            group->first = image;
+            group->count = count;
+        }
+
+        for (I32 j = 0; j < count; ++j)
+        {
+            SpriteImageDisk *disk = (SpriteImageDisk *)in;
+            in += sizeof(SpriteImageDisk);
+            I32 width = disk->width;
+            I32 height = disk->height;
+            if (width <= 0 || height <= 0)
+            {
+                g_platformAPI.SysError("Model %s has a frame of size %dx%d", 
+                                       model->name, width, height);
+            }
+
+            if (header)
+            {
+                float interval = intervals ? intervals[j] : 1.0f;
+                if (interval <= 0.0f)
+                {
+                    g_platformAPI.SysError("Model %s has a frame interval <= 0", model->name);
+                }
+                ((float *)SpriteData(header, header->intervals))[image + j] = interval;
+
+                SpriteImage *dest = (SpriteImage *)SpriteData(header, header->images) + image + j;
+                dest->width = width;
+                dest->height = height;
+                dest->up = (float)disk->origin[1];
+                dest->down = (float)(disk->origin[1] - height);
+                dest->left = (float)disk->origin[0];
+                dest->right = (float)(disk->origin[0] + width);
+
+                for (I32 mip = 0; mip < SPRITE_MIP_LEVELS; ++mip)
+                {
+                    dest->pixels[mip] = pixel_offset;
+                    U8 *pixels = (U8 *)SpriteData(header, pixel_offset);
+                    I32 mip_width = (width >> mip) ? (width >> mip) : 1;
+                    I32 mip_height = (height >> mip) ? (height >> mip) : 1;
+                    for (I32 y = 0; y < mip_height; ++y)
+                    {
+                        for (I32 x = 0; x < mip_width; ++x)
+                        {
+                            *pixels++ = in[(y << mip) * width + (x << mip)];
+                        }
+                    }
+                    pixel_offset += mip_width * mip_height;
+                }
+            }
+            else
+            {
+                for (I32 mip = 0; mip < SPRITE_MIP_LEVELS; ++mip)
+                {
+                    *pixel_size += SpriteMipSize(width, height, mip);
+                }
+            }
+
+            in += width * height;
+        }
+
+        image += count;
+    }
+
+    *image_count = image;
+    return in;
+}
+
+// the same as alias models, the data go into the cache
+void ModelLoadSpriteModel(Model *model, void *buffer)
+{
+    SpriteHeaderDisk *disk = (SpriteHeaderDisk *)buffer;
+
+    if (disk->version != SPRITE_VERSION)
+    {
+        g_platformAPI.SysError("Model %s has wrong version number (%d should be %d)",
+                               model->name, disk->version, SPRITE_VERSION);
+    }
+
+    if (disk->num_frame < 1 || disk->num_frame > MAX_SPRITE_FRAMES)
+    {
+        g_platformAPI.SysError("Model %s has invalid # of frames: %d", model->name, disk->num_frame);
+    }
+
+    if (disk->type < SpriteType::VP_PARALLEL_UPRIGHT || disk->type > SpriteType::VP_PARALLEL_ORIENTED)
+    {
+        g_platformAPI.SysError("Model %s has invalid type %d", model->name, disk->type);
+    }
+
+    I32 num_image = 0;
+    I32 pixel_size = 0;
+    U8 *frames_in = (U8 *)(disk + 1);
+    ModelReadSpriteFrames(model, frames_in, disk->num_frame, NULL, &num_image, &pixel_size);
+
+    I32 size = (I32)sizeof(SpriteHeader);
+    I32 frames = size;
+    size += disk->num_frame * (I32)sizeof(AliasGroup);
+    I32 intervals = size;
+    size += num_image * (I32)sizeof(float);
+    I32 images = size;
+    size += num_image * (I32)sizeof(SpriteImage) + pixel_size;
+
+    SpriteHeader *header = (SpriteHeader *)CacheAlloc(&model->cache, size, model->name);
+    if (!header)
+    {
+        g_platformAPI.SysError("Not enough cache for model %s", model->name);
+    }
+
+    header->type = (SpriteType)disk->type;
+    header->max_width = disk->width;
+    header->max_height = disk->height;
+    header->num_frame = disk->num_frame;
+    header->num_image = num_image;
+    header->frames = frames;
+    header->intervals = intervals;
+    header->images = images;
+    ModelReadSpriteFrames(model, frames_in, disk->num_frame, header, &num_image, &pixel_size);
+
+    model->type = ModelType::SPRITE;
+    model->flags = 0;
+    model->numFrame = disk->num_frame;
+    float half_width = (float)disk->width * 0.5f;
+    float half_height = (float)disk->height * 0.5f;
+    model->min = {-half_width, -half_width, -half_height};
+    model->max = {half_width, half_width, half_height};
+    model->radius = ModelRadiusFromBounds(model->min, model->max);
+}
+
+// in_place is set if buffer lives as long as the model
+void ModelLoadFromBuffer(Model *model, void *buffer, B32 in_place)
+{
+    model->loadStatus = ModelLoadStatus::PRESENT;
+
+    switch (*((U32 *)buffer))
+    {
+        case IDPOLYHEADER:
+        {
+            ModelLoadAliasModel(model, buffer);
+        } break; 
+
+        case IDSPRITEHEADER:
+        {
+            ModelLoadSpriteModel(model, buffer);
+        } break;
+
+        default:
+        {
+            ModelLoadBrushModel(model, buffer, in_place);
+        } break;
     }
+}
 
-    // no existing model matches the name, need to load one
-    if (modelIndex == g_numKnownModel)
+void ModelLoad(Model *model)
+{
+    // paks stay mapped, the view lives as long as the model
+    int length = 0;
+    void *buffer = (void *)FileMap(model->name, &length);
+    B32 in_place = buffer != NULL;
+    if (!buffer)
     {
-        if (unusedModel)
+        buffer = FileLoad(model->name, ALLocType::TEMPHUNK);
+    }
+
+    if (!buffer)
+    {
+        g_platformAPI.SysError("Model %s not found", model->name);
+    }
+
+    ModelLoadFromBuffer(model, buffer, in_place);
+}
+
+// the model and its submodels can be loaded again, memory is the caller's
+void ModelRelease(Model *model)
+{
+    // decoded mips point back at the textures, which go with the memory
+    if (model->type == ModelType::BRUSH)
+    {
+        for (int i = 0; i < model->numTexture; ++i)
         {
-            model = unusedModel;
-            // if cache is still in memory, eject it
-            if (model->type == ModelType::ALIAS)
+            Texture *texture = model->textures[i];
+            for (int j = 0; texture && j < MIP_LEVELS; ++j)
             {
-                if (CacheCheck(&model->cache))
+                if (texture->mip_cache[j].data)
                 {
-                    CacheFree(&model->cache);
+                    CacheFree(&texture->mip_cache[j]);
                 }
             }
         }
-        else if (g_numKnownModel == MAX_KNOWN_MODEL)
+    }
+
+    SpinLockAcquire(&g_model_lock);
+
+    int nameLength = StringLength(model->name);
+    char name[MAX_PACK_FILE_PATH];
+    StringCopy(name, MAX_PACK_FILE_PATH, model->name);
+
+    Model *known = g_knownModels;
+    for (int i = 0; i < g_numKnownModel; ++i, ++known)
+    {
+        // submodels are named "name*index"
+        if (StringNCompare(known->name, name, nameLength) == 0 
+            && (known->name[nameLength] == '\0' || known->name[nameLength] == '*'))
         {
-            g_platformAPI.SysError("Exceeds maximum model number!");
+            known->loadStatus = ModelLoadStatus::UNUSED;
+            known->arena = NULL;
+        }
+    }
+
+    SpinLockRelease(&g_model_lock);
+}
+
+Model *ModelLoadForName(char *name)
+{
+    // find a model. if it's an existing one, load it.
+    Model *result = ModelFindForName(name);
+
+    if (result->loadStatus == ModelLoadStatus::PRESENT)
+    {
+        if (result->type != ModelType::BRUSH)
+        {
+            // make sure cache has not been evicted
+            if (CacheCheck(&result->cache))
+            {
+                return result;
+            }
         }
         else
         {
-            g_numKnownModel++;
+            return result;
         }
-
-        StringCopy(model->name, sizeof(model->name), name);
-        model->loadStatus = ModelLoadStatus::NEEDLOAD;
     }
 
-    return model;
+    ModelLoad(result);
+
+    return result;
 }
 
-float ModelRadiusFromBounds(Vec3f min, Vec3f max)
+// data of an alias or sprite model, loaded again if the cache has evicted them
+void *ModelExtradata(Model *model)
 {
-    Vec3f extreme = {0};
-    for (int i = 0; i < 3; ++i)
+    void *result = CacheCheck(&model->cache);
+    if (!result)
     {
-        extreme[i] = Absf(min[i]) > Absf(max[i]) ? Absf(min[i]) : Absf(max[i]);
+        ModelLoad(model);
+        result = model->cache.data;
     }
-
-    float result = Vec3Length(extreme);
     return result;
 }
 
+//=== Visibility ===
+
 /*
-Type Submodel is used for describing data, the real data of each submodel are 
-stored as an instance of type of Model too. Submodel includes the room model as
-well as torche and other small models. 
+ Leaf sets have a bit per leaf, bit n is leaf n + 1, the solid leaf 0 is never
+ in a set. A set of a model takes ModelLeafSetBytes, rounded up to whole SSE
+ registers with the bits past the last leaf cleared, so the set operations go
+ 16 bytes at a time. LEAF_SET_BYTES is enough for any model.
 */
-void ModelSetupSubmodel(Model *model)
+
+I32 LeafSetBytesForCount(I32 leaf_count)
 {
-    Model *submodel = model;
-    for (int i = 0; i < model->numSubmodel; ++i)
+    I32 result = (leaf_count + 127) / 128 * 16;
+    return result;
+}
+
+// leaves that can be in a set, not including leaf 0
+I32 ModelVisibleLeafCount(Model *model)
+{
+    // numLeaf is all the leaves until the submodels are set up
+    I32 result = model->numSubmodel ? model->submodels[0].visibleLeaves : model->numLeaf;
+    return result;
+}
+
+I32 ModelLeafSetBytes(Model *model)
+{
+    I32 result = LeafSetBytesForCount(ModelVisibleLeafCount(model));
+    return result;
+}
+
+// a run-length compressed set into dest, NULL means every leaf is in it
+void ModelDecompressVisibility(U8 *visibility, I32 leaf_count, U8 *dest)
+{
+    I32 bytes = (leaf_count + 7) >> 3;
+    I32 set_bytes = LeafSetBytesForCount(leaf_count);
+
+    if (visibility == NULL)
     {
-        Submodel *spec = &model->submodels[i];
-        submodel->hulls[0].firstClipNode = spec->headNodes[0];
-        for (int j = 0; j < MAX_MAP_HULLS; ++j)
+        MemSet(dest, 0xff, bytes);
+        if (leaf_count & 7)
         {
-            submodel->hulls[j].firstClipNode = spec->headNodes[j];
-            submodel->hulls[j].lastClipNode = model->numClipNode - 1;
+            dest[bytes - 1] = (U8)((1 << (leaf_count & 7)) - 1);
         }
+    }
+    else
+    {
+        U8 *out = dest;
+        U8 *end = dest + bytes;
+        while (out < end)
+        {
+            if (*visibility)
+            {   // if the byte is not zero, write it
+                *out++ = *visibility++;
+                continue;
+            }
 
-        submodel->firstModelSurface = spec->firstFace;
-        submodel->numModelSurface = spec->numFace;
+            // if the byte is zero, the next byte is how many zeroes there are
+            I32 count = visibility[1];
+            visibility += 2;
+            if (count > end - out)
+            {
+                count = (I32)(end - out);
+            }
+            MemSet(out, 0, count);
+            out += count;
+        }
+    }
 
-        submodel->min = spec->min;
-        submodel->max = spec->max;
-        submodel->radius = ModelRadiusFromBounds(submodel->min, submodel->max);
+    MemSet(dest + bytes, 0, set_bytes - bytes);
+}
 
-        submodel->numLeaf = spec->visibleLeaves;
+// the other way around, returns the compressed size. dest takes twice the
+// bytes of the set at most.
+I32 ModelCompressVisibility(U8 *set, I32 leaf_count, U8 *dest)
+{
+    I32 bytes = (leaf_count + 7) >> 3;
+    U8 *out = dest;
+    for (I32 i = 0; i < bytes; ++i)
+    {
+        *out++ = set[i];
+        if (set[i])
+        {
+            continue;
+        }
 
-        if (i < model->numSubmodel - 1)
+        I32 count = 1;
+        while (i + 1 < bytes && !set[i + 1] && count < 255)
         {
-            char submodelname[MAX_PACK_FILE_PATH];
-            snprintf(submodelname, MAX_PACK_FILE_PATH, "%s*%d", model->name, i);
-            Model *nextSubmodel = ModelFindForName(submodelname);
-            // duplicate the basic information
-            *nextSubmodel = *model;
-            StringCopy(nextSubmodel->name, MAX_PACK_FILE_PATH, submodelname, 0);
-            submodel = nextSubmodel;
+            ++i;
+            ++count;
         }
+        *out++ = (U8)count;
     }
+    return (I32)(out - dest);
+}
 
+// the leaves visible from leaf into dest, which takes ModelLeafSetBytes
+void ModelGetPVS(Model *model, Leaf *leaf, U8 *dest)
+{
+    // everything is visible from the solid leaf, as from a map without vis
+    U8 *compressed = leaf == model->leaves ? NULL : leaf->visibilityCompressed;
+    ModelDecompressVisibility(compressed, ModelVisibleLeafCount(model), dest);
 }
 
-void ModelLoadBrushModel(Model *model, void *buffer)
+// the leaves a sound in leaf can be heard in, that is every leaf visible
+// from a leaf that is visible from it
+void ModelGetPHS(Model *model, Leaf *leaf, U8 *dest)
 {
-    model->type = ModelType::BRUSH;
+    U8 *compressed = leaf == model->leaves ? NULL : leaf->hearabilityCompressed;
+    ModelDecompressVisibility(compressed, ModelVisibleLeafCount(model), dest);
+}
 
-    ModelHeaderDisk *headerDisk = (ModelHeaderDisk *)buffer;
+// only valid until the next call, for the renderer
+U8 *ModelGetDecompressedPVS(Leaf *leaf, Model *model)
+{
+    static U8 decompressed[LEAF_SET_BYTES];
+    ModelGetPVS(model, leaf, decompressed);
+    return decompressed;
+}
 
-    if (headerDisk->version != BSPVERSION)
+inline B32 LeafSetContains(Model *model, U8 *set, Leaf *leaf)
+{
+    I32 index = (I32)(leaf - model->leaves) - 1;
+    B32 result = index >= 0 && (set[index >> 3] & (1 << (index & 7)));
+    return result;
+}
+
+// is to in the PVS of from, reads the compressed set of from only up to to
+B32 ModelLeafCanSee(Model *model, Leaf *from, Leaf *to)
+{
+    I32 index = (I32)(to - model->leaves) - 1;
+    if (index < 0)
     {
-        g_platformAPI.SysError("ModelLoadBrushModel: %s has wrong version number", model->name);
+        return false;
     }
 
-    // load into low hunk
-    U8 *base = (U8 *)buffer;
-    ModelLoadVertices(model, base, headerDisk->lumps[ModelLump::VERTEX]);
-    ModelLoadEdges(model, base, headerDisk->lumps[ModelLump::EDGE]);
-    ModelLoadSurfaceEdges(model, base, headerDisk->lumps[ModelLump::SURFACEEDGE]);
-    ModelLoadTextures(model, base, headerDisk->lumps[ModelLump::TEXTURE]);
-    ModelLoadLighting(model, base, headerDisk->lumps[ModelLump::LIGHTING]);
-    ModelLoadPlanes(model, base, headerDisk->lumps[ModelLump::PLANE]);
-    ModelLoadTextureInfo(model, base, headerDisk->lumps[ModelLump::TEXTUREINFO]);
-    ModelLoadFaces(model, base, headerDisk->lumps[ModelLump::FACE]);
-    ModelLoadMarkSurfaces(model, base, headerDisk->lumps[ModelLump::MARKSURFACE]);
-    ModelLoadVisibility(model, base, headerDisk->lumps[ModelLump::VISIBILITY]);
-    ModelLoadLeaves(model, base, headerDisk->lumps[ModelLump::LEAF]);
-    ModelLoadNodes(model, base, headerDisk->lumps[ModelLump::NODE]);
-    ModelLoadClipNodes(model, base, headerDisk->lumps[ModelLump::CLIPNODE]);
-    ModelLoadEntities(model, base, headerDisk->lumps[ModelLump::ENTITY]);
-    ModelLoadSubmodels(model, base, headerDisk->lumps[ModelLump::SUBMODEL]);
-
-    ModelMakeHull(model);
-
-    model->numFrame = 2; // regular and alternate animation TODO lw: ???
-    model->flags = 0;
+    U8 *visibility = from->visibilityCompressed;
+    if (from == model->leaves || !visibility)
+    {
+        return true;
+    }
 
-    ModelSetupSubmodel(model);
+    I32 byte = index >> 3;
+    for (;;)
+    {
+        if (*visibility)
+        {
+            if (byte == 0)
+            {
+                return (*visibility >> (index & 7)) & 1;
+            }
+            --byte;
+            ++visibility;
+        }
+        else
+        {
+            byte -= visibility[1];
+            if (byte < 0)
+            {
+                return false;
+            }
+            visibility += 2;
+        }
+    }
 }
 
-void ModelLoad(Model *model)
+void LeafSetOr(U8 *dest, U8 *src, I32 bytes)
 {
-    void *buffer = FileLoad(model->name, ALLocType::TEMPHUNK);
+    for (I32 i = 0; i < bytes; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((__m128i *)(dest + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_or_si128(a, b));
+    }
+}
 
-    model->loadStatus = ModelLoadStatus::PRESENT;
+void LeafSetAnd(U8 *dest, U8 *src, I32 bytes)
+{
+    for (I32 i = 0; i < bytes; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((__m128i *)(dest + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_and_si128(a, b));
+    }
+}
 
-    switch (*((U32 *)buffer))
+// true if a leaf is in both sets
+B32 LeafSetIntersects(U8 *lhs, U8 *rhs, I32 bytes)
+{
+    __m128i any = _mm_setzero_si128();
+    for (I32 i = 0; i < bytes; i += 16)
     {
-        case IDPOLYHEADER:
-        {
+        __m128i a = _mm_loadu_si128((__m128i *)(lhs + i));
+        __m128i b = _mm_loadu_si128((__m128i *)(rhs + i));
+        any = _mm_or_si128(any, _mm_and_si128(a, b));
+    }
+    B32 result = _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff;
+    return result;
+}
 
-        } break; 
+I32 LeafSetCount(U8 *set, I32 bytes)
+{
+    I32 result = 0;
+    for (I32 i = 0; i < bytes; i += 8)
+    {
+        U64 v;
+        MemCpy(&v, set + i, 8);
+        // bits counted in pairs, nibbles, then bytes summed by the multiply
+        v = v - ((v >> 1) & 0x5555555555555555ull);
+        v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+        v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0full;
+        result += (I32)((v * 0x0101010101010101ull) >> 56);
+    }
+    return result;
+}
 
-        case IDSPRITEHEADER:
+// 1 if the box is in front of the plane, 2 if behind, 3 if on both sides
+I32 BoxOnPlaneSide(const Vec3f &mins, const Vec3f &maxs, Plane *plane)
+{
+    if (plane->type < 3)
+    {
+        float min = ((float *)&mins)[plane->type];
+        float max = ((float *)&maxs)[plane->type];
+        if (plane->distance <= min)
+        {
+            return 1;
+        }
+        if (plane->distance >= max)
         {
+            return 2;
+        }
+        return 3;
+    }
 
-        } break;
+    // the corners furthest in front of and behind the plane
+    float front = 0;
+    float back = 0;
+    for (I32 i = 0; i < 3; ++i)
+    {
+        float n = ((float *)&plane->normal)[i];
+        float min = ((float *)&mins)[i];
+        float max = ((float *)&maxs)[i];
+        front += n * (n >= 0 ? max : min);
+        back += n * (n >= 0 ? min : max);
+    }
 
-        default:
-        {
-            ModelLoadBrushModel(model, buffer);
-        } break;
+    I32 sides = 0;
+    if (front >= plane->distance)
+    {
+        sides = 1;
+    }
+    if (back < plane->distance)
+    {
+        sides |= 2;
     }
+    return sides;
 }
 
-Model *ModelLoadForName(char *name)
+struct BoxLeafQuery
 {
-    // find a model. if it's an existing one, load it.
-    Model *result = ModelFindForName(name);
+    Vec3f mins;
+    Vec3f maxs;
+    Leaf **leaves;
+    I32 max_count;
+    I32 count;
+    // if set, stop at the first leaf in it
+    U8 *set;
+    Model *model;
+};
 
-    if (result->loadStatus == ModelLoadStatus::PRESENT)
+// true once the query is done
+B32 ModelBoxLeavesRecursive(BoxLeafQuery *query, Node *node)
+{
+    while (node->contents >= 0)
     {
-        if (result->type == ModelType::ALIAS)
+        I32 sides = BoxOnPlaneSide(query->mins, query->maxs, node->plane);
+        if (sides == 3)
         {
-            // make sure cache has not been evicted
-            if (CacheCheck(&result->cache))
+            if (ModelBoxLeavesRecursive(query, node->children[0]))
             {
-                return result;
+                return true;
             }
+            node = node->children[1];
         }
         else
         {
-            return result;
+            node = node->children[sides - 1];
         }
     }
 
-    ModelLoad(result);
+    if (node->contents == CONTENTS_SOLID)
+    {
+        return false;
+    }
 
-    return result;
+    Leaf *leaf = (Leaf *)node;
+    if (query->set)
+    {
+        return LeafSetContains(query->model, query->set, leaf);
+    }
+
+    if (query->count < query->max_count)
+    {
+        query->leaves[query->count] = leaf;
+    }
+    query->count++;
+    return false;
 }
 
-U8 g_allVisible[MAX_MAP_LEAVES / 8];
+// the leaves the box touches, solid ones left out. Returns how many there 
+// are, only max_count of them go into leaves.
+I32 ModelFindBoxLeaves(Model *model, const Vec3f &mins, const Vec3f &maxs,
+                       Leaf **leaves, I32 max_count)
+{
+    BoxLeafQuery query = {};
+    query.mins = mins;
+    query.maxs = maxs;
+    query.leaves = leaves;
+    query.max_count = max_count;
+    query.model = model;
+    ModelBoxLeavesRecursive(&query, model->nodes + model->hulls[0].firstClipNode);
+    return query.count;
+}
+
+// true if the box touches a leaf of the set, e.g. an entity in a PVS
+B32 ModelBoxTouchesSet(Model *model, U8 *set, const Vec3f &mins, const Vec3f &maxs)
+{
+    BoxLeafQuery query = {};
+    query.mins = mins;
+    query.maxs = maxs;
+    query.set = set;
+    query.model = model;
+    B32 result = ModelBoxLeavesRecursive(&query, model->nodes + model->hulls[0].firstClipNode);
+    return result;
+}
 
-U8 *ModelDecompressVisibility(U8 *visibility, int numLeaf)
+/*
+ The PHS is built at load time from the PVS of every leaf. Those are 
+ decompressed once on top of the model arena, each PHS is compressed right 
+ after them, and at the end the compressed sets are moved down over the
+ decompressed ones. Maps without vis, or too big for what's left of the 
+ arena, have none, which means everything is hearable.
+*/
+void ModelBuildHearability(Model *model)
 {
-    // the n-th bit is set if the n-th leaf if visible
-    // MAX_MAP_LEAVES is defined to be multiple of 8, no need to ceil
-    static U8 decompressed[MAX_MAP_LEAVES / 8];
+    MemoryArena *arena = model->arena;
+    if (!arena || !model->visibility)
+    {
+        return;
+    }
 
-    // ensure to have enough bits
-    int numBytes = (numLeaf + 7) >> 3;
+    I32 leaf_count = ModelVisibleLeafCount(model);
+    I32 row_bytes = LeafSetBytesForCount(leaf_count);
+    I32 matrix_size = leaf_count * row_bytes;
 
-    U8 *result = decompressed;
+    // the compressed sets are at most as large as all the sets decompressed
+    if (arena->size - arena->used < 2 * matrix_size + 64)
+    {
+        g_platformAPI.SysPrint("ModelBuildHearability: no room for the PHS of %s\n", model->name);
+        return;
+    }
 
-    // no visibility info, make all leaves visible
-    if (visibility == NULL)
+    ArenaMarker marker = ArenaGetMarker(arena);
+    U8 *visible = (U8 *)ArenaPush(arena, matrix_size);
+    for (I32 i = 0; i < leaf_count; ++i)
     {
-        result = g_allVisible;
+        ModelDecompressVisibility(model->leaves[i + 1].visibilityCompressed, 
+                                  leaf_count, visible + i * row_bytes);
     }
-    else
+
+    U8 *packed = (U8 *)ArenaPush(arena, 0, 1);
+    I32 packed_size = 0;
+
+    U8 hearable[LEAF_SET_BYTES];
+    U8 compressed[LEAF_SET_BYTES * 2];
+    for (I32 i = 0; i < leaf_count; ++i)
     {
-        do 
+        U8 *row = visible + i * row_bytes;
+        MemSet(hearable, 0, row_bytes);
+        for (I32 j = 0; j < row_bytes; ++j)
         {
-            if (*visibility)
-            {   // if the byte is not zero, write it
-                *result++ = *visibility++;
+            if (!row[j])
+            {
                 continue;
             }
-            else
-            {   // if the byte is zero, get the next byte to see how many zeroes 
-                // following it, then write all zeroes.
-                int count = visibility[1];
-                visibility += 2;
-                while (count)
+            for (I32 k = 0; k < 8; ++k)
+            {
+                if (row[j] & (1 << k))
                 {
-                    *result++ = 0;
-                    count--;
+                    LeafSetOr(hearable, visible + (j * 8 + k) * row_bytes, row_bytes);
                 }
             }
-        } while (result - decompressed < numBytes);
-    }
-
+        }
 
-    return decompressed;
-}
+        I32 size = ModelCompressVisibility(hearable, leaf_count, compressed);
+        U8 *dest = (U8 *)ArenaPush(arena, size, 1);
+        MemCpy(dest, compressed, size);
+        model->leaves[i + 1].hearabilityCompressed = dest;
+        packed_size += size;
+    }
 
-U8 *ModelGetDecompressedPVS(Leaf *leaf, Model *model)
-{
-    if (leaf == model->leaves) 
+    // dest is below src, a forward copy is fine
+    for (I32 i = 0; i < packed_size; ++i)
     {
-        return g_allVisible;
+        visible[i] = packed[i];
     }
-    else
-    {
-        U8 *result = ModelDecompressVisibility(
-                leaf->visibilityCompressed, model->numLeaf);
+    ArenaPopToMarker(arena, marker);
+    U8 *block = (U8 *)ArenaPush(arena, packed_size);
+    ASSERT(block == visible);
 
-        return result;
+    for (I32 i = 0; i < leaf_count; ++i)
+    {
+        Leaf *leaf = model->leaves + i + 1;
+        leaf->hearabilityCompressed = block + (leaf->hearabilityCompressed - packed);
     }
 }
 
@@ -1089,8 +2880,3 @@ Leaf *ModelFindViewLeaf(Vec3f pos, Model *worldModel)
         }
     }
 }
-
-void ModelInit()
-{
-    MemSet(g_allVisible, 0xff, sizeof(g_allVisible));
-}
@@ -3,9 +3,15 @@
 #include "q_math.h"
 
 #define MAX_MAP_HULLS 4
+#define MAX_MAP_LEAVES 8192
+
+// bytes of a set with a bit per leaf
+#define LEAF_SET_BYTES (MAX_MAP_LEAVES / 8)
 
 #define MIP_LEVELS 4
 #define MAX_LIGHT_MAPS 4
+// 255 in the light styles of a surface means none
+#define MAX_LIGHT_STYLE_NUM 64
 
 #define TEX_SPECIAL 1 // sky or slime, no lightmap or 256 subdivision
 
@@ -18,6 +24,31 @@
 
 #define NUM_AMBIENT_SOUND 4 // automatic ambient sound
 
+#define	CONTENTS_EMPTY		-1
+#define	CONTENTS_SOLID		-2
+#define	CONTENTS_WATER		-3
+#define	CONTENTS_SLIME		-4
+#define	CONTENTS_LAVA		-5
+#define	CONTENTS_SKY		-6
+#define	CONTENTS_ORIGIN		-7		// removed at csg time
+#define	CONTENTS_CLIP		-8		// changed to contents_solid
+
+#define	CONTENTS_CURRENT_0		-9
+#define	CONTENTS_CURRENT_90		-10
+#define	CONTENTS_CURRENT_180	-11
+#define	CONTENTS_CURRENT_270	-12
+#define	CONTENTS_CURRENT_UP		-13
+#define	CONTENTS_CURRENT_DOWN	-14
+
+// 0-2 are axial planes
+#define	PLANE_X			0
+#define	PLANE_Y			1
+#define	PLANE_Z			2
+// 3-5 are non-axial planes snapped to the nearest
+#define	PLANE_ANYX		3
+#define	PLANE_ANYY		4
+#define	PLANE_ANYZ		5
+
 
 struct Vertex
 {
@@ -36,11 +67,25 @@ struct Texture
     U32 width;
     U32 height;
     I32 animTotal; // total tenths in sequence (0 = no)
+    // tenths of the sequence this frame is shown, from anim_min to anim_max
+    I32 anim_min;
+    I32 anim_max;
     Texture *animNext; // in the animation sequence
     Texture *alternateAnims; // bmodels in frame 1 use this
-    U32 offsets[MIP_LEVELS]; // 4 mip maps stored
+    U32 offsets[MIP_LEVELS]; // 4 mip maps stored, relative to mip_base
+    // the texture itself, or the mip texture in a mapped pak file
+    U8 *mip_base;
+
+    // set if the mips are kept compressed instead, each level is decoded 
+    // into the cache when it's first drawn
+    U8 *packed;
+    U32 packed_offsets[MIP_LEVELS + 1]; // relative to packed
+    CacheUser mip_cache[MIP_LEVELS];
 };
 
+// only valid until the next cache allocation
+U8 *TextureGetMip(Texture *texture, I32 mip_level);
+
 struct TextureInfo
 {
     Vec3f u_axis;
@@ -70,14 +115,18 @@ struct Plane
 struct SurfaceCache
 {
     SurfaceCache *next;
+    SurfaceCache *prev;
     SurfaceCache **owner;
     Texture *texture;
-    I32 bright_adjusts[MAX_LIGHT_MAPS];
+    I32 lit_frame; // see SurfaceCacheIsValid
     I32 dlight; // ?
     I32 size; // including the header
     U32 width;
     U32 height; // debug
     float mipscale;
+    I32 last_used_frame;
+    I16 size_class;
+    I16 page; // first page holding the entry
     U8 data[4]; // &data[0] is the starting address of cache data
 };
 
@@ -87,12 +136,16 @@ struct Surface
     TextureInfo *tex_info;
 
     SurfaceCache *cachespots[MIP_LEVELS];
+    // bit per mip level that ever had a surface cache
+    U32 cached_mips;
 
     I32 visibleframe;
 
     I32 lightframe;
     // every 1-bit represents a light affectting this surface
     I32 lightbits;
+    // last frame one of its light styles changed
+    I32 styleframe;
 
     I32 flags;
 
@@ -144,6 +197,8 @@ struct Leaf
     U8 ambientSoundLevel[NUM_AMBIENT_SOUND];
 
     U8 *visibilityCompressed; // run-length compressed
+    // potentially hearable set, the same way
+    U8 *hearabilityCompressed;
     struct EFrag *efrags;
 
     Surface **firstMarksurface; // surfaces that this leaf contains
@@ -159,14 +214,14 @@ struct Hull
     Vec3f clipMax;
 };
 
-// TODO lw: Entity Fragment???
+// entity fragment, links an entity into one of the leaves it's in
 struct EFrag
 {
     Leaf *leaf;
-    EFrag *nextLeaf; 
+    EFrag *nextLeaf; // next fragment in the same leaf
 
     struct Entity *entity;
-    EFrag *nextEntity;
+    EFrag *nextEntity; // next fragment of the same entity
 };
 
 struct Submodel
@@ -180,6 +235,126 @@ struct Submodel
     I32 numFace;
 };
 
+//=== Alias models ===
+
+#define MAX_ALIAS_VERTS 2048
+#define MAX_ALIAS_TRIS 4096
+#define MAX_ALIAS_FRAMES 256
+#define MAX_ALIAS_SKINS 32
+
+// vertex of a pose, scaled by AliasHeader::scale and moved by scale_origin
+struct TriVertex
+{
+    U8 v[3];
+    U8 light_normal_index;
+};
+
+struct AliasSTVert
+{
+    I32 on_seam; // s is half a skin further on triangles facing back
+    I32 s;
+    I32 t;
+};
+
+struct AliasTriangle
+{
+    I32 faces_front;
+    I32 vert_index[3];
+};
+
+// a frame is a pose or a group of poses played in a loop, skins the same
+struct AliasGroup
+{
+    I32 first; // pose or skin image
+    I32 count;
+};
+
+/*
+ Alias model data in the cache, the members name offsets from the header. 
+ The intervals are the times in the loop of its group each pose or skin 
+ image ends at.
+*/
+struct AliasHeader
+{
+    Vec3f scale;
+    Vec3f scale_origin;
+    I32 skin_width;
+    I32 skin_height;
+    I32 num_vert;
+    I32 num_tri;
+    I32 num_frame;
+    I32 num_pose;
+    I32 num_skin;
+    I32 num_skin_image;
+
+    I32 frames; // AliasGroup[num_frame]
+    I32 skins; // AliasGroup[num_skin]
+    I32 pose_intervals; // float[num_pose]
+    I32 skin_intervals; // float[num_skin_image]
+    I32 stverts; // AliasSTVert[num_vert]
+    I32 triangles; // AliasTriangle[num_tri]
+    I32 poses; // TriVertex[num_vert] for each pose
+    I32 skin_images; // skin_width * skin_height texels each
+};
+
+inline void *AliasData(AliasHeader *header, I32 offset)
+{
+    void *result = (U8 *)header + offset;
+    return result;
+}
+
+//=== Sprite models ===
+
+#define MAX_SPRITE_FRAMES 256
+#define SPRITE_MIP_LEVELS 4
+// skipped when drawing
+#define SPRITE_TRANSPARENT_COLOR 255
+
+enum SpriteType
+{
+    VP_PARALLEL_UPRIGHT, // faces the view plane, stands upright
+    FACING_UPRIGHT, // faces the viewer, stands upright
+    VP_PARALLEL, // faces the view plane, like the screen
+    ORIENTED, // turned by the angles of the entity
+    VP_PARALLEL_ORIENTED, // faces the view plane, rolled by the entity
+};
+
+/*
+ An image of a sprite, up, down, left and right are where its edges are from 
+ the origin of the entity, in world units. Mips are taken every other texel,
+ they are only smaller.
+*/
+struct SpriteImage
+{
+    I32 width;
+    I32 height;
+    float up;
+    float down;
+    float left;
+    float right;
+    I32 pixels[SPRITE_MIP_LEVELS]; // offsets from the sprite header
+};
+
+// sprite data in the cache, frames are grouped like alias frames
+struct SpriteHeader
+{
+    SpriteType type;
+    I32 max_width;
+    I32 max_height;
+    I32 num_frame;
+    I32 num_image;
+
+    I32 frames; // AliasGroup[num_frame]
+    I32 intervals; // float[num_image]
+    I32 images; // SpriteImage[num_image]
+};
+
+inline void *SpriteData(SpriteHeader *header, I32 offset)
+{
+    void *result = (U8 *)header + offset;
+    return result;
+}
+
 enum ModelType
 {
     BRUSH, // wall, building, etc.
@@ -224,7 +399,17 @@ struct Model
     U8 *visibility;
 
     U8 *light_data;
+    // indices of the surfaces lit by each light style, the ones of style i
+    // are from style_surface_first[i] to style_surface_first[i + 1]
+    I32 *style_surfaces;
+    I32 style_surface_first[MAX_LIGHT_STYLE_NUM + 1];
     char *entities;
+    // set when one of the textures is a sky, the sky canvas is only set up 
+    // when the model becomes the world
+    Texture *skyTexture;
+
+    // where the model data goes, low hunk if NULL
+    MemoryArena *arena;
 
     // additional model data, only access through Mod_Extradata
     CacheUser cache;
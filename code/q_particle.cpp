@@ -0,0 +1,481 @@
+#include <emmintrin.h> // SSE2, every x64 cpu has it
+
+/*
+ Particles of rocket trails and explosions, 10k of them are alive at times.
+ They are kept as a structure of arrays and moved four at a time in SSE
+ lanes. The live ones are always packed in [0, count): a new one is put at the
+ end, a dead one is replaced by the last one.
+
+ They are drawn after the sprites as squares of one color, lit through the
+ colormap and tested against the z-buffer. The screen is split into
+ horizontal bands that don't share pixels, large batches are drawn on the
+ worker threads a band at a time.
+*/
+
+// a multiple of 4, the lanes past count are moved as well
+#define MAX_PARTICLES 16384
+// units per second squared at a gravity of 1
+#define PARTICLE_GRAVITY 40.0f
+// closer than this particles are skipped
+#define PARTICLE_NEAR_Z 4.0f
+// world size of a particle, the square is at least a pixel wide
+#define PARTICLE_SIZE 1.5f
+#define PARTICLE_MAX_SPLAT 8
+#define PARTICLE_BAND_SHIFT 5
+#define PARTICLE_BAND_HEIGHT (1 << PARTICLE_BAND_SHIFT)
+#define PARTICLE_MAX_BANDS (MAX_PIXEL_HEIGHT >> PARTICLE_BAND_SHIFT)
+// fewer splats than this are drawn on the calling thread
+#define PARTICLE_BATCH_MIN 1024
+#define PARTICLE_MAX_WORKERS 8
+
+#define PARTICLE_COLOR_FIRE 0x68
+#define PARTICLE_COLOR_SMOKE 0x04
+
+struct ParticleSystem
+{
+    // in world space
+    float x[MAX_PARTICLES];
+    float y[MAX_PARTICLES];
+    float z[MAX_PARTICLES];
+    float vx[MAX_PARTICLES];
+    float vy[MAX_PARTICLES];
+    float vz[MAX_PARTICLES];
+    // scale of PARTICLE_GRAVITY, negative ones rise
+    float gravity[MAX_PARTICLES];
+    // fraction of the velocity lost per second, negative ones speed up
+    float drag[MAX_PARTICLES];
+    // 0 - 255 row of the colormap and its change per second
+    float light[MAX_PARTICLES];
+    float light_step[MAX_PARTICLES];
+    // removed once time gets there
+    float die[MAX_PARTICLES];
+    U8 color[MAX_PARTICLES];
+
+    I32 count;
+    float time;
+    U32 seed;
+    // not spawned because all of them were alive
+    I32 dropped;
+};
+
+ParticleSystem g_particlesystem;
+
+// a particle projected on the screen
+struct ParticleSplat
+{
+    // pixels it covers, inclusive, inside the screen rect
+    I32 min_x, min_y;
+    I32 max_x, max_y;
+    float invz;
+    U8 pixel; // color through the colormap
+};
+
+struct ParticleDraw
+{
+    U8 *pbuffer;
+    I32 bytes_per_row;
+    float *zbuffer;
+    I32 zbuffer_width;
+    Recti rect; // pixels outside are not touched
+    U8 *colormap;
+};
+
+// pixels a band has drawn, empty if max_x < min_x
+struct ParticleBand
+{
+    I32 min_x, min_y;
+    I32 max_x, max_y;
+};
+
+void ParticleReset(ParticleSystem *system)
+{
+    system->count = 0;
+    system->time = 0;
+    system->dropped = 0;
+}
+
+U32 ParticleRandom(ParticleSystem *system)
+{
+    system->seed = system->seed * 1664525 + 1013904223;
+    return system->seed >> 8;
+}
+
+// -range to range
+float ParticleRandomFloat(ParticleSystem *system, float range)
+{
+    float t = (float)(ParticleRandom(system) & 0xffff) / 32767.5f - 1.0f;
+    return t * range;
+}
+
+/*
+ Returns the index of the new particle, lit and falling, or -1 if all of them
+ are alive. The caller changes the rest.
+*/
+I32 ParticleSpawn(ParticleSystem *system, Vec3f origin, Vec3f velocity, U8 color, float life)
+{
+    if (system->count == MAX_PARTICLES)
+    {
+        system->dropped++;
+        return -1;
+    }
+
+    I32 i = system->count++;
+    system->x[i] = origin.x;
+    system->y[i] = origin.y;
+    system->z[i] = origin.z;
+    system->vx[i] = velocity.x;
+    system->vy[i] = velocity.y;
+    system->vz[i] = velocity.z;
+    system->gravity[i] = 1;
+    system->drag[i] = 0;
+    system->light[i] = 255;
+    system->light_step[i] = 0;
+    system->die[i] = system->time + life;
+    system->color[i] = color;
+    return i;
+}
+
+// the last one takes its place
+void ParticleKill(ParticleSystem *system, I32 i)
+{
+    I32 last = --system->count;
+    system->x[i] = system->x[last];
+    system->y[i] = system->y[last];
+    system->z[i] = system->z[last];
+    system->vx[i] = system->vx[last];
+    system->vy[i] = system->vy[last];
+    system->vz[i] = system->vz[last];
+    system->gravity[i] = system->gravity[last];
+    system->drag[i] = system->drag[last];
+    system->light[i] = system->light[last];
+    system->light_step[i] = system->light_step[last];
+    system->die[i] = system->die[last];
+    system->color[i] = system->color[last];
+}
+
+void ParticleUpdate(ParticleSystem *system, float dt)
+{
+    system->time += dt;
+
+    __m128 dt4 = _mm_set1_ps(dt);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 gravity_dt = _mm_set1_ps(PARTICLE_GRAVITY * dt);
+    for (I32 i = 0; i < system->count; i += 4)
+    {
+        __m128 keep = _mm_sub_ps(one, _mm_mul_ps(_mm_loadu_ps(system->drag + i), dt4));
+        __m128 vx = _mm_mul_ps(_mm_loadu_ps(system->vx + i), keep);
+        __m128 vy = _mm_mul_ps(_mm_loadu_ps(system->vy + i), keep);
+        __m128 vz = _mm_mul_ps(_mm_loadu_ps(system->vz + i), keep);
+        vz = _mm_sub_ps(vz, _mm_mul_ps(_mm_loadu_ps(system->gravity + i), gravity_dt));
+        _mm_storeu_ps(system->vx + i, vx);
+        _mm_storeu_ps(system->vy + i, vy);
+        _mm_storeu_ps(system->vz + i, vz);
+
+        __m128 x = _mm_add_ps(_mm_loadu_ps(system->x + i), _mm_mul_ps(vx, dt4));
+        __m128 y = _mm_add_ps(_mm_loadu_ps(system->y + i), _mm_mul_ps(vy, dt4));
+        __m128 z = _mm_add_ps(_mm_loadu_ps(system->z + i), _mm_mul_ps(vz, dt4));
+        _mm_storeu_ps(system->x + i, x);
+        _mm_storeu_ps(system->y + i, y);
+        _mm_storeu_ps(system->z + i, z);
+
+        __m128 light = _mm_loadu_ps(system->light + i);
+        __m128 light_step = _mm_loadu_ps(system->light_step + i);
+        _mm_storeu_ps(system->light + i, _mm_add_ps(light, _mm_mul_ps(light_step, dt4)));
+    }
+
+    // four at a time are skipped if none of them is dead, a particle moved in
+    // from the end is checked again
+    __m128 time = _mm_set1_ps(system->time);
+    I32 i = 0;
+    while (i < system->count)
+    {
+        if (!(i & 3) && i + 4 <= system->count)
+        {
+            __m128 dead = _mm_cmple_ps(_mm_loadu_ps(system->die + i), time);
+            if (!_mm_movemask_ps(dead))
+            {
+                i += 4;
+                continue;
+            }
+        }
+
+        if (system->die[i] <= system->time)
+        {
+            ParticleKill(system, i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+void ParticleExplosion(ParticleSystem *system, Vec3f origin)
+{
+    for (I32 i = 0; i < 1024; ++i)
+    {
+        Vec3f offset = {ParticleRandomFloat(system, 16), ParticleRandomFloat(system, 16),
+                        ParticleRandomFloat(system, 16)};
+        Vec3f velocity = {ParticleRandomFloat(system, 256), ParticleRandomFloat(system, 256),
+                          ParticleRandomFloat(system, 256)};
+        float life = 0.5f + (float)(ParticleRandom(system) & 0xff) / 512.0f;
+        U8 color = (U8)(PARTICLE_COLOR_FIRE + (ParticleRandom(system) & 7));
+        I32 p = ParticleSpawn(system, origin + offset, velocity, color, life);
+        if (p < 0)
+        {
+            return ;
+        }
+        // half of them fly apart and die out fast, half slow down
+        system->drag[p] = (i & 1) ? -4.0f : 1.0f;
+        system->light_step[p] = -255.0f / life;
+    }
+}
+
+// smoke rising where a rocket has been, a puff every few units
+void ParticleRocketTrail(ParticleSystem *system, Vec3f start, Vec3f end)
+{
+    Vec3f dir = end - start;
+    float length = Vec3Length(dir);
+    if (length <= 0)
+    {
+        return ;
+    }
+    dir = dir * (1.0f / length);
+
+    for (float d = 0; d < length; d += 3.0f)
+    {
+        Vec3f offset = {ParticleRandomFloat(system, 3), ParticleRandomFloat(system, 3),
+                        ParticleRandomFloat(system, 3)};
+        float life = 2.0f;
+        U8 color = (ParticleRandom(system) & 3)
+                 ? (U8)(PARTICLE_COLOR_SMOKE + (ParticleRandom(system) & 3))
+                 : (U8)(PARTICLE_COLOR_FIRE + (ParticleRandom(system) & 7));
+        I32 p = ParticleSpawn(system, start + dir * d + offset, Vec3f{0, 0, 0}, color, life);
+        if (p < 0)
+        {
+            return ;
+        }
+        system->gravity[p] = -1.0f;
+        system->light_step[p] = -192.0f / life;
+    }
+}
+
+/*
+ Transforms four particles at a time into view space, the ones in front of
+ the near plane and on the screen become splats. Returns the splat count.
+*/
+I32 ParticleProject(ParticleSystem *system, Camera *camera, ParticleDraw *draw,
+                    ParticleSplat *splats)
+{
+    __m128 px = _mm_set1_ps(camera->position.x);
+    __m128 py = _mm_set1_ps(camera->position.y);
+    __m128 pz = _mm_set1_ps(camera->position.z);
+    __m128 rot[3][3];
+    Vec3f axes[3] = {camera->rotx, camera->rotz, camera->roty};
+    for (I32 i = 0; i < 3; ++i)
+    {
+        for (I32 j = 0; j < 3; ++j)
+        {
+            rot[i][j] = _mm_set1_ps(axes[i][j]);
+        }
+    }
+    __m128 near_z = _mm_set1_ps(PARTICLE_NEAR_Z);
+    __m128 one = _mm_set1_ps(1.0f);
+
+    Recti rect = draw->rect;
+    float min_x = (float)(rect.x - PARTICLE_MAX_SPLAT);
+    float min_y = (float)(rect.y - PARTICLE_MAX_SPLAT);
+    float max_x = (float)(rect.x + rect.width + PARTICLE_MAX_SPLAT);
+    float max_y = (float)(rect.y + rect.height + PARTICLE_MAX_SPLAT);
+    float size_scale = camera->scale_z * PARTICLE_SIZE;
+
+    I32 count = 0;
+    for (I32 i = 0; i < system->count; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(system->x + i), px);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(system->y + i), py);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(system->z + i), pz);
+        __m128 view[3];
+        for (I32 j = 0; j < 3; ++j)
+        {
+            view[j] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, rot[j][0]), _mm_mul_ps(dy, rot[j][1])),
+                                 _mm_mul_ps(dz, rot[j][2]));
+        }
+        I32 visible = _mm_movemask_ps(_mm_cmpge_ps(view[2], near_z));
+        if (!visible)
+        {
+            continue;
+        }
+
+        // lanes behind the near plane are garbage and skipped
+        float invz[4], vx[4], vy[4];
+        _mm_storeu_ps(invz, _mm_div_ps(one, _mm_max_ps(view[2], near_z)));
+        _mm_storeu_ps(vx, view[0]);
+        _mm_storeu_ps(vy, view[1]);
+
+        for (I32 j = 0; j < 4 && i + j < system->count; ++j)
+        {
+            if (!(visible & (1 << j)))
+            {
+                continue;
+            }
+
+            float scale = camera->scale_z * invz[j];
+            float sx = camera->screen_center.x + vx[j] * scale;
+            float sy = camera->screen_center.y - vy[j] * scale;
+            if (sx < min_x || sx > max_x || sy < min_y || sy > max_y)
+            {
+                continue;
+            }
+
+            I32 size = Clamp(1, PARTICLE_MAX_SPLAT, (I32)(size_scale * invz[j]));
+            ParticleSplat *splat = splats + count;
+            splat->min_x = (I32)floorf(sx + 0.5f) - (size >> 1);
+            splat->min_y = (I32)floorf(sy + 0.5f) - (size >> 1);
+            splat->max_x = splat->min_x + size - 1;
+            splat->max_y = splat->min_y + size - 1;
+            splat->min_x = splat->min_x < rect.x ? rect.x : splat->min_x;
+            splat->min_y = splat->min_y < rect.y ? rect.y : splat->min_y;
+            splat->max_x = splat->max_x > rect.x + rect.width - 1 ? rect.x + rect.width - 1 : splat->max_x;
+            splat->max_y = splat->max_y > rect.y + rect.height - 1 ? rect.y + rect.height - 1 : splat->max_y;
+            if (splat->min_x > splat->max_x || splat->min_y > splat->max_y)
+            {
+                continue;
+            }
+
+            I32 light = Clamp(0, 255, (I32)system->light[i + j]);
+            splat->pixel = draw->colormap[(((255 - light) << COLOR_SHADE_BITS) & 0xff00)
+                                          + system->color[i + j]];
+            splat->invz = invz[j];
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// rows from band_min_y to band_max_y, inclusive
+void ParticleDrawBand(ParticleDraw *draw, ParticleSplat *splats, I32 count,
+                      I32 band_min_y, I32 band_max_y, ParticleBand *band)
+{
+    band->min_x = band->min_y = 0x7fffffff;
+    band->max_x = band->max_y = -1;
+
+    for (I32 i = 0; i < count; ++i)
+    {
+        ParticleSplat *splat = splats + i;
+        I32 y_start = splat->min_y > band_min_y ? splat->min_y : band_min_y;
+        I32 y_end = splat->max_y < band_max_y ? splat->max_y : band_max_y;
+        if (y_start > y_end)
+        {
+            continue;
+        }
+
+        float invz = splat->invz;
+        U8 color = splat->pixel;
+        for (I32 y = y_start; y <= y_end; ++y)
+        {
+            U8 *pixel = draw->pbuffer + y * draw->bytes_per_row + splat->min_x;
+            float *zpixel = draw->zbuffer + y * draw->zbuffer_width + splat->min_x;
+            for (I32 x = splat->min_x; x <= splat->max_x; ++x, ++pixel, ++zpixel)
+            {
+                if (invz >= *zpixel)
+                {
+                    *zpixel = invz;
+                    *pixel = color;
+                }
+            }
+        }
+
+        band->min_x = splat->min_x < band->min_x ? splat->min_x : band->min_x;
+        band->max_x = splat->max_x > band->max_x ? splat->max_x : band->max_x;
+        band->min_y = y_start < band->min_y ? y_start : band->min_y;
+        band->max_y = y_end > band->max_y ? y_end : band->max_y;
+    }
+}
+
+struct ParticleBandJob
+{
+    ParticleDraw *draw;
+    ParticleSplat *splats;
+    I32 splat_count;
+    ParticleBand *bands;
+    I32 band_count;
+    // first band nobody has taken yet
+    volatile I32 next;
+    // workers that may still touch the job
+    volatile I32 workers;
+};
+
+void ParticleBandRun(ParticleBandJob *job)
+{
+    for (;;)
+    {
+        I32 band = AtomicAdd(&job->next, 1) - 1;
+        if (band >= job->band_count)
+        {
+            break;
+        }
+
+        I32 min_y = job->draw->rect.y + (band << PARTICLE_BAND_SHIFT);
+        I32 max_y = min_y + PARTICLE_BAND_HEIGHT - 1;
+        ParticleDrawBand(job->draw, job->splats, job->splat_count, min_y, max_y,
+                         job->bands + band);
+    }
+}
+
+PLATFORM_WORK_QUEUE_CALLBACK(ParticleBandWork)
+{
+    ParticleBandJob *job = (ParticleBandJob *)data;
+    ParticleBandRun(job);
+    // the job is on the stack of the thread that started it, this is the
+    // last time it's touched
+    AtomicAdd(&job->workers, -1);
+}
+
+/*
+ Each band only touches its own rows, splats crossing a band boundary are
+ drawn in parts by both bands. Returns the band count, bands gets what each
+ of them has drawn.
+*/
+I32 ParticleDrawSplats(ParticleDraw *draw, ParticleSplat *splats, I32 count,
+                       ParticleBand bands[PARTICLE_MAX_BANDS])
+{
+    ParticleBandJob job = {};
+    job.draw = draw;
+    job.splats = splats;
+    job.splat_count = count;
+    job.bands = bands;
+    job.band_count = (draw->rect.height + PARTICLE_BAND_HEIGHT - 1) >> PARTICLE_BAND_SHIFT;
+    job.next = 0;
+
+    I32 worker_count = 0;
+    if (g_work_queue && count >= PARTICLE_BATCH_MIN)
+    {
+        // the calling thread takes bands too
+        worker_count = job.band_count - 1;
+        if (worker_count > PARTICLE_MAX_WORKERS)
+        {
+            worker_count = PARTICLE_MAX_WORKERS;
+        }
+    }
+    job.workers = worker_count;
+    for (I32 i = 0; i < worker_count; ++i)
+    {
+        g_platformAPI.SysAddWork(g_work_queue, ParticleBandWork, &job);
+    }
+
+    ParticleBandRun(&job);
+
+    // may be inside a work callback itself, so help instead of waiting for
+    // the whole queue
+    while (job.workers)
+    {
+        if (!g_platformAPI.SysDoNextWork(g_work_queue))
+        {
+            CpuPause();
+        }
+    }
+
+    return job.band_count;
+}
@@ -34,6 +34,118 @@ typedef I32 Fixed20; // 20 bits for mantissa
 #define GIGA_BYTES(val) (MEGA_BYTES(val) * 1024LL)
 #define TERA_BYTES(val) (GIGA_BYTES(val) * 1024LL)
 
+//=== Atomic operations ===
+
+#if defined(_MSC_VER)
+
+#include <intrin.h>
+
+#define THREAD_LOCAL __declspec(thread)
+
+// returns the initial value of *dest
+inline I32 AtomicCompareExchange(volatile I32 *dest, I32 exchange, I32 comparand)
+{
+    I32 result = _InterlockedCompareExchange((volatile long *)dest, exchange, comparand);
+    return result;
+}
+
+// returns the new value of *dest
+inline I32 AtomicAdd(volatile I32 *dest, I32 value)
+{
+    I32 result = _InterlockedExchangeAdd((volatile long *)dest, value) + value;
+    return result;
+}
+
+inline void CpuPause()
+{
+    _mm_pause();
+}
+
+// time stamp counter, for profiling only
+inline U64 ReadCycleCounter()
+{
+    U64 result = __rdtsc();
+    return result;
+}
+
+inline I32 FindLeastSignificantSetBit(U32 value)
+{
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (I32)index;
+}
+
+inline I32 FindMostSignificantSetBit(U32 value)
+{
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return (I32)index;
+}
+
+#else
+
+#define THREAD_LOCAL __thread
+
+inline I32 AtomicCompareExchange(volatile I32 *dest, I32 exchange, I32 comparand)
+{
+    I32 result = __sync_val_compare_and_swap(dest, comparand, exchange);
+    return result;
+}
+
+inline I32 AtomicAdd(volatile I32 *dest, I32 value)
+{
+    I32 result = __sync_add_and_fetch(dest, value);
+    return result;
+}
+
+inline void CpuPause()
+{
+    __builtin_ia32_pause();
+}
+
+inline U64 ReadCycleCounter()
+{
+    U64 result = __builtin_ia32_rdtsc();
+    return result;
+}
+
+inline I32 FindLeastSignificantSetBit(U32 value)
+{
+    I32 result = __builtin_ctz(value);
+    return result;
+}
+
+inline I32 FindMostSignificantSetBit(U32 value)
+{
+    I32 result = 31 - __builtin_clz(value);
+    return result;
+}
+
+#endif
+
+struct SpinLock
+{
+    volatile I32 locked;
+};
+
+inline void SpinLockAcquire(SpinLock *lock)
+{
+    while (AtomicCompareExchange(&lock->locked, 1, 0) != 0)
+    {
+        while (lock->locked)
+        {
+            CpuPause();
+        }
+    }
+}
+
+inline void SpinLockRelease(SpinLock *lock)
+{
+    // interlocked operation as a full barrier, stores inside the lock must be
+    // visible before the lock is
+    AtomicCompareExchange(&lock->locked, 0, 1);
+}
+
 inline Fixed20 FloatToFixed20(float v)
 {
     // 0x100000 = 2^20
@@ -91,6 +203,14 @@ typedef DEBUG_PLATFORM_WRITE_WHOLE_FILE(DebugPlatformWriteWholeFile_t);
 //========================================================
 
 //=== Services that the game provides to the platform layer
+struct GameDirtyRect
+{
+    I32 x, y; // top-left corner
+    I32 width, height;
+};
+
+#define MAX_DIRTY_RECT_NUM 32
+
 struct GameOffScreenBuffer
 {
     I32 width;
@@ -99,6 +219,11 @@ struct GameOffScreenBuffer
     I32 bytesPerRow;
     void *memory;
     U8 *palette;
+
+    // regions of memory that changed in the last frame, pixels outside them 
+    // are the same as the previous frame. 0 means nothing changed.
+    GameDirtyRect dirtyRects[MAX_DIRTY_RECT_NUM];
+    I32 dirtyRectCount;
 };
 
 struct GameSoundOutputBuffer
@@ -177,12 +302,44 @@ struct GameInput
 #define SYS_ERROR(name) void name(char *format, ...)
 typedef SYS_ERROR(SysError_t);
 
+// debug output, not shown to the player
+#define SYS_PRINT(name) void name(char *format, ...)
+typedef SYS_PRINT(SysPrint_t);
+
+// read-only view of a whole file, stays mapped until the process exits. 
+// NULL if the file can't be mapped.
+#define SYS_MAP_FILE(name) void *name(const char *path, I32 *size)
+typedef SYS_MAP_FILE(SysMapFile_t);
+
+// work queue run by worker threads of the platform layer
+struct PlatformWorkQueue;
+
+#define PLATFORM_WORK_QUEUE_CALLBACK(name) void name(PlatformWorkQueue *queue, void *data)
+typedef PLATFORM_WORK_QUEUE_CALLBACK(PlatformWorkQueueCallback_t);
+
+// callback is run on one of the worker threads, can be called from any thread
+#define SYS_ADD_WORK(name) void name(PlatformWorkQueue *queue, PlatformWorkQueueCallback_t *callback, void *data)
+typedef SYS_ADD_WORK(SysAddWork_t);
+
+// run one work on the calling thread, false if the queue is empty
+#define SYS_DO_NEXT_WORK(name) B32 name(PlatformWorkQueue *queue)
+typedef SYS_DO_NEXT_WORK(SysDoNextWork_t);
+
+// help out until all added work is done, not to be called from a work callback
+#define SYS_COMPLETE_ALL_WORK(name) void name(PlatformWorkQueue *queue)
+typedef SYS_COMPLETE_ALL_WORK(SysCompleteAllWork_t);
+
 #define SYS_SET_PALETTE(name) void name(U8 *palette)
 typedef SYS_SET_PALETTE(SysSetPalette_t);
 
 struct PlatformAPI
 {
     SysError_t *SysError;
+    SysPrint_t *SysPrint;
+    SysMapFile_t *SysMapFile;
+    SysAddWork_t *SysAddWork;
+    SysDoNextWork_t *SysDoNextWork;
+    SysCompleteAllWork_t *SysCompleteAllWork;
     SysSetPalette_t *SysSetPalette;
 };
 
@@ -194,6 +351,8 @@ struct GameMemory
     I32 gameMemorySize;
 
     PlatformAPI platformAPI;
+    // NULL if the platform runs everything on the main thread
+    PlatformWorkQueue *workQueue;
 
     char gameAssetDir[MAX_OS_PATH_LENGTH];
 
@@ -3,31 +3,6 @@
 #include "q_model.h"
 #include "q_render.h"
 
-#define	CONTENTS_EMPTY		-1
-#define	CONTENTS_SOLID		-2
-#define	CONTENTS_WATER		-3
-#define	CONTENTS_SLIME		-4
-#define	CONTENTS_LAVA		-5
-#define	CONTENTS_SKY		-6
-#define	CONTENTS_ORIGIN		-7		// removed at csg time
-#define	CONTENTS_CLIP		-8		// changed to contents_solid
-
-#define	CONTENTS_CURRENT_0		-9
-#define	CONTENTS_CURRENT_90		-10
-#define	CONTENTS_CURRENT_180	-11
-#define	CONTENTS_CURRENT_270	-12
-#define	CONTENTS_CURRENT_UP		-13
-#define	CONTENTS_CURRENT_DOWN	-14
-
-// 0-2 are axial planes
-#define	PLANE_X			0
-#define	PLANE_Y			1
-#define	PLANE_Z			2
-// 3-5 are non-axial planes snapped to the nearest
-#define	PLANE_ANYX		3
-#define	PLANE_ANYY		4
-#define	PLANE_ANYZ		5
-
 #define BACKFACE_EPSILON 0.01
 
 // used for edge caching mechanism
@@ -42,6 +17,10 @@
 #define CACHE_SIZE 64
 
 #include "q_lightmap.cpp"
+#include "q_efrag.cpp"
+#include "q_alias.cpp"
+#include "q_sprite.cpp"
+#include "q_particle.cpp"
 
 // TODO lw: why these numbers, empirical?
 float g_base_mip[MIP_NUM - 1] = {1.0f, 0.5f * 0.8f, 0.25f * 0.8f};
@@ -575,8 +554,133 @@ U32 ReEmitIEdge(Edge *edge, RenderData *renderdata)
     return 1;
 }
 
-void RenderFace(Surface *surface, RenderData *renderdata, Camera *camera, 
-                B32 in_submodel, I32 clipflag)
+// frustum planes the clipflag asks for, linked with the left one first
+ClipPlane *BuildClipPlanes(Camera *camera, I32 clipflag)
+{
+    ClipPlane *clip_plane = NULL;
+    U32 mask = 0x08;
+    for (int i = 3; i >= 0; --i, mask >>= 1)
+    {
+        if (clipflag & mask)
+        {
+            camera->worldFrustumPlanes[i].next = clip_plane;
+            clip_plane = &camera->worldFrustumPlanes[i];
+        }
+    }
+    return clip_plane;
+}
+
+// close a surface along the left and right screen edges where the frustum 
+// cut it, returns true if an iedge was emitted
+B32 EmitScreenEdges(SurfaceClipResult *scr, B32 make_left_edge, B32 make_right_edge,
+                    ClipPlane *clip_plane, Camera *camera, RenderData *renderdata)
+{
+    B32 edge_emitted = 0;
+    U32 iedge_offset = 0;
+    LastVertex last_vert = {0};
+    EmitIEdgeResult emit_result = {0};
+
+    if (make_left_edge)
+    {
+        last_vert.is_valid = 0;
+		// Based on how clip plane list is set up, left clip plane must be the 
+        // first one, namely clip_plane. Passing clip_plane->next will exlucde 
+        // the left clip plane
+        emit_result = EmitIEdge(scr->left_exit_vert, scr->left_enter_vert, false, 
+                                &iedge_offset, camera, renderdata, clip_plane->next, 
+                                NULL, &last_vert, scr);
+        edge_emitted |= emit_result.edge_emitted;
+    }
+    if (make_right_edge)
+    {
+        last_vert.is_valid = 0;
+        // view_clipplanes[1] is the right clip plane, passing 
+        // view_clipplanes[1].next will exclude the right clip plane.
+        emit_result = EmitIEdge(scr->right_exit_vert, scr->right_enter_vert, true, 
+                                &iedge_offset, camera, renderdata, 
+                                camera->worldFrustumPlanes[1].next, NULL, &last_vert, scr);
+        edge_emitted |= emit_result.edge_emitted;
+    }
+
+    return edge_emitted;
+}
+
+// isurface for the iedges just emitted
+void EmitISurface(Surface *surface, Entity *entity, I32 key, RenderData *renderdata, 
+                  Camera *camera)
+{
+    renderdata->surfaceCount++;
+
+    ISurface *isurface = renderdata->currentISurface;
+
+    isurface->data = (void *)surface;
+    isurface->nearest_invz = renderdata->nearest_invz;
+    isurface->flags = surface->flags; // sky, water, normal plane and etc.
+    isurface->in_submodel = entity != NULL;
+    isurface->spanState = 0;
+    isurface->entity = entity;
+    isurface->key = key;
+    isurface->spans = NULL;
+    isurface->cache = NULL;
+
+    Vec3f n_view = TransformDirectionToView(camera, surface->plane->normal);
+
+    /* 
+    Affine transformation won't change the distance.
+    Q is a point on the plane, O is the world orign, P is camera position
+    N is the normal of the plane
+    distance_world = (Q - O) * N  and distance_view = (Q - P) * N
+    distance_view = ((Q - O) - (P - O)) * N = distance_world - (P - O) * N
+    */
+    float inv_dist = 1.0f / (surface->plane->distance - Vec3Dot(camera->position, surface->plane->normal));
+
+    /* 
+	Instead of calculating 1/z by interpolating between edges,
+	we use plane equation to get 1/z. 
+
+    normal = (a, b, c)
+    z_s is the z value of the projecting plane that's perpendicular to z axis, ...
+    x_s and y_s are values the projecting plane in view space
+
+	a*x + b*y + c*z - d = 0                 eq.1
+	x/x_s = z/z_s --> x = (z/z_s) * x_s     eq.2
+	y/y_s = z/z_s --> y = (z/z_s) * y_s   eq.3
+
+	put eq.2 and eq.3 into eq.1, we get
+	1/z = ((a/z_s) * x_s + (b/z_s) * y_s + c) / d
+		= ((a/z_s)/d * x_s) + ((b/z_s)/d * y_s) + c/d
+
+    screen_origin is at top-left corner
+
+    x_ss = screen_center_x + x_s (x_ss is in screen space)
+    y_ss = screen_center_y - y_s (y_ss is in screen space)
+
+	1/z = ((a/z_s)/d * (x_ss - screen_center_x)) 
+        + ((b/z_s)/d * (screen_center_y - y_ss)) 
+        + c/d
+
+	Note: Above calculation assumes the origin is at the center of the view,
+	however, screen space has the origin at top-left corner. There is some
+	translation work needs to be done.
+	*/
+    isurface->zi_stepx = n_view.x * camera->scale_invz * inv_dist;
+    // y axis is pointing up in view space
+    isurface->zi_stepy = -n_view.y * camera->scale_invz * inv_dist;
+    // move to top-left corner
+    isurface->zi_start = n_view.z * inv_dist
+                       - camera->screen_center.x * isurface->zi_stepx
+                       - camera->screen_center.y * isurface->zi_stepy;
+
+    renderdata->currentISurface++;
+}
+
+/*
+ entity: NULL for the world. Otherwise camera is in the space of the entity, 
+ and the surface takes renderdata->currentKey as it is, the key of the leaf 
+ the entity is in.
+*/
+void RenderFace(Surface *surface, Entity *entity, RenderData *renderdata, Camera *camera, 
+                I32 clipflag)
 {
     // no more surface
     if (renderdata->currentISurface >= renderdata->endISurface)
@@ -591,16 +695,11 @@ void RenderFace(Surface *surface, RenderData *renderdata, Camera *camera,
         return ;
     }
 
-    ClipPlane *clip_plane = NULL;
-    U32 mask = 0x08;
-    for (int i = 3; i >= 0; --i, mask >>= 1)
-    {
-        if (clipflag & mask)
-        {
-            camera->worldFrustumPlanes[i].next = clip_plane;
-            clip_plane = &camera->worldFrustumPlanes[i];
-        }
-    }
+    // edges of brush entities move with them, the edge cache is only for the
+    // world
+    B32 in_submodel = entity != NULL;
+
+    ClipPlane *clip_plane = BuildClipPlanes(camera, clipflag);
 
     Vertex *vertices = renderdata->worldModel->vertices;
     I32 *surfaceEdges = renderdata->worldModel->surfaceEdges;
@@ -675,99 +774,23 @@ void RenderFace(Surface *surface, RenderData *renderdata, Camera *camera,
         make_right_edge += emit_result.right_edge_clipped;
 
 
-        edge->iedge_cache_state = iedge_offset;
+        if (in_submodel == false)
+        {
+            edge->iedge_cache_state = iedge_offset;
+        }
         last_vert.is_valid = 1;
     }
 
-    if (make_left_edge)
-    {
-        last_vert.is_valid = 0;
-		// Based on how clip plane list is set up, left clip plane must be the 
-        // first one, namely clip_plane. Passing clip_plane->next will exlucde 
-        // the left clip plane
-        emit_result = EmitIEdge(scr.left_exit_vert, scr.left_enter_vert, false, 
-                                &iedge_offset, camera, renderdata, clip_plane->next, 
-                                NULL, &last_vert, &scr);
-        edge_emitted |= emit_result.edge_emitted;
-    }
-    if (make_right_edge)
-    {
-        last_vert.is_valid = 0;
-        // view_clipplanes[1] is the right clip plane, passing 
-        // view_clipplanes[1].next will exclude the right clip plane.
-        emit_result = EmitIEdge(scr.right_exit_vert, scr.right_enter_vert, true, 
-                                &iedge_offset, camera, renderdata, 
-                                camera->worldFrustumPlanes[1].next, NULL, &last_vert, &scr);
-        edge_emitted |= emit_result.edge_emitted;
-    }
+    edge_emitted |= EmitScreenEdges(&scr, make_left_edge, make_right_edge, clip_plane, 
+                                    camera, renderdata);
 
     if (!edge_emitted)
     {
         return ;
     }
 
-    renderdata->surfaceCount++;
-
-    ISurface *isurface = renderdata->currentISurface;
-
-    isurface->data = (void *)surface;
-    isurface->nearest_invz = renderdata->nearest_invz;
-    isurface->flags = surface->flags; // sky, water, normal plane and etc.
-    isurface->in_submodel = in_submodel;
-    isurface->spanState = 0;
-    // isurface->entity = ;
-    isurface->key = renderdata->currentKey++;
-    isurface->spans = NULL;
-
-    Vec3f n_view = TransformDirectionToView(camera, surface->plane->normal);
-
-    /* 
-    Affine transformation won't change the distance.
-    Q is a point on the plane, O is the world orign, P is camera position
-    N is the normal of the plane
-    distance_world = (Q - O) * N  and distance_view = (Q - P) * N
-    distance_view = ((Q - O) - (P - O)) * N = distance_world - (P - O) * N
-    */
-    float inv_dist = 1.0f / (surface->plane->distance - Vec3Dot(camera->position, surface->plane->normal));
-
-    /* 
-	Instead of calculating 1/z by interpolating between edges,
-	we use plane equation to get 1/z. 
-
-    normal = (a, b, c)
-    z_s is the z value of the projecting plane that's perpendicular to z axis, ...
-    x_s and y_s are values the projecting plane in view space
-
-	a*x + b*y + c*z - d = 0                 eq.1
-	x/x_s = z/z_s --> x = (z/z_s) * x_s     eq.2
-	y/y_s = z/z_s --> y = (z/z_s) * y_s   eq.3
-
-	put eq.2 and eq.3 into eq.1, we get
-	1/z = ((a/z_s) * x_s + (b/z_s) * y_s + c) / d
-		= ((a/z_s)/d * x_s) + ((b/z_s)/d * y_s) + c/d
-
-    screen_origin is at top-left corner
-
-    x_ss = screen_center_x + x_s (x_ss is in screen space)
-    y_ss = screen_center_y - y_s (y_ss is in screen space)
-
-	1/z = ((a/z_s)/d * (x_ss - screen_center_x)) 
-        + ((b/z_s)/d * (screen_center_y - y_ss)) 
-        + c/d
-
-	Note: Above calculation assumes the origin is at the center of the view,
-	however, screen space has the origin at top-left corner. There is some
-	translation work needs to be done.
-	*/
-    isurface->zi_stepx = n_view.x * camera->scale_invz * inv_dist;
-    // y axis is pointing up in view space
-    isurface->zi_stepy = -n_view.y * camera->scale_invz * inv_dist;
-    // move to top-left corner
-    isurface->zi_start = n_view.z * inv_dist
-                       - camera->screen_center.x * isurface->zi_stepx
-                       - camera->screen_center.y * isurface->zi_stepy;
-
-    renderdata->currentISurface++;
+    I32 key = in_submodel ? renderdata->currentKey : renderdata->currentKey++;
+    EmitISurface(surface, entity, key, renderdata, camera);
 }
 
 void RecurseWorldNode(Node *node, Camera *camera, RenderData *renderdata, int clipflag)
@@ -845,7 +868,7 @@ void RecurseWorldNode(Node *node, Camera *camera, RenderData *renderdata, int cl
         }
         if (leaf->efrags)
         {
-            // store efrags
+            StoreEFrags(renderdata, leaf->efrags);
         }
         leaf->key = renderdata->currentKey;
         renderdata->currentKey++;
@@ -900,7 +923,7 @@ void RecurseWorldNode(Node *node, Camera *camera, RenderData *renderdata, int cl
                     if ((surface->flags & SURF_PLANE_BACK) 
                         && (surface->visibleframe == renderdata->framecount))
                     {
-                        RenderFace(surface, renderdata, camera, false, clipflag);
+                        RenderFace(surface, NULL, renderdata, camera, clipflag);
                     }
                     surface++;
                     count--;
@@ -913,23 +936,312 @@ void RecurseWorldNode(Node *node, Camera *camera, RenderData *renderdata, int cl
                     if (!(surface->flags & SURF_PLANE_BACK) 
                         && (surface->visibleframe == renderdata->framecount))
                     {
-                        RenderFace(surface, renderdata, camera, false, clipflag);
+                        RenderFace(surface, NULL, renderdata, camera, clipflag);
                     }
                     surface++;
                     count--;
                 }
             }
 
-            renderdata->currentKey++;
+            renderdata->currentKey++;
+        }
+
+        RecurseWorldNode(node->children[!side], camera, renderdata, clipflag);
+    }
+}
+
+void RenderWorld(Node *nodes, Camera *camera, RenderData *renderdata)
+{
+    RecurseWorldNode(nodes, camera, renderdata, 15);
+}
+
+//=== Brush entities ===
+
+/*
+ Brush entities are drawn in their own space, the camera is moved there 
+ instead of every vertex being moved into the world. Their surfaces are cut 
+ into pieces by the world nodes below entity->topnode, each piece takes the 
+ key of the leaf it ends up in and sorts with the world like anything else in 
+ that leaf. Pieces in the same leaf are sorted by z, see LeadingEdge.
+*/
+
+#define MAX_CLIP_POLYGON_VERTS 64
+
+// camera seen from the space of the entity
+void SetupEntityCamera(Camera *dest, const Camera *camera, Entity *entity)
+{
+    Vec3f ex, ey, ez;
+    AngleVectors(entity->angles, &ex, &ey, &ez);
+
+    *dest = *camera;
+
+    Vec3f position = camera->position - entity->origin;
+    dest->position = {Vec3Dot(ex, position), Vec3Dot(ey, position), Vec3Dot(ez, position)};
+    dest->rotx = {Vec3Dot(ex, camera->rotx), Vec3Dot(ey, camera->rotx), Vec3Dot(ez, camera->rotx)};
+    dest->roty = {Vec3Dot(ex, camera->roty), Vec3Dot(ey, camera->roty), Vec3Dot(ez, camera->roty)};
+    dest->rotz = {Vec3Dot(ex, camera->rotz), Vec3Dot(ey, camera->rotz), Vec3Dot(ez, camera->rotz)};
+
+    TransformFrustum(dest);
+    SetupFrustumIndices(dest);
+}
+
+// clipflag for a box in world space, -1 if it's outside of the frustum
+I32 BoxClipFlags(Camera *camera, Vec3f mins, Vec3f maxs)
+{
+    float minmax[6] = {mins.x, mins.y, mins.z, maxs.x, maxs.y, maxs.z};
+
+    I32 clipflag = 0;
+    for (I32 i = 0; i < 4; ++i)
+    {
+        // see SetupFrustumIndices for information
+        I32 *index = &(camera->frustumIndices[i * 6]);
+        Vec3f reject_point = {minmax[index[0]], minmax[index[1]], minmax[index[2]]};
+        float d = Vec3Dot(reject_point, camera->worldFrustumPlanes[i].normal)
+                - camera->worldFrustumPlanes[i].distance;
+        if (d <= 0)
+        {
+            return -1;
+        }
+
+        index = &(camera->frustumIndices[i * 6 + 3]);
+        Vec3f accept_point = {minmax[index[0]], minmax[index[1]], minmax[index[2]]};
+        d = Vec3Dot(accept_point, camera->worldFrustumPlanes[i].normal)
+          - camera->worldFrustumPlanes[i].distance;
+        if (d < 0)
+        {
+            clipflag |= (1 << i);
+        }
+    }
+    return clipflag;
+}
+
+struct BrushEntityClip
+{
+    Entity *entity;
+    Surface *surface;
+    Camera *camera; // in the space of the entity
+    RenderData *renderdata;
+    I32 clipflag;
+    // axes of the entity in world space
+    Vec3f ex, ey, ez;
+};
+
+// a piece of a surface of a brush entity, it's gone after this frame
+void RenderPolygon(BrushEntityClip *clip, Vec3f *verts, I32 count)
+{
+    RenderData *renderdata = clip->renderdata;
+
+    if (renderdata->currentISurface >= renderdata->endISurface)
+    {
+        return ;
+    }
+
+    if ((renderdata->currentIEdge + count + 4) >= renderdata->endIEdge)
+    {
+        renderdata->outOfIEdges += count;
+        return ;
+    }
+
+    ClipPlane *clip_plane = BuildClipPlanes(clip->camera, clip->clipflag);
+
+    B32 edge_emitted = 0;
+    B32 make_left_edge = 0;
+    B32 make_right_edge = 0;
+    SurfaceClipResult scr = {0};
+    LastVertex last_vert = {0};
+    renderdata->nearest_invz = 0;
+
+    for (I32 i = 0; i < count; ++i)
+    {
+        // never cached, nothing owns the edge
+        U32 iedge_cache_state = 0;
+        Vec3f end_vert = verts[i + 1 < count ? i + 1 : 0];
+        EmitIEdgeResult emit_result = EmitIEdge(verts[i], end_vert, false, &iedge_cache_state, 
+                                                clip->camera, renderdata, clip_plane, NULL, 
+                                                &last_vert, &scr);
+        edge_emitted += emit_result.edge_emitted;
+        make_left_edge += emit_result.left_edge_clipped;
+        make_right_edge += emit_result.right_edge_clipped;
+        last_vert.is_valid = 1;
+    }
+
+    edge_emitted |= EmitScreenEdges(&scr, make_left_edge, make_right_edge, clip_plane, 
+                                    clip->camera, renderdata);
+
+    if (edge_emitted)
+    {
+        EmitISurface(clip->surface, clip->entity, renderdata->currentKey, renderdata, 
+                     clip->camera);
+    }
+}
+
+void RecursiveClipPolygon(BrushEntityClip *clip, Node *node, Vec3f *verts, I32 count)
+{
+    if (node->contents == CONTENTS_SOLID)
+    {
+        return ;
+    }
+
+    if (node->contents < 0)
+    {
+        if (node->visibleframe != clip->renderdata->updateCountPVS)
+        {
+            return ;
+        }
+
+        clip->renderdata->currentKey = ((Leaf *)node)->key;
+        RenderPolygon(clip, verts, count);
+        return ;
+    }
+
+    // the world plane in the space of the entity
+    Plane *plane = node->plane;
+    Vec3f normal = {Vec3Dot(clip->ex, plane->normal), Vec3Dot(clip->ey, plane->normal), 
+                    Vec3Dot(clip->ez, plane->normal)};
+    float distance = plane->distance - Vec3Dot(plane->normal, clip->entity->origin);
+
+    float dists[MAX_CLIP_POLYGON_VERTS];
+    B32 has_front = false;
+    B32 has_back = false;
+    for (I32 i = 0; i < count; ++i)
+    {
+        dists[i] = Vec3Dot(verts[i], normal) - distance;
+        has_front |= dists[i] > 0;
+        has_back |= dists[i] < 0;
+    }
+
+    // on the plane goes to the front
+    if (!has_back)
+    {
+        RecursiveClipPolygon(clip, node->children[0], verts, count);
+        return ;
+    }
+    if (!has_front)
+    {
+        RecursiveClipPolygon(clip, node->children[1], verts, count);
+        return ;
+    }
+
+    Vec3f front[MAX_CLIP_POLYGON_VERTS];
+    Vec3f back[MAX_CLIP_POLYGON_VERTS];
+    I32 front_count = 0;
+    I32 back_count = 0;
+    for (I32 i = 0; i < count; ++i)
+    {
+        I32 next = i + 1 < count ? i + 1 : 0;
+        float d0 = dists[i];
+        float d1 = dists[next];
+
+        // a vertex and a cut at most, polygons that aren't quite convex 
+        // can cross the plane more than twice
+        if (front_count + 2 > MAX_CLIP_POLYGON_VERTS || back_count + 2 > MAX_CLIP_POLYGON_VERTS)
+        {
+            return ;
+        }
+
+        if (d0 >= 0)
+        {
+            front[front_count++] = verts[i];
+        }
+        if (d0 <= 0)
+        {
+            back[back_count++] = verts[i];
+        }
+
+        if ((d0 > 0 && d1 < 0) || (d0 < 0 && d1 > 0))
+        {
+            float t = d0 / (d0 - d1);
+            Vec3f mid = verts[i] + t * (verts[next] - verts[i]);
+            front[front_count++] = mid;
+            back[back_count++] = mid;
+        }
+    }
+
+    RecursiveClipPolygon(clip, node->children[0], front, front_count);
+    RecursiveClipPolygon(clip, node->children[1], back, back_count);
+}
+
+void RenderBrushEntity(Entity *entity, Camera *camera, RenderData *renderdata)
+{
+    // in solid or not linked
+    if (!entity->efrags)
+    {
+        return ;
+    }
+
+    Vec3f mins, maxs;
+    EntityGetLocalBounds(entity, &mins, &maxs);
+    I32 clipflag = BoxClipFlags(camera, entity->origin + mins, entity->origin + maxs);
+    if (clipflag < 0)
+    {
+        return ;
+    }
+
+    Camera entity_camera;
+    SetupEntityCamera(&entity_camera, camera, entity);
+
+    BrushEntityClip clip = {};
+    clip.entity = entity;
+    clip.camera = &entity_camera;
+    clip.renderdata = renderdata;
+    clip.clipflag = clipflag;
+    AngleVectors(entity->angles, &clip.ex, &clip.ey, &clip.ez);
+
+    Model *model = entity->model;
+    Vertex *vertices = model->vertices;
+    I32 *surfaceEdges = model->surfaceEdges;
+    Edge *edges = model->edges;
+
+    Surface *surface = model->surfaces + model->firstModelSurface;
+    for (I32 i = 0; i < model->numModelSurface; ++i, ++surface)
+    {
+        float d = Vec3Dot(entity_camera.position, surface->plane->normal) 
+                - surface->plane->distance;
+        B32 facing = (surface->flags & SURF_PLANE_BACK) ? d < -BACKFACE_EPSILON 
+                                                        : d > BACKFACE_EPSILON;
+        if (!facing)
+        {
+            continue;
+        }
+
+        if (!entity->topnode)
+        {
+            // all in one leaf, nothing to cut
+            renderdata->currentKey = entity->efrags->leaf->key;
+            RenderFace(surface, entity, renderdata, &entity_camera, clipflag);
+            continue;
         }
 
-        RecurseWorldNode(node->children[!side], camera, renderdata, clipflag);
+        if (surface->numEdge > MAX_CLIP_POLYGON_VERTS)
+        {
+            continue;
+        }
+
+        Vec3f verts[MAX_CLIP_POLYGON_VERTS];
+        for (I32 j = 0; j < surface->numEdge; ++j)
+        {
+            I32 edge_index = surfaceEdges[surface->firstEdge + j];
+            I32 start_vert_index = edge_index > 0 ? 0 : 1;
+            Edge *edge = edges + (edge_index > 0 ? edge_index : -edge_index);
+            verts[j] = vertices[edge->vertIndex[start_vert_index]].position;
+        }
+
+        clip.surface = surface;
+        RecursiveClipPolygon(&clip, entity->topnode, verts, surface->numEdge);
     }
 }
 
-void RenderWorld(Node *nodes, Camera *camera, RenderData *renderdata)
+// after the world, the keys of the leaves are known then
+void RenderEntities(Camera *camera, RenderData *renderdata)
 {
-    RecurseWorldNode(nodes, camera, renderdata, 15);
+    for (I32 i = 0; i < renderdata->visible_entity_count; ++i)
+    {
+        Entity *entity = renderdata->visible_entities[i];
+        if (entity->model->type == ModelType::BRUSH)
+        {
+            RenderBrushEntity(entity, camera, renderdata);
+        }
+    }
 }
 
 void InsertNewIEdges(IEdge *edges_to_add, IEdge *edge_list)
@@ -1786,13 +2098,237 @@ void Debug_DrawSkyTexture(U8 *pixelbuffer, I32 bytes_per_row, SkyCanvas *sky)
 #endif
 }
 
+inline U32 DirtyHash(U32 hash, U32 value)
+{
+    // murmur3 finalizer
+    hash ^= value;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+inline U32 DirtyHashFloat(U32 hash, float value)
+{
+    union { float f; U32 u; } bits;
+    bits.f = value;
+    return DirtyHash(hash, bits.u);
+}
+
+inline U32 DirtyHashPointer(U32 hash, void *pointer)
+{
+    U64 value = (U64)(size_t)pointer;
+    hash = DirtyHash(hash, (U32)value);
+    hash = DirtyHash(hash, (U32)(value >> 32));
+    return hash;
+}
+
+/*
+ keep_signatures: spans are not scanned this frame (see DrawSurfaces with 
+ only_changed), signatures of the last scanned frame still describe the screen.
+ They are copied over the older ones so the area that changed in the last 
+ scanned frame isn't dirty again, only forced tiles are.
+*/
+void DirtyTilesBeginFrame(DirtyTiles *tiles, I32 width, I32 height, B32 keep_signatures)
+{
+    I32 tile_count_x = (width + DIRTY_TILE_SIZE - 1) >> DIRTY_TILE_SHIFT;
+    I32 tile_count_y = (height + DIRTY_TILE_SIZE - 1) >> DIRTY_TILE_SHIFT;
+    ASSERT(tile_count_x * tile_count_y <= MAX_DIRTY_TILE_NUM);
+
+    tiles->all_dirty = false;
+    if (tiles->width != width || tiles->height != height)
+    {
+        tiles->width = width;
+        tiles->height = height;
+        tiles->tile_count_x = tile_count_x;
+        tiles->tile_count_y = tile_count_y;
+        tiles->all_dirty = true;
+    }
+
+    I32 tile_count = tile_count_x * tile_count_y;
+    if (!keep_signatures)
+    {
+        tiles->current ^= 1;
+        MemSet(tiles->signatures[tiles->current], 0, tile_count * (I32)sizeof(U32));
+    }
+    else
+    {
+        MemCpy(tiles->signatures[tiles->current ^ 1], tiles->signatures[tiles->current], 
+               tile_count * (I32)sizeof(U32));
+    }
+    MemSet(tiles->forced, 0, tile_count);
+}
+
+void DirtyTilesAddSpans(DirtyTiles *tiles, ESpan *spans, U32 signature, B32 forced)
+{
+    U32 *tile_signatures = tiles->signatures[tiles->current];
+    for (ESpan *span = spans; span != NULL; span = span->next)
+    {
+        if (span->count <= 0)
+        {
+            continue;
+        }
+        I32 tile_row = (span->y >> DIRTY_TILE_SHIFT) * tiles->tile_count_x;
+        I32 span_end_x = span->x_start + span->count;
+        I32 start_x = span->x_start;
+        // split the span at tile boundaries
+        while (start_x < span_end_x)
+        {
+            I32 tile_x = start_x >> DIRTY_TILE_SHIFT;
+            I32 end_x = (tile_x + 1) << DIRTY_TILE_SHIFT;
+            if (end_x > span_end_x)
+            {
+                end_x = span_end_x;
+            }
+            I32 tile_index = tile_row + tile_x;
+            if (forced)
+            {
+                tiles->forced[tile_index] = 1;
+            }
+            else
+            {
+                U32 hash = DirtyHash(signature, span->y);
+                hash = DirtyHash(hash, start_x);
+                hash = DirtyHash(hash, end_x - start_x);
+                // sum up, the order spans come in doesn't matter
+                tile_signatures[tile_index] += hash;
+            }
+            start_x = end_x;
+        }
+    }
+}
+
+// pixels that aren't in the spans, e.g. alias models
+void DirtyTilesAddRect(DirtyTiles *tiles, I32 min_x, I32 min_y, I32 max_x, I32 max_y, 
+                       U32 signature)
+{
+    U32 *tile_signatures = tiles->signatures[tiles->current];
+    for (I32 tile_y = min_y >> DIRTY_TILE_SHIFT; tile_y <= (max_y >> DIRTY_TILE_SHIFT); ++tile_y)
+    {
+        for (I32 tile_x = min_x >> DIRTY_TILE_SHIFT; tile_x <= (max_x >> DIRTY_TILE_SHIFT); ++tile_x)
+        {
+            U32 hash = DirtyHash(signature, tile_y);
+            tile_signatures[tile_y * tiles->tile_count_x + tile_x] += DirtyHash(hash, tile_x);
+        }
+    }
+}
+
+inline B32 DirtyTilesIsDirty(DirtyTiles *tiles, I32 tile_index)
+{
+    B32 result = tiles->forced[tile_index] 
+        || tiles->signatures[0][tile_index] != tiles->signatures[1][tile_index];
+    return result;
+}
+
+/*
+ Merge dirty tiles into rectangles: runs of dirty tiles in a row, glued to the
+ rectangle right above if they have the same columns. Falls back to one 
+ bounding rectangle if there are too many.
+*/
+I32 DirtyTilesBuildRects(DirtyTiles *tiles, GameDirtyRect *rects, I32 max_rect_count)
+{
+    if (tiles->all_dirty)
+    {
+        rects[0] = {0, 0, tiles->width, tiles->height};
+        return 1;
+    }
+
+    I32 rect_count = 0;
+    B32 collapsed = false;
+    for (I32 tile_y = 0; tile_y < tiles->tile_count_y; ++tile_y)
+    {
+        I32 tile_x = 0;
+        while (tile_x < tiles->tile_count_x)
+        {
+            if (!DirtyTilesIsDirty(tiles, tile_y * tiles->tile_count_x + tile_x))
+            {
+                tile_x++;
+                continue;
+            }
+            I32 run_start = tile_x;
+            while (tile_x < tiles->tile_count_x 
+                   && DirtyTilesIsDirty(tiles, tile_y * tiles->tile_count_x + tile_x))
+            {
+                tile_x++;
+            }
+
+            GameDirtyRect run;
+            run.x = run_start << DIRTY_TILE_SHIFT;
+            run.y = tile_y << DIRTY_TILE_SHIFT;
+            run.width = Minimum(tile_x << DIRTY_TILE_SHIFT, tiles->width) - run.x;
+            run.height = Minimum(run.y + DIRTY_TILE_SIZE, tiles->height) - run.y;
+
+            if (collapsed)
+            {
+                I32 right = Maximum(rects[0].x + rects[0].width, run.x + run.width);
+                rects[0].x = Minimum(rects[0].x, run.x);
+                rects[0].width = right - rects[0].x;
+                rects[0].height = run.y + run.height - rects[0].y;
+                continue;
+            }
+
+            B32 merged = false;
+            for (I32 i = 0; i < rect_count; ++i)
+            {
+                GameDirtyRect *rect = rects + i;
+                if (rect->x == run.x && rect->width == run.width 
+                    && rect->y + rect->height == run.y)
+                {
+                    rect->height += run.height;
+                    merged = true;
+                    break;
+                }
+            }
+
+            if (!merged)
+            {
+                if (rect_count < max_rect_count)
+                {
+                    rects[rect_count++] = run;
+                }
+                else
+                {
+                    // too many, use the bounding rectangle
+                    I32 left = run.x;
+                    I32 right = run.x + run.width;
+                    I32 top = run.y;
+                    for (I32 i = 0; i < rect_count; ++i)
+                    {
+                        left = Minimum(left, rects[i].x);
+                        right = Maximum(right, rects[i].x + rects[i].width);
+                        top = Minimum(top, rects[i].y);
+                    }
+                    rects[0] = {left, top, right - left, run.y + run.height - top};
+                    rect_count = 1;
+                    collapsed = true;
+                }
+            }
+        }
+    }
+
+    return rect_count;
+}
+
+/*
+ only_changed: the spans are the ones drawn last frame with the same camera, 
+ only surfaces whose look could have changed (sky, water and surfaces whose
+ lighting is no longer the same) are redrawn, the z-buffer is left untouched.
+*/
 void DrawSurfaces(ISurface *isurfaces, ISurface *endISurf, U8 *pbuffer, 
                   I32 bytes_per_row, float *zbuffer, I32 zbuffer_width, U8 *colormap,
-                  RenderData *renderdata, SkyCanvas *sky, Camera *camera)
+                  RenderData *renderdata, SkyCanvas *sky, Camera *camera, B32 only_changed)
 {
-    Cvar *cvar_drawflat = CvarGet("drawflat");
-    if (cvar_drawflat->val)
+    DirtyTiles *dirty_tiles = &renderdata->dirty_tiles;
+
+    if (renderdata->cvar_drawflat->val)
     {
+        if (only_changed)
+        {
+            return;
+        }
+
         for (ISurface *isurf = &isurfaces[1]; isurf < endISurf; ++isurf)
         {
             if (!isurf->spans)
@@ -1800,6 +2336,8 @@ void DrawSurfaces(ISurface *isurfaces, ISurface *endISurf, U8 *pbuffer,
                 continue;
             }
             DrawSolidSurfaces(isurf, pbuffer, bytes_per_row);
+            // color comes from the address of the surface
+            DirtyTilesAddSpans(dirty_tiles, isurf->spans, DirtyHashPointer(0, isurf->data), false);
             DrawZBuffer(isurf->zi_stepx, isurf->zi_stepy, isurf->zi_start, 
                         isurf->spans, zbuffer, zbuffer_width);
         }
@@ -1817,47 +2355,68 @@ void DrawSurfaces(ISurface *isurfaces, ISurface *endISurf, U8 *pbuffer,
             {
                 //DrawSolidSurfaces(isurf, pbuffer, bytes_per_row);
                 DrawSkySpan(isurf, pbuffer, bytes_per_row, sky->sky_shift, sky->new_sky, camera);
+                // sky is always moving
+                DirtyTilesAddSpans(dirty_tiles, isurf->spans, 0, true);
 
-                DrawZBuffer(isurf->zi_stepx, isurf->zi_stepy, isurf->zi_start, 
-                            isurf->spans, zbuffer, zbuffer_width);
+                if (!only_changed)
+                {
+                    DrawZBuffer(isurf->zi_stepx, isurf->zi_stepy, isurf->zi_start, 
+                                isurf->spans, zbuffer, zbuffer_width);
+                }
             }
             else if (isurf->flags & SURF_DRAW_BACKGROUND)
             {
-                DrawSolidSurfaces(isurf, pbuffer, bytes_per_row);
+                if (!only_changed)
+                {
+                    DrawSolidSurfaces(isurf, pbuffer, bytes_per_row);
+                    DirtyTilesAddSpans(dirty_tiles, isurf->spans, 
+                                       DirtyHashPointer(0, isurf->data), false);
+                }
             }
             else if (isurf->flags & SURF_DRAW_TURB) // water, lava
             {
+                // texture axes of brush entities are in their own space
+                Camera entity_camera;
+                Camera *surface_camera = camera;
                 if (isurf->in_submodel)
                 {
-
+                    SetupEntityCamera(&entity_camera, camera, isurf->entity);
+                    surface_camera = &entity_camera;
                 }
 
                 Surface *surface = (Surface *)isurf->data;
-                TextureGradient tex_grad = CalcGradients(surface, 0, camera);
+                TextureGradient tex_grad = CalcGradients(surface, 0, surface_camera);
 
 #if 1
                 // use original texture as surface cache, no lighting
-                U8 *surfcache = (U8 *)surface->tex_info->texture 
-                              + surface->tex_info->texture->offsets[0];
+                U8 *surfcache = TextureGetMip(surface->tex_info->texture, 0);
                 I32 surfcache_width = 64;
 #else // use default checker-board texture
 
-                U8 *surfcache = (U8 *)g_defaultTexture + g_defaultTexture->offsets[0];
+                U8 *surfcache = TextureGetMip(g_defaultTexture, 0);
                 I32 surfcache_width = 64;
 #endif
 
                 DrawTurbulentSpan16(isurf, tex_grad, isurf->zi_start, isurf->zi_stepx,
                                     isurf->zi_stepy, surfcache, surfcache_width, pbuffer, 
                                     bytes_per_row, renderdata->sine_table, renderdata->framecount);
+                // turbulence changes with framecount
+                DirtyTilesAddSpans(dirty_tiles, isurf->spans, 0, true);
 
-                DrawZBuffer(isurf->zi_stepx, isurf->zi_stepy, isurf->zi_start, 
-                            isurf->spans, zbuffer, zbuffer_width);
+                if (!only_changed)
+                {
+                    DrawZBuffer(isurf->zi_stepx, isurf->zi_stepy, isurf->zi_start, 
+                                isurf->spans, zbuffer, zbuffer_width);
+                }
             }
             else
             {
+                Camera entity_camera;
+                Camera *surface_camera = camera;
                 if (isurf->in_submodel)
                 {
-
+                    SetupEntityCamera(&entity_camera, camera, isurf->entity);
+                    surface_camera = &entity_camera;
                 }
 
                 Surface *surface = (Surface *)isurf->data;
@@ -1870,18 +2429,54 @@ void DrawSurfaces(ISurface *isurfaces, ISurface *endISurf, U8 *pbuffer,
                 I32 mip_level = GetMipLevelForScale(renderdata->scaled_mip, 
                                                     renderdata->mip_min, scale);
 
-                TextureGradient tex_grad = CalcGradients(surface, mip_level, camera);
+                I32 frame = isurf->in_submodel ? isurf->entity->frame : 0;
+                Texture *texture = AnimateTexture(surface->tex_info->texture, frame, 
+                                                  renderdata->time);
+
+                // pixels on screen already came from this cache and it's 
+                // still up to date
+                if (only_changed && isurf->cache 
+                    && isurf->cache == surface->cachespots[mip_level]
+                    && SurfaceCacheIsValid(isurf->cache, surface, texture, 
+                                           renderdata->framecount))
+                {
+                    SurfaceCacheTouch(isurf->cache);
+                    continue;
+                }
+
+                TextureGradient tex_grad = CalcGradients(surface, mip_level, surface_camera);
 
-                SurfaceCache *surfcache = CacheSurface(surface, mip_level, &g_lightsystem, 
+                // a rebuilt cache could be at the same address with new texels,
+                // the next frame of an animated texture has new texels too
+                B32 cache_rebuilt = !SurfaceCacheIsValid(surface->cachespots[mip_level], surface, 
+                                                         texture, renderdata->framecount);
+
+                SurfaceCache *surfcache = CacheSurface(surface, mip_level, texture, &g_lightsystem, 
                                                        renderdata->framecount, colormap);
+                isurf->cache = surfcache;
 
                 DrawSpan8(isurf, tex_grad, isurf->zi_start, isurf->zi_stepx,
                           isurf->zi_stepy, surfcache->data, surfcache->width, 
                           pbuffer, bytes_per_row);
+
+                U32 signature = DirtyHashPointer(0, surfcache);
+                signature = DirtyHash(signature, tex_grad.u_adjust);
+                signature = DirtyHash(signature, tex_grad.v_adjust);
+                signature = DirtyHashFloat(signature, tex_grad.uinvz_step_x);
+                signature = DirtyHashFloat(signature, tex_grad.vinvz_step_x);
+                signature = DirtyHashFloat(signature, tex_grad.uinvz_step_y);
+                signature = DirtyHashFloat(signature, tex_grad.vinvz_step_y);
+                signature = DirtyHashFloat(signature, tex_grad.uinvz_origin);
+                signature = DirtyHashFloat(signature, tex_grad.vinvz_origin);
+                DirtyTilesAddSpans(dirty_tiles, isurf->spans, signature, 
+                                   only_changed || cache_rebuilt);
                 // DrawSolidSurfaces(isurf, pbuffer, bytes_per_row);
 
-                DrawZBuffer(isurf->zi_stepx, isurf->zi_stepy, isurf->zi_start, 
-                            isurf->spans, zbuffer, zbuffer_width);
+                if (!only_changed)
+                {
+                    DrawZBuffer(isurf->zi_stepx, isurf->zi_stepy, isurf->zi_start, 
+                                isurf->spans, zbuffer, zbuffer_width);
+                }
             }
         }
 #else
@@ -1902,15 +2497,12 @@ void DrawSurfaces(ISurface *isurfaces, ISurface *endISurf, U8 *pbuffer,
     }
 }
 
-#define MAX_SPAN_NUM 5120
-
 void ScanEdge(RenderData *renderdata, RenderBuffer *renderbuffer, SkyCanvas *sky,
               Camera *camera)
 {
     Recti rect = camera->screen_rect;
 
-    U8 basespans[MAX_SPAN_NUM * sizeof(ESpan) + CACHE_SIZE];
-    ESpan *spanlist = (ESpan *)((size_t)(basespans + CACHE_SIZE - 1) & ~(CACHE_SIZE - 1));
+    ESpan *spanlist = renderdata->spanStorage;
     ESpan *maxSpan = &spanlist[MAX_SPAN_NUM - rect.width]; // TODO lw: ???
     ESpan *currentSpan = spanlist;
 
@@ -1972,7 +2564,8 @@ void ScanEdge(RenderData *renderdata, RenderBuffer *renderbuffer, SkyCanvas *sky
         if (currentSpan >= maxSpan)
         {
             DrawSurfaces(renderdata->isurfaces, endISurf, pbuffer, bytes_per_row, zbuffer, 
-                         zbuffer_width, renderbuffer->colormap, renderdata, sky, camera);
+                         zbuffer_width, renderbuffer->colormap, renderdata, sky, camera, false);
+            renderdata->spans_flushed = true;
             
             // clear surface span list
             for (ISurface *surf = &(renderdata->isurfaces[1]); surf < endISurf; ++surf)
@@ -2002,18 +2595,230 @@ void ScanEdge(RenderData *renderdata, RenderBuffer *renderbuffer, SkyCanvas *sky
                  &iedgeHead, &iedgeTail);
 
     DrawSurfaces(renderdata->isurfaces, endISurf, pbuffer, bytes_per_row, zbuffer, 
-                 zbuffer_width, renderbuffer->colormap, renderdata, sky, camera);
+                 zbuffer_width, renderbuffer->colormap, renderdata, sky, camera, false);
 }
 
 // take the entire screen as a texture and then do the same as water turbulent 
 // drawing
-void WarpScreen(U8 *pixelbuffer, I32 bytes_per_row, I32 bufferwidth, I32 bufferheight,
-                I32 *sine_table, I32 framecount)
+// alias models of the visible entities, the z-buffer has the world in it
+void DrawAliasEntities(RenderData *renderdata, Camera *camera, RenderBuffer *renderbuffer,
+                       MemoryArena *arena)
+{
+    for (I32 i = 0; i < renderdata->visible_entity_count; ++i)
+    {
+        Entity *entity = renderdata->visible_entities[i];
+        if (entity->model->type != ModelType::ALIAS)
+        {
+            continue;
+        }
+
+        Vec3f mins, maxs;
+        EntityGetLocalBounds(entity, &mins, &maxs);
+        if (BoxClipFlags(camera, entity->origin + mins, entity->origin + maxs) < 0)
+        {
+            continue;
+        }
+
+        AliasHeader *header = (AliasHeader *)ModelExtradata(entity->model);
+        I32 light = LightPoint(&g_lightsystem, renderdata->worldModel, entity->origin);
+
+        AliasDraw draw = {};
+        draw.pbuffer = renderbuffer->backbuffer;
+        draw.bytes_per_row = renderbuffer->bytes_per_row;
+        draw.zbuffer = renderbuffer->zbuffer;
+        draw.zbuffer_width = renderbuffer->width;
+        draw.rect = camera->screen_rect;
+        draw.colormap = renderbuffer->colormap;
+        AliasDrawModel(&draw, entity, header, camera, light, renderdata->time, arena);
+
+        renderdata->models_drawn = true;
+        if (draw.max_x < draw.min_x)
+        {
+            continue;
+        }
+
+        U32 signature = DirtyHashPointer(0, entity);
+        signature = DirtyHash(signature, draw.pose);
+        signature = DirtyHash(signature, draw.old_pose);
+        signature = DirtyHashFloat(signature, draw.lerp);
+        signature = DirtyHash(signature, draw.skin_image);
+        signature = DirtyHashPointer(signature, draw.colormap);
+        for (I32 j = 0; j < 3; ++j)
+        {
+            signature = DirtyHashFloat(signature, entity->origin[j]);
+            signature = DirtyHashFloat(signature, entity->angles[j]);
+            signature = DirtyHashFloat(signature, camera->position[j]);
+            signature = DirtyHashFloat(signature, camera->angles[j]);
+        }
+        DirtyTilesAddRect(&renderdata->dirty_tiles, draw.min_x, draw.min_y, 
+                          draw.max_x, draw.max_y, signature);
+    }
+}
+
+/*
+ Sprites of the visible entities, in batches sorted by image, see q_sprite.cpp.
+ The data of all of them are in the cache before any is drawn, loading one 
+ could evict another one. 
+*/
+void DrawSpriteEntities(RenderData *renderdata, Camera *camera, RenderBuffer *renderbuffer,
+                        MemoryArena *arena)
+{
+    ArenaMarker marker = ArenaGetMarker(arena);
+    SpriteBatch *batch = ARENA_PUSH_ARRAY(arena, SpriteBatch, 1);
+    batch->count = 0;
+
+    for (I32 i = 0; i < renderdata->visible_entity_count; ++i)
+    {
+        Entity *entity = renderdata->visible_entities[i];
+        if (entity->model->type == ModelType::SPRITE)
+        {
+            ModelExtradata(entity->model);
+        }
+    }
+
+    for (I32 i = 0; i < renderdata->visible_entity_count; ++i)
+    {
+        Entity *entity = renderdata->visible_entities[i];
+        if (entity->model->type != ModelType::SPRITE)
+        {
+            continue;
+        }
+
+        SpriteHeader *header = (SpriteHeader *)CacheCheck(&entity->model->cache);
+        if (!header)
+        {
+            continue;
+        }
+
+        Vec3f mins, maxs;
+        EntityGetLocalBounds(entity, &mins, &maxs);
+        if (BoxClipFlags(camera, entity->origin + mins, entity->origin + maxs) < 0)
+        {
+            continue;
+        }
+
+        Vec3f right, up;
+        if (!SpriteOrient(header->type, entity, camera, &right, &up))
+        {
+            continue;
+        }
+
+        SpriteDrawItem *item = batch->items + batch->count;
+        item->entity = entity;
+        item->image = SpriteGetImage(header, entity->frame, renderdata->time);
+        item->origin = TransformPointToView(camera, entity->origin);
+        if (item->origin.z < SPRITE_NEAR_Z && header->type == SpriteType::VP_PARALLEL)
+        {
+            continue;
+        }
+        item->screen_aligned = header->type == SpriteType::VP_PARALLEL;
+        item->right = item->screen_aligned ? Vec3f{1, 0, 0} : TransformDirectionToView(camera, right);
+        item->up = item->screen_aligned ? Vec3f{0, 1, 0} : TransformDirectionToView(camera, up);
+
+        float z = item->origin.z > SPRITE_NEAR_Z ? item->origin.z : SPRITE_NEAR_Z;
+        item->mip = GetMipLevelForScale(renderdata->scaled_mip, renderdata->mip_min, 
+                                        camera->scale_z / z);
+        item->pixels = (U8 *)SpriteData(header, item->image->pixels[item->mip]);
+
+        if (++batch->count == MAX_SPRITE_BATCH)
+        {
+            break;
+        }
+    }
+
+    if (batch->count)
+    {
+        SpriteDrawItem *temp = ARENA_PUSH_ARRAY(arena, SpriteDrawItem, batch->count);
+        SpriteBatchSort(batch, temp);
+
+        SpriteDraw draw = {};
+        draw.pbuffer = renderbuffer->backbuffer;
+        draw.bytes_per_row = renderbuffer->bytes_per_row;
+        draw.zbuffer = renderbuffer->zbuffer;
+        draw.zbuffer_width = renderbuffer->width;
+        draw.rect = camera->screen_rect;
+        SpriteDrawBatch(&draw, batch, camera);
+
+        renderdata->models_drawn = true;
+    }
+
+    for (I32 i = 0; i < batch->count; ++i)
+    {
+        SpriteDrawItem *item = batch->items + i;
+        if (item->max_x < item->min_x)
+        {
+            continue;
+        }
+
+        Entity *entity = item->entity;
+        U32 signature = DirtyHashPointer(0, entity);
+        signature = DirtyHashPointer(signature, item->pixels);
+        for (I32 j = 0; j < 3; ++j)
+        {
+            signature = DirtyHashFloat(signature, entity->origin[j]);
+            signature = DirtyHashFloat(signature, entity->angles[j]);
+            signature = DirtyHashFloat(signature, camera->position[j]);
+            signature = DirtyHashFloat(signature, camera->angles[j]);
+        }
+        DirtyTilesAddRect(&renderdata->dirty_tiles, item->min_x, item->min_y, 
+                          item->max_x, item->max_y, signature);
+    }
+
+    ArenaPopToMarker(arena, marker);
+}
+
+/*
+ Particles of g_particlesystem as splats, see q_particle.cpp. They move every
+ frame, the tiles they cover always come out dirty.
+*/
+void DrawParticles(RenderData *renderdata, Camera *camera, RenderBuffer *renderbuffer,
+                   MemoryArena *arena)
 {
-    const I32 MAX_RENDER_BUFFER_WIDTH = 640;
-    const I32 MAX_RENDER_BUFFER_HEIGHT = 480;
+    ParticleSystem *system = &g_particlesystem;
+    if (!system->count)
+    {
+        return ;
+    }
+
+    ArenaMarker marker = ArenaGetMarker(arena);
+    ParticleSplat *splats = ARENA_PUSH_ARRAY(arena, ParticleSplat, system->count);
+
+    ParticleDraw draw = {};
+    draw.pbuffer = renderbuffer->backbuffer;
+    draw.bytes_per_row = renderbuffer->bytes_per_row;
+    draw.zbuffer = renderbuffer->zbuffer;
+    draw.zbuffer_width = renderbuffer->width;
+    draw.rect = camera->screen_rect;
+    draw.colormap = renderbuffer->colormap;
+
+    I32 count = ParticleProject(system, camera, &draw, splats);
+    renderdata->models_drawn = true;
+    if (count)
+    {
+        ParticleBand bands[PARTICLE_MAX_BANDS];
+        I32 band_count = ParticleDrawSplats(&draw, splats, count, bands);
+
+        U32 signature = DirtyHashFloat(0, system->time);
+        for (I32 i = 0; i < band_count; ++i)
+        {
+            ParticleBand *band = bands + i;
+            if (band->max_x < band->min_x)
+            {
+                continue;
+            }
+            DirtyTilesAddRect(&renderdata->dirty_tiles, band->min_x, band->min_y, 
+                              band->max_x, band->max_y, DirtyHash(signature, i));
+        }
+    }
+
+    ArenaPopToMarker(arena, marker);
+}
 
-    U8 tempbuffer[MAX_RENDER_BUFFER_HEIGHT * MAX_RENDER_BUFFER_WIDTH];
+void WarpScreen(U8 *pixelbuffer, I32 bytes_per_row, I32 bufferwidth, I32 bufferheight,
+                I32 *sine_table, I32 framecount, MemoryArena *arena)
+{
+    ArenaMarker marker = ArenaGetMarker(arena);
+    U8 *tempbuffer = ARENA_PUSH_ARRAY(arena, U8, bufferwidth * bufferheight);
 
     sine_table = sine_table + ((I32)(framecount * 1.5f)& (SINE_SAMPLE_SIZE - 1));
     I32 sine_scale_y = 4;
@@ -2031,7 +2836,7 @@ void WarpScreen(U8 *pixelbuffer, I32 bytes_per_row, I32 bufferwidth, I32 bufferh
             float cy = (y + sine_y) * stretch_rate_height;
             float cx = (x + sine_x) * stretch_rate_width;
 
-            tempbuffer[y * MAX_RENDER_BUFFER_WIDTH + x] = pixelbuffer[(I32)cy * bytes_per_row + (I32)cx];
+            tempbuffer[y * bufferwidth + x] = pixelbuffer[(I32)cy * bytes_per_row + (I32)cx];
         }
     }
 
@@ -2041,22 +2846,35 @@ void WarpScreen(U8 *pixelbuffer, I32 bytes_per_row, I32 bufferwidth, I32 bufferh
     {
         MemCpy(dest, src, bufferwidth);
         dest += bytes_per_row;
-        src += MAX_RENDER_BUFFER_WIDTH;
+        src += bufferwidth;
     }
+
+    ArenaPopToMarker(arena, marker);
 }
 
-#define NUM_STACK_EDGE 2400
-#define NUM_STACK_SURFACE 800
+void RenderAllocSpanStorage(RenderData *renderdata)
+{
+    I32 isurface_size = NUM_STACK_SURFACE * sizeof(ISurface) + CACHE_SIZE;
+    U8 *isurface_base = (U8 *)HunkHighAlloc(isurface_size, "isurfaces");
+    renderdata->isurfaceStorage = 
+        (ISurface *)(((size_t)isurface_base + CACHE_SIZE - 1) & ~(CACHE_SIZE - 1));
+
+    I32 span_size = MAX_SPAN_NUM * sizeof(ESpan) + CACHE_SIZE;
+    U8 *span_base = (U8 *)HunkHighAlloc(span_size, "spans");
+    renderdata->spanStorage = 
+        (ESpan *)(((size_t)span_base + CACHE_SIZE - 1) & ~(CACHE_SIZE - 1));
 
-void SetupEdgeDrawingFrame(RenderData *renderdata, IEdge *iedgeStack, ISurface *isurfaceStack)
+    renderdata->coherent_valid = false;
+}
+
+void SetupEdgeDrawingFrame(RenderData *renderdata, IEdge *iedges)
 {
-    // NOTE lw: always use int or (char *) to do pointer calculation!!!!
-    renderdata->iedges = (IEdge *)(((size_t)&iedgeStack[0] + CACHE_SIZE - 1) & ~(CACHE_SIZE - 1));
+    renderdata->iedges = iedges;
     renderdata->currentIEdge = renderdata->iedges;
     renderdata->endIEdge = &(renderdata->iedges[NUM_STACK_EDGE]);
 
 
-    renderdata->isurfaces= (ISurface *)(((size_t)&isurfaceStack[0] + CACHE_SIZE -1) & ~(CACHE_SIZE - 1));
+    renderdata->isurfaces = renderdata->isurfaceStorage;
     renderdata->endISurface = &(renderdata->isurfaces[NUM_STACK_SURFACE]);
     // surface[0] is a dummy representing the surface with no edge
     renderdata->isurfaces--;
@@ -2067,6 +2885,9 @@ void SetupEdgeDrawingFrame(RenderData *renderdata, IEdge *iedgeStack, ISurface *
     renderdata->isurfaces[1].key = 0x7fffffff;
 
     renderdata->currentKey = 0;
+    renderdata->spans_flushed = false;
+    renderdata->visible_entity_count = 0;
+    renderdata->models_drawn = false;
 
     for (int i = 0; i < MAX_PIXEL_HEIGHT; ++i)
     {
@@ -2075,39 +2896,43 @@ void SetupEdgeDrawingFrame(RenderData *renderdata, IEdge *iedgeStack, ISurface *
     }
 }
 
-void EdgeDrawing(RenderData *renderdata, Camera *camera, RenderBuffer *renderbuffer, SkyCanvas *sky)
+void EdgeDrawing(RenderData *renderdata, Camera *camera, RenderBuffer *renderbuffer, 
+                 SkyCanvas *sky, MemoryArena *arena)
 {
-    // TODO lw: why put these data on stack? easy to clear up every frame?
-    IEdge iedgeStack[NUM_STACK_EDGE + (CACHE_SIZE - 1)/sizeof(IEdge) + 1];
-    ISurface isurfaceStack[NUM_STACK_SURFACE + (CACHE_SIZE - 1)/sizeof(ISurface) + 1];
+    // iedges only live until spans are generated, isurfaces and spans are 
+    // kept, see RenderAllocSpanStorage
+    ArenaMarker marker = ArenaGetMarker(arena);
+    IEdge *iedges = (IEdge *)ArenaPush(arena, NUM_STACK_EDGE * (I32)sizeof(IEdge), CACHE_SIZE);
 
-    // NOTE lw: stack is growing from high address to low address
-    ASSERT((size_t)iedgeStack > (size_t)isurfaceStack);
-    ASSERT((size_t)&iedgeStack[NUM_STACK_SURFACE] > (size_t)isurfaceStack);
-    ASSERT((size_t)&isurfaceStack[NUM_STACK_SURFACE] < (size_t)iedgeStack);
-
-    SetupEdgeDrawingFrame(renderdata, iedgeStack, isurfaceStack);
+    SetupEdgeDrawingFrame(renderdata, iedges);
 
     // TODO lw: how does it make sense in the case where the camera is facing 
     // away the root node 
     // construct data from BSP for span-drawing
     RenderWorld(renderdata->worldModel->nodes, camera, renderdata);
+    RenderEntities(camera, renderdata);
 
     SkyAnimate(sky);
 
     ScanEdge(renderdata, renderbuffer, sky, camera);
+    DrawAliasEntities(renderdata, camera, renderbuffer, arena);
+    DrawSpriteEntities(renderdata, camera, renderbuffer, arena);
+    DrawParticles(renderdata, camera, renderbuffer, arena);
+
+    ArenaPopToMarker(arena, marker);
 }
 
-void SetupFrame(RenderData *renderdata, Camera *camera, float target_dt)
+void RenderUpdateMipScale(RenderData *renderdata)
 {
-    Cvar *mipscale = CvarGet("mipscale");
     for (I32 i = 0; i < (MIP_NUM - 1); ++i)
     {
-        renderdata->scaled_mip[i] = g_base_mip[i] * mipscale->val;
+        renderdata->scaled_mip[i] = g_base_mip[i] * renderdata->cvar_mipscale->val;
     }
-    Cvar *mip_min = CvarGet("mipmin");
-    renderdata->mip_min = (I32)mip_min->val;
+    renderdata->mip_min = (I32)renderdata->cvar_mipmin->val;
+}
 
+void SetupFrame(RenderData *renderdata, Camera *camera, float target_dt)
+{
     renderdata->framecount++;
 
     renderdata->oldViewLeaf = renderdata->currentViewLeaf;
@@ -2120,7 +2945,9 @@ void SetupFrame(RenderData *renderdata, Camera *camera, float target_dt)
 
     UpdateVisibleLeaves(renderdata);
 
-    AnimateLights(&g_lightsystem, renderdata->framecount);
+    AnimateLights(&g_lightsystem, renderdata->worldModel, renderdata->framecount);
+
+    renderdata->time += target_dt;
 }
 
 /* 
@@ -2181,15 +3008,74 @@ void GammaCorrect(U8 *gamma_table, U8 *new_palette, U8 *old_palette)
 RenderBuffer g_renderbuffer;
 RenderData g_renderdata;
 
+// The spans of the last frame are still valid if the camera and everything
+// that decides the spans or the texels of them stays the same. Cvars that 
+// change the texels clear coherent_valid when they change.
+B32 IsFrameCoherent(RenderData *renderdata, Camera *camera)
+{
+    B32 result = renderdata->cvar_coherence->val
+        && renderdata->coherent_valid
+        && renderdata->coherent_world == renderdata->worldModel
+        && renderdata->coherent_position == camera->position
+        && renderdata->coherent_angles == camera->angles
+        && !g_efragsystem.moved
+        && !g_particlesystem.count;
+    return result;
+}
+
+void RecordFrameCoherence(RenderData *renderdata, Camera *camera)
+{
+    // spans that got flushed are gone, can't redraw from the span list. Alias
+    // models, sprites and particles aren't in it at all.
+    renderdata->coherent_valid = !renderdata->spans_flushed && !renderdata->in_water
+                              && !renderdata->models_drawn;
+    renderdata->coherent_world = renderdata->worldModel;
+    renderdata->coherent_position = camera->position;
+    renderdata->coherent_angles = camera->angles;
+    g_efragsystem.moved = false;
+}
+
 void RenderView(float dt)
 {
+    // transient data of the last frame is gone
+    ArenaReset(&g_frame_arena);
+
+    B32 was_in_water = g_renderdata.in_water;
+
     SetupFrame(&g_renderdata, &g_camera, dt);
+    SurfaceCacheBeginFrame(g_renderdata.framecount);
     SkySetupFrame(&g_skycanvas);
 
     PushLights(&g_lightsystem, dt, g_renderdata.worldModel->nodes,
                g_renderdata.framecount, g_renderdata.worldModel->surfaces);
 
-    EdgeDrawing(&g_renderdata, &g_camera, &g_renderbuffer, &g_skycanvas);
+    B32 coherent = IsFrameCoherent(&g_renderdata, &g_camera);
+    DirtyTilesBeginFrame(&g_renderdata.dirty_tiles, g_renderbuffer.width, 
+                         g_renderbuffer.height, coherent);
+
+    if (coherent)
+    {
+        // static camera, no need to walk the BSP and scan edges again
+        U8 *sbuffer = g_renderbuffer.backbuffer 
+                    + g_camera.screen_rect.y * g_renderbuffer.bytes_per_row 
+                    + g_camera.screen_rect.x;
+        float *zbuffer = g_renderbuffer.zbuffer 
+                       + g_camera.screen_rect.y * g_renderbuffer.width 
+                       + g_camera.screen_rect.x;
+
+        SkyAnimate(&g_skycanvas);
+
+        DrawSurfaces(g_renderdata.isurfaces, g_renderdata.currentISurface, sbuffer, 
+                     g_renderbuffer.bytes_per_row, zbuffer, g_renderbuffer.width, 
+                     g_renderbuffer.colormap, &g_renderdata, &g_skycanvas, &g_camera, true);
+
+        g_renderdata.coherentFrameCount++;
+    }
+    else
+    {
+        EdgeDrawing(&g_renderdata, &g_camera, &g_renderbuffer, &g_skycanvas, &g_frame_arena);
+        RecordFrameCoherence(&g_renderdata, &g_camera);
+    }
 
     U8 *pbuffer = g_renderbuffer.backbuffer 
                 + g_camera.screen_rect.y * g_renderbuffer.bytes_per_row 
@@ -2198,15 +3084,47 @@ void RenderView(float dt)
     if (g_renderdata.in_water)
     {
         WarpScreen(pbuffer, g_renderbuffer.bytes_per_row, g_renderbuffer.width, 
-                   g_renderbuffer.height, g_renderdata.sine_table, g_renderdata.framecount);
+                   g_renderbuffer.height, g_renderdata.sine_table, g_renderdata.framecount,
+                   &g_frame_arena);
+    }
+
+    // every pixel moves while warping, and once more when it stops
+    if (g_renderdata.in_water || was_in_water)
+    {
+        g_renderdata.dirty_tiles.all_dirty = true;
     }
 }
 
+// regions of the backbuffer that changed in the last RenderView
+I32 RenderGetDirtyRects(GameDirtyRect *rects, I32 max_rect_count)
+{
+    I32 result = DirtyTilesBuildRects(&g_renderdata.dirty_tiles, rects, max_rect_count);
+    return result;
+}
+
+CVAR_CHANGED_CALLBACK(RenderDrawFlatChanged)
+{
+    g_renderdata.coherent_valid = false;
+}
+
+CVAR_CHANGED_CALLBACK(RenderMipCvarChanged)
+{
+    RenderUpdateMipScale(&g_renderdata);
+    g_renderdata.coherent_valid = false;
+}
+
 void RenderInit()
 {
-    CvarSet("drawflat", 0);
-    CvarSet("mipscale", 1);
-    CvarSet("mipmin", 0);
+    g_renderdata.cvar_drawflat = CvarRegister("drawflat", 0, RenderDrawFlatChanged);
+    g_renderdata.cvar_mipscale = CvarRegister("mipscale", 1, RenderMipCvarChanged);
+    g_renderdata.cvar_mipmin = CvarRegister("mipmin", 0, RenderMipCvarChanged);
+    g_renderdata.cvar_coherence = CvarRegister("coherence", 1);
+    RenderUpdateMipScale(&g_renderdata);
+
+    CvarRegister("surfcache_autosize", 1);
+    // fraction of lookups missing because of eviction before the cache grows
+    CvarRegister("surfcache_missrate", 0.02f);
+    CvarRegister("surfcache_stats", 0);
 
     BuildSineTable(g_renderdata.sine_table, SINE_TABLE_SIZE, SINE_SAMPLE_SIZE, 
                    1.0f, 0x10000);
@@ -84,6 +84,53 @@ struct Camera
     U32 dirty;
 };
 
+// something in the world that isn't the world itself
+struct Entity
+{
+    Vec3f origin;
+    Vec3f angles;
+    Model *model; // NULL if there's nothing to draw
+    I32 frame;
+    I32 skin_num;
+    // an alias model blends from old_frame into frame, see EntitySetFrame
+    I32 old_frame;
+    float frame_time;
+
+    // leaves the entity is in, see EntityLink
+    EFrag *efrags;
+    // the first node that splits the bounds of the entity, it only needs to
+    // be clipped against the world below it. NULL if it's all in one leaf.
+    Node *topnode;
+    B32 linked;
+    // where the efrags were made, they are still right as long as the bounds 
+    // relative to the origin stay the same and the origin moves less than 
+    // link_slack from there
+    Vec3f link_origin;
+    Vec3f link_mins;
+    Vec3f link_maxs;
+    float link_slack;
+
+    // last frame one of its leaves was visible
+    I32 visframe;
+};
+
+#define MAX_EFRAGS 2048
+
+struct EFragSystem
+{
+    EFrag efrags[MAX_EFRAGS];
+    EFrag *free_efrags;
+    // efrags past this one have never been used
+    I32 high_mark;
+    // set when an entity moved, the spans of the last frame are out of date
+    B32 moved;
+    // how many links were needed and how many could be skipped
+    I32 link_count;
+    I32 skip_count;
+};
+
+#define MAX_VISIBLE_ENTITIES 1024
+
 struct ESpan
 {
     ESpan *next;
@@ -117,6 +164,8 @@ struct ISurface
     
     void *data;
     Entity *entity;
+    // surface cache the spans were last drawn with, see DrawSurfaces
+    SurfaceCache *cache;
 
     // We are using span-base drawing, no need to walk bsp tree from back to
     // front. It's actually being walked from front to back, and therefore 
@@ -135,6 +184,33 @@ struct ISurface
 #define MAX_PIXEL_HEIGHT 1024
 #define MIP_NUM 4
 
+#define NUM_STACK_EDGE 2400
+#define NUM_STACK_SURFACE 800
+#define MAX_SPAN_NUM 5120
+
+// transient data of one frame, see g_frame_arena
+#define FRAME_ARENA_SIZE (1024 * 1024)
+
+// Screen is split into tiles to find out what changed since last frame.
+// Every span adds its signature (surface cache, texture mapping and geometry)
+// to the tiles it covers. A tile is dirty if the sum differs from last frame.
+#define DIRTY_TILE_SIZE 16
+#define DIRTY_TILE_SHIFT 4
+#define MAX_DIRTY_TILE_NUM ((MAX_PIXEL_HEIGHT / DIRTY_TILE_SIZE) * (MAX_PIXEL_HEIGHT / DIRTY_TILE_SIZE))
+
+struct DirtyTiles
+{
+    I32 width, height; // in pixels
+    I32 tile_count_x, tile_count_y;
+    // signatures[current] is being built, the other one is from last frame
+    U32 signatures[2][MAX_DIRTY_TILE_NUM];
+    I32 current;
+    // tiles with animated content or rebuilt surface caches
+    U8 forced[MAX_DIRTY_TILE_NUM];
+    // the whole screen changed, e.g. warped
+    B32 all_dirty;
+};
+
 #define SINE_SAMPLE_SIZE 128
 #define SINE_TABLE_SIZE (1280 + SINE_SAMPLE_SIZE)
 
@@ -152,12 +228,23 @@ struct RenderData
     ISurface *currentISurface;
     ISurface *endISurface;
 
+    // Unlike iedges, isurfaces and spans outlive the frame, a static camera
+    // can redraw the spans of the last frame without walking the BSP again.
+    ISurface *isurfaceStorage;
+    ESpan *spanStorage;
+
     Leaf *oldViewLeaf;
     Leaf *currentViewLeaf;
 
     Model *worldModel;
 
+    // entities in the visible leaves, collected while walking the BSP
+    Entity *visible_entities[MAX_VISIBLE_ENTITIES];
+    I32 visible_entity_count;
+
     B32 in_water;
+    // set when alias models or sprites were drawn, they are not in the spans
+    B32 models_drawn;
 
     float nearest_invz; // for surface
 
@@ -165,12 +252,32 @@ struct RenderData
 
     I32 framecount;
     I32 updateCountPVS;
+    // seconds since start, animates the frame and skin groups of alias models
+    float time;
 
     I32 outOfIEdges;
     I32 surfaceCount;
 
+    // frame-to-frame coherence
+    // set when isurfaces and spans describe everything in the backbuffer
+    B32 coherent_valid;
+    // span list was flushed while scanning, some spans are lost
+    B32 spans_flushed;
+    Model *coherent_world;
+    Vec3f coherent_position;
+    Vec3f coherent_angles;
+    I32 coherentFrameCount;
+
+    DirtyTiles dirty_tiles;
+
+    // derived from mipscale and mipmin when they change
     float scaled_mip[MIP_NUM - 1];
     I32 mip_min;
 
+    Cvar *cvar_drawflat;
+    Cvar *cvar_mipscale;
+    Cvar *cvar_mipmin;
+    Cvar *cvar_coherence;
+
     I32 sine_table[SINE_TABLE_SIZE];
 };
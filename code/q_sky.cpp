@@ -31,7 +31,7 @@ SkyCanvas g_skycanvas;
 void SkyInit(SkyCanvas *sky, Texture *texture)
 {
     U8 *newsky = sky->new_sky + SKY_SIZE;
-    U8 *tex_src = (U8 *)texture + texture->offsets[0] + SKY_SIZE;
+    U8 *tex_src = TextureGetMip(texture, 0) + SKY_SIZE;
 
     for (I32 y = 0; y < SKY_SIZE; ++y)
     {
@@ -46,7 +46,7 @@ void SkyInit(SkyCanvas *sky, Texture *texture)
     }
 
     newsky = sky->new_sky;
-    tex_src = (U8 *)texture + texture->offsets[0];
+    tex_src = TextureGetMip(texture, 0);
 
     for (I32 y = 0; y < SKY_SIZE; ++y)
     {
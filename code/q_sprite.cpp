@@ -0,0 +1,406 @@
+/*
+ Sprites, explosions, bubbles and the like, are drawn after the alias models,
+ a few hundred of them at times. They are collected into a batch first and
+ sorted by the mip they are drawn with, sprites showing the same image are
+ drawn one after the other while its texels are still in the cache. Sprites
+ are not lit, texels of SPRITE_TRANSPARENT_COLOR are skipped. Pixels are
+ tested against the z-buffer and written into it like the alias models.
+
+ Sprites facing the view plane are screen-aligned rectangles at one depth,
+ their texels are stepped without a divide. The others are drawn with a
+ divide per pixel.
+*/
+
+#define MAX_SPRITE_BATCH MAX_VISIBLE_ENTITIES
+// closer than this sprites are clipped
+#define SPRITE_NEAR_Z 1.0f
+// a quad and one more vertex from the near plane
+#define SPRITE_CLIP_VERTS 5
+// upright sprites are skipped when looked at from right above or below
+#define SPRITE_UPRIGHT_LIMIT 0.999848f
+
+struct SpriteDrawItem
+{
+    Entity *entity;
+    SpriteImage *image;
+    U8 *pixels; // of the mip, the batch is sorted on it
+    I32 mip;
+    // in view space, right and up are unit vectors
+    Vec3f origin;
+    Vec3f right;
+    Vec3f up;
+    // right and up are the axes of the screen
+    B32 screen_aligned;
+
+    // pixels the sprite covers, inclusive, empty if max_x < min_x
+    I32 min_x, min_y;
+    I32 max_x, max_y;
+};
+
+struct SpriteBatch
+{
+    SpriteDrawItem items[MAX_SPRITE_BATCH];
+    I32 count;
+};
+
+struct SpriteDraw
+{
+    U8 *pbuffer;
+    I32 bytes_per_row;
+    float *zbuffer;
+    I32 zbuffer_width;
+    Recti rect; // pixels outside are not touched
+};
+
+SpriteImage *SpriteGetImage(SpriteHeader *header, I32 frame, float time)
+{
+    AliasGroup *frames = (AliasGroup *)SpriteData(header, header->frames);
+    float *intervals = (float *)SpriteData(header, header->intervals);
+    frame = Clamp(0, header->num_frame - 1, frame);
+    I32 image = AliasGroupSelect(frames + frame, intervals, time);
+    SpriteImage *result = (SpriteImage *)SpriteData(header, header->images) + image;
+    return result;
+}
+
+// right and up of the sprite in world space, false if it's seen edge on
+B32 SpriteOrient(SpriteType type, Entity *entity, Camera *camera, Vec3f *right, Vec3f *up)
+{
+    switch (type)
+    {
+        case SpriteType::VP_PARALLEL_UPRIGHT:
+        {
+            // the camera's forward in the ground plane
+            Vec3f forward = camera->roty;
+            if (forward.z > SPRITE_UPRIGHT_LIMIT || forward.z < -SPRITE_UPRIGHT_LIMIT)
+            {
+                return false;
+            }
+            *up = {0, 0, 1};
+            *right = Vec3Normalize({forward.y, -forward.x, 0});
+        } break;
+
+        case SpriteType::FACING_UPRIGHT:
+        {
+            Vec3f to_sprite = Vec3Normalize(entity->origin - camera->position);
+            if (to_sprite.z > SPRITE_UPRIGHT_LIMIT || to_sprite.z < -SPRITE_UPRIGHT_LIMIT)
+            {
+                return false;
+            }
+            *up = {0, 0, 1};
+            *right = Vec3Normalize({to_sprite.y, -to_sprite.x, 0});
+        } break;
+
+        case SpriteType::VP_PARALLEL:
+        {
+            *right = camera->rotx;
+            *up = camera->rotz;
+        } break;
+
+        case SpriteType::ORIENTED:
+        {
+            Vec3f forward;
+            AngleVectors(entity->angles, right, &forward, up);
+        } break;
+
+        case SpriteType::VP_PARALLEL_ORIENTED:
+        {
+            // AngleVectors leaves angles.y alone, it's the roll here
+            float radian = DegreeToRadian(entity->angles.y);
+            float sine = Sine(radian);
+            float cosine = Cosine(radian);
+            *right = camera->rotx * cosine + camera->rotz * sine;
+            *up = camera->rotz * cosine - camera->rotx * sine;
+        } break;
+    }
+    return true;
+}
+
+// stable, in the order of the pixels, temp holds as many items as the batch
+void SpriteBatchSort(SpriteBatch *batch, SpriteDrawItem *temp)
+{
+    SpriteDrawItem *src = batch->items;
+    SpriteDrawItem *dest = temp;
+    I32 count = batch->count;
+    for (I32 width = 1; width < count; width *= 2)
+    {
+        for (I32 start = 0; start < count; start += 2 * width)
+        {
+            I32 middle = start + width < count ? start + width : count;
+            I32 end = start + 2 * width < count ? start + 2 * width : count;
+            I32 left = start;
+            I32 right = middle;
+            for (I32 i = start; i < end; ++i)
+            {
+                if (left < middle && (right >= end || src[left].pixels <= src[right].pixels))
+                {
+                    dest[i] = src[left++];
+                }
+                else
+                {
+                    dest[i] = src[right++];
+                }
+            }
+        }
+        SpriteDrawItem *swap = src;
+        src = dest;
+        dest = swap;
+    }
+
+    if (src != batch->items)
+    {
+        MemCpy(batch->items, src, count * (I32)sizeof(SpriteDrawItem));
+    }
+}
+
+inline void SpriteGrowBounds(SpriteDrawItem *item, I32 x_start, I32 x_end, I32 y)
+{
+    item->min_x = x_start < item->min_x ? x_start : item->min_x;
+    item->max_x = x_end > item->max_x ? x_end : item->max_x;
+    item->min_y = y < item->min_y ? y : item->min_y;
+    item->max_y = y > item->max_y ? y : item->max_y;
+}
+
+void SpriteDrawScreenAligned(SpriteDraw *draw, SpriteDrawItem *item, Camera *camera)
+{
+    SpriteImage *image = item->image;
+    Vec3f origin = item->origin;
+    if (origin.z < SPRITE_NEAR_Z)
+    {
+        return ;
+    }
+
+    float invz = 1.0f / origin.z;
+    float scale = camera->scale_z * invz;
+    float x_left = camera->screen_center.x + (origin.x + image->left) * scale;
+    float x_right = camera->screen_center.x + (origin.x + image->right) * scale;
+    float y_top = camera->screen_center.y - (origin.y + image->up) * scale;
+    float y_bottom = camera->screen_center.y - (origin.y + image->down) * scale;
+
+    Recti rect = draw->rect;
+    I32 x_start = (I32)ceilf(x_left);
+    I32 x_end = (I32)ceilf(x_right) - 1;
+    I32 y_start = (I32)ceilf(y_top);
+    I32 y_end = (I32)ceilf(y_bottom) - 1;
+    x_start = x_start < rect.x ? rect.x : x_start;
+    y_start = y_start < rect.y ? rect.y : y_start;
+    x_end = x_end > rect.x + rect.width - 1 ? rect.x + rect.width - 1 : x_end;
+    y_end = y_end > rect.y + rect.height - 1 ? rect.y + rect.height - 1 : y_end;
+    if (x_start > x_end || y_start > y_end)
+    {
+        return ;
+    }
+    SpriteGrowBounds(item, x_start, x_end, y_start);
+    SpriteGrowBounds(item, x_start, x_end, y_end);
+
+    I32 mip_width = (image->width >> item->mip) ? (image->width >> item->mip) : 1;
+    I32 mip_height = (image->height >> item->mip) ? (image->height >> item->mip) : 1;
+    // texels of the mip per pixel
+    float texel_step = 1.0f / (scale * (float)(1 << item->mip));
+    Fixed16 s_step = (Fixed16)(texel_step * 65536.0f);
+    Fixed16 t_step = s_step;
+    Fixed16 s_start = (Fixed16)(((float)x_start - x_left) * texel_step * 65536.0f);
+    Fixed16 t = (Fixed16)(((float)y_start - y_top) * texel_step * 65536.0f);
+    Fixed16 s_max = (mip_width << 16) - 1;
+    Fixed16 t_max = (mip_height << 16) - 1;
+
+    for (I32 y = y_start; y <= y_end; ++y, t += t_step)
+    {
+        U8 *row = item->pixels + (Clamp(0, t_max, t) >> 16) * mip_width;
+        U8 *pixel = draw->pbuffer + y * draw->bytes_per_row + x_start;
+        float *zpixel = draw->zbuffer + y * draw->zbuffer_width + x_start;
+        Fixed16 s = s_start;
+        for (I32 x = x_start; x <= x_end; ++x, s += s_step, ++pixel, ++zpixel)
+        {
+            U8 color = row[Clamp(0, s_max, s) >> 16];
+            if (color != SPRITE_TRANSPARENT_COLOR && invz >= *zpixel)
+            {
+                *zpixel = invz;
+                *pixel = color;
+            }
+        }
+    }
+}
+
+// a value that is affine on the screen, at x, y it's x * dx + y * dy + c
+struct SpriteGradient
+{
+    float dx;
+    float dy;
+    float c;
+};
+
+// v dot the view space direction through a pixel at z = 1
+inline SpriteGradient SpriteGradientForVector(Vec3f v, Camera *camera)
+{
+    SpriteGradient result;
+    result.dx = v.x * camera->scale_invz;
+    result.dy = -v.y * camera->scale_invz;
+    result.c = v.z - result.dx * camera->screen_center.x - result.dy * camera->screen_center.y;
+    return result;
+}
+
+inline SpriteGradient SpriteGradientAdd(SpriteGradient a, SpriteGradient b, float scale)
+{
+    SpriteGradient result = {a.dx + b.dx * scale, a.dy + b.dy * scale, a.c + b.c * scale};
+    return result;
+}
+
+/*
+ A point P on the sprite is at top_left + right * s - up * t, texels from the
+ top left corner. Through a pixel whose direction is d, 1/z, s/z and t/z are
+ affine on the screen:
+   1/z = (n.d) / (n.top_left), n the normal of the sprite
+   s/z = right.d - (right.top_left) / z
+   t/z = (up.top_left) / z - up.d
+*/
+void SpriteDrawPerspective(SpriteDraw *draw, SpriteDrawItem *item, Camera *camera)
+{
+    SpriteImage *image = item->image;
+    Vec3f right = item->right;
+    Vec3f up = item->up;
+
+    Vec3f corners[4];
+    corners[0] = item->origin + right * image->left + up * image->up;
+    corners[1] = item->origin + right * image->right + up * image->up;
+    corners[2] = item->origin + right * image->right + up * image->down;
+    corners[3] = item->origin + right * image->left + up * image->down;
+
+    Vec3f normal = Vec3Cross(right, up);
+    float distance = Vec3Dot(normal, corners[0]);
+    if (Absf(distance) < 0.001f)
+    {
+        return ;
+    }
+
+    // the part in front of the near plane
+    Vec2f verts[SPRITE_CLIP_VERTS];
+    I32 count = 0;
+    for (I32 i = 0; i < 4; ++i)
+    {
+        Vec3f v0 = corners[i];
+        Vec3f v1 = corners[(i + 1) & 3];
+        B32 in0 = v0.z >= SPRITE_NEAR_Z;
+        B32 in1 = v1.z >= SPRITE_NEAR_Z;
+        Vec3f clipped[2];
+        I32 clipped_count = 0;
+        if (in0)
+        {
+            clipped[clipped_count++] = v0;
+        }
+        if (in0 != in1)
+        {
+            float frac = (SPRITE_NEAR_Z - v0.z) / (v1.z - v0.z);
+            clipped[clipped_count] = v0 + (v1 - v0) * frac;
+            clipped[clipped_count++].z = SPRITE_NEAR_Z;
+        }
+        for (I32 j = 0; j < clipped_count; ++j)
+        {
+            float scale = camera->scale_z / clipped[j].z;
+            verts[count].x = camera->screen_center.x + clipped[j].x * scale;
+            verts[count].y = camera->screen_center.y - clipped[j].y * scale;
+            ++count;
+        }
+    }
+    if (count < 3)
+    {
+        return ;
+    }
+
+    float y_min = verts[0].y;
+    float y_max = verts[0].y;
+    for (I32 i = 1; i < count; ++i)
+    {
+        y_min = verts[i].y < y_min ? verts[i].y : y_min;
+        y_max = verts[i].y > y_max ? verts[i].y : y_max;
+    }
+
+    Recti rect = draw->rect;
+    I32 y_start = (I32)ceilf(y_min);
+    I32 y_end = (I32)ceilf(y_max) - 1;
+    y_start = y_start < rect.y ? rect.y : y_start;
+    y_end = y_end > rect.y + rect.height - 1 ? rect.y + rect.height - 1 : y_end;
+
+    float mip_scale = 1.0f / (float)(1 << item->mip);
+    SpriteGradient invz = SpriteGradientForVector(normal * (1.0f / distance), camera);
+    SpriteGradient sdivz = SpriteGradientAdd(SpriteGradientForVector(right * mip_scale, camera),
+                                             invz, -Vec3Dot(right, corners[0]) * mip_scale);
+    SpriteGradient tdivz = SpriteGradientAdd(SpriteGradientForVector(up * -mip_scale, camera),
+                                             invz, Vec3Dot(up, corners[0]) * mip_scale);
+
+    I32 mip_width = (image->width >> item->mip) ? (image->width >> item->mip) : 1;
+    I32 mip_height = (image->height >> item->mip) ? (image->height >> item->mip) : 1;
+    float s_max = (float)mip_width - 0.001f;
+    float t_max = (float)mip_height - 0.001f;
+
+    for (I32 y = y_start; y <= y_end; ++y)
+    {
+        // the polygon is convex, the edges crossing the scanline bound it
+        float fy = (float)y;
+        float x_left = 1e30f;
+        float x_right = -1e30f;
+        for (I32 i = 0; i < count; ++i)
+        {
+            Vec2f a = verts[i];
+            Vec2f b = verts[(i + 1) % count];
+            if ((a.y <= fy && fy < b.y) || (b.y <= fy && fy < a.y))
+            {
+                float x = a.x + (fy - a.y) * (b.x - a.x) / (b.y - a.y);
+                x_left = x < x_left ? x : x_left;
+                x_right = x > x_right ? x : x_right;
+            }
+        }
+
+        I32 x_start = (I32)ceilf(x_left);
+        I32 x_end = (I32)ceilf(x_right) - 1;
+        x_start = x_start < rect.x ? rect.x : x_start;
+        x_end = x_end > rect.x + rect.width - 1 ? rect.x + rect.width - 1 : x_end;
+        if (x_start > x_end)
+        {
+            continue ;
+        }
+        SpriteGrowBounds(item, x_start, x_end, y);
+
+        float fx = (float)x_start;
+        float zi = invz.dx * fx + invz.dy * fy + invz.c;
+        float sz = sdivz.dx * fx + sdivz.dy * fy + sdivz.c;
+        float tz = tdivz.dx * fx + tdivz.dy * fy + tdivz.c;
+        U8 *pixel = draw->pbuffer + y * draw->bytes_per_row + x_start;
+        float *zpixel = draw->zbuffer + y * draw->zbuffer_width + x_start;
+        for (I32 x = x_start; x <= x_end; ++x, ++pixel, ++zpixel)
+        {
+            if (zi >= *zpixel)
+            {
+                float z = 1.0f / zi;
+                I32 s = (I32)Clamp(0.0f, s_max, sz * z);
+                I32 t = (I32)Clamp(0.0f, t_max, tz * z);
+                U8 color = item->pixels[t * mip_width + s];
+                if (color != SPRITE_TRANSPARENT_COLOR)
+                {
+                    *zpixel = zi;
+                    *pixel = color;
+                }
+            }
+            zi += invz.dx;
+            sz += sdivz.dx;
+            tz += tdivz.dx;
+        }
+    }
+}
+
+void SpriteDrawBatch(SpriteDraw *draw, SpriteBatch *batch, Camera *camera)
+{
+    for (I32 i = 0; i < batch->count; ++i)
+    {
+        SpriteDrawItem *item = batch->items + i;
+        item->min_x = item->min_y = 0x7fffffff;
+        item->max_x = item->max_y = -0x7fffffff;
+        if (item->screen_aligned)
+        {
+            SpriteDrawScreenAligned(draw, item, camera);
+        }
+        else
+        {
+            SpriteDrawPerspective(draw, item, camera);
+        }
+    }
+}
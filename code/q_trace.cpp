@@ -0,0 +1,774 @@
+#include <emmintrin.h> // SSE2, every x64 cpu has it
+
+#include "q_trace.h"
+
+// keep a little away from the planes so a trace that stopped on one doesn't
+// start in solid next time
+#define TRACE_DIST_EPSILON 0.03125f
+
+//======================================
+// Single traces through a hull
+//======================================
+
+I32 HullPointContents(Hull *hull, I32 num, const Vec3f &point)
+{
+    while (num >= 0)
+    {
+        if (num < hull->firstClipNode || num > hull->lastClipNode)
+        {
+            g_platformAPI.SysError("HullPointContents: bad node number %d", num);
+        }
+
+        ClipNode *node = hull->clipNodes + num;
+        Plane *plane = hull->planes + node->planeOffset;
+
+        float d;
+        if (plane->type < 3)
+        {
+            d = ((float *)&point)[plane->type] - plane->distance;
+        }
+        else
+        {
+            d = Vec3Dot(plane->normal, point) - plane->distance;
+        }
+
+        num = node->children[d < 0];
+    }
+
+    return num;
+}
+
+void TraceInit(Trace *trace, const Vec3f &end)
+{
+    *trace = {};
+    trace->fraction = 1;
+    trace->all_solid = true;
+    trace->end = end;
+    trace->contents = CONTENTS_SOLID;
+}
+
+// the move reached a leaf
+void TraceEnterLeaf(Trace *trace, I32 contents)
+{
+    if (contents == CONTENTS_SOLID)
+    {
+        trace->start_solid = true;
+        return;
+    }
+
+    trace->all_solid = false;
+    trace->contents = contents;
+    if (contents == CONTENTS_EMPTY)
+    {
+        trace->in_open = true;
+    }
+    else
+    {
+        trace->in_water = true;
+    }
+}
+
+/*
+ Splits the move at every node it crosses and goes down the near side first.
+ When the near side is done and the far side of a split is solid, the split
+ point is the impact. p1f and p2f are the fractions of the whole move at p1
+ and p2. Returns false once something has been hit.
+*/
+B32 HullTraceRecursive(Hull *hull, I32 num, float p1f, float p2f,
+                       Vec3f p1, Vec3f p2, Trace *trace)
+{
+    if (num < 0)
+    {
+        TraceEnterLeaf(trace, num);
+        return true;
+    }
+
+    if (num < hull->firstClipNode || num > hull->lastClipNode)
+    {
+        g_platformAPI.SysError("HullTraceRecursive: bad node number %d", num);
+    }
+
+    ClipNode *node = hull->clipNodes + num;
+    Plane *plane = hull->planes + node->planeOffset;
+
+    float t1, t2;
+    if (plane->type < 3)
+    {
+        t1 = p1[plane->type] - plane->distance;
+        t2 = p2[plane->type] - plane->distance;
+    }
+    else
+    {
+        t1 = Vec3Dot(plane->normal, p1) - plane->distance;
+        t2 = Vec3Dot(plane->normal, p2) - plane->distance;
+    }
+
+    if (t1 >= 0 && t2 >= 0)
+    {
+        return HullTraceRecursive(hull, node->children[0], p1f, p2f, p1, p2, trace);
+    }
+    if (t1 < 0 && t2 < 0)
+    {
+        return HullTraceRecursive(hull, node->children[1], p1f, p2f, p1, p2, trace);
+    }
+
+    // put the crosspoint TRACE_DIST_EPSILON pixels on the near side
+    float frac = t1 < 0 ? (t1 + TRACE_DIST_EPSILON) / (t1 - t2)
+                        : (t1 - TRACE_DIST_EPSILON) / (t1 - t2);
+    frac = Clamp(0.0f, 1.0f, frac);
+
+    float midf = p1f + (p2f - p1f) * frac;
+    Vec3f mid = p1 + frac * (p2 - p1);
+
+    I32 side = t1 < 0;
+
+    if (!HullTraceRecursive(hull, node->children[side], p1f, midf, p1, mid, trace))
+    {
+        return false;
+    }
+
+    if (HullPointContents(hull, node->children[side ^ 1], mid) != CONTENTS_SOLID)
+    {
+        return HullTraceRecursive(hull, node->children[side ^ 1], midf, p2f, mid, p2, trace);
+    }
+
+    if (trace->all_solid)
+    {
+        // never got out of the solid area
+        return false;
+    }
+
+    if (!side)
+    {
+        trace->plane.normal = plane->normal;
+        trace->plane.distance = plane->distance;
+    }
+    else
+    {
+        trace->plane.normal = -1.0f * plane->normal;
+        trace->plane.distance = -plane->distance;
+    }
+    trace->plane.type = plane->type;
+
+    // the epsilon can push the crosspoint into another solid leaf, back up
+    // until it's out
+    while (HullPointContents(hull, hull->firstClipNode, mid) == CONTENTS_SOLID)
+    {
+        frac -= 0.1f;
+        if (frac < 0)
+        {
+            break;
+        }
+        midf = p1f + (p2f - p1f) * frac;
+        mid = p1 + frac * (p2 - p1);
+    }
+
+    trace->fraction = midf;
+    trace->end = mid;
+    return false;
+}
+
+B32 HullTrace(Hull *hull, const Vec3f &start, const Vec3f &end, Trace *trace)
+{
+    TraceInit(trace, end);
+    B32 result = HullTraceRecursive(hull, hull->firstClipNode, 0, 1, start, end, trace);
+    return result;
+}
+
+Hull *ModelHullForBox(Model *model, const Vec3f &mins, const Vec3f &maxs, Vec3f *offset)
+{
+    // the clip hulls are the brushes expanded by the player and the shambler
+    // sizes, any box is moved through the one that fits it best
+    float size = maxs.x - mins.x;
+    Hull *hull;
+    if (size < 3)
+    {
+        hull = &model->hulls[0];
+    }
+    else if (size <= 32)
+    {
+        hull = &model->hulls[1];
+    }
+    else
+    {
+        hull = &model->hulls[2];
+    }
+
+    *offset = hull->clipMin - mins;
+    return hull;
+}
+
+Trace TraceBox(Model *model, const Vec3f &start, const Vec3f &mins,
+               const Vec3f &maxs, const Vec3f &end)
+{
+    Vec3f offset;
+    Hull *hull = ModelHullForBox(model, mins, maxs, &offset);
+
+    Trace trace;
+    HullTrace(hull, start + offset, end + offset, &trace);
+    trace.end -= offset;
+    return trace;
+}
+
+//======================================
+// Batched traces
+//======================================
+
+/*
+ A batch traces many rays through the same hull, so the hull is repacked once
+ into nodes that carry their plane. The nodes of the top of the tree, which
+ every ray goes through, then stay in the cache for the whole batch.
+*/
+
+void TraceHullBuild(TraceHull *dest, Hull *hull, MemoryArena *arena)
+{
+    // node numbers stay the same, the nodes before the first one of the hull
+    // are left alone
+    I32 count = hull->lastClipNode + 1;
+    TraceNode *nodes = (TraceNode *)ArenaPush(arena, count * sizeof(TraceNode), 32);
+
+    for (I32 i = hull->firstClipNode; i < count; ++i)
+    {
+        ClipNode *clipNode = hull->clipNodes + i;
+        Plane *plane = hull->planes + clipNode->planeOffset;
+        TraceNode *node = nodes + i;
+        node->normal = plane->normal;
+        node->distance = plane->distance;
+        node->type = plane->type;
+        node->children[0] = clipNode->children[0];
+        node->children[1] = clipNode->children[1];
+        node->padding = 0;
+    }
+
+    dest->nodes = nodes;
+    dest->firstNode = hull->firstClipNode;
+    dest->clipMin = hull->clipMin;
+    dest->clipMax = hull->clipMax;
+}
+
+I32 TracePointContents(TraceNode *nodes, I32 num, const Vec3f &point)
+{
+    while (num >= 0)
+    {
+        TraceNode *node = nodes + num;
+        float d;
+        if (node->type < 3)
+        {
+            d = ((float *)&point)[node->type] - node->distance;
+        }
+        else
+        {
+            d = Vec3Dot(node->normal, point) - node->distance;
+        }
+        num = node->children[d < 0];
+    }
+    return num;
+}
+
+// same as HullTraceRecursive on the repacked nodes
+B32 TraceRecursive(TraceHull *hull, I32 num, float p1f, float p2f,
+                   Vec3f p1, Vec3f p2, Trace *trace)
+{
+    if (num < 0)
+    {
+        TraceEnterLeaf(trace, num);
+        return true;
+    }
+
+    TraceNode *node = hull->nodes + num;
+
+    float t1, t2;
+    if (node->type < 3)
+    {
+        t1 = p1[node->type] - node->distance;
+        t2 = p2[node->type] - node->distance;
+    }
+    else
+    {
+        t1 = Vec3Dot(node->normal, p1) - node->distance;
+        t2 = Vec3Dot(node->normal, p2) - node->distance;
+    }
+
+    if (t1 >= 0 && t2 >= 0)
+    {
+        return TraceRecursive(hull, node->children[0], p1f, p2f, p1, p2, trace);
+    }
+    if (t1 < 0 && t2 < 0)
+    {
+        return TraceRecursive(hull, node->children[1], p1f, p2f, p1, p2, trace);
+    }
+
+    float frac = t1 < 0 ? (t1 + TRACE_DIST_EPSILON) / (t1 - t2)
+                        : (t1 - TRACE_DIST_EPSILON) / (t1 - t2);
+    frac = Clamp(0.0f, 1.0f, frac);
+
+    float midf = p1f + (p2f - p1f) * frac;
+    Vec3f mid = p1 + frac * (p2 - p1);
+
+    I32 side = t1 < 0;
+
+    if (!TraceRecursive(hull, node->children[side], p1f, midf, p1, mid, trace))
+    {
+        return false;
+    }
+
+    if (TracePointContents(hull->nodes, node->children[side ^ 1], mid) != CONTENTS_SOLID)
+    {
+        return TraceRecursive(hull, node->children[side ^ 1], midf, p2f, mid, p2, trace);
+    }
+
+    if (trace->all_solid)
+    {
+        return false;
+    }
+
+    if (!side)
+    {
+        trace->plane.normal = node->normal;
+        trace->plane.distance = node->distance;
+    }
+    else
+    {
+        trace->plane.normal = -1.0f * node->normal;
+        trace->plane.distance = -node->distance;
+    }
+    trace->plane.type = (U8)node->type;
+
+    while (TracePointContents(hull->nodes, hull->firstNode, mid) == CONTENTS_SOLID)
+    {
+        frac -= 0.1f;
+        if (frac < 0)
+        {
+            break;
+        }
+        midf = p1f + (p2f - p1f) * frac;
+        mid = p1 + frac * (p2 - p1);
+    }
+
+    trace->fraction = midf;
+    trace->end = mid;
+    return false;
+}
+
+void TraceRange(TraceHull *hull, TraceRay *rays, Trace *results, I32 count)
+{
+    for (I32 i = 0; i < count; ++i)
+    {
+        TraceInit(results + i, rays[i].end);
+        TraceRecursive(hull, hull->firstNode, 0, 1, rays[i].start, rays[i].end, results + i);
+    }
+}
+
+#define TRACE_BATCH_SIZE 256
+#define TRACE_BATCH_MAX_WORKERS 8
+
+struct TraceBatchJob
+{
+    TraceHull *hull;
+    TraceRay *rays;
+    Trace *results;
+    I32 count;
+    // first ray nobody has taken yet
+    volatile I32 next;
+    // workers that may still touch the job
+    volatile I32 workers;
+};
+
+void TraceBatchRun(TraceBatchJob *job)
+{
+    for (;;)
+    {
+        I32 first = AtomicAdd(&job->next, TRACE_BATCH_SIZE) - TRACE_BATCH_SIZE;
+        if (first >= job->count)
+        {
+            break;
+        }
+
+        I32 count = job->count - first;
+        if (count > TRACE_BATCH_SIZE)
+        {
+            count = TRACE_BATCH_SIZE;
+        }
+        TraceRange(job->hull, job->rays + first, job->results + first, count);
+    }
+}
+
+PLATFORM_WORK_QUEUE_CALLBACK(TraceBatchWork)
+{
+    TraceBatchJob *job = (TraceBatchJob *)data;
+    TraceBatchRun(job);
+    // the job is on the stack of the thread that started it, this is the
+    // last time it's touched
+    AtomicAdd(&job->workers, -1);
+}
+
+void TraceBatch(TraceHull *hull, TraceRay *rays, Trace *results, I32 count)
+{
+    I32 batch_count = (count + TRACE_BATCH_SIZE - 1) / TRACE_BATCH_SIZE;
+    if (!g_work_queue || batch_count < 2)
+    {
+        TraceRange(hull, rays, results, count);
+        return;
+    }
+
+    TraceBatchJob job = {};
+    job.hull = hull;
+    job.rays = rays;
+    job.results = results;
+    job.count = count;
+    job.next = 0;
+
+    // the calling thread takes batches too
+    I32 worker_count = batch_count - 1;
+    if (worker_count > TRACE_BATCH_MAX_WORKERS)
+    {
+        worker_count = TRACE_BATCH_MAX_WORKERS;
+    }
+    job.workers = worker_count;
+    for (I32 i = 0; i < worker_count; ++i)
+    {
+        g_platformAPI.SysAddWork(g_work_queue, TraceBatchWork, &job);
+    }
+
+    TraceBatchRun(&job);
+
+    // may be inside a work callback itself, so help instead of waiting for
+    // the whole queue
+    while (job.workers)
+    {
+        if (!g_platformAPI.SysDoNextWork(g_work_queue))
+        {
+            CpuPause();
+        }
+    }
+}
+
+//======================================
+// Line of sight through the nodes
+//======================================
+
+/*
+ Lines go through the render nodes instead of a clip hull, the leaves are 
+ where the visibility is. A line is start + t * delta for t in [0, 1], each 
+ node splits the t range a line is in on the way down. The fraction of a hit
+ is where the line enters the solid leaf.
+*/
+
+B32 TraceLineRecursive(Node *node, const Vec3f &start, const Vec3f &delta,
+                       float tmin, float tmax, LineHit *hit)
+{
+    if (node->contents < 0)
+    {
+        if (node->contents != CONTENTS_SOLID)
+        {
+            return false;
+        }
+        hit->leaf = (Leaf *)node;
+        hit->fraction = tmin;
+        return true;
+    }
+
+    Plane *plane = node->plane;
+    float d0, dd;
+    if (plane->type < 3)
+    {
+        d0 = ((float *)&start)[plane->type] - plane->distance;
+        dd = ((float *)&delta)[plane->type];
+    }
+    else
+    {
+        d0 = Vec3Dot(plane->normal, start) - plane->distance;
+        dd = Vec3Dot(plane->normal, delta);
+    }
+
+    // same side test as the packets, so both give the same fractions
+    float smin = d0 + tmin * dd;
+    float smax = d0 + tmax * dd;
+    if (smin >= 0 && smax >= 0)
+    {
+        return TraceLineRecursive(node->children[0], start, delta, tmin, tmax, hit);
+    }
+    if (smin < 0 && smax < 0)
+    {
+        return TraceLineRecursive(node->children[1], start, delta, tmin, tmax, hit);
+    }
+
+    float tsplit = -d0 / dd;
+    I32 near_side = smin < 0;
+    if (TraceLineRecursive(node->children[near_side], start, delta, tmin, tsplit, hit))
+    {
+        return true;
+    }
+    return TraceLineRecursive(node->children[near_side ^ 1], start, delta, tsplit, tmax, hit);
+}
+
+Node *TraceLineRoot(Model *model)
+{
+    // submodels share the nodes of the world
+    Node *result = model->nodes + model->hulls[0].firstClipNode;
+    return result;
+}
+
+B32 TraceLine(Model *model, const Vec3f &start, const Vec3f &end, LineHit *hit)
+{
+    hit->leaf = NULL;
+    hit->fraction = 1;
+    B32 blocked = TraceLineRecursive(TraceLineRoot(model), start, end - start, 0, 1, hit);
+    return !blocked;
+}
+
+// four lines in SSE lanes, x, y and z in a register each
+struct LinePacket
+{
+    __m128 start[3];
+    __m128 delta[3];
+    LineHit *hits;
+    // bit per line that has hit something
+    I32 done;
+};
+
+inline __m128 LinePacketSelect(__m128 mask, __m128 a, __m128 b)
+{
+    __m128 result = _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    return result;
+}
+
+/*
+ A line may be all in front of a node, all behind it, or cross it either way.
+ Lines going from front to back are done with the front child before the 
+ back, lines going the other way need the back child first. The node is then
+ gone down three times at most: front for the front-to-back lines, back for
+ everyone crossing, front again for the back-to-front lines. Each line still
+ sees its leaves in order, so its first hit is the nearest.
+*/
+void TraceLinePacketRecursive(LinePacket *packet, Node *node, __m128 tmin, 
+                              __m128 tmax, I32 mask)
+{
+    mask &= ~packet->done;
+    if (!mask)
+    {
+        return;
+    }
+
+    if (node->contents < 0)
+    {
+        if (node->contents == CONTENTS_SOLID)
+        {
+            float t[4];
+            _mm_storeu_ps(t, tmin);
+            for (I32 i = 0; i < 4; ++i)
+            {
+                if (mask & (1 << i))
+                {
+                    packet->hits[i].leaf = (Leaf *)node;
+                    packet->hits[i].fraction = t[i];
+                }
+            }
+            packet->done |= mask;
+        }
+        return;
+    }
+
+    Plane *plane = node->plane;
+    __m128 distance = _mm_set1_ps(plane->distance);
+    __m128 d0, dd;
+    if (plane->type < 3)
+    {
+        d0 = _mm_sub_ps(packet->start[plane->type], distance);
+        dd = packet->delta[plane->type];
+    }
+    else
+    {
+        __m128 nx = _mm_set1_ps(plane->normal.x);
+        __m128 ny = _mm_set1_ps(plane->normal.y);
+        __m128 nz = _mm_set1_ps(plane->normal.z);
+        d0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, packet->start[0]),
+                                   _mm_mul_ps(ny, packet->start[1])),
+                        _mm_mul_ps(nz, packet->start[2]));
+        d0 = _mm_sub_ps(d0, distance);
+        dd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, packet->delta[0]),
+                                   _mm_mul_ps(ny, packet->delta[1])),
+                        _mm_mul_ps(nz, packet->delta[2]));
+    }
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 front_min = _mm_cmpge_ps(_mm_add_ps(d0, _mm_mul_ps(tmin, dd)), zero);
+    __m128 front_max = _mm_cmpge_ps(_mm_add_ps(d0, _mm_mul_ps(tmax, dd)), zero);
+    __m128 front_to_back = _mm_andnot_ps(front_max, front_min);
+    __m128 back_to_front = _mm_andnot_ps(front_min, front_max);
+
+    I32 front_bits = _mm_movemask_ps(_mm_and_ps(front_min, front_max));
+    I32 back_bits = _mm_movemask_ps(_mm_or_ps(front_min, front_max)) ^ 15;
+    I32 front_to_back_bits = _mm_movemask_ps(front_to_back);
+    I32 back_to_front_bits = _mm_movemask_ps(back_to_front);
+
+    if (!((front_to_back_bits | back_to_front_bits) & mask))
+    {
+        // nobody crosses
+        TraceLinePacketRecursive(packet, node->children[0], tmin, tmax, mask & front_bits);
+        TraceLinePacketRecursive(packet, node->children[1], tmin, tmax, mask & back_bits);
+        return;
+    }
+
+    // lanes not crossing get garbage here, they aren't in the masks using it
+    __m128 tsplit = _mm_div_ps(_mm_sub_ps(zero, d0), dd);
+
+    TraceLinePacketRecursive(packet, node->children[0], tmin, 
+                             LinePacketSelect(front_to_back, tsplit, tmax),
+                             mask & (front_bits | front_to_back_bits));
+    TraceLinePacketRecursive(packet, node->children[1], 
+                             LinePacketSelect(front_to_back, tsplit, tmin),
+                             LinePacketSelect(back_to_front, tsplit, tmax),
+                             mask & (back_bits | front_to_back_bits | back_to_front_bits));
+    TraceLinePacketRecursive(packet, node->children[0], tsplit, tmax, 
+                             mask & back_to_front_bits);
+}
+
+void TraceLinePacket(Model *model, TraceRay *rays, LineHit *hits)
+{
+    LinePacket packet;
+    for (I32 i = 0; i < 3; ++i)
+    {
+        packet.start[i] = _mm_setr_ps(rays[0].start[i], rays[1].start[i], 
+                                      rays[2].start[i], rays[3].start[i]);
+        packet.delta[i] = _mm_setr_ps(rays[0].end[i] - rays[0].start[i],
+                                      rays[1].end[i] - rays[1].start[i],
+                                      rays[2].end[i] - rays[2].start[i],
+                                      rays[3].end[i] - rays[3].start[i]);
+    }
+    packet.hits = hits;
+    packet.done = 0;
+
+    for (I32 i = 0; i < 4; ++i)
+    {
+        hits[i].leaf = NULL;
+        hits[i].fraction = 1;
+    }
+
+    TraceLinePacketRecursive(&packet, TraceLineRoot(model), _mm_setzero_ps(), 
+                             _mm_set1_ps(1), 15);
+}
+
+void TraceLineBatch(Model *model, TraceRay *rays, LineHit *hits, I32 count)
+{
+    I32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        TraceLinePacket(model, rays + i, hits + i);
+    }
+    for (; i < count; ++i)
+    {
+        TraceLine(model, rays[i].start, rays[i].end, hits + i);
+    }
+}
+
+//======================================
+// Benchmark
+//======================================
+
+#define TRACE_BENCHMARK_RAYS 4096
+
+U32 TraceBenchmarkRandom(U32 *seed)
+{
+    *seed = *seed * 1664525 + 1013904223;
+    return *seed >> 8;
+}
+
+Vec3f TraceBenchmarkPoint(Model *model, U32 *seed)
+{
+    Vec3f result;
+    for (I32 i = 0; i < 3; ++i)
+    {
+        float t = (TraceBenchmarkRandom(seed) & 0xffff) / 65535.0f;
+        result[i] = model->min[i] + (model->max[i] - model->min[i]) * t;
+    }
+    return result;
+}
+
+// rays between random points of the model through the player hull, one by
+// one and as a batch. Then lines of sight from random points to four points
+// close to each other, one by one and in packets. Prints cycles per trace.
+void TraceBenchmark(Model *model, MemoryArena *arena)
+{
+    ArenaMarker marker = ArenaGetMarker(arena);
+
+    Hull *hull = &model->hulls[1];
+    TraceRay *rays = (TraceRay *)ArenaPush(arena, TRACE_BENCHMARK_RAYS * sizeof(TraceRay));
+    Trace *results = (Trace *)ArenaPush(arena, TRACE_BENCHMARK_RAYS * sizeof(Trace));
+
+    U32 seed = 1;
+    for (I32 i = 0; i < TRACE_BENCHMARK_RAYS; ++i)
+    {
+        rays[i].start = TraceBenchmarkPoint(model, &seed);
+        rays[i].end = TraceBenchmarkPoint(model, &seed);
+    }
+
+    U64 start = ReadCycleCounter();
+    I32 stopped = 0;
+    for (I32 i = 0; i < TRACE_BENCHMARK_RAYS; ++i)
+    {
+        stopped += !HullTrace(hull, rays[i].start, rays[i].end, results + i);
+    }
+    U64 single = ReadCycleCounter() - start;
+
+    start = ReadCycleCounter();
+    TraceHull trace_hull;
+    TraceHullBuild(&trace_hull, hull, arena);
+    U64 build = ReadCycleCounter() - start;
+
+    start = ReadCycleCounter();
+    TraceBatch(&trace_hull, rays, results, TRACE_BENCHMARK_RAYS);
+    U64 batch = ReadCycleCounter() - start;
+
+    g_platformAPI.SysPrint("trace benchmark: %d rays, %d hit, %d clip nodes\n",
+                           TRACE_BENCHMARK_RAYS, stopped, hull->lastClipNode + 1);
+    g_platformAPI.SysPrint("  single %.0f cycles per trace\n",
+                           (double)single / TRACE_BENCHMARK_RAYS);
+    g_platformAPI.SysPrint("  batch  %.0f cycles per trace, %.1f Mcycles to build the hull\n",
+                           (double)batch / TRACE_BENCHMARK_RAYS, build / 1000000.0);
+
+    for (I32 i = 0; i < TRACE_BENCHMARK_RAYS; i += 4)
+    {
+        Vec3f origin = TraceBenchmarkPoint(model, &seed);
+        Vec3f target = TraceBenchmarkPoint(model, &seed);
+        for (I32 j = 0; j < 4; ++j)
+        {
+            Vec3f jitter = {(float)(TraceBenchmarkRandom(&seed) % 128) - 64,
+                            (float)(TraceBenchmarkRandom(&seed) % 128) - 64,
+                            (float)(TraceBenchmarkRandom(&seed) % 128) - 64};
+            rays[i + j].start = origin;
+            rays[i + j].end = target + jitter;
+        }
+    }
+
+    LineHit *hits = (LineHit *)ArenaPush(arena, TRACE_BENCHMARK_RAYS * sizeof(LineHit));
+    LineHit *packet_hits = (LineHit *)ArenaPush(arena, TRACE_BENCHMARK_RAYS * sizeof(LineHit));
+
+    start = ReadCycleCounter();
+    I32 visible = 0;
+    for (I32 i = 0; i < TRACE_BENCHMARK_RAYS; ++i)
+    {
+        visible += TraceLine(model, rays[i].start, rays[i].end, hits + i);
+    }
+    U64 line = ReadCycleCounter() - start;
+
+    start = ReadCycleCounter();
+    TraceLineBatch(model, rays, packet_hits, TRACE_BENCHMARK_RAYS);
+    U64 packet = ReadCycleCounter() - start;
+
+    I32 differ = 0;
+    for (I32 i = 0; i < TRACE_BENCHMARK_RAYS; ++i)
+    {
+        differ += hits[i].leaf != packet_hits[i].leaf 
+            || hits[i].fraction != packet_hits[i].fraction;
+    }
+
+    g_platformAPI.SysPrint("line of sight: %d lines, %d clear, %d differ\n",
+                           TRACE_BENCHMARK_RAYS, visible, differ);
+    g_platformAPI.SysPrint("  scalar %.0f cycles per line\n",
+                           (double)line / TRACE_BENCHMARK_RAYS);
+    g_platformAPI.SysPrint("  packet %.0f cycles per line\n",
+                           (double)packet / TRACE_BENCHMARK_RAYS);
+
+    ArenaPopToMarker(arena, marker);
+}
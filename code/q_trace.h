@@ -0,0 +1,82 @@
+#pragma once
+
+#include "q_model.h"
+
+// result of moving a point through a hull, or a box through the world
+struct Trace
+{
+    B32 all_solid; // the whole move is in solid
+    B32 start_solid; // the start point is in solid
+    B32 in_open; // some of the move is in empty space
+    B32 in_water; // some of the move is in water, slime or lava
+    float fraction; // how far along the move it stopped, 1 if nothing was hit
+    Vec3f end; // where it stopped
+    Plane plane; // surface that was hit, the normal faces the start
+    I32 contents; // contents of the leaf the move ended in
+};
+
+struct TraceRay
+{
+    Vec3f start;
+    Vec3f end;
+};
+
+// clip node with its plane in it, a step down the tree reads one cache line
+// instead of a clip node and a plane somewhere else
+struct TraceNode
+{
+    Vec3f normal;
+    float distance;
+    I32 type;
+    I32 children[2];
+    I32 padding;
+};
+
+// hull repacked for batches of traces
+struct TraceHull
+{
+    TraceNode *nodes;
+    I32 firstNode;
+    Vec3f clipMin;
+    Vec3f clipMax;
+};
+
+I32 HullPointContents(Hull *hull, I32 num, const Vec3f &point);
+
+// trace a point from start to end, false if it was stopped on the way out of
+// empty space. A move that is all in solid is never stopped.
+B32 HullTrace(Hull *hull, const Vec3f &start, const Vec3f &end, Trace *trace);
+
+// the hull a box of that size moves through, the offset takes a point from
+// the box to the hull
+Hull *ModelHullForBox(Model *model, const Vec3f &mins, const Vec3f &maxs, Vec3f *offset);
+
+// move a box through a brush model, a point if mins and maxs are 0
+Trace TraceBox(Model *model, const Vec3f &start, const Vec3f &mins,
+               const Vec3f &maxs, const Vec3f &end);
+
+// the nodes go into the arena, valid as long as the hull is
+void TraceHullBuild(TraceHull *dest, Hull *hull, MemoryArena *arena);
+
+// trace a ray per result, large batches are split over the worker threads
+void TraceBatch(TraceHull *hull, TraceRay *rays, Trace *results, I32 count);
+
+// first solid leaf on a line through the nodes of a brush model
+struct LineHit
+{
+    Leaf *leaf; // NULL if the line gets through
+    float fraction; // where the line enters the leaf, 1 if it gets through
+};
+
+// true if nothing solid is between start and end
+B32 TraceLine(Model *model, const Vec3f &start, const Vec3f &end, LineHit *hit);
+
+// four lines at once, one node is read for all of them. Fastest when they
+// go the same way, like from one point to things close to each other.
+void TraceLinePacket(Model *model, TraceRay *rays, LineHit *hits);
+
+// lines in packets of four
+void TraceLineBatch(Model *model, TraceRay *rays, LineHit *hits, I32 count);
+
+// prints how many cycles a trace takes, temporary memory comes from the arena
+void TraceBenchmark(Model *model, MemoryArena *arena);
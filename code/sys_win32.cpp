@@ -25,6 +25,157 @@ SYS_ERROR(Win32SysError)
     MessageBox(NULL, error, "Quake Error", MB_OK | MB_SETFOREGROUND | MB_ICONSTOP);
 }
 
+SYS_PRINT(Win32SysPrint)
+{
+    char message[1024];
+    va_list vl;
+    va_start(vl, format);
+    // long messages are cut off
+    _vsnprintf_s(message, 1024, _TRUNCATE, format, vl);
+    va_end(vl);
+
+    OutputDebugStringA(message);
+}
+
+SYS_MAP_FILE(Win32MapFile)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+
+    void *result = NULL;
+    LARGE_INTEGER file_size;
+    // pak offsets are 32-bit
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 && file_size.QuadPart < 0x7fffffff)
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+        {
+            result = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            // the view keeps the mapping alive
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+
+    if (result)
+    {
+        *size = (I32)file_size.QuadPart;
+    }
+
+    return result;
+}
+
+SYS_DO_NEXT_WORK(Win32DoNextWork)
+{
+    LONG entry_index = queue->next_entry_to_read;
+    if (entry_index == queue->next_entry_to_write || !queue->entries[entry_index].ready)
+    {
+        return false;
+    }
+
+    LONG next_index = (entry_index + 1) & (WIN32_WORK_QUEUE_SIZE - 1);
+    if (InterlockedCompareExchange(&queue->next_entry_to_read, next_index, entry_index) == entry_index)
+    {
+        Win32WorkQueueEntry entry = queue->entries[entry_index];
+        InterlockedExchange(&queue->entries[entry_index].ready, 0);
+
+        entry.callback(queue, entry.data);
+        InterlockedIncrement(&queue->completion_count);
+    }
+
+    // another thread took it, there may be more
+    return true;
+}
+
+SYS_ADD_WORK(Win32AddWork)
+{
+    for (;;)
+    {
+        LONG entry_index = queue->next_entry_to_write;
+        LONG next_index = (entry_index + 1) & (WIN32_WORK_QUEUE_SIZE - 1);
+        // full, or the reader of the entry hasn't copied it out yet: the 
+        // work would be lost, help with the queue until there's room
+        if (next_index == queue->next_entry_to_read || queue->entries[entry_index].ready)
+        {
+            if (!Win32DoNextWork(queue))
+            {
+                YieldProcessor();
+            }
+            continue;
+        }
+
+        // other threads may add work at the same time
+        if (InterlockedCompareExchange(&queue->next_entry_to_write, next_index, entry_index) == entry_index)
+        {
+            Win32WorkQueueEntry *entry = queue->entries + entry_index;
+            entry->callback = callback;
+            entry->data = data;
+            InterlockedIncrement(&queue->completion_goal);
+            // callback and data must be visible before ready
+            InterlockedExchange(&entry->ready, 1);
+            ReleaseSemaphore(queue->semaphore, 1, NULL);
+            break;
+        }
+    }
+}
+
+SYS_COMPLETE_ALL_WORK(Win32CompleteAllWork)
+{
+    while (queue->completion_count != queue->completion_goal)
+    {
+        if (!Win32DoNextWork(queue))
+        {
+            // the last works are running on other threads
+            YieldProcessor();
+        }
+    }
+}
+
+DWORD WINAPI Win32WorkerThreadProc(LPVOID parameter)
+{
+    PlatformWorkQueue *queue = (PlatformWorkQueue *)parameter;
+    for (;;)
+    {
+        if (!Win32DoNextWork(queue))
+        {
+            WaitForSingleObjectEx(queue->semaphore, INFINITE, FALSE);
+        }
+    }
+}
+
+void Win32InitWorkQueue(PlatformWorkQueue *queue)
+{
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+
+    // leave one core to the main thread
+    LONG thread_count = (LONG)system_info.dwNumberOfProcessors - 1;
+    if (thread_count < 1)
+    {
+        thread_count = 1;
+    }
+    if (thread_count > WIN32_MAX_WORKER_THREAD_NUM)
+    {
+        thread_count = WIN32_MAX_WORKER_THREAD_NUM;
+    }
+
+    queue->completion_goal = 0;
+    queue->completion_count = 0;
+    queue->next_entry_to_write = 0;
+    queue->next_entry_to_read = 0;
+    queue->semaphore = CreateSemaphoreEx(NULL, 0, WIN32_WORK_QUEUE_SIZE, NULL, 0, SEMAPHORE_ALL_ACCESS);
+
+    for (LONG i = 0; i < thread_count; ++i)
+    {
+        HANDLE thread = CreateThread(NULL, 0, Win32WorkerThreadProc, queue, 0, NULL);
+        CloseHandle(thread);
+    }
+}
+
 SYS_SET_PALETTE(Win32SetPalette)
 {
     for (int i = 0; i < 256; ++i)
@@ -34,6 +185,8 @@ SYS_SET_PALETTE(Win32SetPalette)
         g_screenBuffer.bitmapInfo.bmiColors[i].rgbBlue = palette[i * 3 + 2];
         g_screenBuffer.bitmapInfo.bmiColors[i].rgbReserved = 0; // must be zero
     }
+    // every pixel changes its color
+    g_win32_state.force_full_blit = true;
 }
 
 inline U64 
@@ -237,6 +390,37 @@ Win32DisplayBufferInWindow(HDC deviceContext, Win32ScreenBuffer *screenBuffer, W
     return result;
 }
 
+// only copy the regions that the game changed last frame
+INTERNAL_LINKAGE int 
+Win32DisplayDirtyRects(HDC deviceContext, Win32ScreenBuffer *screenBuffer, 
+                       Win32WindowSize window_size, GameDirtyRect *rects, int rect_count)
+{
+    int result = 0;
+
+    for (int i = 0; i < rect_count; ++i)
+    {
+        GameDirtyRect *rect = rects + i;
+
+        // scale to the window, rounding both edges the same way as a full 
+        // blit does to not leave gaps between neighbouring rects
+        int dest_left = rect->x * window_size.width / screenBuffer->width;
+        int dest_top = rect->y * window_size.height / screenBuffer->height;
+        int dest_right = (rect->x + rect->width) * window_size.width / screenBuffer->width;
+        int dest_bottom = (rect->y + rect->height) * window_size.height / screenBuffer->height;
+
+        // source origin of a top-down DIB is the top-left corner
+        result = StretchDIBits(deviceContext, 
+                               dest_left, dest_top, 
+                               dest_right - dest_left, dest_bottom - dest_top,
+                               rect->x, rect->y, rect->width, rect->height,
+                               screenBuffer->memory,
+                               (BITMAPINFO *)&screenBuffer->bitmapInfo, 
+                               DIB_RGB_COLORS, SRCCOPY);
+    }
+
+    return result;
+}
+
 INTERNAL_LINKAGE void 
 Win32ResizeDIBSection(Win32ScreenBuffer *screenBuffer, 
                       GameOffScreenBuffer *offscreenBuffer)
@@ -542,6 +726,15 @@ WinMain(HINSTANCE instance, HINSTANCE preInstance, LPSTR cmdline, int showCode)
     gameMemory.gameMemorySize = MEGA_BYTES(64);
 
     gameMemory.platformAPI.SysError = Win32SysError;
+    gameMemory.platformAPI.SysPrint = Win32SysPrint;
+    gameMemory.platformAPI.SysMapFile = Win32MapFile;
+    gameMemory.platformAPI.SysAddWork = Win32AddWork;
+    gameMemory.platformAPI.SysDoNextWork = Win32DoNextWork;
+    gameMemory.platformAPI.SysCompleteAllWork = Win32CompleteAllWork;
+
+    static PlatformWorkQueue work_queue;
+    Win32InitWorkQueue(&work_queue);
+    gameMemory.workQueue = &work_queue;
     gameMemory.platformAPI.SysSetPalette = Win32SetPalette;
 
     Win32BuildGameFilePath(&g_win32_state, "..\\assets\\", 
@@ -681,7 +874,20 @@ WinMain(HINSTANCE instance, HINSTANCE preInstance, LPSTR cmdline, int showCode)
         startCounter = endCounter;
 
         Win32WindowSize windowSize = Win32GetWindowSize(hwnd);
-        Win32DisplayBufferInWindow(privateDC, &g_screenBuffer, windowSize);
+        if (g_win32_state.force_full_blit 
+            || windowSize.width != g_win32_state.blit_size.width
+            || windowSize.height != g_win32_state.blit_size.height)
+        {
+            Win32DisplayBufferInWindow(privateDC, &g_screenBuffer, windowSize);
+            g_win32_state.blit_size = windowSize;
+            g_win32_state.force_full_blit = false;
+        }
+        else
+        {
+            Win32DisplayDirtyRects(privateDC, &g_screenBuffer, windowSize, 
+                                   gameMemory.offscreenBuffer.dirtyRects,
+                                   gameMemory.offscreenBuffer.dirtyRectCount);
+        }
     }
 
     return 0;
@@ -29,6 +29,35 @@ struct Win32State
     char *onePastLastExeFilePathSlash; 
     RECT window_size;
     bool has_focus;
+
+    // client size of the last full blit, dirty rects are only enough if the
+    // window still has the same size
+    Win32WindowSize blit_size;
+    bool force_full_blit;
+};
+
+struct Win32WorkQueueEntry
+{
+    PlatformWorkQueueCallback_t *callback;
+    void *data;
+    // set once callback and data are written
+    volatile LONG ready;
+};
+
+// must be power of 2
+#define WIN32_WORK_QUEUE_SIZE 256
+#define WIN32_MAX_WORKER_THREAD_NUM 8
+
+struct PlatformWorkQueue
+{
+    volatile LONG completion_goal;
+    volatile LONG completion_count;
+
+    volatile LONG next_entry_to_write;
+    volatile LONG next_entry_to_read;
+
+    HANDLE semaphore;
+    Win32WorkQueueEntry entries[WIN32_WORK_QUEUE_SIZE];
 };
 
 struct Win32GameCode
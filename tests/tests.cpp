@@ -1,6 +1,7 @@
 #include "..\code\q_platform.h"
-#include "..\code\q_common.cpp"
 #include "..\code\q_math.h"
+// the rest of the game code comes with it
+#include "..\code\q_game.cpp"
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -17,6 +18,13 @@ SYS_ERROR(CmdError)
     printf(error);
 }
 
+// errors the tests expect
+I32 g_test_sys_error_count = 0;
+SYS_ERROR(TestCountError)
+{
+    g_test_sys_error_count++;
+}
+
 I32 g_errorCount = 0;
 #define ERROR(condition) if (!(condition)) { \
     ++g_errorCount; \
@@ -128,6 +136,36 @@ void test_StringToInt()
     ERROR(result == 320);
 }
 
+void test_StringParseToken()
+{
+    ERROR(StringToFloat("-12.5") == -12.5f);
+    ERROR(StringToFloat("+3") == 3.0f);
+    ERROR(StringToFloat("x") == 0.0f);
+
+    char text[] = "// comment\n{\n\"model\" \"*12\"\n\"origin\" \"1 -2 3\"\n}word";
+    char token[8];
+
+    char *data = StringParseToken(text, token, (I32)sizeof(token));
+    ERROR(StringCompare(token, "{") == 0);
+    data = StringParseToken(data, token, (I32)sizeof(token));
+    ERROR(StringCompare(token, "model") == 0);
+    data = StringParseToken(data, token, (I32)sizeof(token));
+    ERROR(StringCompare(token, "*12") == 0);
+    data = StringParseToken(data, token, (I32)sizeof(token));
+    data = StringParseToken(data, token, (I32)sizeof(token));
+    ERROR(StringCompare(token, "1 -2 3") == 0);
+    data = StringParseToken(data, token, (I32)sizeof(token));
+    ERROR(StringCompare(token, "}") == 0);
+    data = StringParseToken(data, token, (I32)sizeof(token));
+    ERROR(StringCompare(token, "word") == 0);
+    data = StringParseToken(data, token, (I32)sizeof(token));
+    ERROR(data == NULL && token[0] == '\0');
+
+    // too long, cut to fit
+    data = StringParseToken("abcdefghijk", token, (I32)sizeof(token));
+    ERROR(StringCompare(token, "abcdefg") == 0 && *data == '\0');
+}
+
 void test_MemSet()
 {
     // U8 dest[128] = {7}; will only initialize the dest[0] to 7, the rest 
@@ -207,11 +245,12 @@ void test_MemCpy()
 void test_DataSize()
 {
     ERROR(sizeof(MemoryBlock) == 32);
-    ERROR(sizeof(MemoryZone) == 48);
+    ERROR(sizeof(MemoryZone) == 336);
+    ERROR(sizeof(MemoryFreeLink) == 16);
     ERROR(sizeof(HunkHeader) == 24);
     ERROR(sizeof(CacheHeader) == 64);
     ERROR(sizeof(PackFile) == MAX_PACK_FILE_PATH + 8);
-    ERROR(sizeof(PackHeader) == MAX_OS_PATH_LENGTH + 16);
+    ERROR(sizeof(PackHeader) == MAX_OS_PATH_LENGTH + 32);
     ERROR(sizeof(PackFileDisk) == 64);
     ERROR(sizeof(PackHeaderDisk) == 12);
     ERROR(sizeof(SearchPath) == MAX_OS_PATH_LENGTH + 16);
@@ -231,8 +270,11 @@ void test_MemoryAlloc()
     ERROR(g_hunk_high_used == 0);
 
     ERROR((U8 *)g_main_zone == pool + sizeof(HunkHeader));
-    ERROR(g_main_zone->rover == (MemoryBlock *)(g_main_zone + 1));
+    ERROR(g_main_zone->tailhead.next == (MemoryBlock *)(g_main_zone + 1));
     ERROR(g_main_zone->size == DYNAMIC_ZONE_SIZE);
+    I32 wholeClass = ZoneSizeClass(DYNAMIC_ZONE_SIZE - sizeof(MemoryZone));
+    ERROR(g_main_zone->free_bitmap == (1u << wholeClass));
+    ERROR(g_main_zone->free_lists[wholeClass] == g_main_zone->tailhead.next);
 
     // ====================
     // test hunk allocation
@@ -254,6 +296,26 @@ void test_MemoryAlloc()
     ERROR(StringCompare(hunk1Header->name, "hunk1") == 0);
     ERROR(g_hunk_high_used == hunk1Size);
 
+    // temp data goes away with the next high allocation
+    HunkTempAlloc(100);
+    ERROR(g_hunk_temp_active);
+    void *hunk2 = HunkHighAlloc(64, "hunk2");
+    I32 hunk2Size = Align16(64 + sizeof(HunkHeader));
+    ERROR(!g_hunk_temp_active);
+    ERROR(g_hunk_high_used == hunk1Size + hunk2Size);
+    ERROR((U8 *)hunk2 == pool + POOL_SIZE - hunk1Size - hunk2Size + sizeof(HunkHeader));
+
+    // caches in the way of high hunk are evicted, the ones below stay
+    CacheUser lowCache = {};
+    CacheUser topCache = {};
+    CacheAlloc(&lowCache, 1000, "low");
+    I32 topSize = HunkGetFreeSize() - Align16(1000 + sizeof(CacheHeader)) - (I32)sizeof(CacheHeader) - 16;
+    CacheAlloc(&topCache, topSize, "top");
+    ERROR(lowCache.data && topCache.data);
+    HunkHighAlloc(64, "hunk3");
+    ERROR(lowCache.data && !topCache.data);
+    CacheFree(&lowCache);
+
     // ====================
     // test zone allocation
     // ====================
@@ -302,10 +364,1826 @@ void test_MemoryAlloc()
     ERROR(tooBig == NULL);
 
     ZoneClearAll(g_main_zone);
-    ERROR(g_main_zone->tailhead.next == g_main_zone->rover);
-    ERROR(g_main_zone->tailhead.prev == g_main_zone->rover);
-    ERROR(g_main_zone->rover->next == &g_main_zone->tailhead);
-    ERROR(g_main_zone->rover->next == &g_main_zone->tailhead);
+    MemoryBlock *wholeBlock = (MemoryBlock *)(g_main_zone + 1);
+    ERROR(g_main_zone->tailhead.next == wholeBlock);
+    ERROR(g_main_zone->tailhead.prev == wholeBlock);
+    ERROR(wholeBlock->next == &g_main_zone->tailhead);
+    ERROR(wholeBlock->prev == &g_main_zone->tailhead);
+    ERROR(g_main_zone->free_bitmap == (1u << wholeClass));
+}
+
+void test_ZoneAlloc()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+
+    // size classes
+    ERROR(ZoneSizeClass(ZONE_MIN_BLOCK_SIZE) == 0);
+    ERROR(ZoneSizeClass(64) == 1);
+    ERROR(ZoneSizeClass(ZONE_SMALL_LIMIT - 1) == ZONE_SMALL_CLASS_NUM - 1);
+    ERROR(ZoneSizeClass(ZONE_SMALL_LIMIT) == ZONE_SMALL_CLASS_NUM);
+    ERROR(ZoneSizeClass(ZONE_SMALL_LIMIT * 2 - 1) == ZONE_SMALL_CLASS_NUM);
+    ERROR(ZoneSizeClass(0x7fffffff) == ZONE_CLASS_NUM - 1);
+    ERROR(ZoneFitClass(64) == 1);
+    ERROR(ZoneFitClass(72) == 2);
+    ERROR(ZoneFitClass(ZONE_SMALL_LIMIT + 8) == ZONE_SMALL_CLASS_NUM + 1);
+
+    // tiny allocations still have room for a free link
+    void *tiny = ZoneTagMalloc(1, 1);
+    ERROR(((MemoryBlock *)tiny - 1)->size == ZONE_MIN_BLOCK_SIZE);
+
+    // a freed block is reused by the next allocation of the same size
+    void *zone0 = ZoneTagMalloc(100, 1);
+    void *zone1 = ZoneTagMalloc(100, 1);
+    ZoneFree(zone0);
+    void *zone2 = ZoneTagMalloc(100, 1);
+    ERROR(zone2 == zone0);
+
+    ZoneStats stats = ZoneGetStats();
+    ERROR(stats.live_allocs == 3);
+    ERROR(stats.total_allocs == 4);
+    ERROR(stats.total_frees == 1);
+    ERROR(stats.bytes_used == ZONE_MIN_BLOCK_SIZE + 2 * ZoneBlockSize(100));
+    ERROR(stats.peak_bytes_used == stats.bytes_used);
+
+    ZoneFree(zone1);
+    ZoneFree(zone2);
+    ZoneFree(tiny);
+    stats = ZoneGetStats();
+    ERROR(stats.live_allocs == 0);
+    ERROR(stats.bytes_used == 0);
+
+    // everything got merged back into one block
+    ERROR(g_main_zone->tailhead.next == g_main_zone->tailhead.prev);
+
+    // threads other than the owner of the hunk can't grow the zone
+    I32 old_low_used = g_hunk_low_used;
+    t_zone_can_grow = false;
+    g_test_sys_error_count = 0;
+    g_platformAPI.SysError = TestCountError;
+    ERROR(ZoneMalloc(DYNAMIC_ZONE_SIZE * 2) == NULL);
+    g_platformAPI.SysError = CmdError;
+    t_zone_can_grow = true;
+    ERROR(g_test_sys_error_count == 1);
+    ERROR(g_hunk_low_used == old_low_used);
+
+    // zone grows from low hunk once it's full
+    void *big = ZoneMalloc(DYNAMIC_ZONE_SIZE * 2);
+    ERROR(big != NULL);
+    ERROR(g_hunk_low_used > old_low_used);
+    ERROR(ZoneGetStats().segment_count == 1);
+    MemoryBlock *fence = (MemoryBlock *)big - 2;
+    ERROR(fence->tag == ZONE_FENCE_TAG);
+
+    // free blocks of different segments are never merged
+    ZoneFree(big);
+    ERROR(fence->next->tag == 0);
+    ERROR(fence->prev->tag == 0);
+    ERROR(fence->prev->next == fence);
+
+    ZoneCheckHeap();
+}
+
+void test_MemoryArena()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+
+    MemoryArena arena;
+    ArenaInitOnHunk(&arena, 1024, "arena");
+    ERROR(arena.used == 0);
+    ERROR(arena.size == 1024);
+
+    // pushes are aligned
+    U8 *data0 = (U8 *)ArenaPush(&arena, 10);
+    ERROR(((size_t)data0 & 15) == 0);
+    U8 *data1 = (U8 *)ArenaPush(&arena, 10, 64);
+    ERROR(((size_t)data1 & 63) == 0);
+    ERROR(data1 >= data0 + 10);
+
+    // pop to marker makes memory available again
+    ArenaMarker marker = ArenaGetMarker(&arena);
+    I32 *ints = ARENA_PUSH_ARRAY(&arena, I32, 100);
+    ERROR(((size_t)ints & 15) == 0);
+    I32 peak = arena.used;
+    ArenaPopToMarker(&arena, marker);
+    ERROR(arena.used == marker.used);
+    ERROR((I32 *)ArenaPush(&arena, 400) == ints);
+    ERROR(arena.peak_used == peak);
+
+    // reset keeps the high-watermark of the last period
+    ArenaReset(&arena);
+    ERROR(arena.used == 0);
+    ERROR(arena.peak_used == 0);
+    ERROR(arena.last_peak_used == peak);
+    ArenaPush(&arena, 16);
+    ArenaReset(&arena);
+    ERROR(arena.last_peak_used == 16);
+    ERROR(arena.max_peak_used == peak);
+
+    ArenaSetThreadArena(&arena);
+    ERROR(ArenaGetThreadArena() == &arena);
+}
+
+void test_MemoryReport()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+
+    HunkLowAlloc(1000, "lumps");
+    HunkLowAlloc(3000, "lumps");
+    HunkHighAlloc(5000, "buffer");
+    CacheUser user = {};
+    CacheAlloc(&user, 2000, "model");
+
+    static MemoryReport report;
+    MemoryGetReport(&report);
+
+    ERROR(report.total_size == POOL_SIZE);
+    ERROR(report.low_used == g_hunk_low_used);
+    ERROR(report.high_used == g_hunk_high_used);
+    ERROR(report.low_peak == g_hunk_low_used);
+    ERROR(report.min_free_size == report.free_size);
+
+    // zone, lumps, buffer, model
+    ERROR(report.entry_count == 4);
+    MemoryReportEntry *lumps = report.entries + 1;
+    ERROR(StringCompare(lumps->name, "lumps") == 0);
+    ERROR(lumps->region == MEMORY_REGION_LOW_HUNK);
+    ERROR(lumps->count == 2);
+    ERROR(lumps->bytes == Align16(1000 + sizeof(HunkHeader)) + Align16(3000 + sizeof(HunkHeader)));
+    MemoryReportEntry *buffer = report.entries + 2;
+    ERROR(buffer->region == MEMORY_REGION_HIGH_HUNK);
+    ERROR(buffer->bytes == report.high_used);
+    MemoryReportEntry *model = report.entries + 3;
+    ERROR(model->region == MEMORY_REGION_CACHE);
+    ERROR(report.cache_count == 1);
+    ERROR(report.cache_used == model->bytes);
+    ERROR(report.cache_hole_bytes == 0);
+
+    ERROR(report.zone_size == DYNAMIC_ZONE_SIZE);
+    ERROR(report.zone_free_blocks == 1);
+
+    // peaks outlive the memory
+    I32 high_peak = g_hunk_high_used;
+    I32 cache_size = model->bytes;
+    HunkTempAlloc(10000);
+    HunkFreeTemp();
+    CacheFree(&user);
+    MemoryGetReport(&report);
+    ERROR(report.high_peak > high_peak);
+    ERROR(report.cache_used == 0);
+    ERROR(report.cache_peak == cache_size);
+
+    char text[4096];
+    I32 length = MemoryReportToSnapshot(&report, text, (I32)sizeof(text));
+    ERROR(length == StringLength(text));
+    ERROR(StringNCompare(text, "region,name,count,bytes\n", 24) == 0);
+
+    // output is cut off rather than overflowing
+    length = MemoryReportToText(&report, text, 16);
+    ERROR(length == 15);
+    ERROR(StringLength(text) == 15);
+}
+
+void test_FileIndex()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+    FileIndexInit();
+
+    ERROR(FileHashPath("maps/start.bsp") == FileHashPath("MAPS\\Start.BSP"));
+    ERROR(FileHashPath("maps/start.bsp") != FileHashPath("maps/e1m1.bsp"));
+    ERROR(FilePathEqual("progs/player.mdl", "Progs\\Player.mdl"));
+    ERROR(!FilePathEqual("progs/player.mdl", "progs/player.md"));
+
+    PackFile files0[3] = {{"maps/start.bsp", 0, 10}, {"gfx/palette.lmp", 10, 768}, 
+                          {"gfx/colormap.lmp", 778, 16384}};
+    PackHeader pack0 = {};
+    pack0.numfiles = 3;
+    pack0.files = files0;
+    FileIndexAddPack(&pack0);
+    ERROR(g_file_index.count == 3);
+
+    FileIndexEntry *entry = FileIndexFind("gfx/palette.lmp");
+    ERROR(entry && entry->pack == &pack0 && entry->file_index == 1);
+    ERROR(FileIndexFind("GFX\\PALETTE.LMP") == entry);
+    ERROR(FileIndexFind("gfx/conback.lmp") == NULL);
+
+    // missing files are remembered until a pack has them
+    FileIndexAddMissing("maps/e1m1.bsp");
+    entry = FileIndexFind("maps/e1m1.bsp");
+    ERROR(entry && entry->file_index == -1);
+    ERROR(g_file_index.missing_count == 1);
+    I32 live_allocs = ZoneGetStats().live_allocs;
+
+    // a later pack overrides files of the same name
+    PackFile files1[2] = {{"maps/e1m1.bsp", 0, 20}, {"gfx/palette.lmp", 20, 768}};
+    PackHeader pack1 = {};
+    pack1.numfiles = 2;
+    pack1.files = files1;
+    FileIndexAddPack(&pack1);
+    ERROR(g_file_index.missing_count == 0);
+    // the name of the missing file is given back
+    ERROR(ZoneGetStats().live_allocs == live_allocs - 1);
+    ERROR(g_file_index.count == 4);
+    entry = FileIndexFind("maps/e1m1.bsp");
+    ERROR(entry && entry->pack == &pack1 && entry->file_index == 0);
+    entry = FileIndexFind("gfx/palette.lmp");
+    ERROR(entry && entry->pack == &pack1 && entry->file_index == 1);
+    entry = FileIndexFind("maps/start.bsp");
+    ERROR(entry && entry->pack == &pack0 && entry->file_index == 0);
+
+    // mapped paks hand out views into the mapping
+    int length = 0;
+    ERROR(FileMap("maps/start.bsp", &length) == NULL);
+    static U8 mapping[20000];
+    pack0.mapped = mapping;
+    pack0.mappedSize = 20000;
+    ERROR(FileMap("maps/start.bsp", &length) == mapping && length == 10);
+    ERROR(FileMap("gfx/colormap.lmp", &length) == mapping + 778 && length == 16384);
+    ERROR(FileMap("maps/e1m1.bsp", &length) == NULL);
+
+    // derived files go next to the pak
+    char sidepath[MAX_OS_PATH_LENGTH];
+    StringCopy(pack1.filepath, MAX_OS_PATH_LENGTH, "id1/pak1.pak");
+    ERROR(FilePackSidePath("maps/e1m1.bsp", "c", sidepath, MAX_OS_PATH_LENGTH));
+    ERROR(StringCompare(sidepath, "id1/pak1_maps_e1m1.bspc") == 0);
+    ERROR(!FilePackSidePath("maps/e1m1.bsp", "c", sidepath, 8));
+    ERROR(!FilePackSidePath("maps/start.bsp", "c", sidepath, MAX_OS_PATH_LENGTH));
+    ERROR(!FilePackSidePath("gfx/conback.lmp", "c", sidepath, MAX_OS_PATH_LENGTH));
+
+    ERROR(HashMemory("abc", 3) == HashMemory("abcd", 3));
+    ERROR(HashMemory("abc", 3) != HashMemory("abd", 3));
+    ERROR(HashMemory(NULL, 0) == 2166136261u);
+
+    U8 bytes[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        bytes[i] = (U8)(i * 3);
+    }
+    ERROR(FileWriteWhole("test_readat.bin", bytes, 16));
+    U8 part[4] = {};
+    ERROR(FileReadAt("test_readat.bin", 10, part, 4));
+    ERROR(part[0] == 30 && part[3] == 39);
+    ERROR(!FileReadAt("test_readat.bin", 14, part, 4));
+    ERROR(!FileReadAt("test_missing.bin", 0, part, 4));
+    remove("test_readat.bin");
+}
+
+I32 g_cvar_changed_count;
+float g_cvar_changed_old_val;
+
+CVAR_CHANGED_CALLBACK(TestCvarChanged)
+{
+    g_cvar_changed_count++;
+    g_cvar_changed_old_val = old_val;
+    ERROR(StringCompare(cvar->name, "mipscale") == 0);
+}
+
+void test_Cvar()
+{
+    MemSet(&g_cvar_pool, 0, sizeof(g_cvar_pool));
+
+    ERROR(GetCvarHashKey("drawflat") != GetCvarHashKey("mipscale"));
+    ERROR(CvarFind("drawflat") == NULL);
+
+    Cvar *drawflat = CvarGet("drawflat");
+    ERROR(drawflat->val == 0 && StringCompare(drawflat->name, "drawflat") == 0);
+    ERROR(CvarFind("drawflat") == drawflat);
+    ERROR(CvarSet("drawflat", 2) == drawflat && drawflat->val == 2);
+
+    // registering keeps the value a cvar already has
+    ERROR(CvarRegister("drawflat", 5) == drawflat && drawflat->val == 2);
+    Cvar *mipscale = CvarRegister("mipscale", 1, TestCvarChanged);
+    ERROR(mipscale->val == 1 && g_cvar_pool.count == 2);
+
+    // handles stay valid while the table fills up
+    char name[16];
+    for (I32 i = 0; i < 300; ++i)
+    {
+        snprintf(name, sizeof(name), "var%d", i);
+        CvarSet(name, (float)i);
+    }
+    ERROR(g_cvar_pool.count == 302);
+    ERROR(CvarFind("drawflat") == drawflat && CvarFind("mipscale") == mipscale);
+    ERROR(CvarFind("var123")->val == 123);
+    ERROR(CvarFind("var300") == NULL);
+
+    // callbacks only run when the value changes
+    g_cvar_changed_count = 0;
+    CvarSetValue(mipscale, 1);
+    ERROR(g_cvar_changed_count == 0);
+    CvarSet("mipscale", 0.5f);
+    ERROR(g_cvar_changed_count == 1 && g_cvar_changed_old_val == 1 && mipscale->val == 0.5f);
+    CvarSetValue(mipscale, 2);
+    ERROR(g_cvar_changed_count == 2 && g_cvar_changed_old_val == 0.5f);
+
+    MemSet(&g_cvar_pool, 0, sizeof(g_cvar_pool));
+}
+
+B32 BytesEqual(U8 *lhs, U8 *rhs, I32 count)
+{
+    for (I32 i = 0; i < count; ++i)
+    {
+        if (lhs[i] != rhs[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_LZ4()
+{
+    static U8 src[70000];
+    static U8 packed[72000];
+    static U8 unpacked[70000];
+
+    // texture-like data: runs, repeats and noise
+    U32 seed = 1;
+    for (I32 i = 0; i < 70000; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        if (i < 20000)
+        {
+            src[i] = (U8)(i / 64);
+        }
+        else if (i < 40000)
+        {
+            src[i] = src[i - 300];
+        }
+        else
+        {
+            src[i] = (U8)(seed >> 16);
+        }
+    }
+
+    I32 size = LZ4Compress(src, 70000, packed, sizeof(packed));
+    ERROR(size > 0 && size < 40000);
+    ERROR(LZ4Compress(src, 70000, NULL, 0) == size);
+    ERROR(LZ4Decompress(packed, size, unpacked, 70000) == 70000);
+    ERROR(BytesEqual(src, unpacked, 70000));
+
+    // noise grows a little, but never beyond the bound
+    I32 noise_size = LZ4Compress(src + 40000, 30000, packed, sizeof(packed));
+    ERROR(noise_size >= 30000 && noise_size <= LZ4CompressBound(30000));
+    ERROR(LZ4Decompress(packed, noise_size, unpacked, 30000) == 30000);
+    ERROR(BytesEqual(src + 40000, unpacked, 30000));
+
+    ERROR(LZ4Compress(src, 70000, packed, 100) == -1);
+    ERROR(LZ4Decompress(packed, size, unpacked, 69999) == -1);
+
+    // tiny inputs are all literals
+    size = LZ4Compress(src, 3, packed, sizeof(packed));
+    ERROR(size == 4 && packed[0] == 0x30);
+    ERROR(LZ4Decompress(packed, size, unpacked, 3) == 3);
+    ERROR(LZ4Compress(src, 0, packed, sizeof(packed)) == 1);
+    ERROR(LZ4Decompress(packed, 1, unpacked, 0) == 0);
+
+    // an offset before the start of the output is corrupt
+    U8 corrupt[] = {0x10, 'a', 0x05, 0x00};
+    ERROR(LZ4Decompress(corrupt, sizeof(corrupt), unpacked, 100) == -1);
+    U8 overlap[] = {0x14, 'a', 0x01, 0x00, 0x10, 'b'};
+    ERROR(LZ4Decompress(overlap, sizeof(overlap), unpacked, 100) == 10);
+    ERROR(unpacked[0] == 'a' && unpacked[8] == 'a' && unpacked[9] == 'b');
+}
+
+B32 TracesEqual(Trace *lhs, Trace *rhs)
+{
+    B32 result = lhs->fraction == rhs->fraction && lhs->end == rhs->end
+        && lhs->contents == rhs->contents && lhs->all_solid == rhs->all_solid
+        && lhs->start_solid == rhs->start_solid && lhs->in_open == rhs->in_open
+        && lhs->in_water == rhs->in_water;
+    if (result && lhs->fraction < 1)
+    {
+        result = lhs->plane.normal == rhs->plane.normal 
+            && lhs->plane.distance == rhs->plane.distance;
+    }
+    return result;
+}
+
+void test_HullTrace()
+{
+    // solid for x < 0, water below z = 0 and solid above a slope that 
+    // is at z = 50 for y = 0
+    Plane planes[3] = {};
+    planes[0].normal = {1, 0, 0};
+    planes[0].type = PLANE_X;
+    planes[1].normal = {0, 0, 1};
+    planes[1].type = PLANE_Z;
+    planes[2].normal = {0, 0.6f, 0.8f};
+    planes[2].distance = 40;
+    planes[2].type = PLANE_ANYZ;
+
+    ClipNode nodes[3] = {
+        {0, {1, CONTENTS_SOLID}},
+        {1, {2, CONTENTS_WATER}},
+        {2, {CONTENTS_SOLID, CONTENTS_EMPTY}},
+    };
+
+    Hull hull = {};
+    hull.clipNodes = nodes;
+    hull.planes = planes;
+    hull.firstClipNode = 0;
+    hull.lastClipNode = 2;
+
+    ERROR(HullPointContents(&hull, 0, {10, 0, 5}) == CONTENTS_EMPTY);
+    ERROR(HullPointContents(&hull, 0, {-10, 0, 5}) == CONTENTS_SOLID);
+    ERROR(HullPointContents(&hull, 0, {10, 0, -5}) == CONTENTS_WATER);
+    ERROR(HullPointContents(&hull, 0, {10, 0, 55}) == CONTENTS_SOLID);
+
+    // into the wall, stops just in front of it
+    Trace trace;
+    ERROR(!HullTrace(&hull, {10, 0, 5}, {-10, 0, 5}, &trace));
+    ERROR(trace.fraction == (10 - TRACE_DIST_EPSILON) / 20);
+    ERROR(trace.end.x == TRACE_DIST_EPSILON);
+    ERROR(trace.plane.normal.x == 1 && trace.plane.distance == 0);
+    ERROR(trace.contents == CONTENTS_EMPTY);
+    ERROR(trace.in_open && !trace.in_water);
+    ERROR(!trace.all_solid && !trace.start_solid);
+
+    // into the water, nothing is hit
+    ERROR(HullTrace(&hull, {10, 0, 5}, {10, 0, -5}, &trace));
+    ERROR(trace.fraction == 1);
+    ERROR(trace.end.z == -5);
+    ERROR(trace.contents == CONTENTS_WATER);
+    ERROR(trace.in_open && trace.in_water);
+
+    // up the slope, the plane faces the start
+    ERROR(!HullTrace(&hull, {10, 0, 5}, {10, 0, 100}, &trace));
+    ERROR(trace.plane.normal.z == -0.8f && trace.plane.distance == -40);
+    ERROR(trace.end.z < 50 && trace.end.z > 49.9f);
+    ERROR(trace.fraction > 0.47f && trace.fraction < 0.48f);
+
+    // out of the wall, and all in it
+    ERROR(HullTrace(&hull, {-10, 0, 5}, {10, 0, 5}, &trace));
+    ERROR(trace.start_solid && !trace.all_solid);
+    ERROR(trace.contents == CONTENTS_EMPTY);
+    HullTrace(&hull, {-10, 0, 5}, {-20, 0, 5}, &trace);
+    ERROR(trace.all_solid && trace.contents == CONTENTS_SOLID);
+
+    // a batch gives what every ray gives on its own
+    static TraceRay rays[1000];
+    static Trace results[1000];
+    U32 seed = 7;
+    for (I32 i = 0; i < 1000; ++i)
+    {
+        for (I32 j = 0; j < 3; ++j)
+        {
+            rays[i].start[j] = (TraceBenchmarkRandom(&seed) % 8000) / 100.0f - 20.0f;
+            rays[i].end[j] = (TraceBenchmarkRandom(&seed) % 8000) / 100.0f - 20.0f;
+        }
+    }
+
+    static U8 memory[4096];
+    MemoryArena arena;
+    ArenaInit(&arena, memory, sizeof(memory));
+    TraceHull trace_hull;
+    TraceHullBuild(&trace_hull, &hull, &arena);
+    ERROR(((size_t)trace_hull.nodes & 31) == 0);
+
+    TraceBatch(&trace_hull, rays, results, 1000);
+    I32 hits = 0;
+    for (I32 i = 0; i < 1000; ++i)
+    {
+        hits += !HullTrace(&hull, rays[i].start, rays[i].end, &trace);
+        ERROR(TracesEqual(&trace, results + i));
+    }
+    ERROR(hits > 0 && hits < 1000);
+}
+
+void test_TraceLine()
+{
+    // same space as in test_HullTrace, made of render nodes
+    Plane planes[3] = {};
+    planes[0].normal = {1, 0, 0};
+    planes[0].type = PLANE_X;
+    planes[1].normal = {0, 0, 1};
+    planes[1].type = PLANE_Z;
+    planes[2].normal = {0, 0.6f, 0.8f};
+    planes[2].distance = 40;
+    planes[2].type = PLANE_ANYZ;
+
+    Leaf leaves[3] = {};
+    leaves[0].contents = CONTENTS_SOLID;
+    leaves[1].contents = CONTENTS_EMPTY;
+    leaves[2].contents = CONTENTS_WATER;
+    Node *solid = (Node *)&leaves[0];
+
+    Node nodes[3] = {};
+    nodes[0].plane = &planes[0];
+    nodes[0].children[0] = &nodes[1];
+    nodes[0].children[1] = solid;
+    nodes[1].plane = &planes[1];
+    nodes[1].children[0] = &nodes[2];
+    nodes[1].children[1] = (Node *)&leaves[2];
+    nodes[2].plane = &planes[2];
+    nodes[2].children[0] = solid;
+    nodes[2].children[1] = (Node *)&leaves[1];
+
+    static Model model;
+    model.nodes = nodes;
+    model.hulls[0].firstClipNode = 0;
+
+    LineHit hit;
+    ERROR(!TraceLine(&model, {10, 0, 5}, {-10, 0, 5}, &hit));
+    ERROR(hit.leaf == &leaves[0] && hit.fraction == 0.5f);
+
+    ERROR(TraceLine(&model, {10, 0, 5}, {10, 0, -5}, &hit));
+    ERROR(hit.leaf == NULL && hit.fraction == 1);
+
+    ERROR(!TraceLine(&model, {10, 0, 5}, {10, 0, 100}, &hit));
+    ERROR(hit.fraction > 45 / 95.0f - 0.0001f && hit.fraction < 45 / 95.0f + 0.0001f);
+
+    ERROR(!TraceLine(&model, {-10, 0, 5}, {10, 0, 5}, &hit));
+    ERROR(hit.fraction == 0);
+
+    // packets see what single lines see, the last two lines are single
+    static TraceRay rays[1002];
+    static LineHit hits[1002];
+    U32 seed = 11;
+    for (I32 i = 0; i < 1002; ++i)
+    {
+        for (I32 j = 0; j < 3; ++j)
+        {
+            rays[i].start[j] = (TraceBenchmarkRandom(&seed) % 8000) / 100.0f - 20.0f;
+            rays[i].end[j] = (TraceBenchmarkRandom(&seed) % 8000) / 100.0f - 20.0f;
+        }
+    }
+
+    TraceLineBatch(&model, rays, hits, 1002);
+    I32 clear = 0;
+    for (I32 i = 0; i < 1002; ++i)
+    {
+        clear += TraceLine(&model, rays[i].start, rays[i].end, &hit);
+        ERROR(hit.leaf == hits[i].leaf && hit.fraction == hits[i].fraction);
+    }
+    ERROR(clear > 0 && clear < 1002);
+}
+
+void test_LeafSet()
+{
+    // 300 leaves, a run of empty bytes in the middle
+    static Leaf leaves[301];
+    static Model model;
+    model.leaves = leaves;
+    model.numLeaf = 300;
+    ERROR(ModelLeafSetBytes(&model) == 48);
+
+    U8 set[LEAF_SET_BYTES] = {};
+    U32 seed = 5;
+    I32 count = 0;
+    for (I32 i = 0; i < 300; ++i)
+    {
+        if ((i < 40 || i > 200) && (TraceBenchmarkRandom(&seed) & 1))
+        {
+            set[i >> 3] |= 1 << (i & 7);
+            ++count;
+        }
+    }
+    ERROR(LeafSetCount(set, 48) == count);
+
+    U8 compressed[LEAF_SET_BYTES * 2];
+    I32 size = ModelCompressVisibility(set, 300, compressed);
+    ERROR(size < 38);
+
+    U8 unpacked[LEAF_SET_BYTES];
+    MemSet(unpacked, 0xcc, sizeof(unpacked));
+    ModelDecompressVisibility(compressed, 300, unpacked);
+    ERROR(BytesEqual(set, unpacked, 48));
+
+    // the set can be read without decompressing
+    leaves[1].visibilityCompressed = compressed;
+    for (I32 i = 0; i < 300; ++i)
+    {
+        B32 visible = (set[i >> 3] >> (i & 7)) & 1;
+        ERROR(ModelLeafCanSee(&model, leaves + 1, leaves + i + 1) == visible);
+        ERROR(LeafSetContains(&model, set, leaves + i + 1) == visible);
+    }
+    ERROR(!ModelLeafCanSee(&model, leaves + 1, leaves));
+    ERROR(ModelLeafCanSee(&model, leaves, leaves + 300));
+
+    // no vis is everything, the bits past the last leaf stay clear
+    ModelGetPVS(&model, leaves + 2, unpacked);
+    ERROR(LeafSetCount(unpacked, 48) == 300);
+    ERROR(unpacked[37] == 0x0f && unpacked[38] == 0);
+
+    LeafSetAnd(unpacked, set, 48);
+    ERROR(BytesEqual(set, unpacked, 48));
+    U8 other[LEAF_SET_BYTES] = {};
+    other[20] = 0xff;
+    ERROR(!LeafSetIntersects(set, other, 48));
+    LeafSetOr(other, set, 48);
+    ERROR(LeafSetIntersects(set, other, 48));
+    ERROR(LeafSetCount(other, 48) == count + 8);
+
+    // a line of four leaves, each sees its neighbours. Sounds go one leaf 
+    // further.
+    U8 row[4][LEAF_SET_BYTES] = {{0x03}, {0x07}, {0x0e}, {0x0c}};
+    U8 vis[4][8];
+    model.numLeaf = 4;
+    for (I32 i = 0; i < 4; ++i)
+    {
+        ModelCompressVisibility(row[i], 4, vis[i]);
+        leaves[i + 1].visibilityCompressed = vis[i];
+    }
+    model.visibility = vis[0];
+
+    static U8 memory[4096];
+    MemoryArena arena;
+    ArenaInit(&arena, memory, sizeof(memory));
+    ArenaPush(&arena, 3, 1);
+    model.arena = &arena;
+    ModelBuildHearability(&model);
+    ERROR(arena.used > 3 && arena.used <= 16 + 8);
+
+    U8 expected[4] = {0x07, 0x0f, 0x0f, 0x0e};
+    for (I32 i = 0; i < 4; ++i)
+    {
+        ERROR(leaves[i + 1].hearabilityCompressed >= memory);
+        ModelGetPHS(&model, leaves + i + 1, unpacked);
+        ERROR(unpacked[0] == expected[i]);
+    }
+}
+
+void test_AliasModel()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+
+    // a quad with one skin, a single frame and a group of two poses
+    static U8 mdl[1024];
+    U8 *out = mdl;
+    AliasHeaderDisk header = {};
+    header.ident = IDPOLYHEADER;
+    header.version = ALIAS_VERSION;
+    header.scale = {2, 2, 2};
+    header.scale_origin = {-8, -8, 0};
+    header.num_skin = 1;
+    header.skin_width = 4;
+    header.skin_height = 4;
+    header.num_vert = 4;
+    header.num_tri = 2;
+    header.num_frame = 2;
+    MemCpy(out, &header, sizeof(header));
+    out += sizeof(header);
+
+    *(I32 *)out = 0;
+    out += sizeof(I32);
+    for (I32 i = 0; i < 16; ++i)
+    {
+        *out++ = (U8)i;
+    }
+
+    AliasSTVert stverts[4] = {{0, 0, 0}, {0, 4, 0}, {0, 4, 4}, {1, 0, 4}};
+    MemCpy(out, stverts, sizeof(stverts));
+    out += sizeof(stverts);
+    AliasTriangle triangles[2] = {{1, {0, 1, 2}}, {0, {0, 2, 3}}};
+    MemCpy(out, triangles, sizeof(triangles));
+    out += sizeof(triangles);
+
+    for (I32 frame = 0; frame < 2; ++frame)
+    {
+        I32 pose_count = frame + 1;
+        *(I32 *)out = frame;
+        out += sizeof(I32);
+        if (frame)
+        {
+            *(I32 *)out = pose_count;
+            out += sizeof(I32) + 2 * sizeof(TriVertex);
+            float intervals[2] = {0.1f, 0.2f};
+            MemCpy(out, intervals, sizeof(intervals));
+            out += sizeof(intervals);
+        }
+        for (I32 pose = 0; pose < pose_count; ++pose)
+        {
+            U8 z = (U8)(frame * 10 + pose);
+            AliasFrameDisk disk = {{{0, 0, z}, 0}, {{8, 8, z}, 0}, "pose"};
+            MemCpy(out, &disk, sizeof(disk));
+            out += sizeof(disk);
+            TriVertex verts[4] = {{{0, 0, z}, 0}, {{8, 0, z}, 0}, {{8, 8, z}, 0}, {{0, 8, z}, 0}};
+            MemCpy(out, verts, sizeof(verts));
+            out += sizeof(verts);
+        }
+    }
+
+    static Model model;
+    StringCopy(model.name, MAX_PACK_FILE_PATH, "progs/quad.mdl");
+    ModelLoadFromBuffer(&model, mdl, false);
+    ERROR(model.type == ModelType::ALIAS);
+    ERROR(model.numFrame == 2);
+    ERROR(model.min.x == -8 && model.max.x == 8 && model.min.z == 0 && model.max.z == 22);
+
+    AliasHeader *alias = (AliasHeader *)CacheCheck(&model.cache);
+    ERROR(alias && alias->num_pose == 3 && alias->num_skin_image == 1);
+    AliasGroup *frames = (AliasGroup *)AliasData(alias, alias->frames);
+    ERROR(frames[0].first == 0 && frames[0].count == 1);
+    ERROR(frames[1].first == 1 && frames[1].count == 2);
+    float *intervals = (float *)AliasData(alias, alias->pose_intervals);
+    ERROR(intervals[1] == 0.1f && intervals[2] == 0.2f);
+    TriVertex *poses = (TriVertex *)AliasData(alias, alias->poses);
+    ERROR(poses[2 * 4 + 3].v[1] == 8 && poses[2 * 4 + 3].v[2] == 11);
+    AliasSTVert *st = (AliasSTVert *)AliasData(alias, alias->stverts);
+    ERROR(st[3].on_seam == 1 && st[2].s == 4);
+    U8 *skin = (U8 *)AliasData(alias, alias->skin_images);
+    ERROR(skin[0] == 0 && skin[15] == 15);
+
+    // the cache can take it back, the model is loaded again then
+    CacheFree(&model.cache);
+    ERROR(CacheCheck(&model.cache) == NULL);
+}
+
+void test_SpriteModel()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+
+    // one 4x2 image, then a group of two
+    static U8 spr[512];
+    U8 *out = spr;
+    SpriteHeaderDisk header = {};
+    header.ident = IDSPRITEHEADER;
+    header.version = SPRITE_VERSION;
+    header.type = SpriteType::VP_PARALLEL;
+    header.width = 4;
+    header.height = 2;
+    header.num_frame = 2;
+    MemCpy(out, &header, sizeof(header));
+    out += sizeof(header);
+
+    SpriteImageDisk image = {{-2, 1}, 4, 2};
+    for (I32 frame = 0; frame < 2; ++frame)
+    {
+        *(I32 *)out = frame;
+        out += sizeof(I32);
+        I32 count = frame + 1;
+        if (frame)
+        {
+            *(I32 *)out = count;
+            out += sizeof(I32);
+            float intervals[2] = {0.5f, 1.0f};
+            MemCpy(out, intervals, sizeof(intervals));
+            out += sizeof(intervals);
+        }
+        for (I32 i = 0; i < count; ++i)
+        {
+            MemCpy(out, &image, sizeof(image));
+            out += sizeof(image);
+            for (I32 j = 0; j < 8; ++j)
+            {
+                *out++ = (U8)(frame * 100 + i * 10 + j);
+            }
+        }
+    }
+
+    static Model model;
+    StringCopy(model.name, MAX_PACK_FILE_PATH, "progs/s_test.spr");
+    ModelLoadFromBuffer(&model, spr, false);
+    ERROR(model.type == ModelType::SPRITE);
+    ERROR(model.numFrame == 2);
+    ERROR(model.min.x == -2 && model.max.z == 1);
+
+    SpriteHeader *sprite = (SpriteHeader *)CacheCheck(&model.cache);
+    ERROR(sprite && sprite->num_image == 3 && sprite->type == SpriteType::VP_PARALLEL);
+    AliasGroup *frames = (AliasGroup *)SpriteData(sprite, sprite->frames);
+    ERROR(frames[1].first == 1 && frames[1].count == 2);
+    SpriteImage *images = (SpriteImage *)SpriteData(sprite, sprite->images);
+    ERROR(images[0].left == -2 && images[0].right == 2 && images[0].up == 1 && images[0].down == -1);
+
+    // mips take every other texel, down to one
+    U8 *pixels = (U8 *)SpriteData(sprite, images[2].pixels[0]);
+    ERROR(pixels[0] == 110 && pixels[7] == 117);
+    pixels = (U8 *)SpriteData(sprite, images[2].pixels[1]);
+    ERROR(pixels[0] == 110 && pixels[1] == 112);
+    pixels = (U8 *)SpriteData(sprite, images[2].pixels[3]);
+    ERROR(pixels[0] == 110 && images[2].pixels[3] == images[2].pixels[2] + 1);
+}
+
+void test_DirtyTiles()
+{
+    static DirtyTiles tiles;
+    GameDirtyRect rects[8];
+    ESpan span = {NULL, 0, 0, 8, 0};
+
+    // the first frame sets the size, everything is dirty
+    DirtyTilesBeginFrame(&tiles, 64, 64, false);
+    DirtyTilesAddSpans(&tiles, &span, 1, false);
+    ERROR(DirtyTilesBuildRects(&tiles, rects, 8) == 1);
+    ERROR(rects[0].width == 64 && rects[0].height == 64);
+
+    // the camera moves, the span ends up somewhere else
+    DirtyTilesBeginFrame(&tiles, 64, 64, false);
+    span.y = DIRTY_TILE_SIZE;
+    DirtyTilesAddSpans(&tiles, &span, 1, false);
+    ERROR(DirtyTilesBuildRects(&tiles, rects, 8) == 1);
+    ERROR(rects[0].x == 0 && rects[0].y == 0 && rects[0].height == 2 * DIRTY_TILE_SIZE);
+
+    // the camera stopped, nothing is scanned and nothing changed
+    for (I32 frame = 0; frame < 2; ++frame)
+    {
+        DirtyTilesBeginFrame(&tiles, 64, 64, true);
+        ERROR(DirtyTilesBuildRects(&tiles, rects, 8) == 0);
+    }
+
+    // forced tiles are still redrawn on a coherent frame
+    DirtyTilesBeginFrame(&tiles, 64, 64, true);
+    DirtyTilesAddSpans(&tiles, &span, 0, true);
+    ERROR(DirtyTilesBuildRects(&tiles, rects, 8) == 1);
+    ERROR(rects[0].y == DIRTY_TILE_SIZE && rects[0].height == DIRTY_TILE_SIZE);
+
+    // scanning the same spans again doesn't dirty anything
+    DirtyTilesBeginFrame(&tiles, 64, 64, false);
+    DirtyTilesAddSpans(&tiles, &span, 1, false);
+    ERROR(DirtyTilesBuildRects(&tiles, rects, 8) == 0);
+}
+
+void test_FrameCoherence()
+{
+    MemSet(&g_cvar_pool, 0, sizeof(g_cvar_pool));
+    RenderInit();
+    EFragReset(&g_efragsystem);
+    ParticleReset(&g_particlesystem);
+
+    static Model world;
+    static Model other_world;
+    RenderData *renderdata = &g_renderdata;
+    renderdata->worldModel = &world;
+    renderdata->spans_flushed = false;
+    renderdata->in_water = false;
+    renderdata->models_drawn = false;
+    Camera camera = {};
+    camera.position = {1, 2, 3};
+    camera.angles = {0, 0, 90};
+
+    // nothing has been drawn yet
+    renderdata->coherent_valid = false;
+    ERROR(!IsFrameCoherent(renderdata, &camera));
+
+    // a frame drawn the normal way, nothing changed since
+    RecordFrameCoherence(renderdata, &camera);
+    ERROR(renderdata->coherent_valid && !g_efragsystem.moved);
+    ERROR(IsFrameCoherent(renderdata, &camera));
+
+    // the camera moved or turned, or the world is another one
+    camera.position.x += 1;
+    ERROR(!IsFrameCoherent(renderdata, &camera));
+    camera.position.x -= 1;
+    camera.angles.z += 1;
+    ERROR(!IsFrameCoherent(renderdata, &camera));
+    camera.angles.z -= 1;
+    renderdata->worldModel = &other_world;
+    ERROR(!IsFrameCoherent(renderdata, &camera));
+    renderdata->worldModel = &world;
+    ERROR(IsFrameCoherent(renderdata, &camera));
+
+    // an entity moved, until the next frame drawn the normal way
+    g_efragsystem.moved = true;
+    ERROR(!IsFrameCoherent(renderdata, &camera));
+    RecordFrameCoherence(renderdata, &camera);
+    ERROR(IsFrameCoherent(renderdata, &camera));
+
+    // particles aren't in the span list
+    ParticleSpawn(&g_particlesystem, {0, 0, 0}, {0, 0, 0}, 0, 1.0f);
+    ERROR(!IsFrameCoherent(renderdata, &camera));
+    ParticleReset(&g_particlesystem);
+    ERROR(IsFrameCoherent(renderdata, &camera));
+
+    // cvars that change the texels, only when the value changes
+    const char *texel_cvars[3] = {"drawflat", "mipscale", "mipmin"};
+    for (I32 i = 0; i < 3; ++i)
+    {
+        CvarSet(texel_cvars[i], 2);
+        ERROR(!renderdata->coherent_valid && !IsFrameCoherent(renderdata, &camera));
+        RecordFrameCoherence(renderdata, &camera);
+        CvarSet(texel_cvars[i], 2);
+        ERROR(IsFrameCoherent(renderdata, &camera));
+    }
+    CvarSet("coherence", 0);
+    ERROR(!IsFrameCoherent(renderdata, &camera));
+    CvarSet("coherence", 1);
+    ERROR(IsFrameCoherent(renderdata, &camera));
+
+    // frames that can't be drawn again from the span list
+    B32 *unrecorded[3] = {&renderdata->spans_flushed, &renderdata->in_water, &renderdata->models_drawn};
+    for (I32 i = 0; i < 3; ++i)
+    {
+        *unrecorded[i] = true;
+        RecordFrameCoherence(renderdata, &camera);
+        ERROR(!renderdata->coherent_valid && !IsFrameCoherent(renderdata, &camera));
+        *unrecorded[i] = false;
+        RecordFrameCoherence(renderdata, &camera);
+        ERROR(IsFrameCoherent(renderdata, &camera));
+    }
+
+    CvarSet("drawflat", 0);
+    CvarSet("mipscale", 1);
+    CvarSet("mipmin", 0);
+    renderdata->worldModel = NULL;
+    renderdata->coherent_valid = false;
+    MemSet(&g_cvar_pool, 0, sizeof(g_cvar_pool));
+}
+
+void test_EntityLink()
+{
+    // x >= 0 is leaf 0, the rest is split by y into leaf 1 (y >= 0) and 2
+    static Plane planes[2] = {{{1, 0, 0}, 0, 0}, {{0, 1, 0}, 0, 1}};
+    static Leaf leaves[3];
+    static Node nodes[2];
+    for (I32 i = 0; i < 3; ++i)
+    {
+        leaves[i] = {};
+        leaves[i].contents = CONTENTS_EMPTY;
+    }
+    nodes[0] = {};
+    nodes[0].plane = planes + 0;
+    nodes[0].children[0] = (Node *)(leaves + 0);
+    nodes[0].children[1] = nodes + 1;
+    nodes[1] = {};
+    nodes[1].plane = planes + 1;
+    nodes[1].children[0] = (Node *)(leaves + 1);
+    nodes[1].children[1] = (Node *)(leaves + 2);
+
+    static Model world;
+    world.nodes = nodes;
+    static Model box;
+    box.min = {-4, -4, -4};
+    box.max = {4, 4, 4};
+
+    EFragSystem *system = &g_efragsystem;
+    EFragReset(system);
+    system->link_count = 0;
+    system->skip_count = 0;
+
+    Entity entity = {};
+    entity.model = &box;
+    entity.origin = {10, 10, 0};
+    EntityLink(system, &entity, &world);
+    ERROR(system->link_count == 1);
+    ERROR(entity.efrags && entity.efrags->leaf == leaves + 0 && !entity.efrags->nextEntity);
+    ERROR(leaves[0].efrags == entity.efrags && !entity.topnode);
+    ERROR(fabsf(entity.link_slack - (6 - EFRAG_SLACK_EPSILON)) < 0.001f);
+
+    // less than the slack away, still in the same leaf
+    EFrag *efrag = entity.efrags;
+    system->moved = false;
+    entity.origin = {11, 12, 0};
+    EntityLink(system, &entity, &world);
+    ERROR(system->link_count == 1 && system->skip_count == 1);
+    ERROR(entity.efrags == efrag && leaves[0].efrags == efrag && system->moved);
+
+    // linked again without moving from where the efrags were made
+    system->moved = false;
+    entity.origin = {10, 10, 0};
+    EntityLink(system, &entity, &world);
+    ERROR(system->skip_count == 2 && !system->moved);
+
+    // across the first plane
+    entity.origin = {-10, 10, 0};
+    EntityLink(system, &entity, &world);
+    ERROR(system->link_count == 2);
+    ERROR(!leaves[0].efrags && leaves[1].efrags == entity.efrags && !leaves[2].efrags);
+    ERROR(entity.efrags->leaf == leaves + 1 && !entity.efrags->nextEntity);
+
+    // on the second plane, in both of its leaves
+    entity.origin = {-10, 0, 0};
+    EntityLink(system, &entity, &world);
+    ERROR(system->link_count == 3 && entity.topnode == nodes + 1);
+    ERROR(entity.efrags->leaf == leaves + 1 && entity.efrags->nextEntity->leaf == leaves + 2);
+    ERROR(leaves[1].efrags->entity == &entity && leaves[2].efrags->entity == &entity);
+
+    // another entity shares the leaf, only the efrags of the first one go
+    Entity other = {};
+    other.model = &box;
+    other.origin = {-10, 10, 0};
+    EntityLink(system, &other, &world);
+    EntityUnlink(system, &entity);
+    ERROR(!entity.efrags && !entity.linked && !entity.topnode);
+    ERROR(leaves[1].efrags == other.efrags && !leaves[1].efrags->nextLeaf);
+    ERROR(!leaves[2].efrags);
+    EntityUnlink(system, &other);
+    ERROR(!leaves[1].efrags);
+}
+
+void test_BrushEntityClip()
+{
+    // x >= 0 is leaf 0, the rest leaf 1
+    static Plane plane = {{1, 0, 0}, 0, 0};
+    static Leaf leaves[2];
+    static Node node;
+    for (I32 i = 0; i < 2; ++i)
+    {
+        leaves[i] = {};
+        leaves[i].contents = CONTENTS_EMPTY;
+        leaves[i].key = i + 1;
+    }
+    node = {};
+    node.plane = &plane;
+    node.children[0] = (Node *)(leaves + 0);
+    node.children[1] = (Node *)(leaves + 1);
+
+    // pieces in visible leaves are counted by the vertices that didn't fit
+    static RenderData renderdata;
+    static ISurface isurface;
+    static IEdge iedge;
+    renderdata.currentISurface = &isurface;
+    renderdata.endISurface = &isurface + 1;
+    renderdata.currentIEdge = &iedge;
+    renderdata.endIEdge = &iedge;
+    renderdata.updateCountPVS = 1;
+
+    Entity entity = {};
+    BrushEntityClip clip = {};
+    clip.entity = &entity;
+    clip.renderdata = &renderdata;
+    clip.ex = {1, 0, 0};
+    clip.ey = {0, 1, 0};
+    clip.ez = {0, 0, 1};
+
+    // a square across the plane, both halves get a cut on each crossing edge
+    Vec3f square[4] = {{-1, 0, 0}, {1, 0, 0}, {1, 2, 0}, {-1, 2, 0}};
+    for (I32 i = 0; i < 2; ++i)
+    {
+        leaves[i].visibleFrame = 1;
+        leaves[i ^ 1].visibleFrame = 0;
+        renderdata.outOfIEdges = 0;
+        RecursiveClipPolygon(&clip, &node, square, 4);
+        ERROR(renderdata.outOfIEdges == 4 && renderdata.currentKey == i + 1);
+    }
+
+    // the entity is moved, the plane isn't
+    entity.origin = {2, 0, 0};
+    renderdata.outOfIEdges = 0;
+    RecursiveClipPolygon(&clip, &node, square, 4);
+    ERROR(renderdata.outOfIEdges == 0);
+    entity.origin = {0, 0, 0};
+
+    // on the plane goes to the front
+    Vec3f triangle[3] = {{0, 0, 0}, {0, 1, 0}, {0, 1, 1}};
+    renderdata.outOfIEdges = 0;
+    RecursiveClipPolygon(&clip, &node, triangle, 3);
+    ERROR(renderdata.outOfIEdges == 0);
+    leaves[0].visibleFrame = 1;
+    leaves[1].visibleFrame = 0;
+    RecursiveClipPolygon(&clip, &node, triangle, 3);
+    ERROR(renderdata.outOfIEdges == 3 && renderdata.currentKey == 1);
+
+    // crosses the plane on every edge, the pieces wouldn't fit
+    Vec3f zigzag[MAX_CLIP_POLYGON_VERTS - 1];
+    for (I32 i = 0; i < MAX_CLIP_POLYGON_VERTS - 1; ++i)
+    {
+        zigzag[i] = {(i & 1) ? -1.0f : 1.0f, (float)i, 0};
+    }
+    renderdata.outOfIEdges = 0;
+    RecursiveClipPolygon(&clip, &node, zigzag, MAX_CLIP_POLYGON_VERTS - 1);
+    ERROR(renderdata.outOfIEdges == 0);
+
+    // boxes against the frustum of a camera looking down y
+    Camera camera = {};
+    ResetCamera(&camera, {0, 0, 64, 64}, 90);
+    AngleVectors(camera.angles, &camera.rotx, &camera.roty, &camera.rotz);
+    TransformFrustum(&camera);
+    SetupFrustumIndices(&camera);
+    ERROR(BoxClipFlags(&camera, {-4, 96, -4}, {4, 104, 4}) == 0);
+    ERROR(BoxClipFlags(&camera, {-4, -104, -4}, {4, -96, 4}) == -1);
+    ERROR(BoxClipFlags(&camera, {200, 96, -4}, {210, 104, 4}) == -1);
+    I32 clipflag = BoxClipFlags(&camera, {90, 96, -4}, {110, 104, 4});
+    ERROR(clipflag > 0 && (clipflag & (clipflag - 1)) == 0);
+}
+
+void test_Particles()
+{
+    ParticleSystem *system = &g_particlesystem;
+    ParticleReset(system);
+
+    I32 falling = ParticleSpawn(system, {0, 0, 0}, {0, 0, 0}, 10, 1.0f);
+    I32 slowing = ParticleSpawn(system, {0, 0, 0}, {10, 0, 0}, 20, 1.0f);
+    system->gravity[slowing] = 0;
+    system->drag[slowing] = 1;
+    system->light_step[slowing] = -100;
+    ParticleSpawn(system, {0, 0, 0}, {0, 0, 0}, 30, 0.05f);
+    ERROR(system->count == 3);
+
+    // the short lived one is gone, the other two still packed in front
+    ParticleUpdate(system, 0.1f);
+    ERROR(system->count == 2);
+    ERROR(fabsf(system->vz[falling] + PARTICLE_GRAVITY * 0.1f) < 0.001f);
+    ERROR(fabsf(system->z[falling] + PARTICLE_GRAVITY * 0.01f) < 0.001f);
+    ERROR(fabsf(system->vx[slowing] - 9.0f) < 0.001f && fabsf(system->x[slowing] - 0.9f) < 0.001f);
+    ERROR(fabsf(system->light[slowing] - 245.0f) < 0.001f);
+    ERROR(system->color[0] == 10 && system->color[1] == 20);
+
+    // every other one dies, the ones moved in from the end are checked too
+    ParticleReset(system);
+    for (I32 i = 0; i < 1001; ++i)
+    {
+        ParticleSpawn(system, {0, 0, 0}, {0, 0, 0}, (U8)i, (i & 1) ? 0.05f : 1.0f);
+    }
+    ParticleUpdate(system, 0.1f);
+    ERROR(system->count == 501);
+    I32 dead = 0;
+    for (I32 i = 0; i < system->count; ++i)
+    {
+        dead += system->die[i] <= system->time;
+    }
+    ERROR(dead == 0);
+
+    ParticleReset(system);
+    for (I32 i = 0; i < MAX_PARTICLES; ++i)
+    {
+        ParticleSpawn(system, {0, 0, 0}, {0, 0, 0}, 0, 1.0f);
+    }
+    ERROR(ParticleSpawn(system, {0, 0, 0}, {0, 0, 0}, 0, 1.0f) == -1);
+    ERROR(system->count == MAX_PARTICLES && system->dropped == 1);
+
+    // one right in front of the camera, splatted through the colormap row of
+    // its light and tested against the z-buffer
+    static U8 colormap[64 * 256];
+    for (I32 i = 0; i < 64 * 256; ++i)
+    {
+        colormap[i] = (U8)((i & 0xff) + (i >> 8));
+    }
+    static U8 pixels[64 * 64];
+    static float zbuffer[64 * 64];
+    Camera camera = {};
+    ResetCamera(&camera, {0, 0, 64, 64}, 90);
+    AngleVectors(camera.angles, &camera.rotx, &camera.roty, &camera.rotz);
+
+    ParticleDraw draw = {};
+    draw.pbuffer = pixels;
+    draw.bytes_per_row = 64;
+    draw.zbuffer = zbuffer;
+    draw.zbuffer_width = 64;
+    draw.rect = camera.screen_rect;
+    draw.colormap = colormap;
+
+    ParticleReset(system);
+    I32 p = ParticleSpawn(system, {0, 16, 0}, {0, 0, 0}, 40, 1.0f);
+    system->light[p] = 255 - 2 * 4;
+    ParticleSpawn(system, {0, -16, 0}, {0, 0, 0}, 50, 1.0f);
+    static ParticleSplat splats[2];
+    ERROR(ParticleProject(system, &camera, &draw, splats) == 1);
+    ERROR(splats[0].pixel == 42 && splats[0].invz == 1.0f / 16);
+    // 3 pixels wide at the center, across the first two bands
+    ERROR(splats[0].min_x == 31 && splats[0].max_x == 33);
+    ERROR(splats[0].min_y == 31 && splats[0].max_y == 33);
+
+    zbuffer[31 * 64 + 31] = 1;
+    ParticleBand bands[PARTICLE_MAX_BANDS];
+    ERROR(ParticleDrawSplats(&draw, splats, 1, bands) == 2);
+    I32 drawn = 0;
+    for (I32 i = 0; i < 64 * 64; ++i)
+    {
+        drawn += pixels[i] == 42;
+    }
+    ERROR(drawn == 8 && pixels[31 * 64 + 31] == 0 && zbuffer[33 * 64 + 33] == 1.0f / 16);
+    ERROR(bands[0].min_y == 31 && bands[0].max_y == 31);
+    ERROR(bands[1].min_y == 32 && bands[1].max_y == 33 && bands[1].max_x == 33);
+
+    ParticleReset(system);
+}
+
+// data size of an entry that takes total_size bytes with its header
+#define TEST_SURFCACHE_DATA(total_size) ((total_size) - ((I32)sizeof(SurfaceCache) - 4))
+
+void test_SurfaceCacheAlloc()
+{
+    // two pages, the alignment and the guard
+    static U8 buffer[2 * SURFCACHE_PAGE_SIZE + 16 + SURFACE_CACHE_GUARD_SIZE];
+    SurfaceCacheInit(buffer, (I32)sizeof(buffer));
+    ERROR(g_surfcache_memory.page_count == 2);
+
+    // size classes, right at their edges
+    ERROR(SurfaceCacheSizeClass(128) == 0 && SurfaceCacheSizeClass(129) == 1);
+    ERROR(SurfaceCacheSizeClass(192) == 1 && SurfaceCacheSizeClass(193) == 2);
+    ERROR(SurfaceCacheSizeClass(SURFCACHE_PAGE_SIZE) == SURFCACHE_LARGE_CLASS - 1);
+    ERROR(SurfaceCacheSizeClass(SURFCACHE_PAGE_SIZE + 1) == SURFCACHE_LARGE_CLASS);
+    SurfaceCache *edge_owner = NULL;
+    SurfaceCache *above_owner = NULL;
+    SurfaceCache *edge = SurfaceCacheAlloc(8, TEST_SURFCACHE_DATA(128));
+    SurfaceCache *above = SurfaceCacheAlloc(8, TEST_SURFCACHE_DATA(128) + 1);
+    edge->owner = &edge_owner;
+    above->owner = &above_owner;
+    ERROR(edge->size_class == 0 && edge->size == 128);
+    ERROR(above->size_class == 1 && above->size == 192);
+    ERROR(g_surfcache_memory.pages[edge->page].size_class == 0);
+    ERROR(edge->page != above->page);
+    SurfaceCacheFlush();
+
+    // the least recently used entry of the class goes first, entries of this 
+    // frame only when there's nothing else
+    I32 slot_size = SURFCACHE_PAGE_SIZE / 2;
+    SurfaceCache *owners[6] = {};
+    SurfaceCache *caches[6] = {};
+    SurfaceCacheBeginFrame(1);
+    for (I32 i = 0; i < 4; ++i)
+    {
+        caches[i] = SurfaceCacheAlloc(8, TEST_SURFCACHE_DATA(slot_size));
+        caches[i]->owner = owners + i;
+        owners[i] = caches[i];
+    }
+    ERROR(caches[0]->size == slot_size && caches[0]->page != caches[3]->page);
+
+    SurfaceCacheBeginFrame(2);
+    SurfaceCacheTouch(caches[0]);
+    SurfaceCacheTouch(caches[2]);
+    for (I32 i = 4; i < 6; ++i)
+    {
+        caches[i] = SurfaceCacheAlloc(8, TEST_SURFCACHE_DATA(slot_size));
+        caches[i]->owner = owners + i;
+        owners[i] = caches[i];
+    }
+    ERROR(!owners[1] && !owners[3]);
+    ERROR(caches[4] == caches[1] && caches[5] == caches[3]);
+    ERROR(owners[0] && owners[2]);
+    ERROR(g_surfcache_memory.stats.evictions == 2 && g_surfcache_memory.stats.evicted_visible == 0);
+
+    // everything was used in this frame
+    SurfaceCache *visible = SurfaceCacheAlloc(8, TEST_SURFCACHE_DATA(slot_size));
+    ERROR(visible == caches[0] && !owners[0]);
+    ERROR(g_surfcache_memory.stats.evicted_visible == 1);
+    visible->owner = owners;
+    owners[0] = visible;
+
+    // an entry larger than a page takes both, the entries in them are evicted
+    SurfaceCacheBeginFrame(3);
+    SurfaceCache *large_owner = NULL;
+    SurfaceCache *large = SurfaceCacheAlloc(8, TEST_SURFCACHE_DATA(SURFCACHE_PAGE_SIZE + 4));
+    large->owner = &large_owner;
+    large_owner = large;
+    ERROR(large->size_class == SURFCACHE_LARGE_CLASS && large->size == 2 * SURFCACHE_PAGE_SIZE);
+    ERROR(!owners[0] && !owners[2] && !owners[4] && !owners[5]);
+    ERROR(g_surfcache_memory.pages[0].size_class == SURFCACHE_LARGE_CLASS);
+    ERROR(g_surfcache_memory.pages[1].size_class == SURFCACHE_LARGE_CLASS);
+    ERROR(g_surfcache_memory.pages[1].run_start == 0);
+
+    // and gives the whole run back
+    SurfaceCacheEvict(large);
+    ERROR(!large_owner);
+    ERROR(g_surfcache_memory.pages[0].size_class == SURFCACHE_FREE_PAGE);
+    ERROR(g_surfcache_memory.pages[1].size_class == SURFCACHE_FREE_PAGE);
+
+    // flushing clears the owner of every entry
+    for (I32 i = 0; i < 3; ++i)
+    {
+        caches[i] = SurfaceCacheAlloc(8, TEST_SURFCACHE_DATA(128 << i));
+        caches[i]->owner = owners + i;
+        owners[i] = caches[i];
+    }
+    SurfaceCacheFlush();
+    ERROR(!owners[0] && !owners[1] && !owners[2]);
+    ERROR(!caches[0]->owner && !caches[1]->owner && !caches[2]->owner);
+    ERROR(g_surfcache_memory.pages[0].size_class == SURFCACHE_FREE_PAGE);
+    ERROR(g_surfcache_memory.pages[1].size_class == SURFCACHE_FREE_PAGE);
+    SurfaceCacheCheckCacheGuard();
+
+    // growing evicts the caches in its way, never temp data
+    MemoryInit((void *)pool, POOL_SIZE);
+    CacheUser model_cache = {};
+    CacheAlloc(&model_cache, HunkGetFreeSize() - 1024, "model");
+    I32 page_count = g_surfcache_memory.page_count;
+    HunkTempAlloc(64);
+    ERROR(!SurfaceCacheGrow() && g_hunk_temp_active && model_cache.data);
+    HunkFreeTemp();
+    ERROR(SurfaceCacheGrow() && !model_cache.data);
+    ERROR(g_surfcache_memory.page_count == page_count + SURFCACHE_GROW_SIZE / SURFCACHE_PAGE_SIZE);
+    SurfaceCacheCheckCacheGuard();
+}
+
+void test_AnimatedTexture()
+{
+    static Texture textures[5];
+    static Texture *pointers[5];
+    const char *names[5] = {"+1lava", "wall", "+0lava", "+alava", "+blava"};
+    for (I32 i = 0; i < 5; ++i)
+    {
+        StringCopy(textures[i].name, sizeof(textures[i].name), names[i]);
+        pointers[i] = textures + i;
+    }
+    static Model model;
+    model.textures = pointers;
+    model.numTexture = 5;
+    ModelSequenceTextures(&model);
+
+    Texture *frame0 = textures + 2;
+    Texture *frame1 = textures + 0;
+    Texture *alt1 = textures + 4;
+    Texture *wall = textures + 1;
+    ERROR(frame0->animNext == frame1 && frame1->animNext == frame0);
+    ERROR(frame0->animTotal == 2 * ANIM_CYCLE && frame1->anim_min == ANIM_CYCLE);
+    ERROR(frame1->alternateAnims == textures + 3 && alt1->alternateAnims == frame0);
+    ERROR(!wall->animTotal && !wall->animNext);
+
+    // a frame every 0.2 seconds, from whichever frame the surface has
+    ERROR(AnimateTexture(frame0, 0, 0.05f) == frame0);
+    ERROR(AnimateTexture(frame0, 0, 0.25f) == frame1);
+    ERROR(AnimateTexture(frame1, 0, 0.45f) == frame0);
+    ERROR(AnimateTexture(frame0, 1, 0.25f) == alt1);
+    ERROR(AnimateTexture(wall, 1, 0.25f) == wall);
+
+    // the entry of the last frame is parked, the one of the next picked up
+    static U8 buffer[256 * 1024];
+    SurfaceCacheInit(buffer, (I32)sizeof(buffer));
+    static Surface surface;
+    SurfaceCache *cache0 = SurfaceCacheAlloc(16, 256);
+    cache0->texture = frame0;
+    cache0->owner = surface.cachespots;
+    surface.cachespots[0] = cache0;
+
+    SurfaceCacheSwapFrame(&surface, 0, frame1);
+    ERROR(!surface.cachespots[0]);
+    SurfaceCache *cache1 = SurfaceCacheAlloc(16, 256);
+    cache1->texture = frame1;
+    cache1->owner = surface.cachespots;
+    surface.cachespots[0] = cache1;
+
+    SurfaceCacheSwapFrame(&surface, 0, frame0);
+    ERROR(surface.cachespots[0] == cache0 && cache0->owner == surface.cachespots);
+    SurfaceCacheSwapFrame(&surface, 0, frame1);
+    ERROR(surface.cachespots[0] == cache1 && g_surfcache_memory.stats.anim_swaps == 2);
+
+    // evicted while parked
+    SurfaceCacheFlush();
+    SurfaceCacheSwapFrame(&surface, 0, frame0);
+    ERROR(!surface.cachespots[0]);
+}
+
+void test_LightStyleMarks()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+
+    // styles 0 and 1 on the first face, 1 on the second, none on the third
+    FaceDisk faces[3] = {};
+    U8 styles[3][MAX_LIGHT_MAPS] = {{0, 1, 255, 255}, {1, 255, 255, 255}, {255, 255, 255, 255}};
+    for (I32 i = 0; i < 3; ++i)
+    {
+        MemCpy(faces[i].light_styles, styles[i], MAX_LIGHT_MAPS);
+    }
+    static Model model;
+    StringCopy(model.name, MAX_PACK_FILE_PATH, "maps/styles.bsp");
+    Lump lump = {0, (I32)sizeof(faces)};
+    ModelReserveFaces(&model, (U8 *)faces, lump);
+    ERROR(model.numSurface == 3);
+    ERROR(model.style_surface_first[0] == 0 && model.style_surface_first[1] == 1);
+    ERROR(model.style_surface_first[2] == 3 && model.style_surface_first[MAX_LIGHT_STYLE_NUM] == 3);
+    // what ModelDecodeFaces lists
+    model.style_surfaces[0] = 0;
+    model.style_surfaces[1] = 0;
+    model.style_surfaces[2] = 1;
+
+    static LightSystem lightsystem;
+    lightsystem.styles[1].length = StringCopy(lightsystem.styles[1].wave, 64, "za");
+
+    // everything changes in the first frame, then only the flickering style
+    AnimateLights(&lightsystem, &model, 1);
+    ERROR(model.surfaces[0].styleframe == 1 && model.surfaces[1].styleframe == 1);
+    AnimateLights(&lightsystem, &model, 2);
+    ERROR(model.surfaces[0].styleframe == 2 && model.surfaces[1].styleframe == 2);
+    ERROR(model.surfaces[2].styleframe == 0 && lightsystem.marked_surface_count == 2);
+    ERROR(lightsystem.styles[0].changes == 1 && lightsystem.styles[0].invalidations == 1);
+    ERROR(lightsystem.styles[1].changes == 2 && lightsystem.styles[1].invalidations == 4);
+
+    // a cache lit before the change is out of date
+    SurfaceCache cache = {};
+    cache.lit_frame = 1;
+    ERROR(!SurfaceCacheIsValid(&cache, model.surfaces + 1, NULL, 2));
+    ERROR(SurfaceCacheIsValid(&cache, model.surfaces + 2, NULL, 2));
+    cache.lit_frame = 2;
+    ERROR(SurfaceCacheIsValid(&cache, model.surfaces + 1, NULL, 2));
+}
+
+void TestBspLump(U8 *bsp, I32 *used, I32 lump, void *data, I32 length)
+{
+    ModelHeaderDisk *header = (ModelHeaderDisk *)bsp;
+    header->lumps[lump].offset = *used;
+    header->lumps[lump].length = length;
+    MemCpy(bsp + *used, data, length);
+    *used += (length + 3) & ~3;
+}
+
+// a 64x64 wall on z = 0 with a face on each side, the node in front of it
+// splits the empty leaf 1 from the solid leaf 0
+I32 TestBuildBsp(U8 *bsp, I32 size)
+{
+    MemSet(bsp, 0, size);
+    ModelHeaderDisk *header = (ModelHeaderDisk *)bsp;
+    header->version = BSPVERSION;
+    I32 used = (I32)sizeof(ModelHeaderDisk);
+
+    char entities[] = "{\n\"classname\" \"worldspawn\"\n}\n";
+    TestBspLump(bsp, &used, ModelLump::ENTITY, entities, (I32)sizeof(entities));
+
+    PlaneDisk planes[1] = {{{0, 0, 1}, 0, PLANE_Z}};
+    TestBspLump(bsp, &used, ModelLump::PLANE, planes, (I32)sizeof(planes));
+
+    static U8 textures[8 + sizeof(MipTexture) + 16 * 16 * 85 / 64];
+    MipTexLump *miptex_lump = (MipTexLump *)textures;
+    miptex_lump->numMipTex = 1;
+    miptex_lump->dataOffsets[0] = 8;
+    MipTexture *miptex = (MipTexture *)(textures + 8);
+    StringCopy(miptex->name, 16, "wall");
+    miptex->width = 16;
+    miptex->height = 16;
+    U32 offsets[MIP_LEVELS] = {40, 40 + 256, 40 + 256 + 64, 40 + 256 + 64 + 16};
+    MemCpy(miptex->offsets, offsets, sizeof(offsets));
+    for (I32 i = 0; i < 16 * 16 * 85 / 64; ++i)
+    {
+        textures[8 + sizeof(MipTexture) + i] = (U8)i;
+    }
+    TestBspLump(bsp, &used, ModelLump::TEXTURE, textures, (I32)sizeof(textures));
+
+    VertexDisk vertices[4] = {{{0, 0, 0}}, {{64, 0, 0}}, {{64, 64, 0}}, {{0, 64, 0}}};
+    TestBspLump(bsp, &used, ModelLump::VERTEX, vertices, (I32)sizeof(vertices));
+
+    U8 visibility[1] = {0x01};
+    TestBspLump(bsp, &used, ModelLump::VISIBILITY, visibility, (I32)sizeof(visibility));
+
+    NodeDisk nodes[1] = {{0, {-2, -1}, {0, 0, -64}, {64, 64, 64}, 0, 2}};
+    TestBspLump(bsp, &used, ModelLump::NODE, nodes, (I32)sizeof(nodes));
+
+    TextureInfoDisk tex_info[1] = {{{{1, 0, 0, 0}, {0, 1, 0, 0}}, 0, 0}};
+    TestBspLump(bsp, &used, ModelLump::TEXTUREINFO, tex_info, (I32)sizeof(tex_info));
+
+    FaceDisk faces[2] = {{0, 0, 0, 4, 0, {0, 255, 255, 255}, 0},
+                         {0, 1, 4, 4, 0, {1, 255, 255, 255}, -1}};
+    TestBspLump(bsp, &used, ModelLump::FACE, faces, (I32)sizeof(faces));
+
+    U8 lighting[16 * 16];
+    MemSet(lighting, 128, sizeof(lighting));
+    TestBspLump(bsp, &used, ModelLump::LIGHTING, lighting, (I32)sizeof(lighting));
+
+    ClipNode clipnodes[1] = {{0, {CONTENTS_EMPTY, CONTENTS_SOLID}}};
+    TestBspLump(bsp, &used, ModelLump::CLIPNODE, clipnodes, (I32)sizeof(clipnodes));
+
+    LeafDisk leaves[2] = {{CONTENTS_SOLID, -1},
+                          {CONTENTS_EMPTY, 0, {0, 0, 0}, {64, 64, 64}, 0, 2}};
+    TestBspLump(bsp, &used, ModelLump::LEAF, leaves, (I32)sizeof(leaves));
+
+    I16 marksurfaces[2] = {0, 1};
+    TestBspLump(bsp, &used, ModelLump::MARKSURFACE, marksurfaces, (I32)sizeof(marksurfaces));
+
+    // edge 0 can't be negated, it's never used
+    EdgeDisk edges[5] = {{{0, 0}}, {{0, 1}}, {{1, 2}}, {{2, 3}}, {{3, 0}}};
+    TestBspLump(bsp, &used, ModelLump::EDGE, edges, (I32)sizeof(edges));
+
+    I32 surfedges[8] = {1, 2, 3, 4, -4, -3, -2, -1};
+    TestBspLump(bsp, &used, ModelLump::SURFACEEDGE, surfedges, (I32)sizeof(surfedges));
+
+    Submodel submodels[1] = {{{0, 0, -64}, {64, 64, 64}, {0, 0, 0}, {0, 0, 0, 0}, 1, 0, 2}};
+    TestBspLump(bsp, &used, ModelLump::SUBMODEL, submodels, (I32)sizeof(submodels));
+
+    ASSERT(used <= size);
+    return used;
+}
+
+// index of a node, leaves are -1 - index like on disk
+I32 TestNodeIndex(Model *model, Node *node)
+{
+    if (!node)
+    {
+        return 0x7fff;
+    }
+    if (node->contents < 0)
+    {
+        return -1 - (I32)((Leaf *)node - model->leaves);
+    }
+    return (I32)(node - model->nodes);
+}
+
+// the same data, pointers compared by what they point to
+void TestCompareBrushModels(Model *a, Model *b)
+{
+    ERROR(a->numVert == b->numVert && a->numEdge == b->numEdge && a->numNode == b->numNode);
+    ERROR(a->numPlane == b->numPlane && a->numSurfaceEdge == b->numSurfaceEdge);
+    ERROR(a->numTexture == b->numTexture && a->numTexInfo == b->numTexInfo);
+    ERROR(a->numSurface == b->numSurface && a->numClipNode == b->numClipNode);
+    ERROR(a->numMarksurface == b->numMarksurface && a->numLeaf == b->numLeaf);
+    ERROR(a->numSubmodel == b->numSubmodel);
+
+    ERROR(BytesEqual((U8 *)a->vertices, (U8 *)b->vertices, a->numVert * (I32)sizeof(Vertex)));
+    ERROR(BytesEqual((U8 *)a->edges, (U8 *)b->edges, a->numEdge * (I32)sizeof(Edge)));
+    ERROR(BytesEqual((U8 *)a->surfaceEdges, (U8 *)b->surfaceEdges, a->numSurfaceEdge * (I32)sizeof(I32)));
+    ERROR(BytesEqual((U8 *)a->planes, (U8 *)b->planes, a->numPlane * (I32)sizeof(Plane)));
+    ERROR(BytesEqual((U8 *)a->clipNodes, (U8 *)b->clipNodes, a->numClipNode * (I32)sizeof(ClipNode)));
+    ERROR(BytesEqual((U8 *)a->hulls[0].clipNodes, (U8 *)b->hulls[0].clipNodes, a->numNode * (I32)sizeof(ClipNode)));
+    ERROR(BytesEqual((U8 *)a->submodels, (U8 *)b->submodels, a->numSubmodel * (I32)sizeof(Submodel)));
+    ERROR(StringCompare(a->entities, b->entities) == 0);
+    ERROR(BytesEqual((U8 *)a->style_surface_first, (U8 *)b->style_surface_first, (I32)sizeof(a->style_surface_first)));
+    I32 style_count = a->style_surface_first[MAX_LIGHT_STYLE_NUM];
+    ERROR(BytesEqual((U8 *)a->style_surfaces, (U8 *)b->style_surfaces, style_count * (I32)sizeof(I32)));
+
+    for (I32 i = 0; i < a->numTexture; ++i)
+    {
+        Texture *ta = a->textures[i];
+        Texture *tb = b->textures[i];
+        ERROR(StringCompare(ta->name, tb->name) == 0 && ta->width == tb->width && ta->height == tb->height);
+        ERROR(BytesEqual(ta->mip_base + ta->offsets[0], tb->mip_base + tb->offsets[0],
+                         (I32)(ta->width * ta->height)));
+    }
+
+    for (I32 i = 0; i < a->numTexInfo; ++i)
+    {
+        TextureInfo *ia = a->tex_info + i;
+        TextureInfo *ib = b->tex_info + i;
+        ERROR(BytesEqual((U8 *)ia, (U8 *)ib, 8 * (I32)sizeof(float)));
+        ERROR(ia->mip_adjust == ib->mip_adjust && ia->flags == ib->flags);
+        ERROR(ia->texture - a->textures[0] == ib->texture - b->textures[0]);
+    }
+
+    for (I32 i = 0; i < a->numSurface; ++i)
+    {
+        Surface *sa = a->surfaces + i;
+        Surface *sb = b->surfaces + i;
+        ERROR(sa->plane - a->planes == sb->plane - b->planes);
+        ERROR(sa->tex_info - a->tex_info == sb->tex_info - b->tex_info);
+        ERROR(sa->flags == sb->flags && sa->firstEdge == sb->firstEdge && sa->numEdge == sb->numEdge);
+        ERROR(BytesEqual((U8 *)sa->uv_min, (U8 *)sb->uv_min, (I32)sizeof(sa->uv_min)));
+        ERROR(BytesEqual((U8 *)sa->uv_extents, (U8 *)sb->uv_extents, (I32)sizeof(sa->uv_extents)));
+        ERROR(BytesEqual((U8 *)sa->light_styles, (U8 *)sb->light_styles, (I32)sizeof(sa->light_styles)));
+        ERROR(!sa->samples == !sb->samples);
+        ERROR(!sa->samples || sa->samples - a->light_data == sb->samples - b->light_data);
+    }
+
+    for (I32 i = 0; i < a->numMarksurface; ++i)
+    {
+        ERROR(a->marksurfaces[i] - a->surfaces == b->marksurfaces[i] - b->surfaces);
+    }
+
+    for (I32 i = 0; i < a->numLeaf; ++i)
+    {
+        Leaf *la = a->leaves + i;
+        Leaf *lb = b->leaves + i;
+        ERROR(la->contents == lb->contents && la->numMarksurface == lb->numMarksurface);
+        ERROR(BytesEqual((U8 *)la->minmax, (U8 *)lb->minmax, (I32)sizeof(la->minmax)));
+        ERROR(la->firstMarksurface - a->marksurfaces == lb->firstMarksurface - b->marksurfaces);
+        ERROR(!la->visibilityCompressed == !lb->visibilityCompressed);
+        ERROR(!la->visibilityCompressed
+              || la->visibilityCompressed - a->visibility == lb->visibilityCompressed - b->visibility);
+        ERROR(TestNodeIndex(a, la->parent) == TestNodeIndex(b, lb->parent));
+    }
+
+    for (I32 i = 0; i < a->numNode; ++i)
+    {
+        Node *na = a->nodes + i;
+        Node *nb = b->nodes + i;
+        ERROR(na->contents == nb->contents && na->plane - a->planes == nb->plane - b->planes);
+        ERROR(na->firstsurface == nb->firstsurface && na->numsurface == nb->numsurface);
+        ERROR(BytesEqual((U8 *)na->minmax, (U8 *)nb->minmax, (I32)sizeof(na->minmax)));
+        ERROR(TestNodeIndex(a, na->parent) == TestNodeIndex(b, nb->parent));
+        for (I32 j = 0; j < 2; ++j)
+        {
+            ERROR(TestNodeIndex(a, na->children[j]) == TestNodeIndex(b, nb->children[j]));
+        }
+    }
+}
+
+// a work queue on the calling thread that runs the last work added first,
+// the work is taken for model load tasks and recorded in the order it runs
+struct TestWork
+{
+    PlatformWorkQueueCallback_t *callback;
+    void *data;
+};
+
+TestWork g_test_works[64];
+I32 g_test_work_count;
+ModelLoadTask g_test_work_done[64];
+I32 g_test_work_done_count;
+
+SYS_ADD_WORK(TestAddWork)
+{
+    ASSERT(g_test_work_count < (I32)ARRAY_COUNT(g_test_works));
+    g_test_works[g_test_work_count++] = {callback, data};
+}
+
+SYS_DO_NEXT_WORK(TestDoNextWork)
+{
+    if (!g_test_work_count)
+    {
+        return false;
+    }
+    TestWork work = g_test_works[--g_test_work_count];
+    if (g_test_work_done_count < (I32)ARRAY_COUNT(g_test_work_done))
+    {
+        g_test_work_done[g_test_work_done_count++] = *(ModelLoadTask *)work.data;
+    }
+    work.callback(queue, work.data);
+    return true;
+}
+
+void test_ModelDecodeLumps()
+{
+    static U8 bsp[4096];
+    TestBuildBsp(bsp, (I32)sizeof(bsp));
+
+    // everything on this thread first
+    static U8 memory[2][64 * 1024];
+    static MemoryArena arenas[2];
+    static Model models[2];
+    for (I32 i = 0; i < 2; ++i)
+    {
+        ArenaInit(arenas + i, memory[i], (I32)sizeof(memory[i]));
+        models[i] = {};
+        StringCopy(models[i].name, MAX_PACK_FILE_PATH, "maps/wall.bsp");
+        models[i].arena = arenas + i;
+    }
+    g_work_queue = NULL;
+    ModelDecodeLumps(models + 0, bsp, false);
+    ERROR(models[0].numSurface == 2 && models[0].numLeaf == 2 && models[0].numNode == 1);
+    ERROR(models[0].surfaces[1].flags == SURF_PLANE_BACK);
+    ERROR(models[0].surfaces[0].uv_extents[0] == 64 && models[0].surfaces[1].uv_extents[1] == 64);
+    ERROR(models[0].surfaces[0].samples == models[0].light_data && !models[0].surfaces[1].samples);
+    ERROR(models[0].leaves[1].parent == models[0].nodes && models[0].nodes[0].children[0] == (Node *)(models[0].leaves + 1));
+    ERROR(models[0].hulls[0].clipNodes[0].children[0] == CONTENTS_EMPTY);
+    ERROR(models[0].hulls[0].clipNodes[0].children[1] == CONTENTS_SOLID);
+
+    // then every task through the queue, the ones ready last run first
+    g_work_queue = (PlatformWorkQueue *)&g_test_work_count;
+    g_platformAPI.SysAddWork = TestAddWork;
+    g_platformAPI.SysDoNextWork = TestDoNextWork;
+    g_test_work_count = 0;
+    g_test_work_done_count = 0;
+    ModelDecodeLumps(models + 1, bsp, false);
+    g_work_queue = NULL;
+    g_platformAPI.SysAddWork = NULL;
+    g_platformAPI.SysDoNextWork = NULL;
+
+    TestCompareBrushModels(models + 0, models + 1);
+
+    // each task once, after all it depends on
+    ERROR(g_test_work_done_count == MODEL_LOAD_TASK_COUNT && g_test_work_count == 0);
+    U32 done = 0;
+    for (I32 i = 0; i < g_test_work_done_count; ++i)
+    {
+        ModelLoadTask *task = g_test_work_done + i;
+        ERROR((task->dependencies & done) == task->dependencies);
+        ERROR(!(done & MODEL_LOAD_TASK_BIT(task->id)));
+        done |= MODEL_LOAD_TASK_BIT(task->id);
+    }
+    ERROR(done == MODEL_LOAD_TASK_BIT(MODEL_LOAD_TASK_COUNT) - 1);
+}
+
+void test_LevelSwitch()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+    FileIndexInit();
+    CvarRegister("bsp_cache", 0);
+    CvarRegister("texture_compress", 0);
+
+    // two levels in a mapped pak, they take turns
+    static U8 mapping[4096];
+    I32 length = TestBuildBsp(mapping, (I32)sizeof(mapping));
+    PackFile files[2] = {{"maps/wall1.bsp", 0, length}, {"maps/wall2.bsp", 0, length}};
+    PackHeader pack = {};
+    pack.numfiles = 2;
+    pack.files = files;
+    pack.mapped = mapping;
+    pack.mappedSize = (I32)sizeof(mapping);
+    FileIndexAddPack(&pack);
+    g_mapinfos[0] = {"maps/wall1.bsp", NULL, {32, 32, 16}};
+    g_mapinfos[1] = {"maps/wall2.bsp", NULL, {32, 32, 16}};
+    g_mapinfo_count = 2;
+
+    // the real arenas are too big for the test pool
+    static U8 arena_memory[2][64 * 1024];
+    g_level_loader = {};
+    for (I32 i = 0; i < 2; ++i)
+    {
+        ArenaInit(&g_level_loader.slots[i].arena, arena_memory[i], (I32)sizeof(arena_memory[i]));
+    }
+    static U8 surfcache[256 * 1024];
+    SurfaceCacheInit(surfcache, (I32)sizeof(surfcache));
+    g_work_queue = NULL;
+
+    LevelLoadNow(g_mapinfos + 0);
+    LevelSlot *first = g_level_loader.slots + 1;
+    Model *first_model = g_mapinfos[0].model;
+    ERROR(g_level_loader.current == 1 && g_level_loader.state == LEVEL_LOAD_IDLE);
+    ERROR(first->mapinfo == g_mapinfos + 0 && g_renderdata.worldModel == first_model);
+    ERROR(first_model->arena == &first->arena && first->arena.used > 0);
+    ERROR(first_model->loadStatus == ModelLoadStatus::PRESENT && first_model->numSurface == 2);
+
+    // the next one goes into the spare slot, nothing switches until asked
+    LevelUpdate();
+    LevelSlot *second = g_level_loader.slots + 0;
+    Model *second_model = g_mapinfos[1].model;
+    ERROR(g_level_loader.state == LEVEL_LOAD_READY && second->mapinfo == g_mapinfos + 1);
+    ERROR(second_model && second_model != first_model && second_model->arena == &second->arena);
+    ERROR(second_model->loadStatus == ModelLoadStatus::PRESENT && second->arena.used > 0);
+    LevelUpdate();
+    ERROR(g_level_loader.current == 1 && g_renderdata.worldModel == first_model);
+
+    // what the first level leaves behind
+    SurfaceCache *cache = SurfaceCacheAlloc(16, 256);
+    cache->owner = first_model->surfaces[0].cachespots;
+    first_model->surfaces[0].cachespots[0] = cache;
+    EFragAlloc(&g_efragsystem);
+    g_efragsystem.moved = false;
+    ParticleSpawn(&g_particlesystem, {0, 0, 0}, {0, 0, 0}, 0, 1.0f);
+    g_renderdata.coherent_valid = true;
+
+    g_level_loader.switch_requested = true;
+    LevelSwitch();
+    ERROR(g_level_loader.current == 0 && g_renderdata.worldModel == second_model);
+    ERROR(g_level_loader.state == LEVEL_LOAD_IDLE && !g_level_loader.switch_requested);
+    ERROR(first->arena.used == 0 && !first->mapinfo && !g_mapinfos[0].model);
+    ERROR(first_model->loadStatus == ModelLoadStatus::UNUSED && !first_model->arena);
+    ERROR(!cache->owner && !first_model->surfaces[0].cachespots[0]);
+    ERROR(g_efragsystem.high_mark == 0 && g_efragsystem.moved);
+    ERROR(g_particlesystem.count == 0 && !g_renderdata.coherent_valid);
+
+    // the rotation goes on in the slot that was freed
+    LevelUpdate();
+    ERROR(g_level_loader.state == LEVEL_LOAD_READY && first->mapinfo == g_mapinfos + 0);
+    ERROR(g_mapinfos[0].model == first_model && first_model->arena == &first->arena);
+
+    g_renderdata.worldModel = NULL;
+    MemSet(&g_cvar_pool, 0, sizeof(g_cvar_pool));
+}
+
+I32 g_file_request_callback_count;
+
+FILE_REQUEST_CALLBACK(TestFileRequestCallback)
+{
+    g_file_request_callback_count++;
+    ERROR(request->user_data == &g_file_request_callback_count);
+}
+
+void test_FileLoadAsync()
+{
+    MemoryInit((void *)pool, POOL_SIZE);
+    FileIndexInit();
+
+    static U8 mapping[256];
+    for (I32 i = 0; i < 256; ++i)
+    {
+        mapping[i] = (U8)i;
+    }
+    PackFile files[2] = {{"gfx/palette.lmp", 16, 32}, {"gfx/colormap.lmp", 100, 50}};
+    PackHeader pack = {};
+    pack.numfiles = 2;
+    pack.files = files;
+    pack.mapped = mapping;
+    pack.mappedSize = 256;
+    FileIndexAddPack(&pack);
+
+    // without a work queue requests finish right away
+    g_file_request_callback_count = 0;
+    FileRequestHandle handle = FileLoadAsync("gfx/colormap.lmp", ALLocType::ZONE, 0, 
+                                             TestFileRequestCallback, &g_file_request_callback_count);
+    ERROR(FileRequestPoll(handle) == FILE_REQUEST_DONE);
+    FileRequest *request = g_file_requests.requests + handle.index;
+    ERROR(request->length == 50);
+    ERROR(request->buffer[0] == 100 && request->buffer[49] == 149 && request->buffer[50] == 0);
+    ERROR(g_file_request_callback_count == 0);
+
+    FileRequestHandle missing = FileLoadAsync("gfx/conback.lmp", ALLocType::ZONE, 0, 
+                                              TestFileRequestCallback, &g_file_request_callback_count);
+    ERROR(FileRequestPoll(missing) == FILE_REQUEST_FAILED);
+
+    // callbacks run on update, then the slots are reused
+    FileAsyncUpdate();
+    ERROR(g_file_request_callback_count == 2);
+    ERROR(FileRequestPoll(handle) == FILE_REQUEST_FREE);
+    FileRequestHandle next = FileLoadAsync("gfx/palette.lmp", ALLocType::LOWHUNK, 0, NULL, NULL);
+    ERROR(next.index == handle.index && next.id != handle.id);
+    ERROR(FileRequestPoll(handle) == FILE_REQUEST_FREE);
+    FileRequestWait(next);
+    ERROR(FileRequestPoll(next) == FILE_REQUEST_FREE);
+
+    // pending requests are taken by priority
+    request = g_file_requests.requests + 0;
+    request->state = FILE_REQUEST_PENDING;
+    request->priority = 1;
+    FileRequest *urgent = g_file_requests.requests + 1;
+    urgent->state = FILE_REQUEST_PENDING;
+    urgent->priority = 5;
+    ERROR(FileRequestTakeNext() == urgent);
+    ERROR(urgent->state == FILE_REQUEST_LOADING);
+    ERROR(FileRequestTakeNext() == request);
+    ERROR(FileRequestTakeNext() == NULL);
+    request->state = FILE_REQUEST_FREE;
+    urgent->state = FILE_REQUEST_FREE;
+
+    static U8 arena_memory[256];
+    MemoryArena arena;
+    ArenaInit(&arena, arena_memory, 256);
+    handle = FileLoadToArenaAsync("gfx/palette.lmp", &arena, 0, NULL, NULL);
+    request = g_file_requests.requests + handle.index;
+    ERROR(FileRequestPoll(handle) == FILE_REQUEST_DONE);
+    ERROR(request->buffer == arena_memory && arena_memory[0] == 16 && arena_memory[32] == 0);
+    FileAsyncUpdate();
+
+    // running out of requests gives a handle that failed, nothing is lost
+    g_test_sys_error_count = 0;
+    g_platformAPI.SysError = TestCountError;
+    for (I32 i = 0; i < MAX_FILE_REQUEST_NUM; ++i)
+    {
+        FileLoadAsync("gfx/palette.lmp", ALLocType::ZONE, 0, TestFileRequestCallback, 
+                      &g_file_request_callback_count);
+    }
+    FileRequestHandle overflow = FileLoadAsync("gfx/palette.lmp", ALLocType::ZONE, 0, 
+                                               TestFileRequestCallback, &g_file_request_callback_count);
+    g_platformAPI.SysError = CmdError;
+    ERROR(g_test_sys_error_count == 1);
+    ERROR(overflow.id == 0 && FileRequestPoll(overflow) == FILE_REQUEST_FAILED);
+    g_file_request_callback_count = 0;
+    FileRequestWait(overflow);
+    ERROR(g_file_request_callback_count == MAX_FILE_REQUEST_NUM);
 }
 
 void tests()
@@ -316,6 +2194,7 @@ void tests()
     // TODO lw: test_CatString();
     test_IntToString();
     test_StringToInt();
+    test_StringParseToken();
 
     test_MemSet();
     test_MemCpy();
@@ -323,6 +2202,29 @@ void tests()
     test_DataSize();
 
     test_MemoryAlloc();
+    test_ZoneAlloc();
+    test_MemoryArena();
+    test_MemoryReport();
+
+    test_Cvar();
+    test_LZ4();
+    test_HullTrace();
+    test_TraceLine();
+    test_LeafSet();
+    test_AliasModel();
+    test_SpriteModel();
+    test_DirtyTiles();
+    test_FrameCoherence();
+    test_EntityLink();
+    test_BrushEntityClip();
+    test_Particles();
+    test_SurfaceCacheAlloc();
+    test_AnimatedTexture();
+    test_LightStyleMarks();
+    test_ModelDecodeLumps();
+    test_LevelSwitch();
+    test_FileIndex();
+    test_FileLoadAsync();
 
     if (g_errorCount == 0)
     {